@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <t_pwd.h>
@@ -37,6 +38,8 @@
 
 #define EAD_TIMEOUT	400
 #define EAD_TIMEOUT_LONG 2000
+#define EAD_CMD_RETRIES	3
+#define EAD_ACK_DELAY	20
 
 static char msgbuf[1500];
 static struct ead_msg *msg = (struct ead_msg *) msgbuf;
@@ -63,6 +66,8 @@ static struct t_preconf *tcp;
 static int auth_type = EAD_AUTH_DEFAULT;
 static int timeout = EAD_TIMEOUT;
 static uint16_t sid = 0;
+static uint16_t cmd_seq = 0;
+static bool have_stream = false;
 
 static void
 set_nonblock(int enable)
@@ -74,6 +79,36 @@ set_nonblock(int enable)
 	fcntl(s, F_SETFL, sockflags);
 }
 
+static void
+send_msg(void)
+{
+	memcpy(&msg->ip, &serverip.s_addr, sizeof(msg->ip));
+	set_nonblock(0);
+	sendto(s, msgbuf, sizeof(struct ead_msg) + ntohl(msg->len), 0, (struct sockaddr *) &remote, sizeof(remote));
+	set_nonblock(1);
+}
+
+static bool
+check_reply(int len, int type)
+{
+	if (len < sizeof(struct ead_msg))
+		return false;
+
+	if (len < sizeof(struct ead_msg) + ntohl(msg->len))
+		return false;
+
+	if (msg->magic != htonl(EAD_MAGIC))
+		return false;
+
+	if ((nid != 0xffff) && (ntohs(msg->nid) != nid))
+		return false;
+
+	if (msg->type != type)
+		return false;
+
+	return true;
+}
+
 static int
 send_packet(int type, bool (*handler)(void), unsigned int max)
 {
@@ -84,10 +119,7 @@ send_packet(int type, bool (*handler)(void), unsigned int max)
 	int res = 0;
 
 	type = htonl(type);
-	memcpy(&msg->ip, &serverip.s_addr, sizeof(msg->ip));
-	set_nonblock(0);
-	sendto(s, msgbuf, sizeof(struct ead_msg) + ntohl(msg->len), 0, (struct sockaddr *) &remote, sizeof(remote));
-	set_nonblock(1);
+	send_msg();
 
 	tv.tv_sec = timeout / 1000;
 	tv.tv_usec = (timeout % 1000) * 1000;
@@ -107,19 +139,7 @@ send_packet(int type, bool (*handler)(void), unsigned int max)
 		if (len < 0)
 			break;
 
-		if (len < sizeof(struct ead_msg))
-			continue;
-
-		if (len < sizeof(struct ead_msg) + ntohl(msg->len))
-			continue;
-
-		if (msg->magic != htonl(EAD_MAGIC))
-			continue;
-
-		if ((nid != 0xffff) && (ntohs(msg->nid) != nid))
-			continue;
-
-		if (msg->type != type)
+		if (!check_reply(len, type))
 			continue;
 
 		if (handler())
@@ -156,6 +176,8 @@ handle_pong(void)
 
 	pong->name[len] = 0;
 	auth_type = ntohs(pong->auth_type);
+	have_stream = (strlen(pong->name) + 1 < len) &&
+		(pong->name[strlen(pong->name) + 1] & EAD_PONG_STREAM);
 	if (nid == 0xffff)
 		printf("%04x: %s\n", ntohs(msg->nid), pong->name);
 	sid = msg->sid;
@@ -214,6 +236,29 @@ handle_done_auth(void)
 	return true;
 }
 
+static bool
+write_output(const void *data, int len)
+{
+	const char *p = data;
+	int n;
+
+	while (len > 0) {
+		n = write(1, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			perror("write");
+			return false;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
 static bool
 handle_cmd_data(void)
 {
@@ -223,9 +268,8 @@ handle_cmd_data(void)
 	if (datalen < 0)
 		return false;
 
-	if (datalen > 0) {
-		write(1, cmd->data, datalen);
-	}
+	if (datalen > 0 && !write_output(cmd->data, datalen))
+		exit(1);
 
 	return !!cmd->done;
 }
@@ -283,19 +327,177 @@ send_auth(void)
 	return send_packet(EAD_TYPE_DONE_AUTH, handle_done_auth, 1);
 }
 
+static void
+send_cmd_ack(uint16_t seq, uint32_t mask)
+{
+	struct ead_msg_cmd_ack *ack = EAD_ENC_DATA(msg, cmd_ack);
+
+	msg->type = htonl(EAD_TYPE_SEND_CMD);
+	ack->type = EAD_CMD_ACK;
+	ack->timeout = 0;
+	ack->seq = htons(seq);
+	ack->mask = htonl(mask);
+	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_ack));
+	send_msg();
+}
+
+/*
+ * Receives numbered output packets, writes them out in order and
+ * acknowledges them after every half window, on duplicates and after
+ * a short pause in the stream.
+ * Returns -1 if the server didn't answer at all.
+ */
+static int
+recv_cmd_output(void)
+{
+	static unsigned char buf[EAD_CMD_WINDOW][EAD_CMD_CHUNK];
+	static int buflen[EAD_CMD_WINDOW];
+	static bool have[EAD_CMD_WINDOW], done[EAD_CMD_WINDOW];
+	struct ead_msg_cmd_output *out = EAD_ENC_DATA(msg, cmd_output);
+	uint16_t base = cmd_seq, seq;
+	bool received = false, finished = false;
+	int unacked = 0, type = htonl(EAD_TYPE_RESULT_CMD);
+	struct timeval tv;
+	uint32_t mask;
+	fd_set fds;
+	int len, slot, i;
+
+	memset(have, 0, sizeof(have));
+	FD_ZERO(&fds);
+	while (!finished) {
+		len = unacked ? EAD_ACK_DELAY : timeout;
+		tv.tv_sec = len / 1000;
+		tv.tv_usec = (len % 1000) * 1000;
+
+		FD_SET(s, &fds);
+		if (select(s + 1, &fds, NULL, NULL, &tv) <= 0) {
+			if (!unacked)
+				return received ? 0 : -1;
+			goto ack;
+		}
+
+		len = read(s, msgbuf, sizeof(msgbuf));
+		if (len < 0)
+			return 0;
+
+		if (!check_reply(len, type))
+			continue;
+
+		len = ead_decrypt_message(msg) - sizeof(struct ead_msg_cmd_output);
+		if (len < 0)
+			continue;
+
+		received = true;
+
+		/* keepalive */
+		if (!len && !out->done)
+			continue;
+
+		seq = ntohs(out->seq);
+		slot = seq % EAD_CMD_WINDOW;
+
+		/* duplicate, the last ack was probably lost */
+		if (((uint16_t) (seq - base) >= EAD_CMD_WINDOW) || have[slot])
+			goto ack;
+
+		have[slot] = true;
+		done[slot] = out->done;
+		buflen[slot] = len;
+		memcpy(buf[slot], out->data, len);
+
+		while (have[base % EAD_CMD_WINDOW]) {
+			slot = base % EAD_CMD_WINDOW;
+			have[slot] = false;
+			if (!write_output(buf[slot], buflen[slot]))
+				return 0;
+			base++;
+
+			if (done[slot])
+				finished = true;
+		}
+
+		if (!finished && (++unacked < EAD_CMD_WINDOW / 2))
+			continue;
+
+ack:
+		mask = 0;
+		for (i = 0; i < EAD_CMD_WINDOW - 1; i++) {
+			if (have[(base + 1 + i) % EAD_CMD_WINDOW])
+				mask |= (1 << i);
+		}
+		send_cmd_ack(base, mask);
+		unacked = 0;
+	}
+
+	/* the next command continues the numbering, so that late
+	 * retransmissions for this one are recognized as duplicates */
+	cmd_seq = base;
+	return 1;
+}
+
+static int
+send_stream_command(const char *command)
+{
+	struct ead_msg_cmd_stream *cmd = EAD_ENC_DATA(msg, cmd_stream);
+
+	msg->type = htonl(EAD_TYPE_SEND_CMD);
+	cmd->type = EAD_CMD_STREAM;
+	cmd->timeout = htons(10);
+	cmd->seq = htons(cmd_seq);
+	strncpy((char *)cmd->data, command, 1024);
+	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_stream) + strlen(command) + 1);
+	send_msg();
+	return recv_cmd_output();
+}
+
 static int
 send_command(const char *command)
 {
 	struct ead_msg_cmd *cmd = EAD_ENC_DATA(msg, cmd);
+	int i, ret;
+
+	/* the server starts the command only once per seq, so it is safe
+	 * to send the request again if the replies got lost */
+	if (have_stream) {
+		for (i = 0; i < EAD_CMD_RETRIES; i++) {
+			ret = send_stream_command(command);
+			if (ret >= 0)
+				return ret;
+		}
+		return 0;
+	}
 
 	msg->type = htonl(EAD_TYPE_SEND_CMD);
-	cmd->type = htons(EAD_CMD_NORMAL);
+	cmd->type = EAD_CMD_NORMAL;
 	cmd->timeout = htons(10);
 	strncpy((char *)cmd->data, command, 1024);
 	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd) + strlen(command) + 1);
 	return send_packet(EAD_TYPE_RESULT_CMD, handle_cmd_data, 1);
 }
 
+/* run one command per line of stdin in the same session */
+static int
+send_commands(void)
+{
+	char line[1024];
+	char *nl;
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl = 0;
+
+		if (!line[0])
+			continue;
+
+		if (!send_command(line)) {
+			fprintf(stderr, "Command failed: %s\n", line);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 
 static int
 usage(const char *prog)
@@ -306,6 +508,7 @@ usage(const char *prog)
 		"\t-b <addr>:  Set the broadcast address to <addr>\n"
 		"\t<node>:     Node ID (4 digits hex)\n"
 		"\t<username>: Username to authenticate with\n"
+		"\t<command>:  Command to run, - to read one command per line from stdin\n"
 		"\n"
 		"\tPassing no arguments shows a list of active nodes on the network\n"
 		"\n", prog);
@@ -424,7 +627,10 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Authentication succesful\n");
 		return 0;
 	}
-	if (!send_command(command)) {
+	if (!strcmp(command, "-")) {
+		if (!send_commands())
+			return 1;
+	} else if (!send_command(command)) {
 		fprintf(stderr, "Command failed\n");
 		return 1;
 	}
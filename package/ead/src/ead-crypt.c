@@ -34,51 +34,67 @@
 #endif
 
 
-static uint32_t aes_enc_ctx[AES_PRIV_SIZE];
-static uint32_t aes_dec_ctx[AES_PRIV_SIZE];
-static uint32_t ead_rx_iv;
-static uint32_t ead_tx_iv;
-static uint32_t ivofs_vec;
-static unsigned int ivofs_idx = 0;
+struct ead_crypt {
+	uint32_t aes_enc_ctx[AES_PRIV_SIZE];
+	uint32_t aes_dec_ctx[AES_PRIV_SIZE];
+	uint32_t rx_iv;
+	uint32_t tx_iv;
+	uint32_t ivofs_vec;
+	unsigned int ivofs_idx;
+};
+
+static struct ead_crypt default_ctx;
+static struct ead_crypt *ctx = &default_ctx;
 static uint32_t W[80]; /* work space for sha1 */
 
 #define EAD_ENC_PAD	64
 
+struct ead_crypt *
+ead_crypt_new(void)
+{
+	return calloc(1, sizeof(struct ead_crypt));
+}
+
+void
+ead_crypt_select(struct ead_crypt *c)
+{
+	ctx = c ? c : &default_ctx;
+}
+
 void
 ead_set_key(unsigned char *skey)
 {
 	uint32_t *ivp = (uint32_t *)skey;
 
-	memset(aes_enc_ctx, 0, sizeof(aes_enc_ctx));
-	memset(aes_dec_ctx, 0, sizeof(aes_dec_ctx));
+	memset(ctx, 0, sizeof(*ctx));
 
 	/* first 32 bytes of skey are used as aes key for
 	 * encryption and decryption */
-	rijndaelKeySetupEnc(aes_enc_ctx, skey);
-	rijndaelKeySetupDec(aes_dec_ctx, skey);
+	rijndaelKeySetupEnc(ctx->aes_enc_ctx, skey);
+	rijndaelKeySetupDec(ctx->aes_dec_ctx, skey);
 
 	/* the following bytes are used as initialization vector for messages
 	 * (highest byte cleared to avoid overflow) */
 	ivp += 8;
-	ead_rx_iv = ntohl(*ivp) & 0x00ffffff;
-	ead_tx_iv = ead_rx_iv;
+	ctx->rx_iv = ntohl(*ivp) & 0x00ffffff;
+	ctx->tx_iv = ctx->rx_iv;
 
 	/* the last bytes are used to feed the random iv increment */
 	ivp++;
-	ivofs_vec = *ivp;
+	ctx->ivofs_vec = *ivp;
 }
 
 
 static bool
 ead_check_rx_iv(uint32_t iv)
 {
-	if (iv <= ead_rx_iv)
+	if (iv <= ctx->rx_iv)
 		return false;
 
-	if (iv > ead_rx_iv + EAD_MAX_IV_INCR)
+	if (iv > ctx->rx_iv + EAD_MAX_IV_INCR)
 		return false;
 
-	ead_rx_iv = iv;
+	ctx->rx_iv = iv;
 	return true;
 }
 
@@ -88,11 +104,11 @@ ead_get_tx_iv(void)
 {
 	unsigned int ofs;
 
-	ofs = 1 + ((ivofs_vec >> 2 * ivofs_idx) & 0x3);
-	ivofs_idx = (ivofs_idx + 1) % 16;
-	ead_tx_iv += ofs;
+	ofs = 1 + ((ctx->ivofs_vec >> 2 * ctx->ivofs_idx) & 0x3);
+	ctx->ivofs_idx = (ctx->ivofs_idx + 1) % 16;
+	ctx->tx_iv += ofs;
 
-	return ead_tx_iv;
+	return ctx->tx_iv;
 }
 
 static void
@@ -130,7 +146,7 @@ ead_encrypt_message(struct ead_msg *msg, unsigned int len)
 	DEBUG(2, "SHA1 generate (0x%08x), len=%d\n", enc->hash[0], enclen);
 
 	while (enclen > 0) {
-		rijndaelEncrypt(aes_enc_ctx, data, data);
+		rijndaelEncrypt(ctx->aes_enc_ctx, data, data);
 		data += 16;
 		enclen -= 16;
 	}
@@ -149,7 +165,7 @@ ead_decrypt_message(struct ead_msg *msg)
 		return 0;
 
 	while (len > 0) {
-		rijndaelDecrypt(aes_dec_ctx, data, data);
+		rijndaelDecrypt(ctx->aes_dec_ctx, data, data);
 		data += 16;
 		len -= 16;
 	}
@@ -162,7 +178,7 @@ ead_decrypt_message(struct ead_msg *msg)
 	}
 
 	if (!ead_check_rx_iv(ntohl(enc->iv))) {
-		DEBUG(2, "RX IV mismatch (0x%08x <> 0x%08x)\n", ead_rx_iv, ntohl(enc->iv));
+		DEBUG(2, "RX IV mismatch (0x%08x <> 0x%08x)\n", ctx->rx_iv, ntohl(enc->iv));
 		return 0;
 	}
 
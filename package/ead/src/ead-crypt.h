@@ -14,6 +14,12 @@
 #ifndef __EAD_CRYPT_H
 #define __EAD_CRYPT_H
 
+struct ead_crypt;
+
+/* the key and iv state of one session, operations use the selected one */
+extern struct ead_crypt *ead_crypt_new(void);
+extern void ead_crypt_select(struct ead_crypt *c);
+
 extern void ead_set_key(unsigned char *skey);
 extern void ead_encrypt_message(struct ead_msg *msg, unsigned int len);
 extern int ead_decrypt_message(struct ead_msg *msg);
@@ -14,7 +14,7 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <pcap.h>
 #include <pcap-bpf.h>
@@ -58,6 +59,7 @@
 
 #define PCAP_MRU		1600
 #define PCAP_TIMEOUT	200
+#define PCAP_BATCH		32
 
 #if EAD_DEBUGLEVEL >= 1
 #define DEBUG(n, format, ...) do { \
@@ -72,48 +74,61 @@
 struct ead_instance {
 	struct list_head list;
 	char ifname[16];
-	int pid;
 	char id;
 #ifdef linux
 	char bridge[16];
 	bool br_check;
 #endif
+	pcap_t *pcap_fp;
+	pcap_t *pcap_fp_rx;
+	bool open_warned;
+
+	/* srp session */
+	int state;
+	char username[32];
+	unsigned char abuf[MAXPARAMLEN + 1];
+	unsigned char pwbuf[MAXPARAMLEN];
+	unsigned char saltbuf[MAXSALTLEN];
+	unsigned char pw_saltbuf[MAXSALTLEN];
+	struct t_pwent tpe;
+	struct t_confent *tce;
+	struct t_server *ts;
+	struct t_num A, *B;
+	struct ead_crypt *crypt;
+
+	/* output of a running command, sent back from the main loop */
+	volatile pid_t cmd_pid;
+	bool cmd_active;
+	int cmd_fd;
+	struct timeval cmd_end;
+	struct timeval cmd_next;
+	unsigned char cmd_pkt[sizeof(struct ead_packet)];
+
+	/* EAD_CMD_STREAM: packets from cmd_base up to cmd_seq are in flight */
+	bool cmd_stream;
+	bool cmd_started;	/* a command was started with cmd_first */
+	uint16_t cmd_first;
+	bool cmd_done;
+	uint16_t cmd_base;
+	uint16_t cmd_seq;
+	struct timeval cmd_ack_time;
+	uint16_t cmd_len[EAD_CMD_WINDOW];
+	bool cmd_acked[EAD_CMD_WINDOW];
+	unsigned char cmd_buf[EAD_CMD_WINDOW][EAD_CMD_CHUNK];
 };
 
 static char ethmac[6] = "\x00\x13\x37\x00\x00\x00"; /* last 3 bytes will be randomized */
-static pcap_t *pcap_fp = NULL;
-static pcap_t *pcap_fp_rx = NULL;
 static char pktbuf_b[PCAP_MRU];
 static struct ead_packet *pktbuf = (struct ead_packet *)pktbuf_b;
 static u16_t nid = 0xffff; /* node id */
-static char username[32] = "";
-static int state = EAD_TYPE_SET_USERNAME;
 static const char *passwd_file = PASSWD_FILE;
 static const char password[MAXPARAMLEN];
-static bool child_pending = false;
 
-static unsigned char abuf[MAXPARAMLEN + 1];
-static unsigned char pwbuf[MAXPARAMLEN];
-static unsigned char saltbuf[MAXSALTLEN];
-static unsigned char pw_saltbuf[MAXSALTLEN];
 static struct list_head instances;
+static int n_instances = 0;
 static const char *dev_name = DEFAULT_DEVNAME;
-static bool nonfork = false;
 static struct ead_instance *instance = NULL;
 
-static struct t_pwent tpe = {
-	.name = username,
-	.index = 1,
-	.password.data = pwbuf,
-	.password.len = 0,
-	.salt.data = saltbuf,
-	.salt.len = 0,
-};
-struct t_confent *tce = NULL;
-static struct t_server *ts = NULL;
-static struct t_num A, *B = NULL;
-unsigned char *skey;
-
 static void
 set_recv_type(pcap_t *p, bool rx)
 {
@@ -153,8 +168,12 @@ ead_open_pcap(const char *ifname, char *errbuf, bool rx)
 	pcap_set_protocol(p, (rx ? htons(ETH_P_IP) : 0));
 #endif
 	pcap_set_buffer_size(p, (rx ? 10 : 1) * PCAP_MRU);
-	pcap_activate(p);
+	if (pcap_activate(p) < 0) {
+		pcap_close(p);
+		return NULL;
+	}
 	set_recv_type(p, rx);
+	pcap_setnonblock(p, 1, errbuf);
 out:
 	return p;
 }
@@ -180,6 +199,7 @@ prepare_password(void)
 	unsigned char dig[SHA_DIGESTSIZE];
 	BigInteger x, v, n, g;
 	SHA1_CTX ctxt;
+	const char *username = instance->username;
 	int ulen = strlen(username);
 	FILE *f;
 
@@ -210,8 +230,8 @@ prepare_password(void)
 		if (s2 - str >= MAXSALTLEN)
 			continue;
 
-		strncpy((char *) pw_saltbuf, str, s2 - str);
-		pw_saltbuf[s2 - str] = 0;
+		strncpy((char *) instance->pw_saltbuf, str, s2 - str);
+		instance->pw_saltbuf[s2 - str] = 0;
 
 		s2 = strchr(s2, ':');
 		if (!s2)
@@ -231,15 +251,15 @@ prepare_password(void)
 	return false;
 
 hash_password:
-	tce = gettcid(tpe.index);
+	instance->tce = gettcid(instance->tpe.index);
 	do {
-		t_random(tpe.password.data, SALTLEN);
-	} while (memcmp(saltbuf, (char *)dig, sizeof(saltbuf)) == 0);
-	if (saltbuf[0] == 0)
-		saltbuf[0] = 0xff;
+		t_random(instance->tpe.password.data, SALTLEN);
+	} while (memcmp(instance->saltbuf, (char *)dig, sizeof(instance->saltbuf)) == 0);
+	if (instance->saltbuf[0] == 0)
+		instance->saltbuf[0] = 0xff;
 
-	n = BigIntegerFromBytes(tce->modulus.data, tce->modulus.len);
-	g = BigIntegerFromBytes(tce->generator.data, tce->generator.len);
+	n = BigIntegerFromBytes(instance->tce->modulus.data, instance->tce->modulus.len);
+	g = BigIntegerFromBytes(instance->tce->generator.data, instance->tce->generator.len);
 	v = BigIntegerFromInt(0);
 
 	SHA1Init(&ctxt);
@@ -249,15 +269,15 @@ hash_password:
 	SHA1Final(dig, &ctxt);
 
 	SHA1Init(&ctxt);
-	SHA1Update(&ctxt, saltbuf, tpe.salt.len);
+	SHA1Update(&ctxt, instance->saltbuf, instance->tpe.salt.len);
 	SHA1Update(&ctxt, dig, sizeof(dig));
 	SHA1Final(dig, &ctxt);
 
 	/* x = H(s, H(u, ':', p)) */
 	x = BigIntegerFromBytes(dig, sizeof(dig));
 
-	BigIntegerModExp(v, g, x, n);
-	tpe.password.len = BigIntegerToBytes(v, (unsigned char *)pwbuf);
+	BigIntegerModExpFixed(v, g, x, n);
+	instance->tpe.password.len = BigIntegerToBytes(v, instance->pwbuf);
 
 	BigIntegerFree(v);
 	BigIntegerFree(x);
@@ -302,6 +322,9 @@ ead_send_packet_clone(struct ead_packet *pkt)
 {
 	u16_t len, sum;
 
+	if (!instance->pcap_fp)
+		return;
+
 	memcpy(pktbuf, pkt, offsetof(struct ead_packet, msg));
 	memcpy(pktbuf->eh.ether_shost, ethmac, 6);
 	memcpy(pktbuf->eh.ether_dhost, pkt->eh.ether_shost, 6);
@@ -334,37 +357,40 @@ ead_send_packet_clone(struct ead_packet *pkt)
 	if (sum == 0)
 		sum = 0xffff;
 	pktbuf->udpchksum = htons(~sum);
-	pcap_sendpacket(pcap_fp, (void *) pktbuf, sizeof(struct ead_packet) + ntohl(pktbuf->msg.len));
+	pcap_sendpacket(instance->pcap_fp, (void *) pktbuf, sizeof(struct ead_packet) + ntohl(pktbuf->msg.len));
 }
 
 static void
 set_state(int nstate)
 {
-	if (state == nstate)
+	struct ead_instance *in = instance;
+	unsigned char *skey;
+
+	if (in->state == nstate)
 		return;
 
-	if (nstate < state) {
+	if (nstate < in->state) {
 		if ((nstate < EAD_TYPE_GET_PRIME) &&
-			(state >= EAD_TYPE_GET_PRIME)) {
-			t_serverclose(ts);
-			ts = NULL;
+			(in->state >= EAD_TYPE_GET_PRIME)) {
+			t_serverclose(in->ts);
+			in->ts = NULL;
 		}
 		goto done;
 	}
 
-	switch(state) {
+	switch(in->state) {
 	case EAD_TYPE_SET_USERNAME:
 		if (!prepare_password())
 			goto error;
-		ts = t_serveropenraw(&tpe, tce);
-		if (!ts)
+		in->ts = t_serveropenraw(&in->tpe, in->tce);
+		if (!in->ts)
 			goto error;
 		break;
 	case EAD_TYPE_GET_PRIME:
-		B = t_servergenexp(ts);
+		in->B = t_servergenexp(in->ts);
 		break;
 	case EAD_TYPE_SEND_A:
-		skey = t_servergetkey(ts, &A);
+		skey = t_servergetkey(in->ts, &in->A);
 		if (!skey)
 			goto error;
 
@@ -372,7 +398,7 @@ set_state(int nstate)
 		break;
 	}
 done:
-	state = nstate;
+	in->state = nstate;
 error:
 	return;
 }
@@ -388,9 +414,10 @@ handle_ping(struct ead_packet *pkt, int len, int *nstate)
 	if (slen > 1024)
 		slen = 1024;
 
-	msg->len = htonl(sizeof(struct ead_msg_pong) + slen);
+	msg->len = htonl(sizeof(struct ead_msg_pong) + slen + 2);
 	strncpy(pong->name, dev_name, slen);
 	pong->name[slen] = 0;
+	pong->name[slen + 1] = EAD_PONG_STREAM;
 	pong->auth_type = htons(EAD_AUTH_MD5);
 
 	return true;
@@ -403,8 +430,8 @@ handle_set_username(struct ead_packet *pkt, int len, int *nstate)
 	struct ead_msg_user *user = EAD_DATA(msg, user);
 
 	set_state(EAD_TYPE_SET_USERNAME); /* clear old state */
-	strncpy(username, user->username, sizeof(username));
-	username[sizeof(username) - 1] = 0;
+	strncpy(instance->username, user->username, sizeof(instance->username));
+	instance->username[sizeof(instance->username) - 1] = 0;
 
 	msg = &pktbuf->msg;
 	msg->len = 0;
@@ -420,10 +447,10 @@ handle_get_prime(struct ead_packet *pkt, int len, int *nstate)
 	struct ead_msg_salt *salt = EAD_DATA(msg, salt);
 
 	msg->len = htonl(sizeof(struct ead_msg_salt));
-	salt->prime = tce->index - 1;
-	salt->len = ts->s.len;
-	memcpy(salt->salt, ts->s.data, ts->s.len);
-	memcpy(salt->ext_salt, pw_saltbuf, MAXSALTLEN);
+	salt->prime = instance->tce->index - 1;
+	salt->len = instance->ts->s.len;
+	memcpy(salt->salt, instance->ts->s.data, instance->ts->s.len);
+	memcpy(salt->ext_salt, instance->pw_saltbuf, MAXSALTLEN);
 
 	*nstate = EAD_TYPE_SEND_A;
 	return true;
@@ -439,14 +466,14 @@ handle_send_a(struct ead_packet *pkt, int len, int *nstate)
 	if (len > MAXPARAMLEN + 1)
 		return false;
 
-	A.len = len;
-	A.data = abuf;
-	memcpy(A.data, number->data, len);
+	instance->A.len = len;
+	instance->A.data = instance->abuf;
+	memcpy(instance->A.data, number->data, len);
 
 	msg = &pktbuf->msg;
 	number = EAD_DATA(msg, number);
-	msg->len = htonl(sizeof(struct ead_msg_number) + B->len);
-	memcpy(number->data, B->data, B->len);
+	msg->len = htonl(sizeof(struct ead_msg_number) + instance->B->len);
+	memcpy(number->data, instance->B->data, instance->B->len);
 
 	*nstate = EAD_TYPE_SEND_AUTH;
 	return true;
@@ -458,7 +485,7 @@ handle_send_auth(struct ead_packet *pkt, int len, int *nstate)
 	struct ead_msg *msg = &pkt->msg;
 	struct ead_msg_auth *auth = EAD_DATA(msg, auth);
 
-	if (t_serververify(ts, auth->data) != 0) {
+	if (t_serververify(instance->ts, auth->data) != 0) {
 		DEBUG(2, "Client authentication failed\n");
 		*nstate = EAD_TYPE_SET_USERNAME;
 		return false;
@@ -469,23 +496,318 @@ handle_send_auth(struct ead_packet *pkt, int len, int *nstate)
 	msg->len = htonl(sizeof(struct ead_msg_auth));
 
 	DEBUG(2, "Client authentication successful\n");
-	memcpy(auth->data, t_serverresponse(ts), sizeof(auth->data));
+	/* the command numbering starts over with the new session */
+	instance->cmd_started = false;
+	memcpy(auth->data, t_serverresponse(instance->ts), sizeof(auth->data));
 
 	*nstate = EAD_TYPE_SEND_CMD;
 	return true;
 }
 
+static void
+tv_add_ms(struct timeval *tv, int ms)
+{
+	tv->tv_sec += ms / 1000;
+	tv->tv_usec += (ms % 1000) * 1000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+static int
+tv_diff_ms(const struct timeval *a, const struct timeval *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000 +
+		(a->tv_usec - b->tv_usec) / 1000;
+}
+
+static void
+select_instance(struct ead_instance *in)
+{
+	instance = in;
+	ead_crypt_select(in->crypt);
+}
+
+static void
+start_command(struct ead_packet *pkt, pid_t pid, int fd, int timeout,
+	struct ead_msg_cmd_stream *stream)
+{
+	struct ead_instance *in = instance;
+
+	in->cmd_pid = pid;
+	in->cmd_fd = fd;
+	in->cmd_active = true;
+	memcpy(in->cmd_pkt, pkt, sizeof(in->cmd_pkt));
+
+	gettimeofday(&in->cmd_end, NULL);
+	in->cmd_next = in->cmd_end;
+	in->cmd_ack_time = in->cmd_end;
+	in->cmd_end.tv_sec += timeout;
+	tv_add_ms(&in->cmd_next, PCAP_TIMEOUT);
+
+	if (stream) {
+		in->cmd_stream = true;
+		in->cmd_started = true;
+		in->cmd_first = ntohs(stream->seq);
+		in->cmd_base = in->cmd_first;
+		in->cmd_seq = in->cmd_base;
+	}
+}
+
+static void
+stop_command(struct ead_instance *in)
+{
+	if (in->cmd_pid > 0)
+		kill(in->cmd_pid, SIGKILL);
+	if (in->cmd_fd >= 0)
+		close(in->cmd_fd);
+
+	in->cmd_pid = 0;
+	in->cmd_fd = -1;
+	in->cmd_active = false;
+	in->cmd_stream = false;
+	in->cmd_done = false;
+}
+
+static struct ead_packet *
+prepare_command_reply(void)
+{
+	struct ead_packet *pkt = (struct ead_packet *) instance->cmd_pkt;
+	struct ead_msg *msg = &pktbuf->msg;
+
+	msg->magic = htonl(EAD_MAGIC);
+	msg->type = htonl(EAD_TYPE_RESULT_CMD);
+	msg->nid = htons(nid);
+	msg->sid = pkt->msg.sid;
+
+	return pkt;
+}
+
+static void
+send_command_data(int bytes, bool done)
+{
+	struct ead_packet *pkt = prepare_command_reply();
+	struct ead_msg *msg = &pktbuf->msg;
+	struct ead_msg_cmd_data *cmddata = EAD_ENC_DATA(msg, cmd_data);
+
+	cmddata->done = done;
+
+	DEBUG(3, "Sending %d bytes of console data, done=%d\n", bytes, done);
+	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_data) + bytes);
+	ead_send_packet_clone(pkt);
+}
+
+/* packets are sent again until they are acknowledged, the number of the
+ * next packet to be queued is used for keepalives */
+static void
+send_stream_packet(uint16_t seq)
+{
+	struct ead_instance *in = instance;
+	struct ead_packet *pkt = prepare_command_reply();
+	struct ead_msg *msg = &pktbuf->msg;
+	struct ead_msg_cmd_output *out = EAD_ENC_DATA(msg, cmd_output);
+	int slot = seq % EAD_CMD_WINDOW;
+	int bytes = 0;
+
+	out->done = 0;
+	out->seq = htons(seq);
+	if (seq != in->cmd_seq) {
+		bytes = in->cmd_len[slot];
+		memcpy(out->data, in->cmd_buf[slot], bytes);
+		if (in->cmd_done && ((uint16_t) (seq + 1) == in->cmd_seq))
+			out->done = 1;
+	}
+
+	DEBUG(3, "Sending packet %d with %d bytes of console data, done=%d\n", seq, bytes, out->done);
+	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_output) + bytes);
+	ead_send_packet_clone(pkt);
+}
+
+static bool
+stream_has_room(struct ead_instance *in)
+{
+	return (uint16_t) (in->cmd_seq - in->cmd_base) < EAD_CMD_WINDOW;
+}
+
+static void
+queue_stream_packet(int bytes)
+{
+	struct ead_instance *in = instance;
+	int slot = in->cmd_seq % EAD_CMD_WINDOW;
+
+	/* the ack timeout only runs while packets are outstanding */
+	if (in->cmd_seq == in->cmd_base)
+		gettimeofday(&in->cmd_ack_time, NULL);
+
+	in->cmd_len[slot] = bytes;
+	in->cmd_acked[slot] = false;
+	in->cmd_seq++;
+	send_stream_packet(in->cmd_seq - 1);
+}
+
+static void
+poll_stream(struct ead_instance *in, const struct timeval *now, bool tick)
+{
+	bool drained = (in->cmd_fd < 0);
+	uint16_t seq;
+	int bytes, n = 0;
+
+	/* stop the command, but still deliver what it has written */
+	if (in->cmd_pid && !timercmp(now, &in->cmd_end, <)) {
+		kill(in->cmd_pid, SIGKILL);
+		in->cmd_pid = 0;
+		if (in->cmd_fd >= 0)
+			close(in->cmd_fd);
+		in->cmd_fd = -1;
+		drained = true;
+	}
+
+	while ((in->cmd_fd >= 0) && stream_has_room(in)) {
+		bytes = read(in->cmd_fd, in->cmd_buf[in->cmd_seq % EAD_CMD_WINDOW], EAD_CMD_CHUNK);
+		if (bytes == 0) {
+			close(in->cmd_fd);
+			in->cmd_fd = -1;
+		}
+		if (bytes <= 0) {
+			drained = true;
+			break;
+		}
+		queue_stream_packet(bytes);
+	}
+
+	if (drained && !in->cmd_pid && !in->cmd_done && stream_has_room(in)) {
+		in->cmd_done = true;
+		queue_stream_packet(0);
+	}
+
+	if (!tick)
+		return;
+
+	/* no acknowledgement for a while, the client is gone */
+	if ((in->cmd_seq != in->cmd_base) &&
+		(tv_diff_ms(now, &in->cmd_ack_time) > EAD_CMD_TIMEOUT * 1000)) {
+		DEBUG(2, "Client stopped acknowledging command output\n");
+		stop_command(in);
+		return;
+	}
+
+	for (seq = in->cmd_base; seq != in->cmd_seq; seq++) {
+		if (in->cmd_acked[seq % EAD_CMD_WINDOW])
+			continue;
+
+		send_stream_packet(seq);
+		n++;
+	}
+	if (!n)
+		send_stream_packet(in->cmd_seq);
+
+	in->cmd_next = *now;
+	tv_add_ms(&in->cmd_next, PCAP_TIMEOUT);
+}
+
+static void
+handle_stream_ack(struct ead_msg_cmd_ack *ack)
+{
+	struct ead_instance *in = instance;
+	uint16_t seq = ntohs(ack->seq);
+	uint32_t mask = ntohl(ack->mask);
+	uint16_t last = seq;
+	struct timeval now;
+	int i;
+
+	if ((uint16_t) (seq - in->cmd_base) > (uint16_t) (in->cmd_seq - in->cmd_base))
+		return;
+
+	gettimeofday(&now, NULL);
+	in->cmd_ack_time = now;
+	in->cmd_base = seq;
+	if (in->cmd_done && (in->cmd_base == in->cmd_seq)) {
+		stop_command(in);
+		return;
+	}
+
+	for (i = 0; i < 32; i++) {
+		uint16_t cur = seq + 1 + i;
+
+		if ((uint16_t) (cur - seq) >= (uint16_t) (in->cmd_seq - seq))
+			break;
+
+		if (!(mask & (1U << i)))
+			continue;
+
+		in->cmd_acked[cur % EAD_CMD_WINDOW] = true;
+		last = cur;
+	}
+
+	/* gaps in front of received packets are most likely losses */
+	for (; seq != last; seq++) {
+		if (!in->cmd_acked[seq % EAD_CMD_WINDOW])
+			send_stream_packet(seq);
+	}
+
+	/* fill the space that was freed up */
+	poll_stream(in, &now, false);
+}
+
+/*
+ * Called from the main loop when the output pipe of a command is readable
+ * and every PCAP_TIMEOUT ms, so that the client gets keepalive packets
+ * and doesn't time out while the command is still running
+ */
+static void
+poll_command(struct ead_instance *in, const struct timeval *now)
+{
+	struct ead_msg_cmd_data *cmddata = EAD_ENC_DATA(&pktbuf->msg, cmd_data);
+	int bytes = 0;
+
+	if (in->cmd_stream) {
+		poll_stream(in, now, !timercmp(now, &in->cmd_next, <));
+		return;
+	}
+
+	if (in->cmd_fd >= 0) {
+		bytes = read(in->cmd_fd, cmddata->data, 1024);
+		if (bytes == 0) {
+			close(in->cmd_fd);
+			in->cmd_fd = -1;
+		}
+		if (bytes < 0)
+			bytes = 0;
+	}
+
+	if (!bytes && !in->cmd_pid)
+		goto done;
+
+	send_command_data(bytes, false);
+	if (timercmp(now, &in->cmd_end, <)) {
+		in->cmd_next = *now;
+		tv_add_ms(&in->cmd_next, PCAP_TIMEOUT);
+		return;
+	}
+
+	if (in->cmd_pid) {
+		stop_command(in);
+		return;
+	}
+
+done:
+	send_command_data(0, true);
+	stop_command(in);
+}
+
 static bool
 handle_send_cmd(struct ead_packet *pkt, int len, int *nstate)
 {
 	struct ead_msg *msg = &pkt->msg;
 	struct ead_msg_cmd *cmd = EAD_ENC_DATA(msg, cmd);
+	struct ead_msg_cmd_stream *stream = NULL;
 	struct ead_msg_cmd_data *cmddata;
-	struct timeval tv, to, tn;
+	struct timeval now;
+	sigset_t mask, omask;
+	char *command;
 	int pfd[2], fd;
-	fd_set fds;
 	pid_t pid;
-	bool stream = false;
 	int timeout;
 	int type;
 	int datalen;
@@ -494,20 +816,65 @@ handle_send_cmd(struct ead_packet *pkt, int len, int *nstate)
 	if (datalen <= 0)
 		return false;
 
-	type = ntohs(cmd->type);
+	type = cmd->type;
 	timeout = ntohs(cmd->timeout);
 
-	FD_ZERO(&fds);
+	if (type == EAD_CMD_ACK) {
+		if (datalen < sizeof(struct ead_msg_cmd_ack) - sizeof(struct ead_msg_cmd))
+			return false;
+
+		if (instance->cmd_stream)
+			handle_stream_ack(EAD_ENC_DATA(msg, cmd_ack));
+		return false;
+	}
+
 	cmd->data[datalen] = 0;
+	command = (char *) cmd->data;
+	if (type == EAD_CMD_STREAM) {
+		if (datalen <= sizeof(struct ead_msg_cmd_stream) - sizeof(struct ead_msg_cmd))
+			return false;
+
+		stream = EAD_ENC_DATA(msg, cmd_stream);
+		command = (char *) stream->data;
+
+		/* retransmitted request, the replies were lost: resend
+		 * the outstanding output instead of running it again */
+		if (instance->cmd_started &&
+			(ntohs(stream->seq) == instance->cmd_first)) {
+			if (instance->cmd_stream) {
+				gettimeofday(&now, NULL);
+				instance->cmd_ack_time = now;
+				poll_stream(instance, &now, true);
+			}
+			return false;
+		}
+	}
+
+	if (instance->cmd_active) {
+		/* still sending the output of the previous command */
+		if (!instance->cmd_done)
+			return false;
+
+		/* the client only sends the next command once it has
+		 * received the done packet of the previous one */
+		stop_command(instance);
+	}
+
 	switch(type) {
 	case EAD_CMD_NORMAL:
+	case EAD_CMD_STREAM:
 		if (pipe(pfd) < 0)
 			return false;
 
 		fcntl(pfd[0], F_SETFL, O_NONBLOCK | fcntl(pfd[0], F_GETFL));
-		child_pending = true;
+
+		/* the child must not be reaped before its pid is stored */
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, &omask);
 		pid = fork();
 		if (pid == 0) {
+			sigprocmask(SIG_SETMASK, &omask, NULL);
 			close(pfd[0]);
 			fd = open("/dev/null", O_RDWR);
 			if (fd > 0) {
@@ -515,16 +882,22 @@ handle_send_cmd(struct ead_packet *pkt, int len, int *nstate)
 				dup2(pfd[1], 1);
 				dup2(pfd[1], 2);
 			}
-			system((char *)cmd->data);
+			system(command);
 			exit(0);
-		} else if (pid > 0) {
-			close(pfd[1]);
-			if (!timeout)
-				timeout = EAD_CMD_TIMEOUT;
-
-			stream = true;
-			break;
 		}
+		close(pfd[1]);
+		if (pid < 0) {
+			sigprocmask(SIG_SETMASK, &omask, NULL);
+			close(pfd[0]);
+			return false;
+		}
+
+		if (!timeout)
+			timeout = EAD_CMD_TIMEOUT;
+
+		/* the output is sent from the main loop */
+		start_command(pkt, pid, pfd[0], timeout, stream);
+		sigprocmask(SIG_SETMASK, &omask, NULL);
 		return false;
 	case EAD_CMD_BACKGROUND:
 		pid = fork();
@@ -536,7 +909,7 @@ handle_send_cmd(struct ead_packet *pkt, int len, int *nstate)
 				dup2(fd, 1);
 				dup2(fd, 2);
 			}
-			system((char *)cmd->data);
+			system(command);
 			exit(0);
 		} else if (pid > 0) {
 			break;
@@ -548,37 +921,6 @@ handle_send_cmd(struct ead_packet *pkt, int len, int *nstate)
 
 	msg = &pktbuf->msg;
 	cmddata = EAD_ENC_DATA(msg, cmd_data);
-
-	if (stream) {
-		int nfds, bytes;
-
-		/* send keepalive packets every 200 ms so that the client doesn't timeout */
-		gettimeofday(&to, NULL);
-		memcpy(&tn, &to, sizeof(tn));
-		tv.tv_usec = PCAP_TIMEOUT * 1000;
-		tv.tv_sec = 0;
-		do {
-			cmddata->done = 0;
-			FD_SET(pfd[0], &fds);
-			nfds = select(pfd[0] + 1, &fds, NULL, NULL, &tv);
-			bytes = 0;
-			if (nfds > 0) {
-				bytes = read(pfd[0], cmddata->data, 1024);
-				if (bytes < 0)
-					bytes = 0;
-			}
-			if (!bytes && !child_pending)
-				break;
-			DEBUG(3, "Sending %d bytes of console data, type=%d, timeout=%d\n", bytes, ntohl(msg->type), timeout);
-			ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_data) + bytes);
-			ead_send_packet_clone(pkt);
-			gettimeofday(&tn, NULL);
-		} while (tn.tv_sec < to.tv_sec + timeout);
-		if (child_pending) {
-			kill(pid, SIGKILL);
-			return false;
-		}
-	}
 	cmddata->done = 1;
 	ead_encrypt_message(msg, sizeof(struct ead_msg_cmd_data));
 
@@ -592,11 +934,11 @@ parse_message(struct ead_packet *pkt, int len)
 {
 	bool (*handler)(struct ead_packet *pkt, int len, int *nstate);
 	int min_len = sizeof(struct ead_packet);
-	int nstate = state;
+	int nstate = instance->state;
 	int type = ntohl(pkt->msg.type);
 
 	if ((type >= EAD_TYPE_GET_PRIME) &&
-		(state != type))
+		(instance->state != type))
 		return;
 
 	if ((type != EAD_TYPE_PING) &&
@@ -684,50 +1026,54 @@ handle_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
 }
 
 static void
-ead_pcap_reopen(bool first)
+ead_pcap_close(struct ead_instance *in)
 {
-	static char errbuf[PCAP_ERRBUF_SIZE] = "";
+	if (in->pcap_fp_rx && (in->pcap_fp_rx != in->pcap_fp))
+		pcap_close(in->pcap_fp_rx);
 
-	if (pcap_fp_rx && (pcap_fp_rx != pcap_fp))
-		pcap_close(pcap_fp_rx);
+	if (in->pcap_fp)
+		pcap_close(in->pcap_fp);
 
-	if (pcap_fp)
-		pcap_close(pcap_fp);
+	in->pcap_fp = NULL;
+	in->pcap_fp_rx = NULL;
+}
+
+static void
+ead_pcap_open(struct ead_instance *in)
+{
+	static char errbuf[PCAP_ERRBUF_SIZE] = "";
 
-	pcap_fp_rx = NULL;
-	do {
 #ifdef linux
-		if (instance->bridge[0]) {
-			pcap_fp_rx = ead_open_pcap(instance->bridge, errbuf, 1);
-			pcap_fp = ead_open_pcap(instance->ifname, errbuf, 0);
-		} else
+	if (in->bridge[0]) {
+		in->pcap_fp_rx = ead_open_pcap(in->bridge, errbuf, 1);
+		in->pcap_fp = ead_open_pcap(in->ifname, errbuf, 0);
+	} else
 #endif
-		{
-			pcap_fp = ead_open_pcap(instance->ifname, errbuf, 1);
-		}
+	{
+		in->pcap_fp = ead_open_pcap(in->ifname, errbuf, 1);
+	}
 
-		if (!pcap_fp_rx)
-			pcap_fp_rx = pcap_fp;
-		if (first && !pcap_fp) {
-			DEBUG(1, "WARNING: unable to open interface '%s'\n", instance->ifname);
-			first = false;
-		}
-		if (!pcap_fp)
-			sleep(1);
-	} while (!pcap_fp);
-	pcap_setfilter(pcap_fp_rx, &pktfilter);
+	if (!in->pcap_fp) {
+		if (!in->open_warned)
+			DEBUG(1, "WARNING: unable to open interface '%s'\n", in->ifname);
+		in->open_warned = true;
+		ead_pcap_close(in);
+		return;
+	}
+
+	if (!in->pcap_fp_rx)
+		in->pcap_fp_rx = in->pcap_fp;
+	in->open_warned = false;
+	pcap_setfilter(in->pcap_fp_rx, &pktfilter);
 }
 
 
 static void
-ead_pktloop(void)
+ead_dispatch(struct ead_instance *in)
 {
-	while (1) {
-		if (pcap_dispatch(pcap_fp_rx, 1, handle_packet, NULL) < 0) {
-			ead_pcap_reopen(false);
-			continue;
-		}
-	}
+	/* handles that fail are opened again by start_servers() */
+	if (pcap_dispatch(in->pcap_fp_rx, PCAP_BATCH, handle_packet, NULL) < 0)
+		ead_pcap_close(in);
 }
 
 
@@ -750,88 +1096,85 @@ server_handle_sigchld(int sig)
 {
 	struct ead_instance *in;
 	struct list_head *p;
-	int pid = 0;
-	wait(&pid);
+	pid_t pid;
 
-	list_for_each(p, &instances) {
-		in = list_entry(p, struct ead_instance, list);
-		if (pid != in->pid)
-			continue;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		list_for_each(p, &instances) {
+			in = list_entry(p, struct ead_instance, list);
+			if (pid != in->cmd_pid)
+				continue;
 
-		in->pid = 0;
-		break;
+			in->cmd_pid = 0;
+			break;
+		}
 	}
 }
 
-static void
-instance_handle_sigchld(int sig)
+static struct ead_instance *
+ead_instance_new(const char *ifname)
 {
-	int pid = 0;
-	wait(&pid);
-	child_pending = false;
-}
+	struct ead_instance *in;
 
-static void
-start_server(struct ead_instance *i)
-{
-	if (!nonfork) {
-		i->pid = fork();
-		if (i->pid != 0) {
-			if (i->pid < 0)
-				i->pid = 0;
-			return;
-		}
+	in = malloc(sizeof(struct ead_instance));
+	if (!in)
+		return NULL;
+
+	memset(in, 0, sizeof(struct ead_instance));
+	INIT_LIST_HEAD(&in->list);
+	strncpy(in->ifname, ifname, sizeof(in->ifname) - 1);
+	in->id = n_instances++;
+
+	in->state = EAD_TYPE_SET_USERNAME;
+	in->tpe.name = in->username;
+	in->tpe.index = 1;
+	in->tpe.password.data = in->pwbuf;
+	in->tpe.salt.data = in->saltbuf;
+	in->cmd_fd = -1;
+	in->crypt = ead_crypt_new();
+	if (!in->crypt) {
+		free(in);
+		return NULL;
 	}
 
-	instance = i;
-	signal(SIGCHLD, instance_handle_sigchld);
-	ead_pcap_reopen(true);
-	ead_pktloop();
-	pcap_close(pcap_fp);
-	if (pcap_fp_rx != pcap_fp)
-		pcap_close(pcap_fp_rx);
-
-	exit(0);
+	list_add(&in->list, &instances);
+	return in;
 }
 
-
 static void
-start_servers(bool restart)
+start_servers(void)
 {
 	struct ead_instance *in;
 	struct list_head *p;
 
 	list_for_each(p, &instances) {
 		in = list_entry(p, struct ead_instance, list);
-		if (in->pid > 0)
+		if (in->pcap_fp)
 			continue;
 
-		sleep(1);
-		start_server(in);
+		ead_pcap_open(in);
 	}
 }
 
 static void
-stop_server(struct ead_instance *in, bool do_free)
+stop_server(struct ead_instance *in)
 {
-	if (in->pid > 0)
-		kill(in->pid, SIGKILL);
-	in->pid = 0;
-	if (do_free) {
-		list_del(&in->list);
-		free(in);
-	}
+	/* drop the session, like a restarted server would */
+	select_instance(in);
+	stop_command(in);
+	set_state(EAD_TYPE_SET_USERNAME);
+	ead_pcap_close(in);
 }
 
 static void
 server_handle_sigint(int sig)
 {
 	struct ead_instance *in;
-	struct list_head *p, *tmp;
+	struct list_head *p;
 
-	list_for_each_safe(p, tmp, &instances) {
+	list_for_each(p, &instances) {
 		in = list_entry(p, struct ead_instance, list);
-		stop_server(in, true);
+		if (in->cmd_pid > 0)
+			kill(in->cmd_pid, SIGKILL);
 	}
 	exit(1);
 }
@@ -855,7 +1198,7 @@ check_bridge_port(const char *br, const char *port, void *arg)
 
 		strncpy(in->bridge, br, sizeof(in->bridge));
 		DEBUG(2, "assigning port %s to bridge %s\n", in->ifname, in->bridge);
-		stop_server(in, false);
+		stop_server(in);
 	}
 	return 0;
 }
@@ -886,20 +1229,93 @@ check_all_interfaces(void)
 		} else if (in->bridge[0]) {
 			DEBUG(2, "removing port %s from bridge %s\n", in->ifname, in->bridge);
 			in->bridge[0] = 0;
-			stop_server(in, false);
+			stop_server(in);
 		}
 	}
 #endif
 }
 
 
-int main(int argc, char **argv)
+/*
+ * All interfaces are served from this process: the pcap handles and the
+ * output pipes of running commands are polled together, and each
+ * readable handle is drained in batches of up to PCAP_BATCH packets.
+ * Every instance has two slots in the poll array, unused ones are -1.
+ */
+static void
+server_loop(void)
 {
 	struct ead_instance *in;
-	struct timeval tv;
+	struct list_head *p;
+	struct pollfd *pfds, *pfd;
+	struct timeval now, next_check;
+	int timeout, n;
+
+	pfds = calloc(2 * n_instances, sizeof(struct pollfd));
+	if (!pfds) {
+		perror("calloc");
+		exit(1);
+	}
+
+	timerclear(&next_check);
+	while (1) {
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &next_check, <)) {
+			check_all_interfaces();
+			start_servers();
+			next_check = now;
+			tv_add_ms(&next_check, 1000);
+		}
+		timeout = tv_diff_ms(&next_check, &now);
+
+		pfd = pfds;
+		list_for_each(p, &instances) {
+			in = list_entry(p, struct ead_instance, list);
+
+			pfd[0].fd = in->pcap_fp_rx ? pcap_get_selectable_fd(in->pcap_fp_rx) : -1;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = -1;
+			if (in->cmd_active && (!in->cmd_stream || stream_has_room(in)))
+				pfd[1].fd = in->cmd_fd;
+			pfd[1].events = POLLIN;
+			pfd += 2;
+
+			if (in->cmd_active) {
+				n = tv_diff_ms(&in->cmd_next, &now);
+				if (n < timeout)
+					timeout = n;
+			}
+		}
+		if (timeout < 0)
+			timeout = 0;
+
+		/* interrupted by SIGCHLD */
+		if (poll(pfds, pfd - pfds, timeout) < 0)
+			continue;
+
+		gettimeofday(&now, NULL);
+		pfd = pfds;
+		list_for_each(p, &instances) {
+			in = list_entry(p, struct ead_instance, list);
+			select_instance(in);
+
+			if (pfd[0].revents && in->pcap_fp_rx)
+				ead_dispatch(in);
+
+			if (in->cmd_active &&
+				(pfd[1].revents || !timercmp(&now, &in->cmd_next, <)))
+				poll_command(in, &now);
+
+			pfd += 2;
+		}
+	}
+}
+
+
+int main(int argc, char **argv)
+{
 	const char *pidfile = NULL;
 	bool background = false;
-	int n_iface = 0;
 	int fd, ch;
 
 	if (argc == 1)
@@ -912,17 +1328,13 @@ int main(int argc, char **argv)
 			background = true;
 			break;
 		case 'f':
-			nonfork = true;
+			/* no longer forks per interface, kept for compatibility */
 			break;
 		case 'h':
 			return usage(argv[0]);
 		case 'd':
-			in = malloc(sizeof(struct ead_instance));
-			memset(in, 0, sizeof(struct ead_instance));
-			INIT_LIST_HEAD(&in->list);
-			strncpy(in->ifname, optarg, sizeof(in->ifname) - 1);
-			list_add(&in->list, &instances);
-			in->id = n_iface++;
+			if (!ead_instance_new(optarg))
+				return -1;
 			break;
 		case 'D':
 			dev_name = optarg;
@@ -940,7 +1352,7 @@ int main(int argc, char **argv)
 	signal(SIGTERM, server_handle_sigint);
 	signal(SIGKILL, server_handle_sigint);
 
-	if (!n_iface) {
+	if (!n_instances) {
 		fprintf(stderr, "Error: ead needs at least one interface\n");
 		return -1;
 	}
@@ -972,17 +1384,10 @@ int main(int argc, char **argv)
 	get_random_bytes(ethmac + 3, 3);
 	nid = *(((u16_t *) ethmac) + 2);
 
-	start_servers(false);
 #ifdef linux
 	br_init();
 #endif
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	while (1) {
-		check_all_interfaces();
-		start_servers(true);
-		sleep(1);
-	}
+	server_loop();
 #ifdef linux
 	br_shutdown();
 #endif
@@ -27,6 +27,10 @@
 #define EAD_MAGIC	3671771902UL
 #define EAD_CMD_TIMEOUT	10
 
+/* EAD_CMD_STREAM: output packets in flight and payload size of each */
+#define EAD_CMD_WINDOW	16
+#define EAD_CMD_CHUNK	1024
+
 #define EAD_MAX_IV_INCR	128
 
 /* request/response types */
@@ -61,14 +65,22 @@ enum ead_auth_type {
 enum ead_cmd_type {
 	EAD_CMD_NORMAL,
 	EAD_CMD_BACKGROUND,
+	EAD_CMD_STREAM,
+	EAD_CMD_ACK,
 	EAD_CMD_LAST
 };
 
+/*
+ * The name may be followed by its NUL terminator and a byte of
+ * EAD_PONG_* flags, which older clients ignore.
+ */
 struct ead_msg_pong {
 	uint16_t auth_type;
 	char name[];
 } __attribute__((packed));
 
+#define EAD_PONG_STREAM	(1 << 0)	/* EAD_CMD_STREAM is supported */
+
 struct ead_msg_number {
 	uint8_t id;
 	unsigned char data[];
@@ -100,6 +112,36 @@ struct ead_msg_cmd_data {
 	unsigned char data[];
 } __attribute__((packed));
 
+/*
+ * EAD_CMD_STREAM: the output is sent in numbered packets, up to
+ * EAD_CMD_WINDOW of them before they are acknowledged. Packets without
+ * data and without the done flag are keepalives and carry no number.
+ * The session stays authenticated, so the client can send the next
+ * command as soon as it has received the done packet. A request is
+ * retransmitted with the same seq if no output arrives, the server
+ * starts the command only once per seq and authentication.
+ */
+struct ead_msg_cmd_stream {
+	uint8_t type;
+	uint16_t timeout;
+	uint16_t seq; /* number of the first output packet */
+	unsigned char data[];
+} __attribute__((packed));
+
+struct ead_msg_cmd_output {
+	uint8_t done;
+	uint16_t seq;
+	unsigned char data[];
+} __attribute__((packed));
+
+/* sent with type EAD_CMD_ACK as an EAD_TYPE_SEND_CMD message */
+struct ead_msg_cmd_ack {
+	uint8_t type;
+	uint16_t timeout; /* unused */
+	uint16_t seq; /* all packets before seq were received */
+	uint32_t mask; /* bit n: packet seq + 1 + n was received */
+} __attribute__((packed));
+
 struct ead_msg_encrypted {
 	uint32_t hash[5];
 	uint32_t iv;
@@ -107,6 +149,9 @@ struct ead_msg_encrypted {
 	union {
 		struct ead_msg_cmd cmd;
 		struct ead_msg_cmd_data cmd_data;
+		struct ead_msg_cmd_stream cmd_stream;
+		struct ead_msg_cmd_output cmd_output;
+		struct ead_msg_cmd_ack cmd_ack;
 	} data[];
 } __attribute__((packed));
 
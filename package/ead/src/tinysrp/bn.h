@@ -74,7 +74,7 @@ extern "C" {
 #undef BN_SQR_COMBA
 #undef BN_RECURSION
 #undef RECP_MUL_MOD
-#undef MONT_MUL_MOD
+#define MONT_MUL_MOD
 
 #if defined(SIZEOF_LONG_LONG) && SIZEOF_LONG_LONG == 8
 # if SIZEOF_LONG == 4
@@ -260,6 +260,17 @@ typedef struct bn_mont_ctx_st
 	int flags;
 	} BN_MONT_CTX;
 
+/* Used for exponentiation with a fixed base */
+typedef struct bn_fb_ctx_st
+	{
+	BN_MONT_CTX mont; /* The modulus */
+	BIGNUM g;         /* The base */
+	int window;       /* bits per exponent digit */
+	int num;          /* number of table entries */
+	BIGNUM *table;    /* g^(2^(window*i)) in montgomery form */
+	int flags;
+	} BN_FB_CTX;
+
 /* Used for reciprocal division/mod functions
  * It cannot be shared between threads
  */
@@ -382,6 +393,13 @@ void BN_MONT_CTX_free(BN_MONT_CTX *mont);
 int BN_MONT_CTX_set(BN_MONT_CTX *mont,const BIGNUM *modulus,BN_CTX *ctx);
 BN_MONT_CTX *BN_MONT_CTX_copy(BN_MONT_CTX *to,BN_MONT_CTX *from);
 
+void BN_FB_CTX_init(BN_FB_CTX *fb);
+BN_FB_CTX *BN_FB_CTX_new(void);
+void BN_FB_CTX_free(BN_FB_CTX *fb);
+int BN_FB_CTX_set(BN_FB_CTX *fb,const BIGNUM *g,const BIGNUM *m,int bits,
+		  BN_CTX *ctx);
+int BN_mod_exp_fixed(BIGNUM *r,const BIGNUM *p,BN_FB_CTX *fb,BN_CTX *ctx);
+
 void BN_set_params(int mul,int high,int low,int mont);
 int BN_get_params(int which); /* 0, mul, 1 high, 2 low, 3 mont */
 
@@ -111,6 +111,7 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "bn_lcl.h"
 
 #define TABLE_SIZE      32
@@ -155,15 +156,7 @@ int BN_mod_exp(BIGNUM *r, BIGNUM *a, const BIGNUM *p, const BIGNUM *m,
 /*      if ((m->d[m->top-1]&BN_TBIT) && BN_is_odd(m)) */
 
 	if (BN_is_odd(m))
-		{
-		if (a->top == 1)
-			{
-			BN_ULONG A = a->d[0];
-			ret=BN_mod_exp_mont_word(r,A,p,m,ctx,NULL);
-			}
-		else
-			ret=BN_mod_exp_mont(r,a,p,m,ctx,NULL);
-		}
+		{ ret=BN_mod_exp_mont(r,a,p,m,ctx,NULL); }
 	else
 #endif
 #ifdef RECP_MUL_MOD
@@ -176,6 +169,319 @@ int BN_mod_exp(BIGNUM *r, BIGNUM *a, const BIGNUM *p, const BIGNUM *m,
 	}
 
 
+int BN_mod_exp_mont(BIGNUM *rr, BIGNUM *a, const BIGNUM *p,
+		    const BIGNUM *m, BN_CTX *ctx, BN_MONT_CTX *in_mont)
+	{
+	int i,j,bits,ret=0,wstart,wend,window,wvalue;
+	int start=1,ts=0;
+	BIGNUM *d,*r;
+	BIGNUM *aa;
+	BIGNUM val[TABLE_SIZE];
+	BN_MONT_CTX *mont=NULL;
+
+	bn_check_top(a);
+	bn_check_top(p);
+	bn_check_top(m);
+
+	if (!(m->d[0] & 1))
+		{
+		return(0);
+		}
+	bits=BN_num_bits(p);
+	if (bits == 0)
+		{
+		BN_one(rr);
+		return(1);
+		}
+	BN_CTX_start(ctx);
+	d = BN_CTX_get(ctx);
+	r = BN_CTX_get(ctx);
+	if (d == NULL || r == NULL) goto err;
+
+	/* If this is not done, things will break in the montgomery
+	 * part */
+
+	if (in_mont != NULL)
+		mont=in_mont;
+	else
+		{
+		if ((mont=BN_MONT_CTX_new()) == NULL) goto err;
+		if (!BN_MONT_CTX_set(mont,m,ctx)) goto err;
+		}
+
+	BN_init(&val[0]);
+	ts=1;
+	if (BN_ucmp(a,m) >= 0)
+		{
+		if (!BN_mod(&(val[0]),a,m,ctx))
+			goto err;
+		aa= &(val[0]);
+		}
+	else
+		aa=a;
+	if (!BN_to_montgomery(&(val[0]),aa,mont,ctx)) goto err; /* 1 */
+
+	window = BN_window_bits_for_exponent_size(bits);
+	if (window > 1)
+		{
+		if (!BN_mod_mul_montgomery(d,&(val[0]),&(val[0]),mont,ctx)) goto err; /* 2 */
+		j=1<<(window-1);
+		for (i=1; i<j; i++)
+			{
+			BN_init(&(val[i]));
+			if (!BN_mod_mul_montgomery(&(val[i]),&(val[i-1]),d,mont,ctx))
+				goto err;
+			}
+		ts=i;
+		}
+
+	start=1;        /* This is used to avoid multiplication etc
+			 * when there is only the value '1' in the
+			 * buffer. */
+	wvalue=0;       /* The 'value' of the window */
+	wstart=bits-1;  /* The top bit of the window */
+	wend=0;         /* The bottom bit of the window */
+
+	if (!BN_to_montgomery(r,BN_value_one(),mont,ctx)) goto err;
+	for (;;)
+		{
+		if (BN_is_bit_set(p,wstart) == 0)
+			{
+			if (!start)
+				{
+				if (!BN_mod_mul_montgomery(r,r,r,mont,ctx))
+				goto err;
+				}
+			if (wstart == 0) break;
+			wstart--;
+			continue;
+			}
+		/* We now have wstart on a 'set' bit, we now need to work out
+		 * how bit a window to do.  To do this we need to scan
+		 * forward until the last set bit before the end of the
+		 * window */
+		j=wstart;
+		wvalue=1;
+		wend=0;
+		for (i=1; i<window; i++)
+			{
+			if (wstart-i < 0) break;
+			if (BN_is_bit_set(p,wstart-i))
+				{
+				wvalue<<=(i-wend);
+				wvalue|=1;
+				wend=i;
+				}
+			}
+
+		/* wend is the size of the current window */
+		j=wend+1;
+		/* add the 'bytes above' */
+		if (!start)
+			for (i=0; i<j; i++)
+				{
+				if (!BN_mod_mul_montgomery(r,r,r,mont,ctx))
+					goto err;
+				}
+
+		/* wvalue will be an odd number < 2^window */
+		if (!BN_mod_mul_montgomery(r,r,&(val[wvalue>>1]),mont,ctx))
+			goto err;
+
+		/* move the 'window' down further */
+		wstart-=wend+1;
+		wvalue=0;
+		start=0;
+		if (wstart < 0) break;
+		}
+	if (!BN_from_montgomery(rr,r,mont,ctx)) goto err;
+	ret=1;
+err:
+	if ((in_mont == NULL) && (mont != NULL)) BN_MONT_CTX_free(mont);
+	BN_CTX_end(ctx);
+	for (i=0; i<ts; i++)
+		BN_clear_free(&(val[i]));
+	return(ret);
+	}
+
+/* Exponentiation with a fixed base, for the generator of a group.
+ * The table holds g^(2^(window*i)), so with the exponent split into
+ * digits e_i of window bits
+ *
+ *   g^e = prod_i table[i]^e_i = prod_{j>0} (prod_{e_i==j} table[i])^j
+ *
+ * The outer product is evaluated from the largest digit value down,
+ * b collects the table entries of the digits >= j and a the product
+ * of all b, so that each b ends up multiplied into a j times.
+ * This needs no squarings at all, about bits/window + 2^window
+ * montgomery multiplications (Brickell, Gordon, McCurley, Wilson) */
+
+void BN_FB_CTX_init(BN_FB_CTX *fb)
+	{
+	BN_MONT_CTX_init(&(fb->mont));
+	BN_init(&(fb->g));
+	fb->window=0;
+	fb->num=0;
+	fb->table=NULL;
+	fb->flags=0;
+	}
+
+BN_FB_CTX *BN_FB_CTX_new(void)
+	{
+	BN_FB_CTX *ret;
+
+	if ((ret=(BN_FB_CTX *)malloc(sizeof(BN_FB_CTX))) == NULL)
+		return(NULL);
+
+	BN_FB_CTX_init(ret);
+	ret->flags=BN_FLG_MALLOCED;
+	return(ret);
+	}
+
+static void bn_fb_free_table(BN_FB_CTX *fb)
+	{
+	int i;
+
+	for (i=0; i<fb->num; i++)
+		BN_clear_free(&(fb->table[i]));
+	if (fb->table != NULL)
+		free(fb->table);
+	fb->table=NULL;
+	fb->num=0;
+	}
+
+void BN_FB_CTX_free(BN_FB_CTX *fb)
+	{
+	if (fb == NULL)
+		return;
+
+	bn_fb_free_table(fb);
+	BN_MONT_CTX_free(&(fb->mont));
+	BN_clear_free(&(fb->g));
+	if (fb->flags & BN_FLG_MALLOCED)
+		free(fb);
+	}
+
+/* prepare the table for exponents of up to 'bits' bits */
+int BN_FB_CTX_set(BN_FB_CTX *fb, const BIGNUM *g, const BIGNUM *m,
+		  int bits, BN_CTX *ctx)
+	{
+	int i,j,w,ret=0;
+
+	bn_fb_free_table(fb);
+	if (bits <= 0)
+		return(0);
+
+	/* pick the window with the fewest multiplications */
+	for (w=1; (w < 8) && ((bits+w)/(w+1)+(1<<(w+1)) < (bits+w-1)/w+(1<<w)); w++)
+		;
+
+	if (!BN_MONT_CTX_set(&(fb->mont),m,ctx)) goto err;
+	if (!BN_copy(&(fb->g),g)) goto err;
+
+	fb->window=w;
+	j=(bits+w-1)/w;
+	fb->table=(BIGNUM *)malloc(j*sizeof(BIGNUM));
+	if (fb->table == NULL) goto err;
+
+	for (i=0; i<j; i++)
+		BN_init(&(fb->table[i]));
+	fb->num=j;
+
+	if (!BN_mod(&(fb->table[0]),g,m,ctx)) goto err;
+	if (!BN_to_montgomery(&(fb->table[0]),&(fb->table[0]),&(fb->mont),ctx))
+		goto err;
+	for (i=1; i<fb->num; i++)
+		{
+		if (!BN_copy(&(fb->table[i]),&(fb->table[i-1]))) goto err;
+		for (j=0; j<w; j++)
+			{
+			if (!BN_mod_mul_montgomery(&(fb->table[i]),&(fb->table[i]),
+					&(fb->table[i]),&(fb->mont),ctx))
+				goto err;
+			}
+		}
+	ret=1;
+err:
+	if (!ret)
+		bn_fb_free_table(fb);
+	return(ret);
+	}
+
+int BN_mod_exp_fixed(BIGNUM *rr, const BIGNUM *p, BN_FB_CTX *fb, BN_CTX *ctx)
+	{
+	int i,j,k,bits,n,ret=0;
+	int a_one=1,b_one=1;
+	unsigned char *digits=NULL;
+	BIGNUM *a,*b;
+
+	bits=BN_num_bits(p);
+	if (bits == 0)
+		{
+		BN_one(rr);
+		return(1);
+		}
+
+	/* the table is too small for this exponent */
+	if (bits > fb->num*fb->window)
+		return(BN_mod_exp_mont(rr,&(fb->g),p,&(fb->mont.N),ctx,&(fb->mont)));
+
+	BN_CTX_start(ctx);
+	a = BN_CTX_get(ctx);
+	b = BN_CTX_get(ctx);
+	if (a == NULL || b == NULL) goto err;
+
+	n=(bits+fb->window-1)/fb->window;
+	digits=(unsigned char *)malloc(n);
+	if (digits == NULL) goto err;
+
+	for (i=0; i<n; i++)
+		{
+		digits[i]=0;
+		for (k=fb->window-1; k>=0; k--)
+			{
+			digits[i]<<=1;
+			digits[i]|=BN_is_bit_set(p,i*fb->window+k);
+			}
+		}
+
+	/* a and b start out as 1, which is not multiplied in */
+	for (j=(1<<fb->window)-1; j>0; j--)
+		{
+		for (i=0; i<n; i++)
+			{
+			if (digits[i] != j)
+				continue;
+
+			if (b_one)
+				{
+				if (!BN_copy(b,&(fb->table[i]))) goto err;
+				b_one=0;
+				}
+			else if (!BN_mod_mul_montgomery(b,b,&(fb->table[i]),&(fb->mont),ctx))
+				goto err;
+			}
+		if (b_one)
+			continue;
+
+		if (a_one)
+			{
+			if (!BN_copy(a,b)) goto err;
+			a_one=0;
+			}
+		else if (!BN_mod_mul_montgomery(a,a,b,&(fb->mont),ctx))
+			goto err;
+		}
+	if (!BN_from_montgomery(rr,a,&(fb->mont),ctx)) goto err;
+	ret=1;
+err:
+	if (digits != NULL)
+		free(digits);
+	BN_CTX_end(ctx);
+	return(ret);
+	}
+
+
 #ifdef RECP_MUL_MOD
 int BN_mod_exp_recp(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
 		    const BIGNUM *m, BN_CTX *ctx)
@@ -161,6 +161,9 @@ _TYPE( void ) BigIntegerModMul P((BigInteger result,
 				BigInteger m1, BigInteger m2, BigInteger m));
 _TYPE( void ) BigIntegerModExp P((BigInteger result, BigInteger base,
 				BigInteger expt, BigInteger modulus));
+/* For bases that are used over and over again, like the SRP generator */
+_TYPE( void ) BigIntegerModExpFixed P((BigInteger result, BigInteger base,
+				BigInteger expt, BigInteger modulus));
 _TYPE( void ) BigIntegerModExpInt P((BigInteger result, BigInteger base,
 				   unsigned int expt, BigInteger modulus));
 _TYPE( int ) BigIntegerCheckPrime P((BigInteger n));
@@ -155,6 +155,40 @@ BigIntegerModExp(r, b, e, m)
   BN_CTX_free(ctx);
 }
 
+/* the powers of the last base that was used with BigIntegerModExpFixed */
+static BN_FB_CTX * fixed_base = NULL;
+
+void
+BigIntegerModExpFixed(r, b, e, m)
+     BigInteger r, b, e, m;
+{
+  BN_CTX * ctx = BN_CTX_new();
+  int bits = BN_num_bits(e);
+
+  if(fixed_base == NULL)
+    fixed_base = BN_FB_CTX_new();
+
+  if(fixed_base == NULL || !BN_is_odd(m)) {
+    BN_mod_exp(r, b, e, m, ctx);
+    BN_CTX_free(ctx);
+    return;
+  }
+
+  /* the table costs about as much as one regular exponentiation,
+     so it only pays off once the same base is used again */
+  if(fixed_base->num == 0 || bits > fixed_base->num * fixed_base->window ||
+     BN_cmp(&fixed_base->g, b) != 0 || BN_cmp(&fixed_base->mont.N, m) != 0) {
+    if(!BN_FB_CTX_set(fixed_base, b, m, bits, ctx)) {
+      BN_mod_exp(r, b, e, m, ctx);
+      BN_CTX_free(ctx);
+      return;
+    }
+  }
+
+  BN_mod_exp_fixed(r, e, fixed_base, ctx);
+  BN_CTX_free(ctx);
+}
+
 void
 BigIntegerModExpInt(r, b, e, m)
      BigInteger r, b;
@@ -292,6 +292,7 @@ void nl_cache_free(struct nl_cache *cache)
 
 	nl_cache_clear(cache);
 	NL_DBG(1, "Freeing cache %p <%s>...\n", cache, nl_cache_name(cache));
+	free(cache->c_hash);
 	free(cache);
 }
 
@@ -302,8 +303,94 @@ void nl_cache_free(struct nl_cache *cache)
  * @{
  */
 
+/** @cond SKIP */
+#define NL_CACHE_HASH_MIN	16
+
+static int cache_hashable(struct nl_cache *cache, struct nl_object *obj)
+{
+	struct nl_object_ops *ops = cache->c_ops->co_obj_ops;
+
+	return ops->oo_keygen &&
+	       (obj->ce_mask & ops->oo_id_attrs) == ops->oo_id_attrs;
+}
+
+static int cache_hash_resize(struct nl_cache *cache, int size)
+{
+	struct nl_object **hash, *obj, *next;
+	int i;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -NLE_NOMEM;
+
+	for (i = 0; i < cache->c_hash_size; i++) {
+		for (obj = cache->c_hash[i]; obj; obj = next) {
+			next = obj->ce_hnext;
+			obj->ce_hnext = hash[obj->ce_hkey & (size - 1)];
+			hash[obj->ce_hkey & (size - 1)] = obj;
+		}
+	}
+
+	free(cache->c_hash);
+	cache->c_hash = hash;
+	cache->c_hash_size = size;
+
+	return 0;
+}
+
+static int cache_hash_add(struct nl_cache *cache, struct nl_object *obj)
+{
+	struct nl_object **head;
+	int err;
+
+	if (!cache_hashable(cache, obj))
+		return 0;
+
+	/* keep the load factor at or below one, a failure to grow
+	 * only makes the chains longer */
+	if (!cache->c_hash) {
+		err = cache_hash_resize(cache, NL_CACHE_HASH_MIN);
+		if (err < 0)
+			return err;
+	} else if (cache->c_nitems >= cache->c_hash_size)
+		cache_hash_resize(cache, cache->c_hash_size * 2);
+
+	obj->ce_hkey = cache->c_ops->co_obj_ops->oo_keygen(obj);
+	head = &cache->c_hash[obj->ce_hkey & (cache->c_hash_size - 1)];
+	obj->ce_hnext = *head;
+	*head = obj;
+	obj->ce_flags |= NL_OBJ_HASHED;
+
+	return 0;
+}
+
+static void cache_hash_del(struct nl_cache *cache, struct nl_object *obj)
+{
+	struct nl_object **p;
+
+	if (!(obj->ce_flags & NL_OBJ_HASHED))
+		return;
+
+	p = &cache->c_hash[obj->ce_hkey & (cache->c_hash_size - 1)];
+	while (*p != obj)
+		p = &(*p)->ce_hnext;
+
+	*p = obj->ce_hnext;
+	obj->ce_hnext = NULL;
+	obj->ce_flags &= ~NL_OBJ_HASHED;
+}
+/** @endcond */
+
 static int __cache_add(struct nl_cache *cache, struct nl_object *obj)
 {
+	int err;
+
+	err = cache_hash_add(cache, obj);
+	if (err < 0) {
+		nl_object_put(obj);
+		return err;
+	}
+
 	obj->ce_cache = cache;
 
 	nl_list_add_tail(&obj->ce_list, &cache->c_items);
@@ -388,6 +475,7 @@ void nl_cache_remove(struct nl_object *obj)
 	if (cache == NULL)
 		return;
 
+	cache_hash_del(cache, obj);
 	nl_list_del(&obj->ce_list);
 	obj->ce_cache = NULL;
 	nl_object_put(obj);
@@ -397,14 +485,14 @@ void nl_cache_remove(struct nl_object *obj)
 	       obj, cache, nl_cache_name(cache));
 }
 
-#ifdef disabled
 /**
  * Search for an object in a cache
  * @arg cache		Cache to search in.
  * @arg needle		Object to look for.
  *
- * Iterates over the cache and looks for an object with identical
- * identifiers as the needle.
+ * Looks for an object with identical identifiers as the needle. If the
+ * object type provides a hash key generator, the hash index of the
+ * cache is used, otherwise the cache is iterated.
  *
  * @return Reference to object or NULL if not found.
  * @note The returned object must be returned via nl_object_put().
@@ -412,7 +500,27 @@ void nl_cache_remove(struct nl_object *obj)
 struct nl_object *nl_cache_search(struct nl_cache *cache,
 				  struct nl_object *needle)
 {
+	struct nl_object_ops *ops = cache->c_ops->co_obj_ops;
 	struct nl_object *obj;
+	uint32_t key;
+
+	if (ops->oo_keygen && needle->ce_ops == ops) {
+		/* objects without all identifiers never match */
+		if (!cache->c_hash || !cache_hashable(cache, needle))
+			return NULL;
+
+		key = ops->oo_keygen(needle);
+		obj = cache->c_hash[key & (cache->c_hash_size - 1)];
+		for (; obj; obj = obj->ce_hnext) {
+			if (obj->ce_hkey == key &&
+			    nl_object_identical(obj, needle)) {
+				nl_object_get(obj);
+				return obj;
+			}
+		}
+
+		return NULL;
+	}
 
 	nl_list_for_each_entry(obj, &cache->c_items, ce_list) {
 		if (nl_object_identical(obj, needle)) {
@@ -423,7 +531,6 @@ struct nl_object *nl_cache_search(struct nl_cache *cache,
 
 	return NULL;
 }
-#endif
 
 /** @} */
 
@@ -29,6 +29,7 @@
 #define CTRL_VERSION		0x0001
 
 static struct nl_cache_ops genl_ctrl_ops;
+extern struct nl_object_ops genl_family_ops;
 /** @endcond */
 
 static int ctrl_request_update(struct nl_cache *c, struct nl_sock *h)
@@ -157,19 +158,17 @@ int genl_ctrl_alloc_cache(struct nl_sock *sock, struct nl_cache **result)
  */
 struct genl_family *genl_ctrl_search(struct nl_cache *cache, int id)
 {
-	struct genl_family *fam;
+	struct genl_family needle = {
+		.ce_ops = &genl_family_ops,
+		.ce_mask = FAMILY_ATTR_ID,
+		.gf_id = id,
+	};
 
 	if (cache->c_ops != &genl_ctrl_ops)
 		BUG();
 
-	nl_list_for_each_entry(fam, &cache->c_items, ce_list) {
-		if (fam->gf_id == id) {
-			nl_object_get((struct nl_object *) fam);
-			return fam;
-		}
-	}
-
-	return NULL;
+	return (struct genl_family *)
+		nl_cache_search(cache, (struct nl_object *) &needle);
 }
 
 /**
@@ -207,6 +206,175 @@ struct genl_family *genl_ctrl_search_by_name(struct nl_cache *cache,
 	return NULL;
 }
 
+/** @cond SKIP */
+/* families resolved so far, shared by all sockets of the process */
+static struct nl_cache *ctrl_resolved;
+
+/* subscribed to the controller notifications which invalidate it */
+static struct nl_sock *ctrl_notify;
+static int ctrl_events;
+
+static int ctrl_notify_event(struct nl_msg *msg, void *arg)
+{
+	ctrl_events++;
+	return NL_OK;
+}
+
+static int ctrl_notify_open(void)
+{
+	struct nl_sock *sk;
+
+	sk = nl_socket_alloc();
+	if (!sk)
+		return -NLE_NOMEM;
+
+	if (genl_connect(sk) < 0 ||
+	    nl_socket_add_memberships(sk, GENL_ID_CTRL, 0) < 0 ||
+	    nl_socket_set_nonblocking(sk) < 0) {
+		nl_socket_free(sk);
+		return -NLE_FAILURE;
+	}
+
+	nl_socket_disable_seq_check(sk);
+	nl_cb_set(sk->s_cb, NL_CB_VALID, NL_CB_CUSTOM,
+		  ctrl_notify_event, NULL);
+	ctrl_notify = sk;
+
+	return 0;
+}
+
+/*
+ * Read pending controller notifications. Families rarely come and go,
+ * so any of them, or a read error which may hide one, flushes the
+ * whole set of resolved families.
+ */
+static void ctrl_notify_poll(void)
+{
+	int err, events;
+
+	do {
+		events = ctrl_events;
+		err = nl_recvmsgs_default(ctrl_notify);
+		if (err < 0 || ctrl_events != events)
+			nl_cache_clear(ctrl_resolved);
+	} while (err >= 0 && ctrl_events != events);
+}
+
+static int probe_pickup(struct nl_object *obj, struct nl_parser_param *pp)
+{
+	struct genl_family **result = pp->pp_arg;
+
+	if (*result == NULL) {
+		nl_object_get(obj);
+		*result = (struct genl_family *) obj;
+	}
+
+	return 0;
+}
+
+static int probe_response(struct nl_msg *msg, void *arg)
+{
+	struct nl_parser_param pp = {
+		.pp_cb = probe_pickup,
+		.pp_arg = arg,
+	};
+
+	nl_cache_parse(&genl_ctrl_ops, NULL, nlmsg_hdr(msg), &pp);
+
+	return NL_OK;
+}
+
+static int probe_ack(struct nl_msg *msg, void *arg)
+{
+	return NL_STOP;
+}
+
+static struct genl_family *ctrl_probe(struct nl_sock *sk, const char *name)
+{
+	struct genl_family *family = NULL;
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	int err = -NLE_NOMEM;
+
+	msg = nlmsg_alloc();
+	if (msg == NULL)
+		return NULL;
+
+	cb = nl_cb_clone(sk->s_cb);
+	if (cb == NULL)
+		goto errout;
+
+	if (!genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, GENL_ID_CTRL, 0, 0,
+			 CTRL_CMD_GETFAMILY, CTRL_VERSION))
+		goto errout;
+
+	NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, name);
+
+	err = nl_send_auto_complete(sk, msg);
+	if (err < 0)
+		goto errout;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, probe_response, &family);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, probe_ack, NULL);
+	err = nl_recvmsgs(sk, cb);
+
+nla_put_failure:
+errout:
+	if (err < 0 && family) {
+		genl_family_put(family);
+		family = NULL;
+	}
+	nl_cb_put(cb);
+	nlmsg_free(msg);
+
+	return family;
+}
+/** @endcond */
+
+/**
+ * Look up a generic netlink family by name in the kernel.
+ * @arg sk		Netlink socket.
+ * @arg name		Family name.
+ *
+ * Asks the controller for this one family instead of dumping all of
+ * them. Families found are remembered for the whole process until a
+ * controller notification reports a change, so repeated lookups do
+ * not cause any request at all. The caller will own a reference on
+ * the returned object which needs to be given back after usage using
+ * genl_family_put().
+ *
+ * @return Generic netlink family object or NULL if no match was found.
+ */
+struct genl_family *genl_ctrl_probe_by_name(struct nl_sock *sk,
+					    const char *name)
+{
+	struct genl_family *family;
+
+	if (ctrl_resolved == NULL) {
+		if (ctrl_notify_open() < 0)
+			return ctrl_probe(sk, name);
+
+		ctrl_resolved = nl_cache_alloc(&genl_ctrl_ops);
+		if (ctrl_resolved == NULL) {
+			nl_socket_free(ctrl_notify);
+			ctrl_notify = NULL;
+			return ctrl_probe(sk, name);
+		}
+	}
+
+	ctrl_notify_poll();
+
+	family = genl_ctrl_search_by_name(ctrl_resolved, name);
+	if (family)
+		return family;
+
+	family = ctrl_probe(sk, name);
+	if (family)
+		nl_cache_add(ctrl_resolved, (struct nl_object *) family);
+
+	return family;
+}
+
 /** @} */
 
 /**
@@ -215,29 +383,21 @@ struct genl_family *genl_ctrl_search_by_name(struct nl_cache *cache,
  * @arg name		Name of generic netlink family
  *
  * Resolves the generic netlink family name to its identifer and returns
- * it.
+ * it. See genl_ctrl_probe_by_name() for how the lookup is done.
  *
  * @return A positive identifier or a negative error code.
  */
 int genl_ctrl_resolve(struct nl_sock *sk, const char *name)
 {
-	struct nl_cache *cache;
 	struct genl_family *family;
 	int err;
 
-	if ((err = genl_ctrl_alloc_cache(sk, &cache)) < 0)
-		return err;
-
-	family = genl_ctrl_search_by_name(cache, name);
-	if (family == NULL) {
-		err = -NLE_OBJ_NOTFOUND;
-		goto errout;
-	}
+	family = genl_ctrl_probe_by_name(sk, name);
+	if (family == NULL)
+		return -NLE_OBJ_NOTFOUND;
 
 	err = genl_family_get_id(family);
 	genl_family_put(family);
-errout:
-	nl_cache_free(cache);
 
 	return err;
 }
@@ -275,10 +435,6 @@ static struct genl_ops genl_ops = {
 	.o_ncmds		= ARRAY_SIZE(genl_cmds),
 };
 
-/** @cond SKIP */
-extern struct nl_object_ops genl_family_ops;
-/** @endcond */
-
 static struct nl_cache_ops genl_ctrl_ops = {
 	.co_name		= "genl/family",
 	.co_hdrsize		= GENL_HDRSIZE(0),
@@ -83,6 +83,13 @@ static int family_compare(struct nl_object *_a, struct nl_object *_b,
 	return diff;
 }
 
+static uint32_t family_keygen(struct nl_object *obj)
+{
+	struct genl_family *family = (struct genl_family *) obj;
+
+	return family->gf_id * 2654435761U;
+}
+
 
 /**
  * @name Family Object
@@ -129,6 +136,7 @@ struct nl_object_ops genl_family_ops = {
 	.oo_free_data		= family_free_data,
 	.oo_clone		= family_clone,
 	.oo_compare		= family_compare,
+	.oo_keygen		= family_keygen,
 	.oo_id_attrs		= FAMILY_ATTR_ID,
 };
 /** @endcond */
@@ -66,6 +66,33 @@ struct trans_list {
 	struct nl_list_head list;
 };
 
+/* datagrams read per recvmmsg() on sockets with NL_RECV_BATCH */
+#define NL_RX_SLOTS	8
+
+/* initial size of a receive slot, above the size of dump datagrams */
+#define NL_RX_BUFSIZE	32768
+
+/*
+ * Per-socket receive queue. The buffer is kept across reads and only
+ * grows, datagrams read ahead wait in their slots until handed out.
+ */
+struct nl_rxq {
+	unsigned char *		buf;
+	size_t			size;		/* bytes per slot */
+	size_t			want;		/* size needed by a truncated datagram */
+	int			slots;
+	int			count;		/* datagrams in the slots */
+	int			next;		/* next datagram to hand out */
+	int			busy;		/* a slot is being parsed */
+	int			len[NL_RX_SLOTS];
+	int			has_creds[NL_RX_SLOTS];
+	struct sockaddr_nl	addr[NL_RX_SLOTS];
+	struct ucred		creds[NL_RX_SLOTS];
+	char			control[NL_RX_SLOTS][CMSG_SPACE(sizeof(struct ucred))];
+};
+
+extern void nl_rxq_free(struct nl_rxq *);
+
 #define NL_DEBUG	1
 
 #define NL_DBG(LVL,FMT,ARG...) \
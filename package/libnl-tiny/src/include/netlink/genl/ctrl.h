@@ -27,6 +27,8 @@ extern int			genl_ctrl_alloc_cache(struct nl_sock *,
 extern struct genl_family *	genl_ctrl_search(struct nl_cache *, int);
 extern struct genl_family *	genl_ctrl_search_by_name(struct nl_cache *,
 							 const char *);
+extern struct genl_family *	genl_ctrl_probe_by_name(struct nl_sock *,
+							const char *);
 extern int			genl_ctrl_resolve(struct nl_sock *,
 						  const char *);
 
@@ -188,7 +188,9 @@ extern "C" {
 	struct nl_list_head	ce_list;	\
 	int			ce_msgtype;	\
 	int			ce_flags;	\
-	uint32_t		ce_mask;
+	uint32_t		ce_mask;	\
+	uint32_t		ce_hkey;	\
+	struct nl_object *	ce_hnext;
 
 /**
  * Return true if attribute is available in both objects
@@ -320,6 +322,16 @@ struct nl_object_ops
 
 
 	char *(*oo_attrs2str)(int, char *, size_t);
+
+	/**
+	 * Hash key generator
+	 *
+	 * Optional, computes a hash over the attributes listed in
+	 * oo_id_attrs, objects with identical identifiers must give
+	 * the same key. Caches of objects providing it keep a hash
+	 * index which nl_cache_search() uses instead of a list walk.
+	 */
+	uint32_t (*oo_keygen)(struct nl_object *);
 };
 
 /** @} */
@@ -21,6 +21,7 @@ extern "C" {
 #endif
 
 #define NL_OBJ_MARK		1
+#define NL_OBJ_HASHED		2
 
 struct nl_cache;
 struct nl_object;
@@ -24,6 +24,9 @@ extern "C" {
 #define NL_OWN_PORT		(1<<2)
 #define NL_MSG_PEEK		(1<<3)
 #define NL_NO_AUTO_ACK		(1<<4)
+#define NL_RECV_BATCH		(1<<5)
+
+struct nl_rxq;
 
 struct nl_cb;
 struct nl_sock
@@ -36,6 +39,7 @@ struct nl_sock
 	unsigned int		s_seq_expect;
 	int			s_flags;
 	struct nl_cb *		s_cb;
+	struct nl_rxq *		s_rxq;
 };
 
 
@@ -151,6 +155,12 @@ static inline int nl_socket_get_fd(struct nl_sock *sk)
 /**
  * Enable use of MSG_PEEK when reading from socket
  * @arg sk		Netlink socket.
+ *
+ * Every datagram is peeked at first and the receive buffer is enlarged
+ * until it fits, so no datagram is lost to a truncated read. This takes
+ * precedence over batched receiving. Without it the receive buffer starts
+ * out large enough for any datagram the kernel builds for a dump, a larger
+ * one is reported as truncated and the buffer is enlarged for the next read.
  */
 static inline void nl_socket_enable_msg_peek(struct nl_sock *sk)
 {
@@ -166,6 +176,25 @@ static inline void nl_socket_disable_msg_peek(struct nl_sock *sk)
 	sk->s_flags &= ~NL_MSG_PEEK;
 }
 
+/**
+ * Read several datagrams per system call
+ * @arg sk		Netlink socket.
+ *
+ * Datagrams read ahead are queued in the socket and handed out by
+ * the following receive calls, so the file descriptor may not poll
+ * readable while messages are still pending. Only enable this on
+ * sockets that are not driven by an event loop.
+ */
+static inline void nl_socket_enable_batch_recv(struct nl_sock *sk)
+{
+	sk->s_flags |= NL_RECV_BATCH;
+}
+
+static inline void nl_socket_disable_batch_recv(struct nl_sock *sk)
+{
+	sk->s_flags &= ~NL_RECV_BATCH;
+}
+
 /**
  * @name Callback Handler
  * @{
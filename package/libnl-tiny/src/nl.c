@@ -356,6 +356,232 @@ errout:
  * @{
  */
 
+void nl_rxq_free(struct nl_rxq *q)
+{
+	if (!q)
+		return;
+
+	free(q->buf);
+	free(q);
+}
+
+static struct nl_rxq *nl_rxq_get(struct nl_sock *sk)
+{
+	struct nl_rxq *q = sk->s_rxq;
+	unsigned char *buf;
+	int slots = 1;
+
+	/* a datagram read ahead by recvmmsg() cannot be peeked at again */
+	if ((sk->s_flags & NL_RECV_BATCH) && !(sk->s_flags & NL_MSG_PEEK))
+		slots = NL_RX_SLOTS;
+
+	if (!q) {
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			return NULL;
+
+		q->size = NL_RX_BUFSIZE;
+		sk->s_rxq = q;
+	}
+
+	/* the slot layout may only change while nothing is queued */
+	if (q->slots != slots && !q->busy && q->next >= q->count) {
+		buf = realloc(q->buf, q->size * slots);
+		if (!buf)
+			return NULL;
+
+		q->buf = buf;
+		q->slots = slots;
+	}
+
+	return q;
+}
+
+static int nl_rxq_grow(struct nl_rxq *q, size_t len)
+{
+	size_t size = NLMSG_ALIGN(len);
+	unsigned char *buf;
+
+	if (size <= q->size)
+		return 0;
+
+	buf = realloc(q->buf, size * q->slots);
+	if (!buf)
+		return -NLE_NOMEM;
+
+	q->buf = buf;
+	q->size = size;
+	return 0;
+}
+
+/*
+ * Peek at the next datagram and enlarge the slots until it fits into
+ * the first one, so that the following read does not truncate it.
+ */
+static int nl_rx_peek(int fd, struct nl_rxq *q, struct msghdr *mh)
+{
+	int n;
+
+	for (;;) {
+		n = recvmsg(fd, mh, MSG_PEEK | MSG_TRUNC);
+		if (n < 0)
+			return -1;
+
+		if (n <= q->size && !(mh->msg_flags & MSG_TRUNC))
+			return n;
+
+		if (nl_rxq_grow(q, n) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		mh->msg_iov->iov_base = q->buf;
+		mh->msg_iov->iov_len = q->size;
+	}
+}
+
+static int nl_rx_read(int fd, struct msghdr *mh, int *len, int n)
+{
+#ifdef MSG_WAITFORONE
+	static int no_mmsg = 0;
+	struct mmsghdr mm[NL_RX_SLOTS];
+	int i, ret;
+
+	if (n > 1 && !no_mmsg) {
+		for (i = 0; i < n; i++)
+			mm[i].msg_hdr = mh[i];
+
+		ret = recvmmsg(fd, mm, n, MSG_TRUNC | MSG_WAITFORONE, NULL);
+		if (ret >= 0 || errno != ENOSYS) {
+			for (i = 0; i < ret; i++) {
+				mh[i] = mm[i].msg_hdr;
+				len[i] = mm[i].msg_len;
+			}
+			return ret;
+		}
+
+		/* kernel without recvmmsg(), fall back to single reads */
+		no_mmsg = 1;
+	}
+#endif
+
+	len[0] = recvmsg(fd, mh, MSG_TRUNC);
+	return (len[0] < 0) ? -1 : 1;
+}
+
+/*
+ * Read as many datagrams as there are slots into an empty queue.
+ * Datagrams that could not be stored get their error code as length
+ * and are reported when they are handed out. With NL_MSG_PEEK a single
+ * datagram is read, after making sure that it fits.
+ */
+static int nl_rx_fill(struct nl_sock *sk, struct nl_rxq *q)
+{
+	struct msghdr mh[NL_RX_SLOTS];
+	struct iovec iov[NL_RX_SLOTS];
+	struct cmsghdr *cmsg;
+	int peek = sk->s_flags & NL_MSG_PEEK;
+	int i, n;
+
+	q->count = q->next = 0;
+
+	for (i = 0; i < q->slots; i++) {
+		iov[i].iov_base = q->buf + i * q->size;
+		iov[i].iov_len = q->size;
+
+		memset(&mh[i], 0, sizeof(mh[i]));
+		mh[i].msg_name = &q->addr[i];
+		mh[i].msg_namelen = sizeof(struct sockaddr_nl);
+		mh[i].msg_iov = &iov[i];
+		mh[i].msg_iovlen = 1;
+		if (sk->s_flags & NL_SOCK_PASSCRED) {
+			mh[i].msg_control = q->control[i];
+			mh[i].msg_controllen = sizeof(q->control[i]);
+		}
+	}
+
+retry:
+	if (peek && nl_rx_peek(sk->s_fd, q, &mh[0]) < 0)
+		n = -1;
+	else
+		n = nl_rx_read(sk->s_fd, mh, q->len, peek ? 1 : q->slots);
+	if (n < 0) {
+		if (errno == EINTR) {
+			NL_DBG(3, "recvmsg() returned EINTR, retrying\n");
+			goto retry;
+		} else if (errno == EAGAIN) {
+			NL_DBG(3, "recvmsg() returned EAGAIN, aborting\n");
+			return 0;
+		}
+		return -nl_syserr2nlerr(errno);
+	}
+
+	if (!n || !q->len[0])
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		q->has_creds[i] = 0;
+
+		if (q->len[i] > q->size || (mh[i].msg_flags & MSG_TRUNC)) {
+			/* The datagram is lost, make room for the next one */
+			NL_DBG(3, "recvmsg() truncated %d bytes\n", q->len[i]);
+			if (q->len[i] > q->want)
+				q->want = q->len[i];
+			q->len[i] = -NLE_MSG_TRUNC;
+			continue;
+		}
+
+		if (mh[i].msg_namelen != sizeof(struct sockaddr_nl)) {
+			q->len[i] = -NLE_NOADDR;
+			continue;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&mh[i]); cmsg;
+		     cmsg = CMSG_NXTHDR(&mh[i], cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_CREDENTIALS) {
+				memcpy(&q->creds[i], CMSG_DATA(cmsg),
+				       sizeof(struct ucred));
+				q->has_creds[i] = 1;
+				break;
+			}
+		}
+	}
+	q->count = n;
+
+	return n;
+}
+
+static int nl_rx_next(struct nl_sock *sk, struct nl_rxq *q,
+		      struct sockaddr_nl *nla, unsigned char **buf,
+		      struct ucred **creds)
+{
+	int i, n;
+
+	if (q->next >= q->count) {
+		/* apply a size increase requested by a truncated read */
+		if (nl_rxq_grow(q, q->want) < 0)
+			return -NLE_NOMEM;
+		q->want = 0;
+
+		n = nl_rx_fill(sk, q);
+		if (n <= 0)
+			return n;
+	}
+
+	i = q->next++;
+	if (q->len[i] < 0)
+		return q->len[i];
+
+	*buf = q->buf + i * q->size;
+	if (nla)
+		memcpy(nla, &q->addr[i], sizeof(*nla));
+	if (q->has_creds[i])
+		*creds = &q->creds[i];
+
+	return q->len[i];
+}
+
 /**
  * Receive data from netlink socket
  * @arg sk		Netlink socket.
@@ -367,8 +593,9 @@ errout:
  * stores the message content. The peer's netlink address is stored
  * in \c *nla. The caller is responsible for freeing the buffer allocated
  * in \c *buf if a positive value is returned.  Interruped system calls
- * are handled by repeating the read. The input buffer size is determined
- * by peeking before the actual read is done.
+ * are handled by repeating the read. Datagrams are read into the
+ * receive queue of the socket first, which nl_recvmsgs() parses
+ * in place without copying.
  *
  * A non-blocking sockets causes the function to return immediately with
  * a return value of 0 if no data is available.
@@ -378,92 +605,73 @@ errout:
 int nl_recv(struct nl_sock *sk, struct sockaddr_nl *nla,
 	    unsigned char **buf, struct ucred **creds)
 {
+	struct nl_rxq *q, tmp;
+	unsigned char *data;
+	struct ucred *c = NULL;
 	int n;
-	int flags = 0;
-	static int page_size = 0;
-	struct iovec iov;
-	struct msghdr msg = {
-		.msg_name = (void *) nla,
-		.msg_namelen = sizeof(struct sockaddr_nl),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-	struct cmsghdr *cmsg;
 
-	if (sk->s_flags & NL_MSG_PEEK)
-		flags |= MSG_PEEK;
-
-	if (page_size == 0)
-		page_size = getpagesize();
-
-	iov.iov_len = page_size;
-	iov.iov_base = *buf = malloc(iov.iov_len);
+	q = nl_rxq_get(sk);
+	if (!q)
+		return -NLE_NOMEM;
 
-	if (sk->s_flags & NL_SOCK_PASSCRED) {
-		msg.msg_controllen = CMSG_SPACE(sizeof(struct ucred));
-		msg.msg_control = calloc(1, msg.msg_controllen);
+	if (q->busy && q->next >= q->count) {
+		/* Called from a callback while a slot is being parsed,
+		 * read into a separate buffer to leave it intact. */
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.size = q->size;
+		tmp.slots = 1;
+		tmp.buf = malloc(tmp.size);
+		if (!tmp.buf)
+			return -NLE_NOMEM;
+		q = &tmp;
 	}
-retry:
 
-	n = recvmsg(sk->s_fd, &msg, flags);
-	if (!n)
-		goto abort;
-	else if (n < 0) {
-		if (errno == EINTR) {
-			NL_DBG(3, "recvmsg() returned EINTR, retrying\n");
-			goto retry;
-		} else if (errno == EAGAIN) {
-			NL_DBG(3, "recvmsg() returned EAGAIN, aborting\n");
-			goto abort;
-		} else {
-			free(msg.msg_control);
-			free(*buf);
-			return -nl_syserr2nlerr(errno);
+	n = nl_rx_next(sk, q, nla, &data, &c);
+	if (n > 0) {
+		*buf = malloc(n);
+		if (!*buf) {
+			n = -NLE_NOMEM;
+			goto out;
 		}
-	}
+		memcpy(*buf, data, n);
 
-	if (iov.iov_len < n ||
-	    msg.msg_flags & MSG_TRUNC) {
-		/* Provided buffer is not long enough, enlarge it
-		 * and try again. */
-		iov.iov_len *= 2;
-		iov.iov_base = *buf = realloc(*buf, iov.iov_len);
-		goto retry;
-	} else if (msg.msg_flags & MSG_CTRUNC) {
-		msg.msg_controllen *= 2;
-		msg.msg_control = realloc(msg.msg_control, msg.msg_controllen);
-		goto retry;
-	} else if (flags != 0) {
-		/* Buffer is big enough, do the actual reading */
-		flags = 0;
-		goto retry;
+		if (c) {
+			*creds = malloc(sizeof(*c));
+			if (*creds)
+				memcpy(*creds, c, sizeof(*c));
+		}
 	}
 
-	if (msg.msg_namelen != sizeof(struct sockaddr_nl)) {
-		free(msg.msg_control);
-		free(*buf);
-		return -NLE_NOADDR;
-	}
+out:
+	if (q == &tmp)
+		free(tmp.buf);
 
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (cmsg->cmsg_level == SOL_SOCKET &&
-		    cmsg->cmsg_type == SCM_CREDENTIALS) {
-			*creds = calloc(1, sizeof(struct ucred));
-			memcpy(*creds, CMSG_DATA(cmsg), sizeof(struct ucred));
-			break;
-		}
+	return n;
+}
+
+/*
+ * Reuse the previous message of a receive loop for the next one unless
+ * a callback took a reference to it.
+ */
+static struct nl_msg *nlmsg_reuse(struct nl_msg *msg, struct nlmsghdr *hdr)
+{
+	if (msg && msg->nm_refcnt == 1 &&
+	    msg->nm_size >= NLMSG_ALIGN(hdr->nlmsg_len)) {
+		memcpy(msg->nm_nlh, hdr, hdr->nlmsg_len);
+		memset(&msg->nm_dst, 0, sizeof(msg->nm_dst));
+		msg->nm_flags = 0;
+		return msg;
 	}
 
-	free(msg.msg_control);
-	return n;
+	nlmsg_free(msg);
+	if (NLMSG_ALIGN(hdr->nlmsg_len) > getpagesize())
+		return nlmsg_convert(hdr);
 
-abort:
-	free(msg.msg_control);
-	free(*buf);
-	return 0;
+	msg = nlmsg_alloc();
+	if (msg)
+		memcpy(msg->nm_nlh, hdr, hdr->nlmsg_len);
+
+	return msg;
 }
 
 #define NL_CB_CALL(cb, type, msg) \
@@ -482,24 +690,48 @@ do { \
 	} \
 } while (0)
 
+static void recvmsgs_release(struct nl_sock *sk, int held,
+			     unsigned char **buf, struct ucred **creds)
+{
+	if (held)
+		sk->s_rxq->busy = 0;
+	else {
+		free(*buf);
+		free(*creds);
+	}
+	*buf = NULL;
+	*creds = NULL;
+}
+
 static int recvmsgs(struct nl_sock *sk, struct nl_cb *cb)
 {
-	int n, err = 0, multipart = 0;
+	int n, err = 0, multipart = 0, held = 0;
 	unsigned char *buf = NULL;
 	struct nlmsghdr *hdr;
 	struct sockaddr_nl nla = {0};
 	struct nl_msg *msg = NULL;
 	struct ucred *creds = NULL;
+	struct nl_rxq *q;
 
 continue_reading:
 	NL_DBG(3, "Attempting to read from %p\n", sk);
 	if (cb->cb_recv_ow)
 		n = cb->cb_recv_ow(sk, &nla, &buf, &creds);
-	else
+	else if (!(q = nl_rxq_get(sk)))
+		n = -NLE_NOMEM;
+	else if (q->busy)
 		n = nl_recv(sk, &nla, &buf, &creds);
+	else {
+		/* parse the datagram in place in its slot */
+		n = nl_rx_next(sk, q, &nla, &buf, &creds);
+		if (n > 0)
+			q->busy = held = 1;
+	}
 
-	if (n <= 0)
+	if (n <= 0) {
+		nlmsg_free(msg);
 		return n;
+	}
 
 	NL_DBG(3, "recvmsgs(%p): Read %d bytes\n", sk, n);
 
@@ -507,8 +739,7 @@ continue_reading:
 	while (nlmsg_ok(hdr, n)) {
 		NL_DBG(3, "recgmsgs(%p): Processing valid message...\n", sk);
 
-		nlmsg_free(msg);
-		msg = nlmsg_convert(hdr);
+		msg = nlmsg_reuse(msg, hdr);
 		if (!msg) {
 			err = -NLE_NOMEM;
 			goto out;
@@ -641,12 +872,8 @@ skip:
 		hdr = nlmsg_next(hdr, &n);
 	}
 	
-	nlmsg_free(msg);
-	free(buf);
-	free(creds);
-	buf = NULL;
-	msg = NULL;
-	creds = NULL;
+	recvmsgs_release(sk, held, &buf, &creds);
+	held = 0;
 
 	if (multipart) {
 		/* Multipart message not yet complete, continue reading */
@@ -656,8 +883,7 @@ stop:
 	err = 0;
 out:
 	nlmsg_free(msg);
-	free(buf);
-	free(creds);
+	recvmsgs_release(sk, held, &buf, &creds);
 
 	return err;
 }
@@ -204,6 +204,7 @@ void nl_object_dump(struct nl_object *obj, struct nl_dump_params *params)
 {
 	dump_from_ops(obj, params);
 }
+#endif
 
 /**
  * Check if the identifiers of two objects are identical 
@@ -235,7 +236,6 @@ int nl_object_identical(struct nl_object *a, struct nl_object *b)
 
 	return !(ops->oo_compare(a, b, req_attrs, 0));
 }
-#endif
 
 /**
  * Compute bitmask representing difference in attribute values
@@ -137,6 +137,7 @@ void nl_socket_free(struct nl_sock *sk)
 	if (!(sk->s_flags & NL_OWN_PORT))
 		release_local_port(sk->s_local.nl_pid);
 
+	nl_rxq_free(sk->s_rxq);
 	nl_cb_put(sk->s_cb);
 	free(sk);
 }
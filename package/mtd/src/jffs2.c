@@ -25,12 +25,14 @@
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <limits.h>
 #include <endian.h>
 #include "jffs2.h"
 #include "crc32.h"
 #include "mtd.h"
 
 #define PAD(x) (((x)+3)&~3)
+#define JFFS2_CACHE_FMT "/tmp/.mtd-jffs2-%lx"
 
 #if BYTE_ORDER == BIG_ENDIAN
 # define CLEANMARKER "\x19\x85\x20\x03\x00\x00\x00\x0c\xf0\x60\xdc\x98"
@@ -46,8 +48,84 @@ static int outfd = -1;
 static int mtdofs = 0;
 static int target_ino = 0;
 
+/*
+ * All nodes are assembled in an arena of erase blocks and written to the
+ * flash in one go by flush_blocks(). buf points to the block currently
+ * being filled, nblocks is the number of completed blocks before it.
+ */
+static char *arena = NULL;
+static int arena_blocks = 0;
+static int nblocks = 0;
+
 static void prep_eraseblock(void);
 
+static int alloc_arena(int blocks)
+{
+	char *p;
+
+	if (blocks <= arena_blocks)
+		return 0;
+
+	p = realloc(arena, blocks * erasesize);
+	if (!p)
+		return -1;
+
+	arena = p;
+	arena_blocks = blocks;
+	buf = arena + nblocks * erasesize;
+	return 0;
+}
+
+static void free_arena(void)
+{
+	free(arena);
+	arena = buf = NULL;
+	arena_blocks = nblocks = 0;
+}
+
+static void next_block(void)
+{
+	if ((nblocks + 1 == arena_blocks) && alloc_arena(arena_blocks * 2)) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	nblocks++;
+	buf = arena + nblocks * erasesize;
+}
+
+/* erase the target area and write all completed blocks of the arena */
+static int flush_blocks(void)
+{
+	int i, len = nblocks * erasesize;
+
+	if (!nblocks)
+		return 0;
+
+	if (mtdofs + len > mtdsize) {
+		fprintf(stderr, "Error: No room for additional data\n");
+		return -1;
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		if (mtd_erase_block(outfd, mtdofs + i * erasesize) < 0) {
+			fprintf(stderr, "Failed to erase block at 0x%x\n", mtdofs + i * erasesize);
+			return -1;
+		}
+	}
+
+	lseek(outfd, mtdofs, SEEK_SET);
+	if (write(outfd, arena, len) != len) {
+		fprintf(stderr, "Error writing jffs2 data\n");
+		return -1;
+	}
+	mtdofs += len;
+
+	nblocks = 0;
+	buf = arena;
+	return 0;
+}
+
 static void pad(int size)
 {
 	if ((ofs % size == 0) && (ofs < erasesize))
@@ -58,11 +136,8 @@ static void pad(int size)
 		ofs += (size - (ofs % size));
 	}
 	ofs = ofs % erasesize;
-	if (ofs == 0) {
-		mtd_erase_block(outfd, mtdofs);
-		write(outfd, buf, erasesize);
-		mtdofs += erasesize;
-	}
+	if (ofs == 0)
+		next_block();
 }
 
 static inline int rbytes(void)
@@ -91,6 +166,7 @@ static void prep_eraseblock(void)
 static int add_dirent(const char *name, const char type, int parent)
 {
 	struct jffs2_raw_dirent *de;
+	int ino;
 
 	if (ofs - erasesize < sizeof(struct jffs2_raw_dirent) + strlen(name))
 		pad(erasesize);
@@ -114,10 +190,12 @@ static int add_dirent(const char *name, const char type, int parent)
 	de->node_crc = crc32(0, (void *) de, sizeof(*de) - 8);
 	memcpy(de->name, name, strlen(name));
 
+	/* pad() may move the arena, de is not valid after it */
+	ino = de->ino;
 	ofs += sizeof(struct jffs2_raw_dirent) + de->nsize;
 	pad(4);
 
-	return de->ino;
+	return ino;
 }
 
 static int add_dir(const char *name, int parent)
@@ -227,22 +305,128 @@ static void add_file(const char *name, int parent)
 	close(fd);
 }
 
+static const char *base_name(const char *name)
+{
+	const char *p = strrchr(name, '/');
+
+	return p ? p + 1 : name;
+}
+
+/* add a file or a whole directory tree below the directory inode parent */
+static void add_path(const char *name, int parent)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+	int ino;
+
+	if (stat(name, &st)) {
+		fprintf(stderr, "File %s does not exist\n", name);
+		return;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		add_file(name, parent);
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Skipping %s: unsupported file type\n", name);
+		return;
+	}
+
+	d = opendir(name);
+	if (!d) {
+		fprintf(stderr, "Cannot open directory %s\n", name);
+		return;
+	}
+
+	ino = add_dir(base_name(name), parent);
+	while ((ent = readdir(d)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", name, ent->d_name);
+		add_path(path, ino);
+	}
+	closedir(d);
+}
+
+/* rough upper bound of the jffs2 data generated for a file or directory tree */
+static int estimate_size(const char *name)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	int size;
+	DIR *d;
+
+	if (stat(name, &st))
+		return 0;
+
+	size = PAD(sizeof(struct jffs2_raw_dirent) + strlen(base_name(name)));
+	if (S_ISREG(st.st_mode))
+		return size + st.st_size +
+			(st.st_size / 128 + 1) * PAD(sizeof(struct jffs2_raw_inode));
+
+	if (!S_ISDIR(st.st_mode))
+		return 0;
+
+	size += sizeof(struct jffs2_raw_inode);
+	d = opendir(name);
+	if (!d)
+		return size;
+
+	while ((ent = readdir(d)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", name, ent->d_name);
+		size += estimate_size(path);
+	}
+	closedir(d);
+
+	return size;
+}
+
+/* size the arena for the given files, plus the directory and the eof marker */
+static int prep_arena(const char **files, int n_files)
+{
+	int i, size = 0;
+
+	for (i = 0; i < n_files; i++)
+		size += estimate_size(files[i]);
+
+	nblocks = 0;
+	return alloc_arena(size / (erasesize - sizeof(CLEANMARKER)) + 3);
+}
+
 int mtd_replace_jffs2(const char *mtd, int fd, int ofs, const char *filename)
 {
+	int err;
+
 	outfd = fd;
 	mtdofs = ofs;
 
-	buf = malloc(erasesize);
+	if (prep_arena(&filename, 1) < 0) {
+		fprintf(stderr, "Out of memory!\n");
+		return -1;
+	}
+
 	target_ino = 1;
 	if (!last_ino)
 		last_ino = 1;
-	add_file(filename, target_ino);
+	add_path(filename, target_ino);
 	pad(erasesize);
 
 	/* add eof marker, pad to eraseblock size and write the data */
 	add_data(JFFS2_EOF, sizeof(JFFS2_EOF) - 1);
 	pad(erasesize);
-	free(buf);
+	err = flush_blocks();
+	free_arena();
+	if (err < 0)
+		return err;
 
 #ifdef target_brcm
 	trx_fixup(outfd, mtd);
@@ -277,19 +461,97 @@ void mtd_parse_jffs2data(const char *buf, const char *dir)
 	}
 }
 
-int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
+/*
+ * The position of the eof marker and the inode/version numbers found by the
+ * partition scan are cached in /tmp, so that consecutive appends to the same
+ * partition do not have to scan it again. The cache is keyed on the device
+ * number, so that all names of a partition share it, and it is dropped by
+ * everything else that writes to or erases the partition. It is only trusted
+ * if the cached block still starts with the eof marker.
+ */
+static int cache_path(char *path, int len, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return -1;
+
+	snprintf(path, len, JFFS2_CACHE_FMT, (unsigned long) st.st_rdev);
+	return 0;
+}
+
+static int cache_load(const char *dir)
+{
+	char path[PATH_MAX], cdir[256];
+	int c_ofs, c_ino, c_version, c_target;
+	FILE *f;
+	int n;
+
+	if (cache_path(path, sizeof(path), outfd) < 0)
+		return -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	*cdir = 0;
+	n = fscanf(f, "%d %d %d %d %255s", &c_ofs, &c_ino, &c_version, &c_target, cdir);
+	fclose(f);
+
+	if ((n < 4) || strcmp(cdir, dir) || (c_ofs < 0) || (c_ofs + erasesize > mtdsize))
+		return -1;
+
+	if ((pread(outfd, buf, erasesize, c_ofs) != erasesize) ||
+	    memcmp(buf, JFFS2_EOF, sizeof(JFFS2_EOF) - 1))
+		return -1;
+
+	mtdofs = c_ofs;
+	last_ino = c_ino;
+	last_version = c_version;
+	target_ino = c_target;
+
+	return 0;
+}
+
+static void cache_save(const char *dir)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (cache_path(path, sizeof(path), outfd) < 0)
+		return;
+
+	f = fopen(path, "w");
+	if (!f)
+		return;
+
+	/* the eof marker starts the last block that was written */
+	fprintf(f, "%d %d %d %d %s\n", mtdofs - erasesize, last_ino, last_version, target_ino, dir);
+	fclose(f);
+}
+
+void mtd_jffs2_cache_drop(int fd)
+{
+	char path[PATH_MAX];
+
+	if (cache_path(path, sizeof(path), fd) == 0)
+		unlink(path);
+}
+
+int mtd_write_jffs2(const char *mtd, const char **files, int n_files, const char *dir)
 {
-	int err = -1, fdeof = 0;
+	int i, err = -1, fdeof = 0;
 
 	outfd = mtd_check_open(mtd);
 	if (outfd < 0)
 		return -1;
 
-	if (quiet < 2)
-		fprintf(stderr, "Appending %s to jffs2 partition %s\n", filename, mtd);
-	
-	buf = malloc(erasesize);
-	if (!buf) {
+	if (quiet < 2) {
+		for (i = 0; i < n_files; i++)
+			fprintf(stderr, "Appending %s to jffs2 partition %s\n", files[i], mtd);
+	}
+
+	if (prep_arena(files, n_files) < 0) {
 		fprintf(stderr, "Out of memory!\n");
 		goto done;
 	}
@@ -297,8 +559,13 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	if (!*dir)
 		target_ino = 1;
 
+	if (cache_load(dir) == 0)
+		goto append;
+
 	/* parse the structure of the jffs2 first
 	 * locate the directory that the file is going to be placed in */
+	mtdofs = 0;
+	lseek(outfd, 0, SEEK_SET);
 	for(;;) {
 		struct jffs2_unknown_node *node = (struct jffs2_unknown_node *) buf;
 
@@ -328,8 +595,8 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 
 	/* jump back one eraseblock */
 	mtdofs -= erasesize;
-	lseek(outfd, mtdofs, SEEK_SET);
 
+append:
 	ofs = 0;
 
 	if (!last_ino)
@@ -338,23 +605,29 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	if (!target_ino)
 		target_ino = add_dir(dir, 1);
 
-	add_file(filename, target_ino);
+	for (i = 0; i < n_files; i++)
+		add_path(files[i], target_ino);
 	pad(erasesize);
 
 	/* add eof marker, pad to eraseblock size and write the data */
 	add_data(JFFS2_EOF, sizeof(JFFS2_EOF) - 1);
 	pad(erasesize);
 
+	/* stale from here on, until the new eof position has been saved */
+	mtd_jffs2_cache_drop(outfd);
+	if (flush_blocks() < 0)
+		goto done;
+
 	err = 0;
 
 #ifdef target_brcm
 	trx_fixup(outfd, mtd);
 #endif
+	cache_save(dir);
 
 done:
 	close(outfd);
-	if (buf)
-		free(buf);
+	free_arena();
 
 	return err;
 }
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <fcntl.h>
@@ -39,6 +40,7 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/reboot.h>
 #include <linux/reboot.h>
 #include "mtd-api.h"
@@ -46,6 +48,9 @@
 #include "mtd.h"
 
 #define MAX_ARGS 8
+#define READER_DEPTH 8	/* number of erase blocks buffered by the image reader */
+#define VERIFY_RETRIES 3	/* erase/program attempts after a failed verify */
+#define VERIFY_CHUNK 4096
 #define JFFS2_DEFAULT_DIR	"" /* directory name without /, empty means root dir */
 
 struct trx_header {
@@ -59,7 +64,45 @@ struct trx_header {
 static char *buf = NULL;
 static char *imagefile = NULL;
 static char *jffs2file = NULL, *jffs2dir = JFFS2_DEFAULT_DIR;
+static char *cmpbuf = NULL;
 static int buflen = 0;
+static int skip_unchanged = 0;
+static int pipelined = 0;
+static int show_stats = 0;
+static int verify = 0;
+
+struct reader_slot {
+	char *data;
+	int len;
+};
+
+/* ring of erase block buffers filled by the image reader thread */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct reader_slot slots[READER_DEPTH];
+	int fd;
+	int head;	/* next slot to be filled by the reader */
+	int tail;	/* next slot to be consumed by the writer */
+	int count;	/* number of filled slots */
+	int pos;	/* consumer position in the tail slot */
+	int done;	/* the last slot has been consumed */
+	int err;
+} reader;
+
+/* time spent in the individual stages of mtd_write, in microseconds */
+static struct {
+	uint64_t start;
+	uint64_t bytes;
+	uint64_t read;
+	uint64_t erase;
+	uint64_t write;
+	uint64_t verify;
+	uint64_t verify_max;	/* slowest single block verify */
+	int blocks;
+	int retries;
+} stats;
 int quiet;
 int mtdsize = 0;
 int erasesize = 0;
@@ -132,6 +175,292 @@ int mtd_write_buffer(int fd, const char *buf, int offset, int length)
 	return 0;
 }
 
+static uint64_t
+time_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * The image reader keeps up to READER_DEPTH erase blocks of the image
+ * buffered, so that slow image sources (e.g. wget piping into stdin) are
+ * read while the flash is being erased and programmed.
+ * A slot shorter than an erase block marks the end of the image.
+ */
+static void *
+image_reader(void *arg)
+{
+	struct reader_slot *slot;
+	ssize_t r;
+	int len;
+
+	do {
+		pthread_mutex_lock(&reader.lock);
+		while (reader.count == READER_DEPTH)
+			pthread_cond_wait(&reader.cond, &reader.lock);
+		slot = &reader.slots[reader.head];
+		pthread_mutex_unlock(&reader.lock);
+
+		len = 0;
+		while (len < erasesize) {
+			r = read(reader.fd, slot->data + len, erasesize - len);
+			if (r < 0) {
+				if ((errno == EINTR) || (errno == EAGAIN))
+					continue;
+
+				reader.err = errno;
+				break;
+			}
+
+			if (r == 0)
+				break;
+
+			len += r;
+		}
+
+		pthread_mutex_lock(&reader.lock);
+		slot->len = len;
+		reader.head = (reader.head + 1) % READER_DEPTH;
+		reader.count++;
+		pthread_cond_broadcast(&reader.cond);
+		pthread_mutex_unlock(&reader.lock);
+	} while (len == erasesize);
+
+	return NULL;
+}
+
+static int
+image_reader_start(int imagefd)
+{
+	int i;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = imagefd;
+	for (i = 0; i < READER_DEPTH; i++) {
+		reader.slots[i].data = malloc(erasesize);
+		if (!reader.slots[i].data)
+			return -1;
+	}
+
+	pthread_mutex_init(&reader.lock, NULL);
+	pthread_cond_init(&reader.cond, NULL);
+	if (pthread_create(&reader.thread, NULL, image_reader, NULL))
+		return -1;
+
+	return 0;
+}
+
+static void
+image_reader_stop(void)
+{
+	int i;
+
+	/* the reader may still be blocked on the image fd if we stop early */
+	pthread_cancel(reader.thread);
+	pthread_join(reader.thread, NULL);
+
+	for (i = 0; i < READER_DEPTH; i++)
+		free(reader.slots[i].data);
+}
+
+/* read(2) replacement, fed from the reader ring in pipelined mode */
+static ssize_t
+image_read(int imagefd, char *dest, int len)
+{
+	struct reader_slot *slot;
+
+	if (!pipelined)
+		return read(imagefd, dest, len);
+
+	pthread_mutex_lock(&reader.lock);
+	while (!reader.count) {
+		if (reader.done) {
+			pthread_mutex_unlock(&reader.lock);
+			if (reader.err) {
+				errno = reader.err;
+				return -1;
+			}
+			return 0;
+		}
+		pthread_cond_wait(&reader.cond, &reader.lock);
+	}
+	slot = &reader.slots[reader.tail];
+	pthread_mutex_unlock(&reader.lock);
+
+	if (len > slot->len - reader.pos)
+		len = slot->len - reader.pos;
+
+	memcpy(dest, slot->data + reader.pos, len);
+	reader.pos += len;
+
+	if (reader.pos == slot->len) {
+		pthread_mutex_lock(&reader.lock);
+		if (slot->len < erasesize)
+			reader.done = 1;
+		reader.tail = (reader.tail + 1) % READER_DEPTH;
+		reader.count--;
+		reader.pos = 0;
+		pthread_cond_broadcast(&reader.cond);
+		pthread_mutex_unlock(&reader.lock);
+	}
+
+	/* the last slot is empty if the read failed, that is not the end
+	 * of the image */
+	if (!len && reader.err) {
+		errno = reader.err;
+		return -1;
+	}
+
+	return len;
+}
+
+static void
+print_stats(void)
+{
+	uint64_t total = time_us() - stats.start;
+	double mb = (double) stats.bytes / (1024 * 1024);
+
+	if (!total)
+		total = 1;
+
+	fprintf(stderr, "Wrote %.2f MB in %.2f s (%.2f MB/s): "
+		"read %llu ms, erase %llu ms, write %llu ms\n",
+		mb, (double) total / 1000000, mb * 1000000 / total,
+		(unsigned long long) stats.read / 1000,
+		(unsigned long long) stats.erase / 1000,
+		(unsigned long long) stats.write / 1000);
+
+	if (verify && stats.blocks)
+		fprintf(stderr, "Verified %d blocks in %llu ms (avg %llu us, max %llu us), %d retries\n",
+			stats.blocks, (unsigned long long) stats.verify / 1000,
+			(unsigned long long) stats.verify / stats.blocks,
+			(unsigned long long) stats.verify_max, stats.retries);
+}
+
+/*
+ * Read back freshly programmed data in small chunks and compare it
+ * against the data written.
+ */
+static int
+mtd_verify_block(int fd, int offset, const char *data, int len)
+{
+	char chunk[VERIFY_CHUNK];
+	int pos, n;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = len - pos;
+		if (n > sizeof(chunk))
+			n = sizeof(chunk);
+
+		if (pread(fd, chunk, n, offset + pos) != n)
+			return -1;
+
+		if (memcmp(chunk, data + pos, n) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Verify data after programming it. If it does not match, erase the
+ * erase blocks it covers and program them again, together with the data
+ * already written in front of it in the first block.
+ */
+static int
+mtd_verify_write(int fd, int offset, const char *data, int len)
+{
+	uint64_t t = time_us();
+	int start = offset - (offset % erasesize);
+	int head = offset - start;
+	const char *vdata = data;
+	int vofs = offset, vlen = len;
+	char *blk = NULL;
+	int retry = 0;
+	int ret = 0;
+	int pos;
+
+	while (mtd_verify_block(fd, vofs, vdata, vlen) < 0) {
+		if (retry++ == VERIFY_RETRIES) {
+			ret = -1;
+			break;
+		}
+
+		if (quiet < 2)
+			fprintf(stderr, "\nVerify failed at 0x%x, rewriting block\n", offset);
+
+		stats.retries++;
+		if (!blk) {
+			blk = malloc(head + len);
+			if (!blk || (pread(fd, blk, head, start) != head)) {
+				ret = -1;
+				break;
+			}
+			memcpy(blk + head, data, len);
+			vdata = blk;
+			vofs = start;
+			vlen = head + len;
+		}
+
+		for (pos = start; pos < offset + len; pos += erasesize) {
+			if (mtd_erase_block(fd, pos) < 0)
+				break;
+		}
+		if (pos < offset + len)
+			continue;
+
+		if (lseek(fd, start, SEEK_SET) != start)
+			continue;
+
+		if (write(fd, blk, head + len) != head + len)
+			continue;
+	}
+
+	free(blk);
+	lseek(fd, offset + len, SEEK_SET);
+	if (ret < 0)
+		return ret;
+
+	t = time_us() - t;
+	stats.verify += t;
+	if (t > stats.verify_max)
+		stats.verify_max = t;
+	stats.blocks++;
+
+	return 0;
+}
+
+/*
+ * Read back the erase block at offset and check whether it already holds
+ * the given data. Anything beyond len has to be erased (0xff), so that
+ * skipping the block leaves the flash in the same state as rewriting it.
+ */
+static int mtd_block_unchanged(int fd, int offset, const char *data, int len)
+{
+	int i;
+
+	if (!cmpbuf) {
+		cmpbuf = malloc(erasesize);
+		if (!cmpbuf)
+			return 0;
+	}
+
+	if (pread(fd, cmpbuf, erasesize, offset) != erasesize)
+		return 0;
+
+	if (memcmp(cmpbuf, data, len) != 0)
+		return 0;
+
+	for (i = len; i < erasesize; i++) {
+		if ((unsigned char) cmpbuf[i] != 0xff)
+			return 0;
+	}
+
+	return 1;
+}
 
 static int
 image_check(int imagefd, const char *mtd)
@@ -235,6 +564,7 @@ mtd_erase(const char *mtd)
 		exit(1);
 	}
 
+	mtd_jffs2_cache_drop(fd);
 	mtdEraseInfo.length = erasesize;
 
 	for (mtdEraseInfo.start = 0;
@@ -286,6 +616,8 @@ mtd_write(int imagefd, const char *mtd, char *fis_layout)
 	int fd, result;
 	ssize_t r, w, e;
 	uint32_t offset = 0;
+	int n_skipped = 0, n_erased = 0;
+	uint64_t t;
 
 #ifdef FIS_SUPPORT
 	static struct fis_part new_parts[MAX_ARGS];
@@ -349,6 +681,14 @@ next:
 
 	r = 0;
 
+	memset(&stats, 0, sizeof(stats));
+	stats.start = time_us();
+
+	if (pipelined && image_reader_start(imagefd) < 0) {
+		fprintf(stderr, "Failed to start the image reader, falling back to unbuffered reads\n");
+		pipelined = 0;
+	}
+
 resume:
 	next = strchr(mtd, ':');
 	if (next) {
@@ -361,6 +701,7 @@ resume:
 		fprintf(stderr, "Could not open mtd device: %s\n", mtd);
 		exit(1);
 	}
+	mtd_jffs2_cache_drop(fd);
 
 	if (quiet < 2)
 		fprintf(stderr, "Writing from %s to %s ... ", imagefile, mtd);
@@ -371,14 +712,16 @@ resume:
 
 	for (;;) {
 		/* buffer may contain data already (from trx check or last mtd partition write attempt) */
+		t = time_us();
 		while (buflen < erasesize) {
-			r = read(imagefd, buf + buflen, erasesize - buflen);
+			r = image_read(imagefd, buf + buflen, erasesize - buflen);
 			if (r < 0) {
 				if ((errno == EINTR) || (errno == EAGAIN))
 					continue;
 				else {
+					/* do not take a truncated image for a complete one */
 					perror("read");
-					break;
+					exit(1);
 				}
 			}
 
@@ -387,6 +730,7 @@ resume:
 
 			buflen += r;
 		}
+		stats.read += time_us() - t;
 
 		if (buflen == 0)
 			break;
@@ -398,7 +742,10 @@ resume:
 				if (quiet < 2)
 					fprintf(stderr, "\nAppending jffs2 data to from %s to %s...", jffs2file, mtd);
 				/* got an EOF marker - this is the place to add some jffs2 data */
-				mtd_replace_jffs2(mtd, fd, e, jffs2file);
+				if (mtd_replace_jffs2(mtd, fd, e, jffs2file) < 0) {
+					fprintf(stderr, "Failed to append jffs2 data\n");
+					exit(1);
+				}
 				goto done;
 			}
 			/* no EOF marker, make sure we figure out the last inode number
@@ -406,16 +753,40 @@ resume:
 			mtd_parse_jffs2data(buf, jffs2dir);
 		}
 
+		/* leave erase blocks alone if they already contain the new data */
+		if (skip_unchanged && !offset && (w == e) &&
+		    mtd_block_unchanged(fd, e, buf, buflen)) {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[s]");
+
+			e += erasesize;
+			w = e;
+			lseek(fd, e, SEEK_SET);
+			n_skipped++;
+			buflen = 0;
+			continue;
+		}
+
 		/* need to erase the next block before writing data to it */
 		while (w + buflen > e) {
 			if (!quiet)
 				fprintf(stderr, "\b\b\b[e]");
 
+			t = time_us();
+			result = mtd_erase_block(fd, e);
+			stats.erase += time_us() - t;
 
-			if (mtd_erase_block(fd, e) < 0) {
+			if (result < 0) {
 				if (next) {
 					if (w < e) {
-						write(fd, buf + offset, e - w);
+						if (write(fd, buf + offset, e - w) != e - w) {
+							fprintf(stderr, "Error writing image.\n");
+							exit(1);
+						}
+						if (verify && (mtd_verify_write(fd, w, buf + offset, e - w) < 0)) {
+							fprintf(stderr, "Failed to verify block at 0x%x\n", (unsigned int) w);
+							exit(1);
+						}
 						offset = e - w;
 					}
 					w = 0;
@@ -432,12 +803,17 @@ resume:
 
 			/* erase the chunk */
 			e += erasesize;
+			n_erased++;
 		}
 
 		if (!quiet)
 			fprintf(stderr, "\b\b\b[w]");
 
-		if ((result = write(fd, buf + offset, buflen)) < buflen) {
+		t = time_us();
+		result = write(fd, buf + offset, buflen);
+		stats.write += time_us() - t;
+
+		if (result < buflen) {
 			if (result < 0) {
 				fprintf(stderr, "Error writing image.\n");
 				exit(1);
@@ -446,7 +822,18 @@ resume:
 				exit(1);
 			}
 		}
+
+		if (verify) {
+			if (!quiet)
+				fprintf(stderr, "\b\b\b[v]");
+
+			if (mtd_verify_write(fd, w, buf + offset, buflen) < 0) {
+				fprintf(stderr, "Failed to verify block at 0x%x\n", (unsigned int) w);
+				exit(1);
+			}
+		}
 		w += buflen;
+		stats.bytes += buflen;
 
 		buflen = 0;
 		offset = 0;
@@ -459,6 +846,15 @@ done:
 	if (quiet < 2)
 		fprintf(stderr, "\n");
 
+	if (skip_unchanged && (quiet < 2))
+		fprintf(stderr, "%d blocks unchanged, %d blocks written\n", n_skipped, n_erased);
+
+	if (show_stats)
+		print_stats();
+
+	if (pipelined)
+		image_reader_stop();
+
 #ifdef FIS_SUPPORT
 	if (fis_layout) {
 		if (fis_remap(old_parts, n_old, new_parts, n_new) < 0)
@@ -479,12 +875,20 @@ static void usage(void)
 	"        refresh                 refresh mtd partition\n"
 	"        erase                   erase all data on device\n"
 	"        write <imagefile>|-     write <imagefile> (use - for stdin) to device\n"
-	"        jffs2write <file>       append <file> to the jffs2 partition on the device\n"
+	"        jffs2write <file>...    append the files or directory trees to the jffs2\n"
+	"                                partition on the device\n"
 	"Following options are available:\n"
 	"        -q                      quiet mode (once: no [w] on writing,\n"
 	"                                           twice: no status messages)\n"
 	"        -r                      reboot after successful command\n"
 	"        -f                      force write without trx checks\n"
+	"        -c                      compare each erase block against the flash contents\n"
+	"                                and only erase/write the blocks that differ\n"
+	"        -p                      read the image in a separate thread, buffering\n"
+	"                                up to %d erase blocks ahead of the flash writes\n"
+	"        -t                      print throughput and timing statistics after writing\n"
+	"        -v                      verify each block after writing it, rewriting it\n"
+	"                                up to %d times on mismatch\n"
 	"        -e <device>             erase <device> before executing the command\n"
 	"        -d <name>               directory for jffs2write, defaults to \"tmp\"\n"
 	"        -j <name>               integrate <file> into jffs2 data when writing an image\n"
@@ -496,7 +900,7 @@ static void usage(void)
 #endif
 	"\n"
 	"Example: To write linux.trx to mtd4 labeled as linux and reboot afterwards\n"
-	"         mtd -r write linux.trx linux\n\n");
+	"         mtd -r write linux.trx linux\n\n", READER_DEPTH, VERIFY_RETRIES);
 	exit(1);
 }
 
@@ -518,6 +922,8 @@ int main (int argc, char **argv)
 	int ch, i, boot, imagefd = 0, force, unlocked;
 	char *erase[MAX_ARGS], *device = NULL;
 	char *fis_layout = NULL;
+	const char **jffs2files = NULL;
+	int n_jffs2files = 0;
 	enum {
 		CMD_ERASE,
 		CMD_WRITE,
@@ -536,11 +942,23 @@ int main (int argc, char **argv)
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frqe:d:j:")) != -1)
+			"frcptvqe:d:j:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
 				break;
+			case 'c':
+				skip_unchanged = 1;
+				break;
+			case 'p':
+				pipelined = 1;
+				break;
+			case 't':
+				show_stats = 1;
+				break;
+			case 'v':
+				verify = 1;
+				break;
 			case 'r':
 				boot = 1;
 				break;
@@ -609,11 +1027,12 @@ int main (int argc, char **argv)
 			fprintf(stderr, "Image check failed.\n");
 			exit(1);
 		}
-	} else if ((strcmp(argv[0], "jffs2write") == 0) && (argc == 3)) {
+	} else if ((strcmp(argv[0], "jffs2write") == 0) && (argc >= 3)) {
 		cmd = CMD_JFFS2WRITE;
-		device = argv[2];
+		device = argv[argc - 1];
 
-		imagefile = argv[1];
+		jffs2files = (const char **) &argv[1];
+		n_jffs2files = argc - 2;
 		if (!mtd_check(device)) {
 			fprintf(stderr, "Can't open device for writing!\n");
 			exit(1);
@@ -652,7 +1071,7 @@ int main (int argc, char **argv)
 		case CMD_JFFS2WRITE:
 			if (!unlocked)
 				mtd_unlock(device);
-			mtd_write_jffs2(device, imagefile, jffs2dir);
+			mtd_write_jffs2(device, jffs2files, n_jffs2files, jffs2dir);
 			break;
 		case CMD_REFRESH:
 			mtd_refresh(device);
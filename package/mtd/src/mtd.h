@@ -17,9 +17,10 @@ extern int mtd_open(const char *mtd, bool block);
 extern int mtd_check_open(const char *mtd);
 extern int mtd_erase_block(int fd, int offset);
 extern int mtd_write_buffer(int fd, const char *buf, int offset, int length);
-extern int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir);
+extern int mtd_write_jffs2(const char *mtd, const char **files, int n_files, const char *dir);
 extern int mtd_replace_jffs2(const char *mtd, int fd, int ofs, const char *filename);
 extern void mtd_parse_jffs2data(const char *buf, const char *dir);
+extern void mtd_jffs2_cache_drop(int fd);
 
 /* target specific */
 extern int trx_fixup(int fd, const char *name);
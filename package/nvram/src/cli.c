@@ -24,6 +24,14 @@
 
 #include "nvram.h"
 
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NVRAM_SOCKET	"/var/run/nvram.sock"
+#define BATCH_LINE_MAX	4096
+#define REQUEST_MAX	65536
+
 
 static nvram_handle_t * nvram_open_rdonly(void)
 {
@@ -46,7 +54,7 @@ static nvram_handle_t * nvram_open_staging(void)
 	return NULL;
 }
 
-static int do_show(nvram_handle_t *nvram)
+static int do_show(nvram_handle_t *nvram, FILE *out)
 {
 	nvram_tuple_t *t;
 	int stat = 1;
@@ -55,7 +63,7 @@ static int do_show(nvram_handle_t *nvram)
 	{
 		while( t )
 		{
-			printf("%s=%s\n", t->name, t->value);
+			fprintf(out, "%s=%s\n", t->name, t->value);
 			t = t->next;
 		}
 
@@ -65,14 +73,14 @@ static int do_show(nvram_handle_t *nvram)
 	return stat;
 }
 
-static int do_get(nvram_handle_t *nvram, const char *var)
+static int do_get(nvram_handle_t *nvram, const char *var, FILE *out)
 {
 	const char *val;
 	int stat = 1;
 
 	if( (val = nvram_get(nvram, var)) != NULL )
 	{
-		printf("%s\n", val);
+		fprintf(out, "%s\n", val);
 		stat = 0;
 	}
 
@@ -100,7 +108,7 @@ static int do_set(nvram_handle_t *nvram, const char *pair)
 	return stat;
 }
 
-static int do_info(nvram_handle_t *nvram)
+static int do_info(nvram_handle_t *nvram, FILE *out)
 {
 	nvram_header_t *hdr = nvram_header(nvram);
 
@@ -109,19 +117,19 @@ static int do_info(nvram_handle_t *nvram)
 		hdr->len - NVRAM_CRC_START_POSITION, 0xff);
 
 	/* Show info */
-	printf("Magic:         0x%08X\n",   hdr->magic);
-	printf("Length:        0x%08X\n",   hdr->len);
+	fprintf(out, "Magic:         0x%08X\n",   hdr->magic);
+	fprintf(out, "Length:        0x%08X\n",   hdr->len);
 
-	printf("CRC8:          0x%02X (calculated: 0x%02X)\n",
+	fprintf(out, "CRC8:          0x%02X (calculated: 0x%02X)\n",
 		hdr->crc_ver_init & 0xFF, crc);
 
-	printf("Version:       0x%02X\n",   (hdr->crc_ver_init >> 8) & 0xFF);
-	printf("SDRAM init:    0x%04X\n",   (hdr->crc_ver_init >> 16) & 0xFFFF);
-	printf("SDRAM config:  0x%04X\n",   hdr->config_refresh & 0xFFFF);
-	printf("SDRAM refresh: 0x%04X\n",   (hdr->config_refresh >> 16) & 0xFFFF);
-	printf("NCDL values:   0x%08X\n\n", hdr->config_ncdl);
+	fprintf(out, "Version:       0x%02X\n",   (hdr->crc_ver_init >> 8) & 0xFF);
+	fprintf(out, "SDRAM init:    0x%04X\n",   (hdr->crc_ver_init >> 16) & 0xFFFF);
+	fprintf(out, "SDRAM config:  0x%04X\n",   hdr->config_refresh & 0xFFFF);
+	fprintf(out, "SDRAM refresh: 0x%04X\n",   (hdr->config_refresh >> 16) & 0xFFFF);
+	fprintf(out, "NCDL values:   0x%08X\n\n", hdr->config_ncdl);
 
-	printf("%i bytes used / %i bytes available (%.2f%%)\n",
+	fprintf(out, "%i bytes used / %i bytes available (%.2f%%)\n",
 		hdr->len, NVRAM_SPACE - hdr->len,
 		(100.00 / (double)NVRAM_SPACE) * (double)hdr->len);
 
@@ -129,6 +137,472 @@ static int do_info(nvram_handle_t *nvram)
 }
 
 
+/* Check whether the commands modify nvram, returns -1 on unknown commands. */
+static int check_commands(int argc, const char *argv[])
+{
+	int write = 0;
+	int i;
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "set") || !strcmp(argv[i], "unset") )
+		{
+			if( ++i >= argc )
+				return -1;
+
+			write = 1;
+		}
+		else if( !strcmp(argv[i], "commit") )
+		{
+			write = 1;
+		}
+		else if( !strcmp(argv[i], "get") )
+		{
+			if( ++i >= argc )
+				return -1;
+		}
+		else if( strcmp(argv[i], "show") && strcmp(argv[i], "info") )
+		{
+			return -1;
+		}
+	}
+
+	return write;
+}
+
+/* Execute the commands, returns the status of the last one. */
+static int run_commands(nvram_handle_t *nvram, int argc, const char *argv[],
+	FILE *out, int *commit, int *done)
+{
+	int stat = 1;
+	int i;
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( !strcmp(argv[i], "show") )
+		{
+			stat = do_show(nvram, out);
+			(*done)++;
+		}
+		else if( !strcmp(argv[i], "info") )
+		{
+			stat = do_info(nvram, out);
+			(*done)++;
+		}
+		else if( !strcmp(argv[i], "get") && ++i < argc )
+		{
+			stat = do_get(nvram, argv[i], out);
+			(*done)++;
+		}
+		else if( !strcmp(argv[i], "unset") && ++i < argc )
+		{
+			stat = do_unset(nvram, argv[i]);
+			(*done)++;
+		}
+		else if( !strcmp(argv[i], "set") && ++i < argc )
+		{
+			stat = do_set(nvram, argv[i]);
+			(*done)++;
+		}
+		else if( !strcmp(argv[i], "commit") )
+		{
+			*commit = 1;
+			(*done)++;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option '%s' !\n", argv[i]);
+			*done = 0;
+			break;
+		}
+	}
+
+	return stat;
+}
+
+/*
+ * Batch mode: read one command per line ("get var", "set var=value",
+ * "unset var", "show", "info" or "commit") and turn them into an argument
+ * vector, so that they are all executed on a single nvram handle.
+ */
+static int read_batch(const char *file, int *argc, const char **argv[])
+{
+	char line[BATCH_LINE_MAX], *cmd, *arg, *p;
+	const char **args = NULL;
+	int nargs = 1, size = 0;
+	FILE *fp;
+
+	if( !strcmp(file, "-") )
+		fp = stdin;
+	else if( (fp = fopen(file, "r")) == NULL )
+		return -1;
+
+	while( fgets(line, sizeof(line), fp) )
+	{
+		if( (p = strchr(line, '\n')) != NULL )
+			*p = '\0';
+
+		cmd = line + strspn(line, " \t");
+		if( !*cmd || *cmd == '#' )
+			continue;
+
+		/* The argument is the rest of the line, values may contain spaces */
+		arg = NULL;
+		if( (p = strpbrk(cmd, " \t")) != NULL )
+		{
+			*p++ = '\0';
+			arg = p + strspn(p, " \t");
+		}
+
+		if( nargs + 2 > size )
+		{
+			size = size ? size * 2 : 64;
+			if( (args = realloc(args, size * sizeof(char *))) == NULL )
+				return -1;
+		}
+
+		args[nargs++] = strdup(cmd);
+		if( arg && *arg )
+			args[nargs++] = strdup(arg);
+	}
+
+	if( fp != stdin )
+		fclose(fp);
+
+	if( !args && (args = malloc(sizeof(char *))) == NULL )
+		return -1;
+
+	args[0] = (*argv)[0];
+	*argc = nargs;
+	*argv = args;
+
+	return 0;
+}
+
+/*
+ * Server mode: keep the parsed nvram resident and execute the commands of
+ * clients connecting to NVRAM_SOCKET. A request is the length of the NUL
+ * separated argument vector (32 bit, host order) followed by the vector
+ * itself, the reply is the command output followed by a NUL byte and the
+ * exit status. Only complete requests of at most REQUEST_MAX bytes are
+ * executed, larger ones are run by the client itself. A client that changed
+ * the nvram itself sends an empty request afterwards, which makes the server
+ * drop its parsed copy; the stat info of the mtd device does not change on
+ * writes, so the server could not notice otherwise.
+ */
+static struct {
+	nvram_handle_t *nvram;
+	int write;		/* handle refers to the staging file opened for writing */
+	char *mtd;
+	struct stat st;	/* file the handle was opened from */
+} server;
+
+static const char * server_source(struct stat *st)
+{
+	const char *file = nvram_find_staging();
+
+	if( file == NULL )
+	{
+		if( server.mtd == NULL )
+			server.mtd = nvram_find_mtd();
+
+		file = server.mtd;
+	}
+
+	if( file == NULL || stat(file, st) )
+		return NULL;
+
+	return file;
+}
+
+static void server_drop(void)
+{
+	if( server.nvram != NULL )
+		nvram_close(server.nvram);
+
+	server.nvram = NULL;
+	server.write = 0;
+}
+
+static nvram_handle_t * server_open(int write)
+{
+	struct stat st;
+	const char *file;
+
+	if( write )
+	{
+		if( server.nvram != NULL && server.write )
+			return server.nvram;
+
+		server_drop();
+		if( (server.nvram = nvram_open_staging()) != NULL )
+		{
+			server.write = 1;
+			stat(NVRAM_STAGING, &server.st);
+		}
+
+		return server.nvram;
+	}
+
+	if( (file = server_source(&st)) == NULL )
+	{
+		server_drop();
+		return NULL;
+	}
+
+	/* Reparse only if the underlying file changed */
+	if( server.nvram != NULL &&
+		st.st_dev == server.st.st_dev && st.st_ino == server.st.st_ino &&
+		st.st_size == server.st.st_size &&
+		st.st_mtim.tv_sec == server.st.st_mtim.tv_sec &&
+		st.st_mtim.tv_nsec == server.st.st_mtim.tv_nsec &&
+		st.st_ctim.tv_sec == server.st.st_ctim.tv_sec &&
+		st.st_ctim.tv_nsec == server.st.st_ctim.tv_nsec )
+		return server.nvram;
+
+	server_drop();
+	if( (server.nvram = nvram_open(file, NVRAM_RO)) != NULL )
+		server.st = st;
+
+	return server.nvram;
+}
+
+static int server_request(int fd, char *req, int len)
+{
+	static const char *argv[REQUEST_MAX / 2];
+	nvram_handle_t *nvram;
+	int argc = 0, commit = 0, done = 0;
+	int write, stat = 1;
+	FILE *out;
+	char *p;
+
+	argv[argc++] = "nvram";
+	for( p = req; p < req + len && argc < (int) (NVRAM_ARRAYSIZE(argv)); p += strlen(p) + 1 )
+		argv[argc++] = p;
+
+	if( (out = fdopen(fd, "w")) == NULL )
+		return -1;
+
+	if( len == 0 )
+	{
+		server_drop();
+		stat = 0;
+	}
+	else if( (write = check_commands(argc, argv)) >= 0 &&
+		(nvram = server_open(write)) != NULL )
+	{
+		stat = run_commands(nvram, argc, argv, out, &commit, &done);
+
+		if( write )
+		{
+			stat = nvram_commit(nvram);
+
+			/* Refresh the stat info, our own changes do not need a reparse */
+			fstat(nvram->fd, &server.st);
+		}
+
+		if( commit )
+		{
+			server_drop();
+			stat = staging_to_nvram();
+		}
+	}
+
+	fputc('\0', out);
+	fputc(stat, out);
+	fclose(out);
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while( len > 0 )
+	{
+		if( (r = read(fd, p, len)) < 0 && errno == EINTR )
+			continue;
+
+		if( r <= 0 )
+			return -1;
+
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while( len > 0 )
+	{
+		/* Do not get killed by SIGPIPE if the server goes away */
+		if( (r = send(fd, p, len, MSG_NOSIGNAL)) < 0 && errno == EINTR )
+			continue;
+
+		if( r <= 0 )
+			return -1;
+
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int server_run(void)
+{
+	struct sockaddr_un addr;
+	char *req;
+	uint32_t len;
+	mode_t mask;
+	int sock, fd, err;
+
+	if( (req = malloc(REQUEST_MAX + 1)) == NULL )
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, NVRAM_SOCKET, sizeof(addr.sun_path) - 1);
+
+	unlink(NVRAM_SOCKET);
+	if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+	{
+		perror("Could not create " NVRAM_SOCKET);
+		return 1;
+	}
+
+	/* Only the owner may run commands through the server */
+	mask = umask(0077);
+	err = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+
+	if( err || chmod(NVRAM_SOCKET, 0600) || listen(sock, 16) )
+	{
+		perror("Could not create " NVRAM_SOCKET);
+		return 1;
+	}
+
+	for( ;; )
+	{
+		if( (fd = accept(sock, NULL, NULL)) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			perror("accept");
+			break;
+		}
+
+		/* Drop incomplete and oversized requests without running them */
+		if( read_all(fd, &len, sizeof(len)) || len > REQUEST_MAX ||
+			read_all(fd, req, len) )
+		{
+			close(fd);
+			continue;
+		}
+
+		req[len] = '\0';
+		if( server_request(fd, req, len) )
+			close(fd);
+	}
+
+	close(sock);
+	unlink(NVRAM_SOCKET);
+	free(req);
+
+	return 1;
+}
+
+/*
+ * Forward the commands to a running server, returns -1 if there is none or
+ * the request could not be sent. The server only runs complete requests, so
+ * the commands can then be run locally.
+ */
+static int client_run(int argc, const char *argv[])
+{
+	struct sockaddr_un addr;
+	char buf[4096], last[2];
+	uint32_t len = 0;
+	int fd, i, r, n = 0;
+
+	for( i = 1; i < argc; i++ )
+		len += strlen(argv[i]) + 1;
+
+	if( len > REQUEST_MAX )
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, NVRAM_SOCKET, sizeof(addr.sun_path) - 1);
+
+	if( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+		return -1;
+
+	if( connect(fd, (struct sockaddr *) &addr, sizeof(addr)) )
+	{
+		close(fd);
+		return -1;
+	}
+
+	if( send_all(fd, &len, sizeof(len)) )
+	{
+		close(fd);
+		return -1;
+	}
+
+	for( i = 1; i < argc; i++ )
+	{
+		if( send_all(fd, argv[i], strlen(argv[i]) + 1) )
+		{
+			close(fd);
+			return -1;
+		}
+	}
+
+	shutdown(fd, SHUT_WR);
+
+	/* Hold back the last two bytes, they carry the NUL and the status */
+	while( (r = read(fd, buf, sizeof(buf))) > 0 )
+	{
+		for( i = 0; i < r; i++ )
+		{
+			if( n < 2 )
+			{
+				last[n++] = buf[i];
+				continue;
+			}
+
+			putchar(last[0]);
+			last[0] = last[1];
+			last[1] = buf[i];
+		}
+	}
+
+	close(fd);
+
+	if( n < 2 || last[0] != '\0' )
+		return 1;
+
+	return (unsigned char) last[1];
+}
+
+/* Tell a running server that the nvram was changed without it */
+static void client_notify(void)
+{
+	const char *argv[] = { "nvram" };
+
+	client_run(1, argv);
+}
+
 int main( int argc, const char *argv[] )
 {
 	nvram_handle_t *nvram;
@@ -138,6 +612,21 @@ int main( int argc, const char *argv[] )
 	int done = 0;
 	int i;
 
+	if( argc > 1 && !strcmp(argv[1], "server") )
+		return server_run();
+
+	if( argc > 2 && !strcmp(argv[1], "batch") &&
+		read_batch(argv[2], &argc, &argv) )
+	{
+		fprintf(stderr, "Could not read commands from %s\n", argv[2]);
+		return 1;
+	}
+
+	/* Let a running server handle well formed requests */
+	if( argc > 1 && check_commands(argc, argv) >= 0 &&
+		(stat = client_run(argc, argv)) >= 0 )
+		return stat;
+
 	/* Ugly... iterate over arguments to see whether we can expect a write */
 	for( i = 1; i < argc; i++ )
 		if( ( !strcmp(argv[i], "set")   && ++i < argc ) ||
@@ -148,50 +637,11 @@ int main( int argc, const char *argv[] )
 			break;
 		}
 
-
 	nvram = write ? nvram_open_staging() : nvram_open_rdonly();
 
 	if( nvram != NULL && argc > 1 )
 	{
-		for( i = 1; i < argc; i++ )
-		{
-			if( !strcmp(argv[i], "show") )
-			{
-				stat = do_show(nvram);
-				done++;
-			}
-			else if( !strcmp(argv[i], "info") )
-			{
-				stat = do_info(nvram);
-				done++;
-			}
-			else if( !strcmp(argv[i], "get") && ++i < argc )
-			{
-				stat = do_get(nvram, argv[i]);
-				done++;
-			}
-			else if( !strcmp(argv[i], "unset") && ++i < argc )
-			{
-				stat = do_unset(nvram, argv[i]);
-				done++;
-			}
-			else if( !strcmp(argv[i], "set") && ++i < argc )
-			{
-				stat = do_set(nvram, argv[i]);
-				done++;
-			}
-			else if( !strcmp(argv[i], "commit") )
-			{
-				commit = 1;
-				done++;
-			}
-			else
-			{
-				fprintf(stderr, "Unknown option '%s' !\n", argv[i]);
-				done = 0;
-				break;
-			}
-		}
+		stat = run_commands(nvram, argc, argv, stdout, &commit, &done);
 
 		if( write )
 			stat = nvram_commit(nvram);
@@ -200,6 +650,9 @@ int main( int argc, const char *argv[] )
 
 		if( commit )
 			stat = staging_to_nvram();
+
+		if( write )
+			client_notify();
 	}
 
 	if( !nvram )
@@ -224,6 +677,8 @@ int main( int argc, const char *argv[] )
 			"	nvram set variable=value [set ...]\n"
 			"	nvram unset variable [unset ...]\n"
 			"	nvram commit\n"
+			"	nvram batch file|-\n"
+			"	nvram server\n"
 		);
 
 		stat = 1;
@@ -25,93 +25,250 @@ size_t nvram_erase_size = 0;
  * -- Helper functions --
  */
 
-/* String hash */
+/* String hash (FNV-1a) */
 static uint32_t hash(const char *s)
 {
-	uint32_t hash = 0;
+	uint32_t hash = 2166136261U;
 
-	while (*s)
-		hash = 31 * hash + *s++;
+	while (*s) {
+		hash ^= (uint8_t) *s++;
+		hash *= 16777619U;
+	}
 
 	return hash;
 }
 
-/* Free all tuples. */
+/* Allocate a new arena chunk with room for at least size bytes. */
+static nvram_arena_t * _nvram_arena_grow(nvram_handle_t *h, size_t size)
+{
+	nvram_arena_t *a;
+
+	if (size < NVRAM_ARENA_CHUNK)
+		size = NVRAM_ARENA_CHUNK;
+
+	if (!(a = malloc(sizeof(nvram_arena_t) + size)))
+		return NULL;
+
+	a->size = size;
+	a->used = 0;
+	a->next = h->arena;
+	h->arena = a;
+
+	return a;
+}
+
+/* Copy a string into the arena, it stays valid until the handle is closed. */
+static char * _nvram_strdup(nvram_handle_t *h, const char *s)
+{
+	nvram_arena_t *a = h->arena;
+	size_t len = strlen(s) + 1;
+
+	if (!a || (a->size - a->used) < len)
+		if (!(a = _nvram_arena_grow(h, len)))
+			return NULL;
+
+	memcpy(a->data + a->used, s, len);
+	a->used += len;
+
+	return a->data + a->used - len;
+}
+
+/* Free all entries, the index and the string arena. */
 static void _nvram_free(nvram_handle_t *h)
 {
-	uint32_t i;
-	nvram_tuple_t *t, *next;
+	nvram_arena_t *a, *next;
 
-	/* Free hash table */
-	for (i = 0; i < NVRAM_ARRAYSIZE(h->nvram_hash); i++) {
-		for (t = h->nvram_hash[i]; t; t = next) {
-			next = t->next;
-			free(t);
-		}
-		h->nvram_hash[i] = NULL;
+	for (a = h->arena; a; a = next) {
+		next = a->next;
+		free(a);
 	}
 
-	/* Free dead table */
-	for (t = h->nvram_dead; t; t = next) {
-		next = t->next;
-		free(t);
+	free(h->entries);
+	free(h->index);
+
+	h->arena = NULL;
+	h->entries = NULL;
+	h->index = NULL;
+	h->nentries = h->entries_size = h->index_size = 0;
+	h->clean = h->crc_known = 0;
+}
+
+/* Find the index slot of name, or the empty slot where it belongs. */
+static uint32_t * _nvram_slot(nvram_handle_t *h, const char *name, uint32_t hv)
+{
+	uint32_t mask = h->index_size - 1;
+	uint32_t i, *slot;
+	nvram_entry_t *e;
+
+	for (i = hv & mask; ; i = (i + 1) & mask) {
+		slot = &h->index[i];
+		if (!*slot)
+			return slot;
+
+		e = &h->entries[*slot - 1];
+		if ((e->hash == hv) && !strcmp(e->name, name))
+			return slot;
 	}
+}
 
-	h->nvram_dead = NULL;
+/* Make room for one more entry, keeping the index at most half full. */
+static int _nvram_reserve(nvram_handle_t *h)
+{
+	uint32_t i, size, *index;
+	nvram_entry_t *e;
+
+	if (h->nentries == h->entries_size) {
+		size = h->entries_size ? h->entries_size * 2 : NVRAM_INDEX_MIN / 2;
+		if (!(e = realloc(h->entries, size * sizeof(nvram_entry_t))))
+			return -1;
+
+		h->entries = e;
+		h->entries_size = size;
+	}
+
+	if ((h->nentries + 1) * 2 <= h->index_size)
+		return 0;
+
+	size = h->index_size ? h->index_size * 2 : NVRAM_INDEX_MIN;
+	if (!(index = calloc(size, sizeof(uint32_t))))
+		return -1;
+
+	free(h->index);
+	h->index = index;
+	h->index_size = size;
+
+	/* Removed entries stay in the index, so that setting them again revives them */
+	for (i = 0; i < h->nentries; i++) {
+		e = &h->entries[i];
+		*_nvram_slot(h, e->name, e->hash) = i + 1;
+	}
+
+	return 0;
 }
 
-/* (Re)allocate NVRAM tuples. */
-static nvram_tuple_t * _nvram_realloc( nvram_handle_t *h, nvram_tuple_t *t,
-	const char *name, const char *value )
+/* Look up an entry, including removed ones. */
+static nvram_entry_t * _nvram_find(nvram_handle_t *h, const char *name)
 {
-	if ((strlen(value) + 1) > NVRAM_SPACE)
+	uint32_t *slot;
+
+	if (!h->index_size)
 		return NULL;
 
-	if (!t) {
-		if (!(t = malloc(sizeof(nvram_tuple_t) + strlen(name) + 1)))
-			return NULL;
+	slot = _nvram_slot(h, name, hash(name));
 
-		/* Copy name */
-		t->name = (char *) &t[1];
-		strcpy(t->name, name);
+	return *slot ? &h->entries[*slot - 1] : NULL;
+}
 
-		t->value = NULL;
-	}
+/* Entry n changed, everything from there on needs to be written again. */
+static void _nvram_dirty(nvram_handle_t *h, uint32_t n)
+{
+	if (h->clean > n)
+		h->clean = n;
 
-	/* Copy value */
-	if (!t->value || strcmp(t->value, value))
-	{
-		if(!(t->value = (char *) realloc(t->value, strlen(value)+1)))
-			return NULL;
+	if (h->crc_known > n)
+		h->crc_known = n;
+}
+
+/* Store a name/value pair. If copy is zero, both strings are used as-is. */
+static int _nvram_store(nvram_handle_t *h, const char *name,
+	const char *value, int copy)
+{
+	uint32_t hv, *slot, n;
+	nvram_entry_t *e;
+	size_t len;
+
+	if ((strlen(value) + 1) > NVRAM_SPACE)
+		return -12; /* -ENOMEM */
+
+	if (_nvram_reserve(h))
+		return -12; /* -ENOMEM */
+
+	hv = hash(name);
+	slot = _nvram_slot(h, name, hv);
 
-		strcpy(t->value, value);
-		t->value[strlen(value)] = '\0';
+	if (*slot) {
+		n = *slot - 1;
+		e = &h->entries[n];
+
+		if (!e->removed && !strcmp(e->value, value))
+			return 0;
+
+		/* Reuse the old value's storage if the new value fits, value may
+		 * point into it (e.g. a suffix of the old value) */
+		len = strlen(value);
+		if (!e->removed && (len <= strlen(e->value)))
+			memmove(e->value, value, len + 1);
+		else if (!copy)
+			e->value = (char *) value;
+		else if (!(e->value = _nvram_strdup(h, value)))
+			return -12; /* -ENOMEM */
+
+		e->removed = 0;
+		_nvram_dirty(h, n);
+
+		return 0;
 	}
 
-	return t;
+	e = &h->entries[h->nentries];
+	memset(e, 0, sizeof(nvram_entry_t));
+
+	e->hash  = hv;
+	e->name  = (char *) name;
+	e->value = (char *) value;
+
+	if (copy && (!(e->name  = _nvram_strdup(h, name)) ||
+	             !(e->value = _nvram_strdup(h, value))))
+		return -12; /* -ENOMEM */
+
+	*slot = ++h->nentries;
+
+	return 0;
 }
 
-/* (Re)initialize the hash table. */
-static int _nvram_rehash(nvram_handle_t *h)
+/* (Re)initialize the entry table from the mapped NVRAM area. */
+static int _nvram_load(nvram_handle_t *h)
 {
 	nvram_header_t *header = nvram_header(h);
-	char buf[] = "0xXXXXXXXX", *name, *value, *eq;
+	char buf[] = "0xXXXXXXXX", *data, *name, *value, *eq;
+	nvram_arena_t *a;
+	uint32_t len;
 
-	/* (Re)initialize hash table */
 	_nvram_free(h);
 
-	/* Parse and set "name=value\0 ... \0\0" */
-	name = (char *) &header[1];
+	len = header->len;
+	if (len < sizeof(nvram_header_t) || len > NVRAM_SPACE)
+		len = NVRAM_SPACE;
+	len -= sizeof(nvram_header_t);
+
+	/* Copy the whole data area once, tuples point into the copy */
+	if (!(a = _nvram_arena_grow(h, len + 2)))
+		return -12; /* -ENOMEM */
+
+	data = a->data;
+	memcpy(data, &header[1], len);
+	data[len] = data[len + 1] = '\0';
+	a->used = len + 2;
 
-	for (; *name; name = value + strlen(value) + 1) {
+	/* Everything parsed from flash is serialized in place already */
+	h->clean = (uint32_t) -1;
+
+	/* Parse and set "name=value\0 ... \0\0" */
+	for (name = data; *name; name = value + strlen(value) + 1) {
 		if (!(eq = strchr(name, '=')))
 			break;
 		*eq = '\0';
 		value = eq + 1;
-		nvram_set(h, name, value);
-		*eq = '=';
+		if (_nvram_store(h, name, value, 0))
+			return -12; /* -ENOMEM */
+
+		if (h->clean == (uint32_t) -1)
+			h->entries[h->nentries - 1].end =
+				value + strlen(value) + 1 - data;
 	}
 
+	if (h->clean > h->nentries)
+		h->clean = h->nentries;
+
 	/* Set special SDRAM parameters */
 	if (!nvram_get(h, "sdram_init")) {
 		sprintf(buf, "0x%04X", (uint16_t)(header->crc_ver_init >> 16));
@@ -134,6 +291,15 @@ static int _nvram_rehash(nvram_handle_t *h)
 	return 0;
 }
 
+/* Flush a range of the mapping, msync() wants a page aligned start. */
+static void _nvram_sync(char *start, char *end)
+{
+	uintptr_t mask = sysconf(_SC_PAGESIZE) - 1;
+	char *page = (char *) ((uintptr_t) start & ~mask);
+
+	msync(page, end - page, MS_SYNC);
+}
+
 
 /*
  * -- Public functions --
@@ -148,80 +314,34 @@ nvram_header_t * nvram_header(nvram_handle_t *h)
 /* Get the value of an NVRAM variable. */
 char * nvram_get(nvram_handle_t *h, const char *name)
 {
-	uint32_t i;
-	nvram_tuple_t *t;
-	char *value;
+	nvram_entry_t *e;
 
 	if (!name)
 		return NULL;
 
-	/* Hash the name */
-	i = hash(name) % NVRAM_ARRAYSIZE(h->nvram_hash);
-
-	/* Find the associated tuple in the hash table */
-	for (t = h->nvram_hash[i]; t && strcmp(t->name, name); t = t->next);
-
-	value = t ? t->value : NULL;
+	e = _nvram_find(h, name);
 
-	return value;
+	return (e && !e->removed) ? e->value : NULL;
 }
 
 /* Set the value of an NVRAM variable. */
 int nvram_set(nvram_handle_t *h, const char *name, const char *value)
 {
-	uint32_t i;
-	nvram_tuple_t *t, *u, **prev;
-
-	/* Hash the name */
-	i = hash(name) % NVRAM_ARRAYSIZE(h->nvram_hash);
-
-	/* Find the associated tuple in the hash table */
-	for (prev = &h->nvram_hash[i], t = *prev;
-		 t && strcmp(t->name, name); prev = &t->next, t = *prev);
-
-	/* (Re)allocate tuple */
-	if (!(u = _nvram_realloc(h, t, name, value)))
-		return -12; /* -ENOMEM */
-
-	/* Value reallocated */
-	if (t && t == u)
-		return 0;
-
-	/* Move old tuple to the dead table */
-	if (t) {
-		*prev = t->next;
-		t->next = h->nvram_dead;
-		h->nvram_dead = t;
-	}
-
-	/* Add new tuple to the hash table */
-	u->next = h->nvram_hash[i];
-	h->nvram_hash[i] = u;
-
-	return 0;
+	return _nvram_store(h, name, value, 1);
 }
 
 /* Unset the value of an NVRAM variable. */
 int nvram_unset(nvram_handle_t *h, const char *name)
 {
-	uint32_t i;
-	nvram_tuple_t *t, **prev;
+	nvram_entry_t *e;
 
 	if (!name)
 		return 0;
 
-	/* Hash the name */
-	i = hash(name) % NVRAM_ARRAYSIZE(h->nvram_hash);
-
-	/* Find the associated tuple in the hash table */
-	for (prev = &h->nvram_hash[i], t = *prev;
-		 t && strcmp(t->name, name); prev = &t->next, t = *prev);
-
-	/* Move it to the dead table */
-	if (t) {
-		*prev = t->next;
-		t->next = h->nvram_dead;
-		h->nvram_dead = t;
+	/* Keep a tombstone, the entry still occupies its index slot */
+	if ((e = _nvram_find(h, name)) != NULL && !e->removed) {
+		e->removed = 1;
+		_nvram_dirty(h, e - h->entries);
 	}
 
 	return 0;
@@ -230,40 +350,55 @@ int nvram_unset(nvram_handle_t *h, const char *name)
 /* Get all NVRAM variables. */
 nvram_tuple_t * nvram_getall(nvram_handle_t *h)
 {
-	int i;
-	nvram_tuple_t *t, *l, *x;
+	uint32_t i;
+	nvram_tuple_t *l, *x;
+	nvram_entry_t *e;
 
 	l = NULL;
 
-	for (i = 0; i < NVRAM_ARRAYSIZE(h->nvram_hash); i++) {
-		for (t = h->nvram_hash[i]; t; t = t->next) {
-			if( (x = (nvram_tuple_t *) malloc(sizeof(nvram_tuple_t))) != NULL )
-			{
-				x->name  = t->name;
-				x->value = t->value;
-				x->next  = l;
-				l = x;
-			}
-			else
-			{
-				break;
-			}
+	for (i = 0; i < h->nentries; i++) {
+		e = &h->entries[i];
+		if (e->removed)
+			continue;
+
+		if( (x = (nvram_tuple_t *) malloc(sizeof(nvram_tuple_t))) != NULL )
+		{
+			x->name  = e->name;
+			x->value = e->value;
+			x->next  = l;
+			l = x;
+		}
+		else
+		{
+			break;
 		}
 	}
 
 	return l;
 }
 
-/* Regenerate NVRAM. */
+/*
+ * Regenerate NVRAM.
+ *
+ * Tuples are serialized in the order they were loaded or added. Only the
+ * part of the data area following the first changed tuple is rewritten,
+ * and the CRC8 state after each tuple is kept so that the checksum of an
+ * unchanged prefix does not have to be computed again.
+ */
 int nvram_commit(nvram_handle_t *h)
 {
 	nvram_header_t *header = nvram_header(h);
 	char *init, *config, *refresh, *ncdl;
-	char *ptr, *end;
-	int i;
-	nvram_tuple_t *t;
+	char *data, *ptr, *end, *dirty, *tail;
+	uint32_t i, first, old_len, len, nlen, vlen;
+	nvram_entry_t *e;
 	nvram_header_t tmp;
 	uint8_t crc;
+	int ret = 0;
+
+	old_len = header->len;
+	if (old_len < sizeof(nvram_header_t) || old_len > NVRAM_SPACE)
+		old_len = NVRAM_SPACE;
 
 	/* Regenerate header */
 	header->magic = NVRAM_MAGIC;
@@ -283,55 +418,90 @@ int nvram_commit(nvram_handle_t *h)
 		header->config_ncdl = strtoul(ncdl, NULL, 0);
 	}
 
-	/* Clear data area */
-	ptr = (char *) header + sizeof(nvram_header_t);
-	memset(ptr, 0xFF, NVRAM_SPACE - sizeof(nvram_header_t));
+	/* Little-endian CRC8 over the last 11 bytes of the header */
 	memset(&tmp, 0, sizeof(nvram_header_t));
+	tmp.crc_ver_init   = header->crc_ver_init;
+	tmp.config_refresh = header->config_refresh;
+	tmp.config_ncdl    = header->config_ncdl;
+	crc = hndcrc8((unsigned char *) &tmp + NVRAM_CRC_START_POSITION,
+		sizeof(nvram_header_t) - NVRAM_CRC_START_POSITION, 0xff);
+
+	/* Cached CRC states depend on the header bytes */
+	if (crc != h->crc_header) {
+		h->crc_header = crc;
+		h->crc_known = 0;
+	}
+
+	data = (char *) &header[1];
 
 	/* Leave space for a double NUL at the end */
 	end = (char *) header + NVRAM_SPACE - 2;
 
-	/* Write out all tuples */
-	for (i = 0; i < NVRAM_ARRAYSIZE(h->nvram_hash); i++) {
-		for (t = h->nvram_hash[i]; t; t = t->next) {
-			if ((ptr + strlen(t->name) + 1 + strlen(t->value) + 1) > end)
-				break;
-			ptr += sprintf(ptr, "%s=%s", t->name, t->value) + 1;
+	/* Resume at the first tuple that is either changed or lacks a CRC state */
+	first = (h->clean < h->crc_known) ? h->clean : h->crc_known;
+	if (first) {
+		ptr = data + h->entries[first - 1].end;
+		crc = h->entries[first - 1].crc;
+	} else {
+		ptr = data;
+	}
+	dirty = data + (h->clean ? h->entries[h->clean - 1].end : 0);
+
+	/* Write out all changed tuples */
+	for (i = first; i < h->nentries; i++) {
+		e = &h->entries[i];
+		tail = ptr;
+
+		if (!e->removed) {
+			if (i < h->clean) {
+				ptr = data + e->end;
+			} else {
+				nlen = strlen(e->name);
+				vlen = strlen(e->value);
+				if ((ptr + nlen + 1 + vlen + 1) > end) {
+					ret = -28; /* -ENOSPC */
+					break;
+				}
+
+				memcpy(ptr, e->name, nlen);
+				ptr[nlen] = '=';
+				memcpy(ptr + nlen + 1, e->value, vlen + 1);
+				ptr += nlen + 1 + vlen + 1;
+			}
+
+			crc = hndcrc8((unsigned char *) tail, ptr - tail, crc);
 		}
+
+		e->end = ptr - data;
+		e->crc = crc;
 	}
 
+	h->clean = h->crc_known = i;
+
 	/* End with a double NULL and pad to 4 bytes */
-	*ptr = '\0';
-	ptr++;
+	tail = ptr;
+	*ptr++ = '\0';
 
-	if( (int)ptr % 4 )
-		memset(ptr, 0, 4 - ((int)ptr % 4));
+	len = NVRAM_ROUNDUP(ptr + 1 - (char *) header, 4);
+	memset(ptr, 0, (char *) header + len - ptr);
 
-	ptr++;
+	/* Clear what is left of the previous contents */
+	if (old_len > len)
+		memset((char *) header + len, 0xFF, old_len - len);
 
 	/* Set new length */
-	header->len = NVRAM_ROUNDUP(ptr - (char *) header, 4);
+	header->len = len;
 
-	/* Little-endian CRC8 over the last 11 bytes of the header */
-	tmp.crc_ver_init   = header->crc_ver_init;
-	tmp.config_refresh = header->config_refresh;
-	tmp.config_ncdl    = header->config_ncdl;
-	crc = hndcrc8((unsigned char *) &tmp + NVRAM_CRC_START_POSITION,
-		sizeof(nvram_header_t) - NVRAM_CRC_START_POSITION, 0xff);
-
-	/* Continue CRC8 over data bytes */
-	crc = hndcrc8((unsigned char *) &header[0] + sizeof(nvram_header_t),
-		header->len - sizeof(nvram_header_t), crc);
-
-	/* Set new CRC8 */
+	/* Continue CRC8 over the terminating bytes and set it */
+	crc = hndcrc8((unsigned char *) tail, (char *) header + len - tail, crc);
 	header->crc_ver_init |= crc;
 
-	/* Write out */
-	msync(h->mmap, h->length, MS_SYNC);
+	/* Write out the header and the rewritten part of the data area */
+	_nvram_sync((char *) header, data);
+	_nvram_sync(dirty, (char *) header + ((len > old_len) ? len : old_len));
 	fsync(h->fd);
 
-	/* Reinitialize hash table */
-	return _nvram_rehash(h);
+	return ret;
 }
 
 /* Open NVRAM and obtain a handle. */
@@ -375,9 +545,15 @@ nvram_handle_t * nvram_open(const char *file, int rdonly)
 
 				if( header->magic == NVRAM_MAGIC )
 				{
-					_nvram_rehash(h);
-					free(mtd);
-					return h;
+					if( _nvram_load(h) == 0 )
+					{
+						free(mtd);
+						return h;
+					}
+
+					_nvram_free(h);
+					munmap(h->mmap, h->length);
+					free(h);
 				}
 				else
 				{
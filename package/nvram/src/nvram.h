@@ -43,17 +43,42 @@ struct nvram_tuple {
 	struct nvram_tuple *next;
 };
 
+struct nvram_entry {
+	char *name;
+	char *value;
+	uint32_t hash;
+	uint32_t end;		/* end offset in the data area at the last commit */
+	uint8_t crc;		/* crc8 state after this entry at the last commit */
+	uint8_t removed;
+};
+
+struct nvram_arena {
+	struct nvram_arena *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
 struct nvram_handle {
 	int fd;
 	char *mmap;
 	unsigned long length;
-	struct nvram_tuple *nvram_hash[257];
-	struct nvram_tuple *nvram_dead;
+	struct nvram_entry *entries;	/* in serialization order */
+	uint32_t nentries;
+	uint32_t entries_size;
+	uint32_t *index;		/* open addressing, entry number + 1 */
+	uint32_t index_size;
+	uint32_t clean;		/* leading entries unchanged since the last commit */
+	uint32_t crc_known;	/* leading entries with a valid crc state */
+	uint8_t crc_header;
+	struct nvram_arena *arena;
 };
 
 typedef struct nvram_handle nvram_handle_t;
 typedef struct nvram_header nvram_header_t;
 typedef struct nvram_tuple  nvram_tuple_t;
+typedef struct nvram_entry  nvram_entry_t;
+typedef struct nvram_arena  nvram_arena_t;
 
 
 /* Get nvram header. */
@@ -119,5 +144,9 @@ char * nvram_find_staging(void);
 
 #define NVRAM_CRC_START_POSITION	9 /* magic, len, crc8 to be skipped */
 
+/* Lookup table constants */
+#define NVRAM_INDEX_MIN		256
+#define NVRAM_ARENA_CHUNK	4096
+
 
 #endif /* _nvram_h_ */
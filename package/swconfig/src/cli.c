@@ -36,7 +36,8 @@
 enum {
 	GET,
 	SET,
-	LOAD
+	LOAD,
+	SHOW
 };
 
 static void
@@ -79,16 +80,73 @@ list_attributes(struct switch_dev *dev)
 	print_attrs(dev->port_ops);
 }
 
+struct show_state {
+	int atype;
+	int port_vlan;
+};
+
+static void
+show_val(struct switch_dev *dev, struct switch_val *val, void *arg)
+{
+	struct show_state *s = arg;
+	struct switch_attr *a = val->attr;
+	int i;
+
+	if ((a->atype != s->atype) || (val->port_vlan != s->port_vlan)) {
+		s->atype = a->atype;
+		s->port_vlan = val->port_vlan;
+		switch(a->atype) {
+		case SWLIB_ATTR_GROUP_GLOBAL:
+			printf("Global attributes:\n");
+			break;
+		case SWLIB_ATTR_GROUP_PORT:
+			printf("Port %d:\n", val->port_vlan);
+			break;
+		case SWLIB_ATTR_GROUP_VLAN:
+			printf("VLAN %d:\n", val->port_vlan);
+			break;
+		}
+	}
+
+	printf("\t%s: ", a->name);
+	switch(a->type) {
+	case SWITCH_TYPE_INT:
+		printf("%d", val->value.i);
+		break;
+	case SWITCH_TYPE_STRING:
+		printf("%s", val->value.s);
+		break;
+	case SWITCH_TYPE_PORTS:
+		for(i = 0; i < val->len; i++)
+			printf("%s%d%s", i ? " " : "", val->value.ports[i].id,
+				(val->value.ports[i].flags & SWLIB_PORT_FLAG_TAGGED) ? "t" : "");
+		break;
+	}
+	printf("\n");
+}
+
+static int
+show_attributes(struct switch_dev *dev)
+{
+	struct show_state s = {
+		.atype = -1,
+		.port_vlan = -1,
+	};
+
+	return swlib_dump_attrs(dev, show_val, &s);
+}
+
 static void
 print_usage(void)
 {
-	printf("swconfig dev <dev> [port <port>|vlan <vlan>] (help|set <key> <value>|get <key>|load <config>)\n");
+	printf("swconfig dev <dev> [port <port>|vlan <vlan>] (help|show|set <key> <value>|get <key>|load <config> [timing])\n");
 	exit(1);
 }
 
 static void
-swconfig_load_uci(struct switch_dev *dev, const char *name)
+swconfig_load_uci(struct switch_dev *dev, const char *name, int timing)
 {
+	struct swlib_apply_stats stats;
 	struct uci_context *ctx;
 	struct uci_package *p = NULL;
 	struct uci_element *e;
@@ -104,9 +162,13 @@ swconfig_load_uci(struct switch_dev *dev, const char *name)
 		goto out;
 	}
 
-	ret = swlib_apply_from_uci(dev, p);
+	ret = swlib_apply_from_uci(dev, p, &stats);
 	if (ret < 0)
 		fprintf(stderr, "Failed to apply configuration for switch '%s'\n", dev->dev_name);
+	else if (timing)
+		fprintf(stderr, "Applied %d of %d settings (%d failed) in %lu.%03lu ms\n",
+			stats.changed, stats.settings, stats.failed,
+			stats.usec / 1000, stats.usec % 1000);
 
 out:
 	uci_free_context(ctx);
@@ -131,6 +193,7 @@ int main(int argc, char **argv)
 	char *ckey = NULL;
 	char *cvalue = NULL;
 	int chelp = 0;
+	int ctiming = 0;
 
 	if(argc < 4)
 		print_usage();
@@ -147,6 +210,13 @@ int main(int argc, char **argv)
 			chelp = 1;
 			continue;
 		}
+		if (!strcmp(argv[i], "show")) {
+			/* only as the last argument, instead of another command */
+			if ((cport >= 0) || (cvlan >= 0) || ckey || (i + 1 < argc))
+				print_usage();
+			cmd = SHOW;
+			continue;
+		}
 		if( i + 1 >= argc)
 			print_usage();
 		p = atoi(argv[i + 1]);
@@ -173,6 +243,10 @@ int main(int argc, char **argv)
 
 			ckey = argv[i + 1];
 			cmd = LOAD;
+			if ((i + 2 < argc) && !strcmp(argv[i + 2], "timing")) {
+				ctiming = 1;
+				i++;
+			}
 		} else {
 			print_usage();
 		}
@@ -198,7 +272,7 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	if (cmd != LOAD) {
+	if ((cmd != LOAD) && (cmd != SHOW)) {
 		if(cport > -1)
 			a = swlib_lookup_attr(dev, SWLIB_ATTR_GROUP_PORT, ckey);
 		else if(cvlan > -1)
@@ -256,7 +330,14 @@ int main(int argc, char **argv)
 		}
 		break;
 	case LOAD:
-		swconfig_load_uci(dev, ckey);
+		swconfig_load_uci(dev, ckey, ctiming);
+		break;
+	case SHOW:
+		if (show_attributes(dev) < 0) {
+			fprintf(stderr, "failed\n");
+			retval = -1;
+			goto out;
+		}
 		break;
 	}
 
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <getopt.h>
 #include <sys/types.h>
@@ -28,6 +29,8 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
 
+#define SWLIB_BATCH_WINDOW	64
+
 //#define DEBUG 1
 #ifdef DEBUG
 #define DPRINTF(fmt, ...) fprintf(stderr, "%s(%d): " fmt, __func__, __LINE__, ##__VA_ARGS__)
@@ -36,7 +39,6 @@
 #endif
 
 static struct nl_sock *handle;
-static struct nl_cache *cache;
 static struct genl_family *family;
 static struct nlattr *tb[SWITCH_ATTR_MAX];
 static int refcount = 0;
@@ -71,13 +73,12 @@ wait_handler(struct nl_msg *msg, void *arg)
 
 /* helper function for performing netlink requests */
 static int
-swlib_call(int cmd, int (*call)(struct nl_msg *, void *),
+swlib_request(int cmd, int flags, int (*call)(struct nl_msg *, void *),
 		int (*data)(struct nl_msg *, void *), void *arg)
 {
 	struct nl_msg *msg;
 	struct nl_cb *cb = NULL;
 	int finished;
-	int flags = 0;
 	int err;
 
 	msg = nlmsg_alloc();
@@ -86,9 +87,6 @@ swlib_call(int cmd, int (*call)(struct nl_msg *, void *),
 		exit(1);
 	}
 
-	if (!data)
-		flags |= NLM_F_DUMP;
-
 	genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family_get_id(family), 0, flags, cmd, 0);
 	if (data) {
 		if (data(msg, arg) < 0)
@@ -112,10 +110,10 @@ swlib_call(int cmd, int (*call)(struct nl_msg *, void *),
 	if (call)
 		nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, call, arg);
 
-	if (data)
-		nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wait_handler, &finished);
-	else
+	if (flags & NLM_F_DUMP)
 		nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, wait_handler, &finished);
+	else
+		nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wait_handler, &finished);
 
 	err = nl_recvmsgs(handle, cb);
 	if (err < 0) {
@@ -133,6 +131,13 @@ nla_put_failure:
 	return err;
 }
 
+static int
+swlib_call(int cmd, int (*call)(struct nl_msg *, void *),
+		int (*data)(struct nl_msg *, void *), void *arg)
+{
+	return swlib_request(cmd, data ? 0 : NLM_F_DUMP, call, data, arg);
+}
+
 static int
 send_attr(struct nl_msg *msg, void *arg)
 {
@@ -346,49 +351,361 @@ swlib_set_attr(struct switch_dev *dev, struct switch_attr *attr, struct switch_v
 	return swlib_call(cmd, NULL, send_attr_val, val);
 }
 
-int swlib_set_attr_string(struct switch_dev *dev, struct switch_attr *a, int port_vlan, const char *str)
+int swlib_parse_attr_string(struct switch_dev *dev, struct switch_attr *a,
+		int port_vlan, const char *str, struct switch_val *val)
 {
 	struct switch_port *ports;
-	struct switch_val val;
 	char *ptr;
 
-	memset(&val, 0, sizeof(val));
-	val.port_vlan = port_vlan;
+	memset(val, 0, sizeof(*val));
+	val->attr = a;
+	val->port_vlan = port_vlan;
 	switch(a->type) {
 	case SWITCH_TYPE_INT:
-		val.value.i = atoi(str);
+		val->value.i = atoi(str);
 		break;
 	case SWITCH_TYPE_STRING:
-		val.value.s = str;
+		val->value.s = str;
 		break;
 	case SWITCH_TYPE_PORTS:
-		ports = alloca(sizeof(struct switch_port) * dev->ports);
-		memset(ports, 0, sizeof(struct switch_port) * dev->ports);
-		val.len = 0;
+		ports = swlib_alloc(sizeof(struct switch_port) * dev->ports);
+		if (!ports)
+			return -ENOMEM;
 		ptr = (char *)str;
-		while(ptr && *ptr)
+		while(ptr && *ptr && val->len < dev->ports)
 		{
-			ports[val.len].flags = 0;
-			ports[val.len].id = strtoul(ptr, &ptr, 10);
+			ports[val->len].flags = 0;
+			ports[val->len].id = strtoul(ptr, &ptr, 10);
 			while(*ptr && !isspace(*ptr)) {
 				if (*ptr == 't')
-					ports[val.len].flags |= SWLIB_PORT_FLAG_TAGGED;
+					ports[val->len].flags |= SWLIB_PORT_FLAG_TAGGED;
 				ptr++;
 			}
 			if (*ptr)
 				ptr++;
-			val.len++;
+			val->len++;
 		}
-		val.value.ports = ports;
+		val->value.ports = ports;
 		break;
 	case SWITCH_TYPE_NOVAL:
 		break;
 	default:
 		return -1;
 	}
-	return swlib_set_attr(dev, a, &val);
+	return 0;
 }
 
+int swlib_set_attr_string(struct switch_dev *dev, struct switch_attr *a, int port_vlan, const char *str)
+{
+	struct switch_val val;
+	int err;
+
+	err = swlib_parse_attr_string(dev, a, port_vlan, str, &val);
+	if (err < 0)
+		return err;
+
+	err = swlib_set_attr(dev, a, &val);
+	if (a->type == SWITCH_TYPE_PORTS)
+		free(val.value.ports);
+
+	return err;
+}
+
+static int
+swlib_attr_cmd(struct switch_attr *attr, int set)
+{
+	switch(attr->atype) {
+	case SWLIB_ATTR_GROUP_GLOBAL:
+		return set ? SWITCH_CMD_SET_GLOBAL : SWITCH_CMD_GET_GLOBAL;
+	case SWLIB_ATTR_GROUP_PORT:
+		return set ? SWITCH_CMD_SET_PORT : SWITCH_CMD_GET_PORT;
+	case SWLIB_ATTR_GROUP_VLAN:
+		return set ? SWITCH_CMD_SET_VLAN : SWITCH_CMD_GET_VLAN;
+	default:
+		return -EINVAL;
+	}
+}
+
+struct swlib_batch {
+	struct switch_val **vals;
+	int n;
+	int set;
+	uint32_t seq;		/* sequence number of the first request */
+	int completed;
+};
+
+static struct switch_val *
+batch_lookup(struct swlib_batch *b, uint32_t seq)
+{
+	uint32_t i = seq - b->seq;
+
+	if (i >= b->n)
+		return NULL;
+
+	return b->vals[i];
+}
+
+static void
+batch_complete(struct swlib_batch *b, struct switch_val *val, int err)
+{
+	if (!val || (val->err != -EINPROGRESS))
+		return;
+
+	val->err = err;
+	b->completed++;
+}
+
+static int
+batch_seq_check(struct nl_msg *msg, void *arg)
+{
+	/* replies are matched to requests by sequence number instead */
+	return NL_OK;
+}
+
+static int
+batch_valid(struct nl_msg *msg, void *arg)
+{
+	struct swlib_batch *b = arg;
+	struct switch_val *val = batch_lookup(b, nlmsg_hdr(msg)->nlmsg_seq);
+
+	if (!val || b->set)
+		return NL_SKIP;
+
+	/* store_val resets val->err, keep the request pending until the ack */
+	store_val(msg, val);
+	val->err = -EINPROGRESS;
+
+	return NL_SKIP;
+}
+
+static int
+batch_ack(struct nl_msg *msg, void *arg)
+{
+	struct swlib_batch *b = arg;
+
+	batch_complete(b, batch_lookup(b, nlmsg_hdr(msg)->nlmsg_seq), 0);
+	return NL_OK;
+}
+
+static int
+batch_error(struct sockaddr_nl *nla, struct nlmsgerr *e, void *arg)
+{
+	struct swlib_batch *b = arg;
+
+	batch_complete(b, batch_lookup(b, e->msg.nlmsg_seq), e->error);
+	return NL_SKIP;
+}
+
+/*
+ * Send a series of get or set requests without waiting for the individual
+ * replies. Up to SWLIB_BATCH_WINDOW requests are kept in flight, so that
+ * the acks do not overrun the socket receive buffer.
+ */
+static int
+swlib_call_batch(struct switch_val **vals, int n, int set)
+{
+	struct swlib_batch b;
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	int sent = 0, limit = n;
+	int err = 0, send_err = 0, ret = 0;
+	int i, cmd;
+
+	if (!n)
+		return 0;
+
+	cb = nl_cb_alloc(NL_CB_CUSTOM);
+	if (!cb) {
+		fprintf(stderr, "nl_cb_alloc failed.\n");
+		exit(1);
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.vals = vals;
+	b.n = n;
+	b.set = set;
+
+	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, batch_seq_check, &b);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, batch_valid, &b);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, batch_ack, &b);
+	nl_cb_err(cb, NL_CB_CUSTOM, batch_error, &b);
+
+	for (i = 0; i < n; i++) {
+		vals[i]->err = -EINPROGRESS;
+		if (!set) {
+			memset(&vals[i]->value, 0, sizeof(vals[i]->value));
+			vals[i]->len = 0;
+		}
+	}
+
+	while (b.completed < sent || sent < limit) {
+		while ((sent < limit) && (sent - b.completed < SWLIB_BATCH_WINDOW)) {
+			struct switch_val *val = vals[sent];
+
+			cmd = swlib_attr_cmd(val->attr, set);
+			msg = nlmsg_alloc();
+			if (!msg) {
+				fprintf(stderr, "Out of memory!\n");
+				exit(1);
+			}
+
+			genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, genl_family_get_id(family), 0, 0, cmd, 0);
+			if ((cmd < 0) || ((set ? send_attr_val : send_attr)(msg, val) < 0))
+				ret = -EINVAL;
+			else
+				ret = nl_send_auto_complete(handle, msg);
+
+			if (!sent)
+				b.seq = nlmsg_hdr(msg)->nlmsg_seq;
+			nlmsg_free(msg);
+
+			if (ret < 0) {
+				/* stop sending, but collect the replies already in flight */
+				fprintf(stderr, "Failed to send request: %d\n", ret);
+				send_err = ret;
+				limit = sent;
+				break;
+			}
+			sent++;
+		}
+
+		if (b.completed == sent)
+			break;
+
+		ret = nl_recvmsgs(handle, cb);
+		if (ret < 0) {
+			err = ret;
+			goto out;
+		}
+	}
+
+	/* report the first failed request */
+	for (i = 0; i < n; i++) {
+		if (i >= sent)
+			vals[i]->err = send_err;
+
+		if (vals[i]->err && !err)
+			err = vals[i]->err;
+	}
+
+out:
+	nl_cb_put(cb);
+	return err;
+}
+
+int
+swlib_get_attr_batch(struct switch_dev *dev, struct switch_val **vals, int n)
+{
+	return swlib_call_batch(vals, n, 0);
+}
+
+int
+swlib_set_attr_batch(struct switch_dev *dev, struct switch_val **vals, int n)
+{
+	return swlib_call_batch(vals, n, 1);
+}
+
+struct dump_arg {
+	struct switch_dev *dev;
+	swlib_dump_cb cb;
+	void *arg;
+	struct switch_port *ports;
+};
+
+static int
+add_dev_id(struct nl_msg *msg, void *arg)
+{
+	struct dump_arg *d = arg;
+
+	NLA_PUT_U32(msg, SWITCH_ATTR_ID, d->dev->id);
+
+	return 0;
+nla_put_failure:
+	return -1;
+}
+
+static struct switch_attr *
+lookup_attr_id(struct switch_attr *head, int id)
+{
+	while (head && head->id != id)
+		head = head->next;
+
+	return head;
+}
+
+static int
+store_dump_val(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct dump_arg *d = arg;
+	struct switch_attr *head;
+	struct switch_val val;
+
+	if (nla_parse(tb, SWITCH_ATTR_MAX - 1, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), NULL) < 0)
+		goto done;
+
+	if (!tb[SWITCH_ATTR_OP_ID])
+		goto done;
+
+	memset(&val, 0, sizeof(val));
+	switch(gnlh->cmd) {
+	case SWITCH_CMD_GET_GLOBAL:
+		head = d->dev->ops;
+		break;
+	case SWITCH_CMD_GET_PORT:
+		if (!tb[SWITCH_ATTR_OP_PORT])
+			goto done;
+		head = d->dev->port_ops;
+		val.port_vlan = nla_get_u32(tb[SWITCH_ATTR_OP_PORT]);
+		break;
+	case SWITCH_CMD_GET_VLAN:
+		if (!tb[SWITCH_ATTR_OP_VLAN])
+			goto done;
+		head = d->dev->vlan_ops;
+		val.port_vlan = nla_get_u32(tb[SWITCH_ATTR_OP_VLAN]);
+		break;
+	default:
+		goto done;
+	}
+
+	val.attr = lookup_attr_id(head, nla_get_u32(tb[SWITCH_ATTR_OP_ID]));
+	if (!val.attr)
+		goto done;
+
+	val.value.ports = (val.attr->type == SWITCH_TYPE_PORTS) ? d->ports : NULL;
+	store_val(msg, &val);
+	if (!val.err)
+		d->cb(d->dev, &val, d->arg);
+	if (val.attr->type == SWITCH_TYPE_STRING)
+		free((char *) val.value.s);
+
+done:
+	return NL_SKIP;
+}
+
+int
+swlib_dump_attrs(struct switch_dev *dev, swlib_dump_cb cb, void *arg)
+{
+	struct dump_arg d;
+	int err;
+
+	if (swlib_scan(dev) < 0)
+		return -EINVAL;
+
+	d.dev = dev;
+	d.cb = cb;
+	d.arg = arg;
+	d.ports = swlib_alloc(sizeof(struct switch_port) * (dev->ports ? dev->ports : 1));
+	if (!d.ports)
+		return -ENOMEM;
+
+	err = swlib_request(SWITCH_CMD_DUMP_VALUES, NLM_F_DUMP, store_dump_val,
+		add_dev_id, &d);
+	free(d.ports);
+
+	return err;
+}
 
 struct attrlist_arg {
 	int id;
@@ -507,19 +824,17 @@ struct switch_attr *swlib_lookup_attr(struct switch_dev *dev,
 static void
 swlib_priv_free(void)
 {
-	if (cache)
-		nl_cache_free(cache);
+	if (family)
+		genl_family_put(family);
 	if (handle)
 		nl_socket_free(handle);
 	handle = NULL;
-	cache = NULL;
+	family = NULL;
 }
 
 static int
 swlib_priv_init(void)
 {
-	int ret;
-
 	handle = nl_socket_alloc();
 	if (!handle) {
 		DPRINTF("Failed to create handle\n");
@@ -531,13 +846,10 @@ swlib_priv_init(void)
 		goto err;
 	}
 
-	ret = genl_ctrl_alloc_cache(handle, &cache);
-	if (ret < 0) {
-		DPRINTF("Failed to allocate netlink cache\n");
-		goto err;
-	}
+	/* only used for request/reply, dumps can be read ahead */
+	nl_socket_enable_batch_recv(handle);
 
-	family = genl_ctrl_search_by_name(cache, "switch");
+	family = genl_ctrl_probe_by_name(handle, "switch");
 	if (!family) {
 		DPRINTF("Switch API not present\n");
 		goto err;
@@ -211,6 +211,19 @@ int swlib_set_attr(struct switch_dev *dev, struct switch_attr *attr,
 int swlib_set_attr_string(struct switch_dev *dev, struct switch_attr *attr,
 		int port_vlan, const char *str);
 
+/**
+ * swlib_parse_attr_string: convert a string to an attribute value
+ * @dev: switch device struct
+ * @attr: switch attribute struct
+ * @port_vlan: port or vlan (if applicable)
+ * @str: string value
+ * @val: attribute value to fill in
+ * returns 0 on success
+ * for port list attributes, val->value.ports must be freed by the caller
+ */
+int swlib_parse_attr_string(struct switch_dev *dev, struct switch_attr *attr,
+		int port_vlan, const char *str, struct switch_val *val);
+
 /**
  * swlib_get_attr: get the value for an attribute
  * @dev: switch device struct
@@ -222,11 +235,62 @@ int swlib_set_attr_string(struct switch_dev *dev, struct switch_attr *attr,
 int swlib_get_attr(struct switch_dev *dev, struct switch_attr *attr,
 		struct switch_val *val);
 
+/**
+ * swlib_get_attr_batch: get the values for a list of attributes
+ * @dev: switch device struct
+ * @vals: attribute values, ->attr and ->port_vlan must be set up
+ * @n: number of values
+ * returns 0 on success, or the error of the first failed request
+ *
+ * all requests are sent without waiting for the individual replies,
+ * the result of each request is stored in vals[i]->err
+ * port lists are allocated for each value and must be freed by the caller
+ */
+int swlib_get_attr_batch(struct switch_dev *dev, struct switch_val **vals, int n);
+
+/**
+ * swlib_set_attr_batch: set the values for a list of attributes
+ * @dev: switch device struct
+ * @vals: attribute values, set up like for swlib_set_attr
+ * @n: number of values
+ * returns 0 on success, or the error of the first failed request
+ *
+ * the requests are processed in order, the result of each request
+ * is stored in vals[i]->err
+ */
+int swlib_set_attr_batch(struct switch_dev *dev, struct switch_val **vals, int n);
+
+typedef void (*swlib_dump_cb)(struct switch_dev *dev, struct switch_val *val, void *arg);
+
+/**
+ * swlib_dump_attrs: read the values of all attributes of a switch at once
+ * @dev: switch device struct
+ * @cb: called for each value in the order global, ports, vlans
+ * @arg: passed on to the callback
+ * returns 0 on success
+ *
+ * the whole state is fetched with a single netlink dump request
+ * instead of one request per attribute, port and vlan.
+ * values passed to the callback are only valid during the call
+ */
+int swlib_dump_attrs(struct switch_dev *dev, swlib_dump_cb cb, void *arg);
+
+struct swlib_apply_stats {
+	int settings;		/* settings found in the configuration */
+	int changed;		/* settings that differed and were written */
+	int failed;
+	unsigned long usec;	/* time taken by the whole apply */
+};
+
 /**
  * swlib_apply_from_uci: set up the switch from a uci configuration
  * @dev: switch device struct
  * @p: uci package which contains the desired global config
+ * @stats: if not NULL, filled with statistics about the apply
+ *
+ * settings which already match the state of the switch are not written
  */
-int swlib_apply_from_uci(struct switch_dev *dev, struct uci_package *p);
+int swlib_apply_from_uci(struct switch_dev *dev, struct uci_package *p,
+		struct swlib_apply_stats *stats);
 
 #endif
@@ -22,6 +22,7 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <uci.h>
 
 #include <linux/types.h>
@@ -100,8 +101,169 @@ skip:
 	}
 }
 
-int swlib_apply_from_uci(struct switch_dev *dev, struct uci_package *p)
+static int
+swlib_ports_equal(struct switch_val *a, struct switch_val *b)
+{
+	int i, j;
+
+	if (a->len != b->len)
+		return 0;
+
+	/* the driver may report the ports in a different order */
+	for (i = 0; i < a->len; i++) {
+		for (j = 0; j < b->len; j++) {
+			if ((a->value.ports[i].id == b->value.ports[j].id) &&
+			    (a->value.ports[i].flags == b->value.ports[j].flags))
+				break;
+		}
+		if (j == b->len)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int
+swlib_val_equal(struct switch_val *a, struct switch_val *b)
+{
+	switch(a->attr->type) {
+	case SWITCH_TYPE_INT:
+		return a->value.i == b->value.i;
+	case SWITCH_TYPE_STRING:
+		return a->value.s && b->value.s && !strcmp(a->value.s, b->value.s);
+	case SWITCH_TYPE_PORTS:
+		return swlib_ports_equal(a, b);
+	default:
+		/* attributes without a value are actions, always run them */
+		return 0;
+	}
+}
+
+static void
+swlib_free_val(struct switch_val *val, int owned_str)
+{
+	switch(val->attr ? val->attr->type : -1) {
+	case SWITCH_TYPE_STRING:
+		if (owned_str)
+			free((char *) val->value.s);
+		break;
+	case SWITCH_TYPE_PORTS:
+		free(val->value.ports);
+		break;
+	}
+}
+
+/*
+ * Read back the current value of every setting, then write only the
+ * settings that differ. Both steps are sent as pipelined batches.
+ *
+ * Writes can change other attributes as a side effect (e.g. setting the
+ * ports of a vlan may rewrite the pvid of its untagged ports), so the
+ * skipped settings are read again afterwards and written if they no
+ * longer match, like a sequential apply would have left them.
+ */
+static void
+swlib_apply_settings(struct switch_dev *dev, struct swlib_apply_stats *stats)
+{
+	struct switch_val *want, *cur, **get, **set;
+	struct swlib_setting *st;
+	int n = 0, n_get = 0, n_set = 0, n_fix = 0;
+	int i;
+
+	for (st = settings; st; st = st->next)
+		n++;
+
+	want = calloc(n, sizeof(struct switch_val));
+	cur = calloc(n, sizeof(struct switch_val));
+	get = calloc(n, sizeof(struct switch_val *));
+	set = calloc(n, sizeof(struct switch_val *));
+	if (!want || !cur || !get || !set) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	for (i = 0, st = settings; st; st = st->next, i++) {
+		if (swlib_parse_attr_string(dev, st->attr, st->port_vlan, st->val, &want[i]) < 0) {
+			want[i].attr = NULL;
+			stats->failed++;
+			continue;
+		}
+
+		cur[i].attr = st->attr;
+		cur[i].port_vlan = st->port_vlan;
+		if (st->attr->type != SWITCH_TYPE_NOVAL)
+			get[n_get++] = &cur[i];
+	}
+
+	/* failed reads just mean that the setting is written unconditionally */
+	swlib_get_attr_batch(dev, get, n_get);
+
+	for (i = 0; i < n; i++) {
+		if (!want[i].attr)
+			continue;
+
+		if (!cur[i].err && swlib_val_equal(&want[i], &cur[i]))
+			continue;
+
+		set[n_set++] = &want[i];
+	}
+
+	swlib_set_attr_batch(dev, set, n_set);
+
+	for (i = 0; i < n_set; i++) {
+		if (set[i]->err)
+			stats->failed++;
+	}
+
+	/* re-read the skipped settings, the writes may have changed them */
+	n_get = 0;
+	for (i = 0; n_set && (i < n); i++) {
+		if (!want[i].attr || (want[i].attr->type == SWITCH_TYPE_NOVAL))
+			continue;
+
+		if (cur[i].err || !swlib_val_equal(&want[i], &cur[i]))
+			continue;
+
+		swlib_free_val(&cur[i], 1);
+		get[n_get++] = &cur[i];
+	}
+
+	swlib_get_attr_batch(dev, get, n_get);
+
+	for (i = 0; i < n_get; i++) {
+		struct switch_val *w = &want[get[i] - cur];
+
+		if (!get[i]->err && swlib_val_equal(w, get[i]))
+			continue;
+
+		set[n_fix++] = w;
+	}
+
+	swlib_set_attr_batch(dev, set, n_fix);
+
+	for (i = 0; i < n_fix; i++) {
+		if (set[i]->err)
+			stats->failed++;
+	}
+
+	stats->settings += n;
+	stats->changed += n_set + n_fix;
+
+	for (i = 0; i < n; i++) {
+		swlib_free_val(&want[i], 0);
+		swlib_free_val(&cur[i], 1);
+	}
+	free(want);
+	free(cur);
+	free(get);
+	free(set);
+}
+
+int swlib_apply_from_uci(struct switch_dev *dev, struct uci_package *p,
+		struct swlib_apply_stats *stats)
 {
+	struct swlib_apply_stats dummy;
+	struct timeval start, end;
 	struct switch_attr *attr;
 	struct uci_context *ctx = p->ctx;
 	struct uci_element *e;
@@ -113,6 +275,11 @@ int swlib_apply_from_uci(struct switch_dev *dev, struct uci_package *p)
 	settings = NULL;
 	head = &settings;
 
+	if (!stats)
+		stats = &dummy;
+	memset(stats, 0, sizeof(*stats));
+	gettimeofday(&start, NULL);
+
 	uci_foreach_element(&p->sections, e) {
 		s = uci_to_section(e);
 
@@ -199,14 +366,18 @@ found:
 		struct swlib_setting *st = &early_settings[i];
 		if (!st->attr || !st->val)
 			continue;
-		swlib_set_attr_string(dev, st->attr, st->port_vlan, st->val);
-
+		stats->settings++;
+		stats->changed++;
+		if (swlib_set_attr_string(dev, st->attr, st->port_vlan, st->val) < 0)
+			stats->failed++;
 	}
 
+	/* the early settings may reset the switch, so read back only now */
+	swlib_apply_settings(dev, stats);
+
 	while (settings) {
 		struct swlib_setting *st = settings;
 
-		swlib_set_attr_string(dev, st->attr, st->port_vlan, st->val);
 		st = st->next;
 		free(settings);
 		settings = st;
@@ -214,11 +385,14 @@ found:
 
 	/* Apply the config */
 	attr = swlib_lookup_attr(dev, SWLIB_ATTR_GROUP_GLOBAL, "apply");
-	if (!attr)
-		return 0;
+	if (attr) {
+		memset(&val, 0, sizeof(val));
+		swlib_set_attr(dev, attr, &val);
+	}
 
-	memset(&val, 0, sizeof(val));
-	swlib_set_attr(dev, attr, &val);
+	gettimeofday(&end, NULL);
+	stats->usec = (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_usec - start.tv_usec);
 
 	return 0;
 }
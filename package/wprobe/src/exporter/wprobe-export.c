@@ -159,24 +159,48 @@ add_template_fields(ipfix_t *handle, ipfix_template_t *t, struct wprobe_mapping
 	g_data.maxfields = f;
 }
 
+struct wprobe_export_data {
+	ipfix_t *ipfixh;
+	ipfix_template_t *ipfixt;
+};
+
+static void
+wprobe_export_link(struct wprobe_iface *dev, struct wprobe_link *link, void *arg)
+{
+	struct wprobe_export_data *d = arg;
+
+	/* the global values are exported along with each link */
+	if (!link)
+		return;
+
+	g_data.addrs[1] = link->addr;
+	ipfix_export_array(d->ipfixh, d->ipfixt, g_data.maxfields, g_data.addrs, g_data.lens);
+	ipfix_export_flush(d->ipfixh);
+}
+
 static void
 wprobe_dump_data(ipfix_t *ipfixh, ipfix_template_t *ipfixt, struct wprobe_iface *dev)
 {
+	struct wprobe_export_data d = {
+		.ipfixh = ipfixh,
+		.ipfixt = ipfixt,
+	};
 	struct wprobe_link *link;
 
-	wprobe_update_links(dev);
-	wprobe_request_data(dev, NULL);
+	if (wprobe_request_all(dev, wprobe_export_link, &d) < 0) {
+		/* kernel module without support for bulk requests */
+		wprobe_update_links(dev);
+		wprobe_request_data(dev, NULL);
+		list_for_each_entry(link, &dev->links, list) {
+			wprobe_request_data(dev, link->addr);
+			wprobe_export_link(dev, link, &d);
+		}
+	}
 	if (list_empty(&dev->links)) {
 		g_data.addrs[1] = link_default;
 		ipfix_export_array(ipfixh, ipfixt, g_data.maxfields, g_data.addrs, g_data.lens);
 		ipfix_export_flush(ipfixh);
 	}
-	list_for_each_entry(link, &dev->links, list) {
-		g_data.addrs[1] = link->addr;
-		wprobe_request_data(dev, link->addr);
-		ipfix_export_array(ipfixh, ipfixt, g_data.maxfields, g_data.addrs, g_data.lens);
-		ipfix_export_flush(ipfixh);
-	}
 }
 
 int main ( int argc, char **argv )
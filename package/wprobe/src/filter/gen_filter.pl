@@ -8,7 +8,7 @@ my $SNR = "radio[10:1]";
 my $DEFAULT = undef;
 
 my $MAGIC = "WPFF";
-my $VERSION = 1; # filter binary format version
+my $VERSION = 2; # filter binary format version
 my $HDRLEN = 3; # assumed storage space for custom fields
 
 my $output = "filter.bin";
@@ -60,4 +60,14 @@ foreach my $groupname (keys %$config) {
 			$? and die "Filter '".$filter->[0]."' did not compile.\n";
 		}
 	}
+
+	# merged program, which evaluates the whole group at once
+	my $args = join(" ", map { "'".escape_q($_->[1] || "")."'" } @$group);
+	open FILTER, "./pfc -m '".escape_q($groupname)."' $args |"
+		or die "Failed to run filter command for group '$groupname': $!\n";
+	while (<FILTER>) {
+		print OUTPUT $_;
+	}
+	close FILTER;
+	$? and die "Group '$groupname' did not compile.\n";
 }
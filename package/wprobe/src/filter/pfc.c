@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,33 +9,67 @@
 #include <pcap.h>
 #include <pcap-bpf.h>
 
+#ifndef BPF_MEMWORDS
+#define BPF_MEMWORDS 16
+#endif
+
+#define MAX_MERGED_INSNS	4096
+
+#define REG_A	(1 << 0)
+#define REG_X	(1 << 1)
+
 struct wprobe_filter_hdr {
 	char name[32];
 	uint32_t len;
 } hdr;
 
-int main (int argc, char ** argv)
+struct merge_item {
+	struct bpf_insn *insns;
+	int len;
+
+	/* index of the item in the group */
+	int idx;
+
+	/* first instruction that is not covered by a previous item */
+	int start;
+
+	/* item that runs the shared instructions and saves the registers */
+	int owner;
+
+	/* registers restored at start */
+	int restore;
+
+	/* registers to save in front of each instruction */
+	unsigned char *save;
+};
+
+struct merge_state {
+	struct merge_item *items;
+	int n_items;
+
+	/* scratch memory slots for the registers saved at a prefix length */
+	int *slot_a;
+	int *slot_x;
+	unsigned int free_slots;
+
+	struct bpf_insn *out;
+	int out_len;
+	int out_size;
+};
+
+static void compile(pcap_t *pc, const char *prog, const char *expr, struct bpf_program *filter)
 {
-    struct  bpf_program filter;
-    pcap_t  *pc;
 	int i;
 
-    if (argc != 3)
-    {
-		fprintf(stderr, "Usage: %s <name> <expression>\n", argv[0]);
-		return 1;
-    }
-
-    pc = pcap_open_dead(DLT_IEEE802_11_RADIO, 256);
-    if (pcap_compile(pc, &filter, argv[2], 1, 0) != 0)
+	if (pcap_compile(pc, filter, expr, 1, 0) != 0)
 	{
-		pcap_perror(pc, argv[0]);
+		pcap_perror(pc, prog);
 		exit(1);
 	}
 
 	/* fix up for linux */
-	for (i = 0; i < filter.bf_len; i++) {
-		struct bpf_insn *bi = &filter.bf_insns[i];
+	for (i = 0; i < filter->bf_len; i++) {
+		struct bpf_insn *bi = &filter->bf_insns[i];
 		switch(BPF_CLASS(bi->code)) {
 		case BPF_RET:
 			if (BPF_MODE(bi->code) == BPF_K) {
@@ -43,15 +78,367 @@ int main (int argc, char ** argv)
 			}
 			break;
 		}
+	}
+}
+
+static void write_item(const char *name, struct bpf_insn *insns, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		struct bpf_insn *bi = &insns[i];
 		bi->code = ntohs(bi->code);
 		bi->k = ntohl(bi->k);
 	}
 
 	memset(&hdr, 0, sizeof(hdr));
-	strncpy(hdr.name, argv[1], sizeof(hdr.name));
-	hdr.len = htonl(filter.bf_len);
+	strncpy(hdr.name, name, sizeof(hdr.name));
+	hdr.len = htonl(len);
 	fwrite(&hdr, sizeof(hdr), 1, stdout);
-	fwrite(filter.bf_insns, 8, filter.bf_len, stdout);
+	fwrite(insns, 8, len, stdout);
+}
+
+/*
+ * instructions that can be shared between items: no jumps, returns or
+ * scratch memory access, so the only state after them is in A and X
+ */
+static int is_plain(const struct bpf_insn *bi)
+{
+	switch(BPF_CLASS(bi->code)) {
+	case BPF_JMP:
+	case BPF_RET:
+	case BPF_ST:
+	case BPF_STX:
+		return 0;
+	case BPF_LD:
+	case BPF_LDX:
+		return BPF_MODE(bi->code) != BPF_MEM;
+	default:
+		return 1;
+	}
+}
+
+static int shared_prefix(const struct merge_item *a, const struct merge_item *b)
+{
+	int i;
+
+	for (i = 0; i < a->len && i < b->len; i++) {
+		if (!is_plain(&a->insns[i]) ||
+		    memcmp(&a->insns[i], &b->insns[i], sizeof(a->insns[i])) != 0)
+			break;
+	}
+	return i;
+}
+
+/* registers that are read before being written when running from pos */
+static int live_regs(const struct merge_item *it, int pos)
+{
+	unsigned char *live;
+	int i, ret;
+
+	live = calloc(it->len + 1, 1);
+	if (!live)
+		return REG_A | REG_X;
+
+	/* jumps only go forward, so one backwards pass is enough */
+	for (i = it->len - 1; i >= pos; i--) {
+		const struct bpf_insn *bi = &it->insns[i];
+		int out = live[i + 1];
+		int use = 0, def = 0;
+
+		switch(BPF_CLASS(bi->code)) {
+		case BPF_RET:
+			out = 0;
+			if (BPF_RVAL(bi->code) == BPF_A)
+				use = REG_A;
+			else if (BPF_RVAL(bi->code) == BPF_X)
+				use = REG_X;
+			break;
+		case BPF_JMP:
+			if (BPF_OP(bi->code) == BPF_JA) {
+				out = live[i + 1 + bi->k];
+				break;
+			}
+			out = live[i + 1 + bi->jt] | live[i + 1 + bi->jf];
+			use = REG_A;
+			if (BPF_SRC(bi->code) == BPF_X)
+				use |= REG_X;
+			break;
+		case BPF_LD:
+			def = REG_A;
+			if (BPF_MODE(bi->code) == BPF_IND)
+				use = REG_X;
+			break;
+		case BPF_LDX:
+			def = REG_X;
+			break;
+		case BPF_ST:
+			use = REG_A;
+			break;
+		case BPF_STX:
+			use = REG_X;
+			break;
+		case BPF_ALU:
+			def = REG_A;
+			use = REG_A;
+			if (BPF_OP(bi->code) != BPF_NEG && BPF_SRC(bi->code) == BPF_X)
+				use |= REG_X;
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(bi->code) == BPF_TAX) {
+				def = REG_X;
+				use = REG_A;
+			} else {
+				def = REG_A;
+				use = REG_X;
+			}
+			break;
+		}
+		live[i] = (out & ~def) | use | it->save[i];
+	}
+
+	ret = live[pos];
+	free(live);
+	return ret;
+}
+
+static int alloc_slot(struct merge_state *s, int *slot)
+{
+	int i;
+
+	if (*slot >= 0)
+		return 0;
+
+	for (i = 0; i < BPF_MEMWORDS; i++) {
+		if (!(s->free_slots & (1 << i)))
+			continue;
+
+		s->free_slots &= ~(1 << i);
+		*slot = i;
+		return 0;
+	}
+	return -1;
+}
+
+static void emit(struct merge_state *s, uint16_t code, uint32_t k)
+{
+	struct bpf_insn *bi;
+
+	if (s->out_len == s->out_size) {
+		s->out_size = s->out_size ? s->out_size * 2 : 256;
+		s->out = realloc(s->out, s->out_size * sizeof(*s->out));
+		if (!s->out) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	bi = &s->out[s->out_len++];
+	memset(bi, 0, sizeof(*bi));
+	bi->code = code;
+	bi->k = k;
+}
+
+/*
+ * Build a single program for a whole group. It returns the index of the
+ * first matching item + 1, or n_group + 1 if no item matched. Items are
+ * chained by turning their 'reject' return into a jump to the next item.
+ * Items that start with the same plain instructions as the previous one
+ * skip them and restore A and X from scratch memory instead, where they
+ * were saved by the item that ran the shared part.
+ * A return value of 0 means that a load went past the end of the frame,
+ * in that case the kernel falls back to checking the items one by one.
+ */
+static int merge(struct merge_state *s, int n_group)
+{
+	struct merge_item *items = s->items;
+	int *pending, n_pending = 0;
+	int i, j, k, maxlen = 0, total = 0;
+
+	s->free_slots = (1 << BPF_MEMWORDS) - 1;
+	for (i = 0; i < s->n_items; i++) {
+		struct merge_item *it = &items[i];
+
+		for (j = 0; j < it->len; j++) {
+			struct bpf_insn *bi = &it->insns[j];
+
+			switch(BPF_CLASS(bi->code)) {
+			case BPF_RET:
+				/* cannot turn the accumulator into an item index */
+				if (BPF_RVAL(bi->code) != BPF_K)
+					return -1;
+				break;
+			case BPF_LD:
+			case BPF_LDX:
+				if (BPF_MODE(bi->code) != BPF_MEM)
+					break;
+				/* fall through */
+			case BPF_ST:
+			case BPF_STX:
+				s->free_slots &= ~(1 << (bi->k % BPF_MEMWORDS));
+				break;
+			}
+		}
+
+		it->save = calloc(it->len, 1);
+		if (!it->save)
+			return -1;
+
+		if (it->len > maxlen)
+			maxlen = it->len;
+	}
+
+	s->slot_a = malloc(maxlen * sizeof(int));
+	s->slot_x = malloc(maxlen * sizeof(int));
+	if (!s->slot_a || !s->slot_x)
+		return -1;
+
+	for (i = 0; i < maxlen; i++)
+		s->slot_a[i] = s->slot_x[i] = -1;
+
+	/* decide which items can skip their shared prefix */
+	for (i = 1; i < s->n_items; i++) {
+		struct merge_item *it = &items[i];
+		int p = shared_prefix(&items[i - 1], it);
+
+		/* restoring the registers costs up to two instructions */
+		if (p <= 2)
+			continue;
+
+		if (alloc_slot(s, &s->slot_a[p]) || alloc_slot(s, &s->slot_x[p]))
+			continue;
+
+		/* the last item that still ran the instruction in front of p,
+		 * all items in between share at least p instructions with it */
+		for (j = i - 1; items[j].start >= p; j--);
+
+		it->start = p;
+		it->owner = j;
+	}
+
+	/* which registers are needed depends on what later items save,
+	 * so work backwards and pass the requirements on to the owners */
+	for (i = s->n_items - 1; i > 0; i--) {
+		struct merge_item *it = &items[i];
+
+		if (!it->start)
+			continue;
+
+		it->restore = live_regs(it, it->start);
+		items[it->owner].save[it->start] |= it->restore;
+	}
+
+	for (i = 0; i < s->n_items; i++)
+		total += items[i].len;
+
+	/* rejects of the previous item, to be pointed at the current one */
+	pending = calloc(total, sizeof(int));
+	if (!pending)
+		return -1;
+
+	for (i = 0; i < s->n_items; i++) {
+		struct merge_item *it = &items[i];
+		int p = it->start;
+
+		for (k = 0; k < n_pending; k++)
+			s->out[pending[k]].k = s->out_len - (pending[k] + 1);
+		n_pending = 0;
+
+		if (it->restore & REG_A)
+			emit(s, BPF_LD | BPF_MEM, s->slot_a[p]);
+		if (it->restore & REG_X)
+			emit(s, BPF_LDX | BPF_MEM, s->slot_x[p]);
+
+		for (j = p; j < it->len; j++) {
+			struct bpf_insn *bi = &it->insns[j];
+
+			if (it->save[j] & REG_A)
+				emit(s, BPF_ST, s->slot_a[j]);
+			if (it->save[j] & REG_X)
+				emit(s, BPF_STX, s->slot_x[j]);
+
+			/* jumps are relative and stay valid, as instructions are
+			 * only added in front of the shared parts, which have none */
+			if (BPF_CLASS(bi->code) != BPF_RET) {
+				emit(s, bi->code, bi->k);
+				s->out[s->out_len - 1] = *bi;
+			} else if (bi->k) {
+				emit(s, BPF_RET | BPF_K, it->idx + 1);
+			} else if (i == s->n_items - 1) {
+				emit(s, BPF_RET | BPF_K, n_group + 1);
+			} else {
+				pending[n_pending++] = s->out_len;
+				emit(s, BPF_JMP | BPF_JA, 0);
+			}
+		}
+	}
+	free(pending);
+
+	if (s->out_len > MAX_MERGED_INSNS)
+		return -1;
+
+	return 0;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s <name> <expression>\n"
+		"       %s -m <group> <expression>...\n"
+		"\n"
+		"The second form generates a merged program for a whole group,\n"
+		"an empty expression marks the default item of the group\n",
+		prog, prog);
+	return 1;
+}
+
+int main (int argc, char ** argv)
+{
+    struct  bpf_program filter;
+    struct merge_state s;
+    pcap_t  *pc;
+	int i, n;
+
+    if (argc < 3)
+		return usage(argv[0]);
+
+    pc = pcap_open_dead(DLT_IEEE802_11_RADIO, 256);
+
+	if (strcmp(argv[1], "-m") != 0) {
+		if (argc != 3)
+			return usage(argv[0]);
+
+		compile(pc, argv[0], argv[2], &filter);
+		write_item(argv[1], filter.bf_insns, filter.bf_len);
+		fflush(stdout);
+		return 0;
+	}
+
+	n = argc - 3;
+	memset(&s, 0, sizeof(s));
+	s.items = calloc(n, sizeof(*s.items));
+	if (!s.items)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		struct merge_item *it = &s.items[s.n_items];
+
+		/* default item */
+		if (!argv[i + 3][0])
+			continue;
+
+		compile(pc, argv[0], argv[i + 3], &filter);
+		it->insns = filter.bf_insns;
+		it->len = filter.bf_len;
+		it->idx = i;
+		s.n_items++;
+	}
+
+	/* an empty program makes the kernel check the items one by one */
+	if (!s.n_items || merge(&s, n) < 0)
+		s.out_len = 0;
+
+	write_item(argv[2], s.out, s.out_len);
 	fflush(stdout);
 
     return 0;
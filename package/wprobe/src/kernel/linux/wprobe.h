@@ -23,6 +23,7 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
 #include <linux/filter.h>
 #include <net/genetlink.h>
 #endif
@@ -65,6 +66,14 @@
  * @WPROBE_ATTR_SAMPLES_MAX: maximum samples to keep before scaling down (NLA_U32)
  * @WPROBE_ATTR_SAMPLES_SCALE_M: multiplier for scaling down samples (NLA_U32)
  * @WPROBE_ATTR_SAMPLES_SCALE_D: divisor for scaling down samples (NLA_U32)
+ * @WPROBE_ATTR_HISTORY_LEN: number of samples to keep per attribute, 0 to disable (NLA_U32),
+ *   one sample (the mean) is taken every measurement interval
+ *   while automatic measurement is enabled
+ *
+ * history:
+ * @WPROBE_ATTR_HISTORY: list of samples of an attribute (NLA_NESTED)
+ * @WPROBE_ATTR_TIMESTAMP: time of a sample in milliseconds since boot (NLA_U64),
+ *   in GET_HISTORY requests only samples newer than this are sent
  *
  * @WPROBE_ATTR_LAST: unused
  */
@@ -110,6 +119,10 @@ enum wprobe_attr {
 	WPROBE_ATTR_RXCOUNT,
 	WPROBE_ATTR_TXCOUNT,
 
+	WPROBE_ATTR_HISTORY_LEN,
+	WPROBE_ATTR_HISTORY,
+	WPROBE_ATTR_TIMESTAMP,
+
 	WPROBE_ATTR_LAST
 };
 
@@ -126,12 +139,21 @@ enum wprobe_attr {
  * @WPROBE_CMD_GET_LINKS: get a list of links
  * @WPROBE_CMD_CONFIG: set config options
  * @WPROBE_CMD_GET_FILTER: get counters for active filters
+ * @WPROBE_CMD_GET_INFO_ALL: get global and all per-link properties in one dump
+ * @WPROBE_CMD_GET_HISTORY: get the recent samples of global/link properties
  *
  * @WPROBE_CMD_LAST: unused
  * 
  * options for GET_INFO and SET_FLAGS:
  *   - mac address set: per-link
  *   - mac address unset: globalsa
+ *
+ * GET_INFO_ALL sends the global values first, followed by the values
+ * of each link, which carry the mac address of the link
+ *
+ * GET_HISTORY sends one or more messages per attribute, each with the
+ * attribute id and a WPROBE_ATTR_HISTORY list of alternating
+ * WPROBE_ATTR_TIMESTAMP and WPROBE_VAL_S64 attributes, oldest first
  */
 enum wprobe_cmd {
 	WPROBE_CMD_UNSPEC,
@@ -142,6 +164,8 @@ enum wprobe_cmd {
 	WPROBE_CMD_GET_LINKS,
 	WPROBE_CMD_CONFIG,
 	WPROBE_CMD_GET_FILTER,
+	WPROBE_CMD_GET_INFO_ALL,
+	WPROBE_CMD_GET_HISTORY,
 	WPROBE_CMD_LAST
 };
 
@@ -163,6 +187,7 @@ struct wprobe_link;
 struct wprobe_item;
 struct wprobe_source;
 struct wprobe_value;
+struct wprobe_history;
 
 /**
  * struct wprobe_link - data structure describing a wireless link
@@ -173,6 +198,7 @@ struct wprobe_value;
  *
  * @list: for internal use
  * @val: for internal use
+ * @history: for internal use
  */
 struct wprobe_link {
 	struct list_head list;
@@ -181,6 +207,7 @@ struct wprobe_link {
 	u32 flags;
 	void *priv;
 	struct wprobe_value *val;
+	struct wprobe_history *history;
 };
 
 /** 
@@ -221,6 +248,29 @@ struct wprobe_value {
 	u64 scale_timestamp;
 };
 
+struct wprobe_sample {
+	u64 time;
+	s64 value;
+};
+
+/* values of an item seen during the current measurement interval */
+struct wprobe_sample_acc {
+	s64 sum;
+	unsigned int n;
+};
+
+/* ring of the last len samples of each item, one per measurement
+ * interval holding the mean of the values seen during it. the samples
+ * of item i start at samples[i * len], count[i] is the number of
+ * samples that were ever added for it */
+struct wprobe_history {
+	int len;
+	int n_items;
+	unsigned int *count;
+	struct wprobe_sample_acc *acc;
+	struct wprobe_sample samples[];
+};
+
 struct wprobe_filter_item_hdr {
 	char name[32];
 	__be32 n_items;
@@ -239,8 +289,14 @@ struct wprobe_filter_counter {
 struct wprobe_filter_group {
 	const char *name;
 	int n_items;
+	int def;
 	struct wprobe_filter_item **items;
-	struct wprobe_filter_counter *counters;
+
+	/* index of the first item in the counter arrays */
+	int first;
+
+	/* optional program for all items, see wprobe_filter_match */
+	struct wprobe_filter_item *merged;
 };
 
 struct wprobe_filter_hdr {
@@ -250,14 +306,20 @@ struct wprobe_filter_hdr {
 	__u16 n_groups;
 } __attribute__((packed));
 
-struct wprobe_filter {
-	spinlock_t lock;
+/* frames are matched on the local cpu only, the counters of all cpus
+ * are summed up when they are read */
+struct wprobe_filter_cpu {
 	struct sk_buff *skb;
+	struct wprobe_filter_counter *counters;
+};
+
+struct wprobe_filter {
+	struct wprobe_filter_cpu *cpu;
 	void *data;
 	int n_groups;
+	int n_items;
 	int hdrlen;
 	struct wprobe_filter_item **items;
-	struct wprobe_filter_counter *counters;
 	struct wprobe_filter_group groups[];
 };
 
@@ -290,6 +352,7 @@ struct wprobe_wlan_hdr {
  * @lock: spinlock protecting value data access
  * @val: internal use
  * @query_val: internal use
+ * @history: internal use
  *
  * if sync_data is NULL, wprobe assumes that it can access the data structure
  * at any time (in atomic context). if sync_data returns a negative error code,
@@ -315,6 +378,8 @@ struct wprobe_iface {
 	struct wprobe_value *val;
 	struct wprobe_value *query_val;
 	struct wprobe_filter *active_filter;
+	struct wprobe_history *history;
+	struct work_struct history_work;
 
 	u32 measure_interval;
 	struct timer_list measure_timer;
@@ -323,6 +388,8 @@ struct wprobe_iface {
 	u32 scale_max;
 	u32 scale_m;
 	u32 scale_d;
+
+	u32 history_len;
 };
 
 
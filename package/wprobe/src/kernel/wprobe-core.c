@@ -25,6 +25,8 @@
 #include <linux/list.h>
 #endif
 #include <linux/skbuff.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
 #include <linux/wprobe.h>
 #include <linux/math64.h>
 
@@ -37,6 +39,7 @@
 #define WPROBE_MIN_INTERVAL		100 /* minimum measurement interval in msecs */
 #define WPROBE_MAX_FILTER_SIZE	1024
 #define WPROBE_MAX_FRAME_SIZE	1900
+#define WPROBE_MAX_HISTORY		256 /* maximum samples kept per attribute */
 
 static struct list_head wprobe_if;
 static spinlock_t wprobe_lock;
@@ -61,6 +64,8 @@ struct wprobe_rtap_hdr {
 static void wprobe_update_stats(struct wprobe_iface *dev, struct wprobe_link *l);
 static int wprobe_sync_data(struct wprobe_iface *dev, struct wprobe_link *l, bool query);
 static void wprobe_free_filter(struct wprobe_filter *f);
+static void wprobe_sample_history(struct wprobe_iface *dev);
+static void wprobe_history_work(struct work_struct *work);
 
 int
 wprobe_add_link(struct wprobe_iface *s, struct wprobe_link *l, const char *addr)
@@ -68,6 +73,7 @@ wprobe_add_link(struct wprobe_iface *s, struct wprobe_link *l, const char *addr)
 	unsigned long flags;
 
 	INIT_LIST_HEAD(&l->list);
+	l->history = NULL;
 	l->val = kzalloc(sizeof(struct wprobe_value) * s->n_link_items, GFP_ATOMIC);
 	if (!l->val)
 		return -ENOMEM;
@@ -78,6 +84,10 @@ wprobe_add_link(struct wprobe_iface *s, struct wprobe_link *l, const char *addr)
 	list_add_tail_rcu(&l->list, &s->links);
 	spin_unlock_irqrestore(&wprobe_lock, flags);
 
+	/* links can be added in atomic context, allocate the history later */
+	if (s->history_len)
+		schedule_work(&s->history_work);
+
 	return 0;
 }
 EXPORT_SYMBOL(wprobe_add_link);
@@ -92,6 +102,7 @@ wprobe_remove_link(struct wprobe_iface *s, struct wprobe_link *l)
 	spin_unlock_irqrestore(&wprobe_lock, flags);
 	synchronize_rcu();
 	kfree(l->val);
+	kfree(l->history);
 }
 EXPORT_SYMBOL(wprobe_remove_link);
 
@@ -106,6 +117,7 @@ wprobe_measure_timer(unsigned long data)
 
 	/* perform measurement */
 	wprobe_sync_data(dev, NULL, false);
+	wprobe_sample_history(dev);
 }
 
 int
@@ -121,6 +133,7 @@ wprobe_add_iface(struct wprobe_iface *s)
 	INIT_LIST_HEAD(&s->list);
 	INIT_LIST_HEAD(&s->links);
 	setup_timer(&s->measure_timer, wprobe_measure_timer, (unsigned long) s);
+	INIT_WORK(&s->history_work, wprobe_history_work);
 
 	s->val = kzalloc(sizeof(struct wprobe_value) * s->n_global_items, GFP_ATOMIC);
 	if (!s->val)
@@ -161,6 +174,7 @@ wprobe_remove_iface(struct wprobe_iface *s)
 	BUG_ON(!list_empty(&s->links));
 
 	del_timer_sync(&s->measure_timer);
+	cancel_work_sync(&s->history_work);
 	spin_lock_irqsave(&wprobe_lock, flags);
 	list_del_rcu(&s->list);
 	spin_unlock_irqrestore(&wprobe_lock, flags);
@@ -171,6 +185,7 @@ wprobe_remove_iface(struct wprobe_iface *s)
 
 	kfree(s->val);
 	kfree(s->query_val);
+	kfree(s->history);
 	if (s->active_filter)
 		wprobe_free_filter(s->active_filter);
 }
@@ -200,10 +215,46 @@ wprobe_get_dev(struct nlattr *attr)
 	return dev;
 }
 
+/*
+ * the merged program of a group returns the index of the first matching
+ * item + 1, or n_items + 1 if none of them matched. it shares the tests
+ * that the items have in common, so that they are only run once.
+ * a return value of 0 means that it was aborted, e.g. because of a load
+ * past the end of a short frame, which must not hide a match of a later
+ * item, so check the items one by one in that case.
+ */
+static int
+wprobe_filter_match(struct wprobe_filter_group *fg, struct sk_buff *skb)
+{
+	struct wprobe_filter_item *fi;
+	unsigned int ret;
+	int i;
+
+	if (fg->merged) {
+		ret = sk_run_filter(skb, fg->merged->filter, fg->merged->hdr.n_items);
+		if (ret > fg->n_items)
+			return fg->def;
+		if (ret > 0)
+			return ret - 1;
+	}
+
+	for (i = 0; i < fg->n_items; i++) {
+		fi = fg->items[i];
+		if (!fi->hdr.n_items)
+			continue;
+
+		if (sk_run_filter(skb, fi->filter, fi->hdr.n_items) != 0)
+			return i;
+	}
+
+	return fg->def;
+}
+
 int
 wprobe_add_frame(struct wprobe_iface *dev, const struct wprobe_wlan_hdr *hdr, void *data, int len)
 {
 	struct wprobe_wlan_hdr *new_hdr;
+	struct wprobe_filter_cpu *fc;
 	struct wprobe_filter *f;
 	struct sk_buff *skb;
 	unsigned long flags;
@@ -214,9 +265,12 @@ wprobe_add_frame(struct wprobe_iface *dev, const struct wprobe_wlan_hdr *hdr, vo
 	if (!f)
 		goto out;
 
-	spin_lock_irqsave(&f->lock, flags);
+	/* the scratch buffer and the counters belong to this cpu,
+	 * only protect them against frames reported from interrupts */
+	local_irq_save(flags);
+	fc = per_cpu_ptr(f->cpu, smp_processor_id());
 
-	skb = f->skb;
+	skb = fc->skb;
 	skb->len = sizeof(struct wprobe_rtap_hdr);
 	skb->tail = skb->data + skb->len;
 	if (len + skb->len > WPROBE_MAX_FRAME_SIZE)
@@ -230,28 +284,10 @@ wprobe_add_frame(struct wprobe_iface *dev, const struct wprobe_wlan_hdr *hdr, vo
 
 	for(i = 0; i < f->n_groups; i++) {
 		struct wprobe_filter_group *fg = &f->groups[i];
-		bool found = false;
-		int def = -1;
-
-		for (j = 0; j < fg->n_items; j++) {
-			struct wprobe_filter_item *fi = fg->items[j];
 
-			if (!fi->hdr.n_items) {
-				def = j;
-				continue;
-			}
-			if (sk_run_filter(skb, fi->filter, fi->hdr.n_items) == 0)
-				continue;
-
-			found = true;
-			break;
-		}
-		if (!found && def >= 0) {
-			j = def;
-			found = true;
-		}
-		if (found) {
-			struct wprobe_filter_counter *c = &fg->counters[j];
+		j = wprobe_filter_match(fg, skb);
+		if (j >= 0) {
+			struct wprobe_filter_counter *c = &fc->counters[fg->first + j];
 
 			if (hdr->type >= WPROBE_PKT_TX)
 				c->tx++;
@@ -260,7 +296,7 @@ wprobe_add_frame(struct wprobe_iface *dev, const struct wprobe_wlan_hdr *hdr, vo
 		}
 	}
 
-	spin_unlock_irqrestore(&f->lock, flags);
+	local_irq_restore(flags);
 out:
 	rcu_read_unlock();
 	return 0;
@@ -324,12 +360,152 @@ wprobe_scale_stats(struct wprobe_iface *dev, const struct wprobe_item *item,
 	}
 }
 
+static u64
+wprobe_msecs(void)
+{
+	return div_u64((get_jiffies_64() - INITIAL_JIFFIES) * MSEC_PER_SEC, HZ);
+}
+
+static void
+wprobe_free_history(struct wprobe_history **hp)
+{
+	kfree(*hp);
+	*hp = NULL;
+}
+
+static void
+wprobe_add_sample(struct wprobe_history *h, int i, u64 time, s64 value)
+{
+	struct wprobe_sample *s;
+
+	s = &h->samples[i * h->len + (h->count[i]++ % h->len)];
+	s->time = time;
+	s->value = value;
+}
+
+/* add a sample with the mean of the values of the last measurement
+ * interval for every item that had any */
+static void
+wprobe_history_interval(struct wprobe_history *h, u64 now)
+{
+	struct wprobe_sample_acc *acc;
+	int i;
+
+	for (i = 0; i < h->n_items; i++) {
+		acc = &h->acc[i];
+		if (!acc->n)
+			continue;
+
+		wprobe_add_sample(h, i, now, div_s64(acc->sum, acc->n));
+		acc->sum = 0;
+		acc->n = 0;
+	}
+}
+
+static void
+wprobe_sample_history(struct wprobe_iface *dev)
+{
+	struct wprobe_link *l;
+	unsigned long flags;
+	u64 now;
+
+	rcu_read_lock();
+	spin_lock_irqsave(&dev->lock, flags);
+	now = wprobe_msecs();
+	if (dev->history)
+		wprobe_history_interval(dev->history, now);
+	list_for_each_entry_rcu(l, &dev->links, list) {
+		if (l->history)
+			wprobe_history_interval(l->history, now);
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+	rcu_read_unlock();
+}
+
+/* must be called with dev->lock and rcu_read_lock held */
+static struct wprobe_history **
+wprobe_missing_history(struct wprobe_iface *dev, int *n)
+{
+	struct wprobe_link *l;
+
+	if (!dev->history_len)
+		return NULL;
+
+	if (!dev->history && dev->n_global_items) {
+		*n = dev->n_global_items;
+		return &dev->history;
+	}
+
+	if (!dev->n_link_items)
+		return NULL;
+
+	list_for_each_entry_rcu(l, &dev->links, list) {
+		if (!l->history) {
+			*n = dev->n_link_items;
+			return &l->history;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The rings can be tens of KB, allocate them here instead of in the
+ * atomic paths that fill them. The locks are dropped for every
+ * allocation, so check again whether the history is still missing
+ * before installing it.
+ */
+static void
+wprobe_history_work(struct work_struct *work)
+{
+	struct wprobe_iface *dev = container_of(work, struct wprobe_iface, history_work);
+	struct wprobe_history *h, **hp;
+	unsigned long flags;
+	int len, n, cur;
+
+	for (;;) {
+		rcu_read_lock();
+		spin_lock_irqsave(&dev->lock, flags);
+		len = dev->history_len;
+		hp = wprobe_missing_history(dev, &n);
+		spin_unlock_irqrestore(&dev->lock, flags);
+		rcu_read_unlock();
+
+		if (!hp)
+			break;
+
+		h = kzalloc(sizeof(struct wprobe_history) +
+			n * len * sizeof(struct wprobe_sample) +
+			n * sizeof(struct wprobe_sample_acc) +
+			n * sizeof(unsigned int), GFP_KERNEL);
+		if (!h)
+			break;
+
+		h->len = len;
+		h->n_items = n;
+		h->acc = (struct wprobe_sample_acc *) &h->samples[n * len];
+		h->count = (unsigned int *) &h->acc[n];
+
+		rcu_read_lock();
+		spin_lock_irqsave(&dev->lock, flags);
+		hp = wprobe_missing_history(dev, &cur);
+		if (hp && (cur == n) && (dev->history_len == len)) {
+			*hp = h;
+			h = NULL;
+		}
+		spin_unlock_irqrestore(&dev->lock, flags);
+		rcu_read_unlock();
+
+		kfree(h);
+	}
+}
 
 void
 wprobe_update_stats(struct wprobe_iface *dev, struct wprobe_link *l)
 {
 	const struct wprobe_item *item;
 	struct wprobe_value *val;
+	struct wprobe_history *h;
 	bool scale_stats = false;
 	int i, n;
 
@@ -337,10 +513,12 @@ wprobe_update_stats(struct wprobe_iface *dev, struct wprobe_link *l)
 		n = dev->n_link_items;
 		item = dev->link_items;
 		val = l->val;
+		h = l->history;
 	} else {
 		n = dev->n_global_items;
 		item = dev->global_items;
 		val = dev->val;
+		h = dev->history;
 	}
 
 	/* process statistics */
@@ -388,6 +566,13 @@ wprobe_update_stats(struct wprobe_iface *dev, struct wprobe_link *l)
 		val[i].s += v;
 		val[i].ss += v * v;
 		val[i].pending = false;
+
+		/* the history keeps the raw values, so it is not affected
+		 * by scaling down the statistics */
+		if (h) {
+			h->acc[i].sum += v;
+			h->acc[i].n++;
+		}
 	}
 	if (scale_stats)
 		wprobe_scale_stats(dev, item, val, n);
@@ -406,6 +591,10 @@ static const struct nla_policy wprobe_policy[WPROBE_ATTR_LAST+1] = {
 	[WPROBE_ATTR_SAMPLES_SCALE_M] = { .type = NLA_U32 },
 	[WPROBE_ATTR_SAMPLES_SCALE_D] = { .type = NLA_U32 },
 	[WPROBE_ATTR_FILTER] = { .type = NLA_BINARY, .len = 32768 },
+	[WPROBE_ATTR_HISTORY_LEN] = { .type = NLA_U32 },
+
+	/* history */
+	[WPROBE_ATTR_TIMESTAMP] = { .type = NLA_U64 },
 };
 
 static bool
@@ -424,15 +613,17 @@ static bool
 wprobe_send_item_value(struct sk_buff *msg, struct netlink_callback *cb,
                        struct wprobe_iface *dev, struct wprobe_link *l,
                        const struct wprobe_item *item,
-                       int i, u32 flags)
+                       int i, u32 flags, u8 cmd)
 {
 	struct genlmsghdr *hdr;
 	struct wprobe_value *val = dev->query_val;
 	u64 time = val[i].last - val[i].first;
 
 	hdr = genlmsg_put(msg, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
-			&wprobe_fam, NLM_F_MULTI, WPROBE_CMD_GET_INFO);
+			&wprobe_fam, NLM_F_MULTI, cmd);
 
+	if (l && (cmd == WPROBE_CMD_GET_INFO_ALL))
+		NLA_PUT(msg, WPROBE_ATTR_MAC, 6, l->addr);
 	NLA_PUT_U32(msg, WPROBE_ATTR_ID, i);
 	NLA_PUT_U32(msg, WPROBE_ATTR_FLAGS, flags);
 	NLA_PUT_U8(msg, WPROBE_ATTR_TYPE, item[i].type);
@@ -519,7 +710,8 @@ wprobe_find_link(struct wprobe_iface *dev, const char *mac)
 }
 
 static bool
-wprobe_dump_filter_group(struct sk_buff *msg, struct wprobe_filter_group *fg, struct netlink_callback *cb)
+wprobe_dump_filter_group(struct sk_buff *msg, struct wprobe_filter *f,
+                         struct wprobe_filter_group *fg, struct netlink_callback *cb)
 {
 	struct genlmsghdr *hdr;
 	struct nlattr *group, *item;
@@ -534,12 +726,21 @@ wprobe_dump_filter_group(struct sk_buff *msg, struct wprobe_filter_group *fg, st
 	group = nla_nest_start(msg, WPROBE_ATTR_FILTER_GROUP);
 	for (i = 0; i < fg->n_items; i++) {
 		struct wprobe_filter_item *fi = fg->items[i];
-		struct wprobe_filter_counter *fc = &fg->counters[i];
+		u64 rx = 0, tx = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct wprobe_filter_counter *fc;
+
+			fc = &per_cpu_ptr(f->cpu, cpu)->counters[fg->first + i];
+			rx += fc->rx;
+			tx += fc->tx;
+		}
 
 		item = nla_nest_start(msg, WPROBE_ATTR_FILTER_GROUP);
 		NLA_PUT_STRING(msg, WPROBE_ATTR_NAME, fi->hdr.name);
-		NLA_PUT_U64(msg, WPROBE_ATTR_RXCOUNT, fc->rx);
-		NLA_PUT_U64(msg, WPROBE_ATTR_TXCOUNT, fc->tx);
+		NLA_PUT_U64(msg, WPROBE_ATTR_RXCOUNT, rx);
+		NLA_PUT_U64(msg, WPROBE_ATTR_TXCOUNT, tx);
 		nla_nest_end(msg, item);
 	}
 
@@ -587,7 +788,7 @@ wprobe_dump_filters(struct sk_buff *skb, struct netlink_callback *cb)
 		goto abort;
 
 	for (i = cb->args[1]; i < f->n_groups; i++) {
-		if (unlikely(!wprobe_dump_filter_group(skb, &f->groups[i], cb)))
+		if (unlikely(!wprobe_dump_filter_group(skb, f, &f->groups[i], cb)))
 			break;
 	}
 	cb->args[1] = i;
@@ -762,7 +963,8 @@ wprobe_dump_info(struct sk_buff *skb, struct netlink_callback *cb)
 	switch(cmd) {
 	case WPROBE_CMD_GET_INFO:
 		while (i < n) {
-			if (!wprobe_send_item_value(skb, cb, dev, l, item, i, vflags))
+			if (!wprobe_send_item_value(skb, cb, dev, l, item, i, vflags,
+					WPROBE_CMD_GET_INFO))
 				break;
 			i++;
 		}
@@ -787,6 +989,241 @@ done:
 }
 #undef WPROBE_F_LINK
 
+static bool
+wprobe_dump_values(struct sk_buff *skb, struct netlink_callback *cb,
+                   struct wprobe_iface *dev, struct wprobe_link *l, int *idx)
+{
+	const struct wprobe_item *item;
+	u32 flags = 0;
+	int n, i = *idx;
+
+	if (l) {
+		item = dev->link_items;
+		n = dev->n_link_items;
+		flags = l->flags;
+	} else {
+		item = dev->global_items;
+		n = dev->n_global_items;
+	}
+
+	if (i == 0) {
+		/* still announce links without any values */
+		if (l && !n)
+			return wprobe_dump_link(skb, l, cb);
+
+		wprobe_sync_data(dev, l, true);
+	}
+
+	while (i < n) {
+		if (!wprobe_send_item_value(skb, cb, dev, l, item, i, flags,
+				WPROBE_CMD_GET_INFO_ALL))
+			break;
+		i++;
+	}
+	*idx = i;
+
+	return (i == n);
+}
+
+static int
+wprobe_dump_all_info(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct wprobe_iface *dev = (struct wprobe_iface *)cb->args[0];
+	struct wprobe_link *l;
+	long pos = cb->args[1];
+	int i = cb->args[2];
+	long p = 1;
+	int err = 0;
+
+	/* position 0 is the global value list, position n is the n-th link.
+	 * the position, the value offset and the link that was being sent
+	 * are stored in the netlink callback. the link list can change between
+	 * two parts of the dump, in that case a partially sent link is simply
+	 * sent again from the start */
+	rcu_read_lock();
+	if (!dev) {
+		err = nlmsg_parse(cb->nlh, GENL_HDRLEN + wprobe_fam.hdrsize,
+				wprobe_fam.attrbuf, wprobe_fam.maxattr, wprobe_policy);
+		if (err)
+			goto done;
+
+		err = -ENOENT;
+		dev = wprobe_get_dev(wprobe_fam.attrbuf[WPROBE_ATTR_INTERFACE]);
+		if (!dev)
+			goto done;
+
+		cb->args[0] = (long) dev;
+		pos = 0;
+		i = 0;
+	} else {
+		err = -ENOENT;
+		if (!wprobe_check_ptr(&wprobe_if, &dev->list))
+			goto done;
+	}
+
+	if (pos == 0) {
+		if (!wprobe_dump_values(skb, cb, dev, NULL, &i))
+			goto out;
+
+		pos++;
+		i = 0;
+	}
+
+	list_for_each_entry_rcu(l, &dev->links, list) {
+		if (p++ < pos)
+			continue;
+
+		if (i && (cb->args[3] != (long) l))
+			i = 0;
+
+		cb->args[3] = (long) l;
+		if (!wprobe_dump_values(skb, cb, dev, l, &i))
+			goto out;
+
+		pos++;
+		i = 0;
+	}
+
+out:
+	cb->args[1] = pos;
+	cb->args[2] = i;
+	err = skb->len;
+done:
+	rcu_read_unlock();
+	return err;
+}
+
+/*
+ * sends the samples of item i that are newer than since, starting at the
+ * sample number *seq. samples that were overwritten since the last part
+ * of the dump are skipped. returns false if the message is full.
+ */
+static bool
+wprobe_dump_samples(struct sk_buff *msg, struct netlink_callback *cb,
+                    struct wprobe_history *h, int i, u64 since, unsigned int *seq)
+{
+	struct wprobe_sample *s = &h->samples[i * h->len];
+	unsigned int cur = *seq, end = h->count[i];
+	struct genlmsghdr *hdr;
+	struct nlattr *samples;
+	unsigned int first;
+	unsigned char *mark;
+
+	if (end - cur > h->len)
+		cur = (end > h->len) ? end - h->len : 0;
+
+	while ((cur != end) && (s[cur % h->len].time <= since))
+		cur++;
+
+	*seq = cur;
+	if (cur == end)
+		return true;
+
+	hdr = genlmsg_put(msg, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			&wprobe_fam, NLM_F_MULTI, WPROBE_CMD_GET_HISTORY);
+	if (!hdr)
+		return false;
+
+	NLA_PUT_U32(msg, WPROBE_ATTR_ID, i);
+	samples = nla_nest_start(msg, WPROBE_ATTR_HISTORY);
+	if (!samples)
+		goto nla_put_failure;
+
+	/* fill the message with as many samples as possible,
+	 * the rest follows in the next part of the dump */
+	for (first = cur; cur != end; cur++) {
+		mark = skb_tail_pointer(msg);
+		if (nla_put_u64(msg, WPROBE_ATTR_TIMESTAMP, s[cur % h->len].time) ||
+		    nla_put_u64(msg, WPROBE_VAL_S64, s[cur % h->len].value)) {
+			nlmsg_trim(msg, mark);
+			break;
+		}
+	}
+	if (cur == first)
+		goto nla_put_failure;
+
+	nla_nest_end(msg, samples);
+	genlmsg_end(msg, hdr);
+	*seq = cur;
+	return (cur == end);
+
+nla_put_failure:
+	genlmsg_cancel(msg, hdr);
+	return false;
+}
+
+static int
+wprobe_dump_history(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct wprobe_iface *dev = (struct wprobe_iface *)cb->args[0];
+	struct wprobe_link *l = (struct wprobe_link *)cb->args[1];
+	int i = cb->args[2];
+	unsigned int seq = cb->args[3];
+	struct wprobe_history *h;
+	struct nlattr *attr;
+	unsigned long flags;
+	u64 since = 0;
+	int err = 0;
+
+	/* the device, link, item and the number of the next sample of the
+	 * item are stored in the netlink callback. the samples are copied
+	 * while holding the lock, so they stay consistent within a part */
+	rcu_read_lock();
+	if (!dev) {
+		err = nlmsg_parse(cb->nlh, GENL_HDRLEN + wprobe_fam.hdrsize,
+				wprobe_fam.attrbuf, wprobe_fam.maxattr, wprobe_policy);
+		if (err)
+			goto done;
+
+		err = -ENOENT;
+		dev = wprobe_get_dev(wprobe_fam.attrbuf[WPROBE_ATTR_INTERFACE]);
+		if (!dev)
+			goto done;
+
+		if (wprobe_fam.attrbuf[WPROBE_ATTR_MAC]) {
+			l = wprobe_find_link(dev, nla_data(wprobe_fam.attrbuf[WPROBE_ATTR_MAC]));
+			if (!l)
+				goto done;
+		}
+
+		if ((attr = wprobe_fam.attrbuf[WPROBE_ATTR_TIMESTAMP]))
+			since = nla_get_u64(attr);
+
+		cb->args[0] = (long) dev;
+		cb->args[1] = (long) l;
+		/* a long cannot hold the timestamp on 32 bit systems */
+		cb->args[4] = (u32) since;
+		cb->args[5] = (u32) (since >> 32);
+		i = 0;
+		seq = 0;
+	} else {
+		err = -ENOENT;
+		if (!wprobe_check_ptr(&wprobe_if, &dev->list))
+			goto done;
+
+		if (l && !wprobe_check_ptr(&dev->links, &l->list))
+			goto done;
+
+		since = ((u64) (u32) cb->args[5] << 32) | (u32) cb->args[4];
+	}
+
+	spin_lock_irqsave(&dev->lock, flags);
+	h = l ? l->history : dev->history;
+	for (; h && (i < h->n_items); i++) {
+		if (!wprobe_dump_samples(skb, cb, h, i, since, &seq))
+			break;
+		seq = 0;
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	cb->args[2] = i;
+	cb->args[3] = seq;
+	err = skb->len;
+done:
+	rcu_read_unlock();
+	return err;
+}
+
 static int
 wprobe_update_auto_measurement(struct wprobe_iface *dev, u32 interval)
 {
@@ -832,12 +1269,48 @@ done:
 }
 
 static int
-wprobe_check_filter(void *data, int datalen, int gs)
+wprobe_check_filter_item(void **data, void *end, int max_len)
+{
+	struct wprobe_filter_item_hdr *hdr;
+	struct sock_filter *sf;
+	int k, n_items;
+
+	hdr = *data;
+	*data += sizeof(*hdr);
+	if (*data > end)
+		return -1;
+
+	hdr->name[31] = 0;
+	n_items = be32_to_cpu(hdr->n_items);
+	hdr->n_items = n_items;
+
+	if (n_items > max_len)
+		return -1;
+
+	sf = *data;
+	*data += n_items * sizeof(struct sock_filter);
+	if (*data > end)
+		return -1;
+
+	if (n_items > 0) {
+		for (k = 0; k < n_items; k++) {
+			sf->code = be16_to_cpu(sf->code);
+			sf->k = be32_to_cpu(sf->k);
+			sf++;
+		}
+		if (sk_chk_filter(*data - n_items * sizeof(struct sock_filter), n_items) != 0)
+			return -2;
+	}
+	return 0;
+}
+
+static int
+wprobe_check_filter(void *data, int datalen, int gs, int version)
 {
 	struct wprobe_filter_item_hdr *hdr;
 	void *orig_data = data;
 	void *end = data + datalen;
-	int i, j, k, is, cur_is;
+	int i, j, is, cur_is, ret;
 
 	for (i = j = is = 0; i < gs; i++) {
 		hdr = data;
@@ -851,38 +1324,29 @@ wprobe_check_filter(void *data, int datalen, int gs)
 		hdr->n_items = cur_is;
 		is += cur_is;
 		for (j = 0; j < cur_is; j++) {
-			struct sock_filter *sf;
-			int n_items;
-
-			hdr = data;
-			data += sizeof(*hdr);
-			if (data > end)
+			ret = wprobe_check_filter_item(&data, end, 1024);
+			if (ret == -1)
 				goto overrun;
+			if (ret < 0)
+				goto invalid;
+		}
 
-			hdr->name[31] = 0;
-			n_items = be32_to_cpu(hdr->n_items);
-			hdr->n_items = n_items;
-
-			if (n_items > 1024)
-				goto overrun;
+		/* version 2 adds a merged program for all items of the group */
+		if (version < 2)
+			continue;
 
-			sf = data;
-			if (n_items > 0) {
-				for (k = 0; k < n_items; k++) {
-					sf->code = be16_to_cpu(sf->code);
-					sf->k = be32_to_cpu(sf->k);
-					sf++;
-				}
-				if (sk_chk_filter(data, n_items) != 0) {
-					printk("%s: filter check failed at group %d, item %d\n", __func__, i, j);
-					return 0;
-				}
-			}
-			data += n_items * sizeof(struct sock_filter);
-		}
+		ret = wprobe_check_filter_item(&data, end, BPF_MAXINSNS);
+		if (ret == -1)
+			goto overrun;
+		if (ret < 0)
+			goto invalid;
 	}
 	return is;
 
+invalid:
+	printk("%s: filter check failed at group %d, item %d\n", __func__, i, j);
+	return 0;
+
 overrun:
 	printk(KERN_ERR "%s: overrun during filter check at group %d, item %d, offset=%d, len=%d\n", __func__, i, j, (data - orig_data), datalen);
 	return 0;
@@ -891,28 +1355,57 @@ overrun:
 static void
 wprobe_free_filter(struct wprobe_filter *f)
 {
-	if (f->skb)
-		kfree_skb(f->skb);
+	struct wprobe_filter_cpu *fc;
+	int cpu;
+
+	if (f->cpu) {
+		for_each_possible_cpu(cpu) {
+			fc = per_cpu_ptr(f->cpu, cpu);
+			if (fc->skb)
+				kfree_skb(fc->skb);
+			if (fc->counters)
+				kfree(fc->counters);
+		}
+		free_percpu(f->cpu);
+	}
 	if (f->data)
 		kfree(f->data);
 	if (f->items)
 		kfree(f->items);
-	if (f->counters)
-		kfree(f->counters);
 	kfree(f);
 }
 
-
 static int
-wprobe_set_filter(struct wprobe_iface *dev, void *data, int len)
+wprobe_init_filter_cpu(struct wprobe_filter *f, struct wprobe_filter_cpu *fc)
 {
-	struct wprobe_filter_hdr *fhdr;
 	struct wprobe_rtap_hdr *rtap;
+
+	fc->skb = alloc_skb(WPROBE_MAX_FRAME_SIZE, GFP_KERNEL);
+	if (!fc->skb)
+		return -ENOMEM;
+
+	/* pad to a full cache line to keep the cpus from sharing one */
+	fc->counters = kzalloc(L1_CACHE_ALIGN(sizeof(struct wprobe_filter_counter) * f->n_items), GFP_KERNEL);
+	if (!fc->counters)
+		return -ENOMEM;
+
+	rtap = (struct wprobe_rtap_hdr *)skb_put(fc->skb, sizeof(*rtap));
+	memset(rtap, 0, sizeof(*rtap));
+	rtap->len = cpu_to_le16(sizeof(struct wprobe_rtap_hdr) + f->hdrlen);
+
+	return 0;
+}
+
+/* may sleep, must be called without holding any locks */
+static struct wprobe_filter *
+wprobe_alloc_filter(void *data, int len)
+{
+	struct wprobe_filter_hdr *fhdr;
 	struct wprobe_filter *f;
-	int i, j, cur_is, is, gs;
+	int i, j, cur_is, is, gs, cpu;
 
 	if (len < sizeof(*fhdr))
-		return -EINVAL;
+		return NULL;
 
 	fhdr = data;
 	data += sizeof(*fhdr);
@@ -920,47 +1413,44 @@ wprobe_set_filter(struct wprobe_iface *dev, void *data, int len)
 
 	if (memcmp(fhdr->magic, "WPFF", 4) != 0) {
 		printk(KERN_ERR "%s: filter rejected (invalid magic)\n", __func__);
-		return -EINVAL;
+		return NULL;
 	}
 
 	gs = be16_to_cpu(fhdr->n_groups);
-	is = wprobe_check_filter(data, len, gs);
+	is = wprobe_check_filter(data, len, gs, fhdr->version);
 	if (is == 0)
-		return -EINVAL;
+		return NULL;
 
 	f = kzalloc(sizeof(struct wprobe_filter) +
-		gs * sizeof(struct wprobe_filter_group), GFP_ATOMIC);
+		gs * sizeof(struct wprobe_filter_group), GFP_KERNEL);
 	if (!f)
-		return -ENOMEM;
-
-	f->skb = alloc_skb(WPROBE_MAX_FRAME_SIZE, GFP_ATOMIC);
-	if (!f->skb)
-		goto error;
+		return NULL;
 
-	f->data = kmalloc(len, GFP_ATOMIC);
+	f->data = kmalloc(len, GFP_KERNEL);
 	if (!f->data)
 		goto error;
 
-	f->items = kzalloc(sizeof(struct wprobe_filter_item *) * is, GFP_ATOMIC);
+	f->items = kzalloc(sizeof(struct wprobe_filter_item *) * is, GFP_KERNEL);
 	if (!f->items)
 		goto error;
 
-	f->counters = kzalloc(sizeof(struct wprobe_filter_counter) * is, GFP_ATOMIC);
-	if (!f->counters)
-		goto error;
-
-	spin_lock_init(&f->lock);
 	memcpy(f->data, data, len);
 	f->n_groups = gs;
+	f->n_items = is;
 
 	if (f->hdrlen < sizeof(struct wprobe_wlan_hdr))
 		f->hdrlen = sizeof(struct wprobe_wlan_hdr);
 
-	rtap = (struct wprobe_rtap_hdr *)skb_put(f->skb, sizeof(*rtap));
-	memset(rtap, 0, sizeof(*rtap));
-	rtap->len = cpu_to_le16(sizeof(struct wprobe_rtap_hdr) + f->hdrlen);
-	data = f->data;
+	f->cpu = alloc_percpu(struct wprobe_filter_cpu);
+	if (!f->cpu)
+		goto error;
+
+	for_each_possible_cpu(cpu) {
+		if (wprobe_init_filter_cpu(f, per_cpu_ptr(f->cpu, cpu)))
+			goto error;
+	}
 
+	data = f->data;
 	cur_is = 0;
 	for (i = 0; i < gs; i++) {
 		struct wprobe_filter_item_hdr *hdr = data;
@@ -969,21 +1459,31 @@ wprobe_set_filter(struct wprobe_iface *dev, void *data, int len)
 		data += sizeof(*hdr);
 		g->name = hdr->name;
 		g->items = &f->items[cur_is];
-		g->counters = &f->counters[cur_is];
+		g->first = cur_is;
 		g->n_items = hdr->n_items;
+		g->def = -1;
 
 		for (j = 0; j < g->n_items; j++) {
 			hdr = data;
+			if (!hdr->n_items)
+				g->def = j;
 			f->items[cur_is++] = data;
 			data += sizeof(*hdr) + hdr->n_items * sizeof(struct sock_filter);
 		}
+
+		if (fhdr->version < 2)
+			continue;
+
+		hdr = data;
+		if (hdr->n_items)
+			g->merged = data;
+		data += sizeof(*hdr) + hdr->n_items * sizeof(struct sock_filter);
 	}
-	rcu_assign_pointer(dev->active_filter, f);
-	return 0;
+	return f;
 
 error:
 	wprobe_free_filter(f);
-	return -ENOMEM;
+	return NULL;
 }
 
 static int
@@ -996,6 +1496,11 @@ wprobe_set_config(struct sk_buff *skb, struct genl_info *info)
 	u32 scale_m, scale_d;
 	struct nlattr *attr;
 	struct wprobe_filter *filter_free = NULL;
+	struct wprobe_filter *filter = NULL;
+
+	attr = info->attrs[WPROBE_ATTR_FILTER];
+	if (attr && (nla_len(attr) > 0))
+		filter = wprobe_alloc_filter(nla_data(attr), nla_len(attr));
 
 	rcu_read_lock();
 	dev = wprobe_get_dev(info->attrs[WPROBE_ATTR_INTERFACE]);
@@ -1016,9 +1521,13 @@ wprobe_set_config(struct sk_buff *skb, struct genl_info *info)
 			struct wprobe_link *l;
 
 			memset(dev->val, 0, sizeof(struct wprobe_value) * dev->n_global_items);
+			wprobe_free_history(&dev->history);
 			list_for_each_entry_rcu(l, &dev->links, list) {
 				memset(l->val, 0, sizeof(struct wprobe_value) * dev->n_link_items);
+				wprobe_free_history(&l->history);
 			}
+			if (dev->history_len)
+				schedule_work(&dev->history_work);
 		}
 	}
 
@@ -1056,11 +1565,30 @@ wprobe_set_config(struct sk_buff *skb, struct genl_info *info)
 		dev->scale_d = scale_d;
 	}
 
+	if ((attr = info->attrs[WPROBE_ATTR_HISTORY_LEN])) {
+		u32 len = nla_get_u32(attr);
+		struct wprobe_link *l;
+
+		if (len > WPROBE_MAX_HISTORY)
+			goto done;
+
+		/* drop the old samples, the history is allocated
+		 * again with the new length outside of the lock */
+		if (len != dev->history_len) {
+			dev->history_len = len;
+			wprobe_free_history(&dev->history);
+			list_for_each_entry_rcu(l, &dev->links, list) {
+				wprobe_free_history(&l->history);
+			}
+			if (len)
+				schedule_work(&dev->history_work);
+		}
+	}
+
 	if ((attr = info->attrs[WPROBE_ATTR_FILTER])) {
 		filter_free = rcu_dereference(dev->active_filter);
-		rcu_assign_pointer(dev->active_filter, NULL);
-		if (nla_len(attr) > 0)
-			wprobe_set_filter(dev, nla_data(attr), nla_len(attr));
+		rcu_assign_pointer(dev->active_filter, filter);
+		filter = NULL;
 	}
 
 	err = 0;
@@ -1078,6 +1606,9 @@ done_unlocked:
 		synchronize_rcu();
 		wprobe_free_filter(filter_free);
 	}
+	/* not installed because of an error */
+	if (filter)
+		wprobe_free_filter(filter);
 	return err;
 }
 
@@ -1112,6 +1643,16 @@ static struct genl_ops wprobe_ops[] = {
 		.dumpit = wprobe_dump_filters,
 		.policy = wprobe_policy,
 	},
+	{
+		.cmd = WPROBE_CMD_GET_INFO_ALL,
+		.dumpit = wprobe_dump_all_info,
+		.policy = wprobe_policy,
+	},
+	{
+		.cmd = WPROBE_CMD_GET_HISTORY,
+		.dumpit = wprobe_dump_history,
+		.policy = wprobe_policy,
+	},
 };
 
 static void __exit
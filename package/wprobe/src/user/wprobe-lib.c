@@ -17,6 +17,7 @@
 #define _BSD_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -118,6 +119,9 @@ static struct nla_policy attribute_policy[WPROBE_ATTR_LAST+1] = {
 	[WPROBE_ATTR_FILTER_GROUP] = { .type = NLA_NESTED },
 	[WPROBE_ATTR_RXCOUNT] = { .type = NLA_U64 },
 	[WPROBE_ATTR_TXCOUNT] = { .type = NLA_U64 },
+	[WPROBE_ATTR_HISTORY_LEN] = { .type = NLA_U32 },
+	[WPROBE_ATTR_HISTORY] = { .type = NLA_NESTED },
+	[WPROBE_ATTR_TIMESTAMP] = { .type = NLA_U64 },
 };
 
 typedef int (*wprobe_cb_t)(struct nl_msg *, void *);
@@ -273,6 +277,7 @@ wprobe_alloc_dev(void)
 	dev->scale_max = -1;
 	dev->scale_m = -1;
 	dev->scale_d = -1;
+	dev->history = -1;
 	dev->sockfd = -1;
 
 	INIT_LIST_HEAD(&dev->global_attr);
@@ -292,7 +297,6 @@ wprobe_init_dev(struct wprobe_iface *dev)
 #ifndef NO_LOCAL_ACCESS 
 static int n_devs = 0;
 static struct nl_sock *handle = NULL;
-static struct nl_cache *cache = NULL;
 static struct genl_family *family = NULL;
 
 static int
@@ -329,19 +333,17 @@ wprobe_local_free(struct wprobe_iface *dev)
 	if (--n_devs != 0)
 		return;
 
-	if (cache)
-		nl_cache_free(cache);
+	if (family)
+		genl_family_put(family);
 	if (handle)
 		nl_socket_free(handle);
 	handle = NULL;
-	cache = NULL;
+	family = NULL;
 }
 
 static int
 wprobe_local_init(void)
 {
-	int ret;
-
 	if (n_devs++ > 0)
 		return 0;
 
@@ -356,13 +358,7 @@ wprobe_local_init(void)
 		goto err;
 	}
 
-	ret = genl_ctrl_alloc_cache(handle, &cache);
-	if (ret < 0) {
-		DPRINTF("Failed to allocate netlink cache\n");
-		goto err;
-	}
-
-	family = genl_ctrl_search_by_name(cache, "wprobe");
+	family = genl_ctrl_probe_by_name(handle, "wprobe");
 	if (!family) {
 		DPRINTF("wprobe API not present\n");
 		goto err;
@@ -541,40 +537,38 @@ free:
 	return NULL;
 }
 
+static void
+wprobe_msg_swap_out(struct nlmsghdr *nlh)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+
+	wprobe_swap_nested(genlmsg_data(gnlh), genlmsg_len(gnlh), true);
+	swap_genlmsghdr(gnlh);
+	swap_nlmsghdr(nlh);
+}
+
+/* converts the message in place, it must not be used afterwards */
 static int
 wprobe_msg_to_network(int socket, struct nl_msg *msg)
 {
 	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 	struct wprobe_msg_hdr mhdr;
-	struct genlmsghdr *gnlh;
-	void *buf, *data;
-	int buflen, datalen;
-	int ret;
+	struct iovec iov[2];
+	int buflen;
 
 	buflen = nlh->nlmsg_len;
-	buf = malloc(buflen);
-	if (!buf)
-		return -ENOMEM;
-
 	memset(&mhdr, 0, sizeof(mhdr));
 	mhdr.status = WPROBE_MSG_DATA;
 	mhdr.len = buflen;
 	wprobe_swap_msg_hdr(&mhdr);
-	write(socket, &mhdr, sizeof(mhdr));
 
-	memcpy(buf, nlh, buflen);
-	nlh = buf;
-	gnlh = nlmsg_data(nlh);
-	data = genlmsg_data(gnlh);
-	datalen = genlmsg_len(gnlh);
-
-	wprobe_swap_nested(data, datalen, true);
-	swap_genlmsghdr(gnlh);
-	swap_nlmsghdr(nlh);
-	ret = write(socket, buf, buflen);
-	free(buf);
+	wprobe_msg_swap_out(nlh);
+	iov[0].iov_base = &mhdr;
+	iov[0].iov_len = sizeof(mhdr);
+	iov[1].iov_base = nlh;
+	iov[1].iov_len = buflen;
 
-	return ret;
+	return writev(socket, iov, 2);
 }
 
 static int
@@ -651,66 +645,179 @@ wprobe_server_init(int socket)
 	return 0;
 }
 
+struct wprobe_server_buf {
+	unsigned char *data;
+	int len;
+	int size;
+};
+
+static void *
+wprobe_server_buf_put(struct wprobe_server_buf *buf, int len)
+{
+	void *ptr;
+
+	if (buf->len + len > buf->size) {
+		int size = buf->size ? buf->size : 4096;
+
+		while (size < buf->len + len)
+			size *= 2;
+
+		ptr = realloc(buf->data, size);
+		if (!ptr)
+			return NULL;
+
+		buf->data = ptr;
+		buf->size = size;
+	}
+
+	ptr = buf->data + buf->len;
+	buf->len += len;
+	return ptr;
+}
+
 static int
 wprobe_server_cb(struct nl_msg *msg, void *arg)
 {
-	int *socket = arg;
-	int ret;
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct wprobe_server_buf *buf = arg;
+	struct wprobe_msg_hdr *mhdr;
 
-	ret = wprobe_msg_to_network(*socket, msg);
-	if (ret > 0)
-		ret = 0;
+	mhdr = wprobe_server_buf_put(buf, sizeof(*mhdr) + nlh->nlmsg_len);
+	if (!mhdr)
+		return NL_STOP;
 
-	return ret;
-}
+	memset(mhdr, 0, sizeof(*mhdr));
+	mhdr->status = WPROBE_MSG_DATA;
+	mhdr->len = nlh->nlmsg_len;
+	wprobe_swap_msg_hdr(mhdr);
+
+	memcpy(mhdr + 1, nlh, nlh->nlmsg_len);
+	wprobe_msg_swap_out((struct nlmsghdr *) (mhdr + 1));
 
+	return NL_OK;
+}
 
 int
-wprobe_server_handle(int socket)
+wprobe_server_parse(const void *data, int len, int *cmd)
 {
 	struct wprobe_msg_hdr mhdr;
-	struct nl_msg *msg;
-	int ret;
+	const struct genlmsghdr *gnlh;
 
-	ret = read(socket, &mhdr, sizeof(mhdr));
-	if (ret != sizeof(mhdr)) {
-		if (ret <= 0)
-			return -1;
+	if (len < sizeof(mhdr))
+		return 0;
 
-		DPRINTF("Failed to read request header\n");
-		return -EINVAL;
-	}
+	memcpy(&mhdr, data, sizeof(mhdr));
 	wprobe_swap_msg_hdr(&mhdr);
-
-	switch(mhdr.status) {
-	case WPROBE_MSG_DATA:
-		if (mhdr.len > WPROBE_MAX_MSGLEN) {
-			DPRINTF("Invalid length in received response message.\n");
-			return -EINVAL;
-		}
-		msg = wprobe_msg_from_network(socket, mhdr.len);
-		break;
-	default:
+	if (mhdr.status != WPROBE_MSG_DATA) {
 		DPRINTF("Invalid request header type\n");
 		return -ENOENT;
 	}
+	if (mhdr.len > WPROBE_MAX_MSGLEN ||
+	    mhdr.len < NLMSG_HDRLEN + GENL_HDRLEN) {
+		DPRINTF("Invalid length in received request message.\n");
+		return -EINVAL;
+	}
+	if (len < sizeof(mhdr) + mhdr.len)
+		return 0;
+
+	if (cmd) {
+		gnlh = (const void *) ((const char *) data + sizeof(mhdr) + NLMSG_HDRLEN);
+		*cmd = gnlh->cmd;
+	}
 
-	if (!msg) {
+	return sizeof(mhdr) + mhdr.len;
+}
+
+int
+wprobe_server_request(const void *data, int len, void **reply)
+{
+	struct wprobe_server_buf buf = { NULL, 0, 0 };
+	struct wprobe_msg_hdr *mhdr;
+	struct genlmsghdr *gnlh;
+	struct nlmsghdr *nlh;
+	struct nl_msg *msg;
+	int ret;
+
+	*reply = NULL;
+	len -= sizeof(*mhdr);
+	msg = nlmsg_alloc_size(len + 32);
+	if (!msg)
+		return -ENOMEM;
+
+	nlh = nlmsg_hdr(msg);
+	memcpy(nlh, (const char *) data + sizeof(*mhdr), len);
+	swap_nlmsghdr(nlh);
+	if (nlh->nlmsg_len > len || nlh->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN) {
 		DPRINTF("Failed to get message\n");
+		nlmsg_free(msg);
 		return -EINVAL;
 	}
 
-	ret = wprobe_local_send_msg(NULL, msg, wprobe_server_cb, &socket);
+	gnlh = nlmsg_data(nlh);
+	swap_genlmsghdr(gnlh);
+	wprobe_swap_nested(genlmsg_data(gnlh), genlmsg_len(gnlh), false);
 
-	memset(&mhdr, 0, sizeof(mhdr));
-	mhdr.status = WPROBE_MSG_DONE;
+	ret = wprobe_local_send_msg(NULL, msg, wprobe_server_cb, &buf);
+
+	mhdr = wprobe_server_buf_put(&buf, sizeof(*mhdr));
+	if (!mhdr) {
+		free(buf.data);
+		return -ENOMEM;
+	}
+
+	memset(mhdr, 0, sizeof(*mhdr));
+	mhdr->status = WPROBE_MSG_DONE;
 	if (ret < 0)
-		mhdr.error = (uint16_t) -ret;
+		mhdr->error = (uint16_t) -ret;
+	wprobe_swap_msg_hdr(mhdr);
 
-	ret = write(socket, (unsigned char *)&mhdr, sizeof(mhdr));
+	*reply = buf.data;
+	return buf.len;
+}
+
+int
+wprobe_server_handle(int socket)
+{
+	unsigned char *data;
+	void *reply;
+	int len, ret;
+
+	data = malloc(sizeof(struct wprobe_msg_hdr) + WPROBE_MAX_MSGLEN);
+	if (!data)
+		return -ENOMEM;
+
+	len = 0;
+	do {
+		ret = read(socket, data + len, sizeof(struct wprobe_msg_hdr));
+		if (ret <= 0) {
+			ret = -1;
+			goto out;
+		}
+		len += ret;
+	} while (len < sizeof(struct wprobe_msg_hdr));
+
+	while ((ret = wprobe_server_parse(data, len, NULL)) == 0) {
+		int n = read(socket, data + len, sizeof(struct wprobe_msg_hdr) + WPROBE_MAX_MSGLEN - len);
+		if (n <= 0) {
+			ret = -1;
+			goto out;
+		}
+		len += n;
+	}
+	if (ret < 0)
+		goto out;
+
+	ret = wprobe_server_request(data, ret, &reply);
+	if (ret < 0)
+		goto out;
+
+	ret = write(socket, reply, ret);
+	free(reply);
 	if (ret > 0)
 		ret = 0;
 
+out:
+	free(data);
 	return ret;
 }
 
@@ -1048,6 +1155,9 @@ wprobe_apply_config(struct wprobe_iface *dev)
 	if (dev->interval >= 0)
 		NLA_PUT_MSECS(msg, WPROBE_ATTR_INTERVAL, dev->interval);
 
+	if (dev->history >= 0)
+		NLA_PUT_U32(msg, WPROBE_ATTR_HISTORY_LEN, dev->history);
+
 	if (dev->filter_len < 0) {
 		NLA_PUT(msg, WPROBE_ATTR_FILTER, 0, NULL);
 		dev->filter_len = 0;
@@ -1083,17 +1193,13 @@ struct wprobe_request_cb {
 	char *addr;
 };
 
+/* stores the value from the attributes in tb in the matching attribute */
 static int
-save_attrdata_handler(struct nl_msg *msg, void *arg)
+save_attrdata(struct wprobe_request_cb *cb)
 {
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
-	struct wprobe_request_cb *cb = arg;
 	struct wprobe_attribute *attr;
 	int type, id;
 
-	nla_parse(tb, WPROBE_ATTR_LAST, genlmsg_attrdata(gnlh, 0),
-			genlmsg_attrlen(gnlh, 0), attribute_policy);
-
 	if (!tb[WPROBE_ATTR_ID])
 		return -1;
 
@@ -1170,6 +1276,17 @@ out:
 	return 0;
 }
 
+static int
+save_attrdata_handler(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+
+	nla_parse(tb, WPROBE_ATTR_LAST, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), attribute_policy);
+
+	return save_attrdata(arg);
+}
+
 
 int
 wprobe_request_data(struct wprobe_iface *dev, const unsigned char *addr)
@@ -1203,4 +1320,189 @@ nla_put_failure:
 	return -ENOMEM;
 }
 
+struct wprobe_request_all_cb {
+	struct wprobe_iface *dev;
+	struct wprobe_request_cb req;
+	struct wprobe_save_cb links;
+	struct wprobe_link *link;
+	wprobe_data_cb cb;
+	void *arg;
+};
+
+/* the values of the global list or of the current link are complete */
+static void
+request_all_flush(struct wprobe_request_all_cb *cb)
+{
+	list_splice(&cb->req.old_list, cb->req.list->prev);
+	INIT_LIST_HEAD(&cb->req.old_list);
+	if (cb->cb)
+		cb->cb(cb->dev, cb->link, cb->arg);
+}
+
+static int
+save_all_handler(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct wprobe_request_all_cb *cb = arg;
+	struct wprobe_link *link;
+	const char *addr;
+
+	nla_parse(tb, WPROBE_ATTR_LAST, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), attribute_policy);
+
+	if (!tb[WPROBE_ATTR_MAC])
+		goto save;
+
+	if (nla_len(tb[WPROBE_ATTR_MAC]) != 6)
+		return -1;
+
+	addr = nla_data(tb[WPROBE_ATTR_MAC]);
+	if (cb->link && !memcmp(cb->link->addr, addr, 6))
+		goto save;
+
+	/* first value of the next link */
+	request_all_flush(cb);
+
+	link = get_link(&cb->links.old_list, addr);
+	if (!link)
+		return -1;
+
+	if (tb[WPROBE_ATTR_FLAGS])
+		link->flags = nla_get_u32(tb[WPROBE_ATTR_FLAGS]);
+
+	list_add_tail(&link->list, cb->links.list);
+	cb->link = link;
+	cb->req.list = &cb->dev->link_attr;
+	cb->req.addr = (char *) link->addr;
+	list_splice_init(&cb->dev->link_attr, &cb->req.old_list);
+
+save:
+	if (!tb[WPROBE_ATTR_ID])
+		return 0;
+
+	return save_attrdata(&cb->req);
+}
+
+int
+wprobe_request_all(struct wprobe_iface *dev, wprobe_data_cb callback, void *arg)
+{
+	struct wprobe_request_all_cb cb;
+	struct wprobe_link *l, *tmp;
+	struct nl_msg *msg;
+	int err;
+
+	msg = wprobe_new_msg(dev, WPROBE_CMD_GET_INFO_ALL, true);
+	if (!msg)
+		return -ENOMEM;
+
+	memset(&cb, 0, sizeof(cb));
+	cb.dev = dev;
+	cb.cb = callback;
+	cb.arg = arg;
+
+	INIT_LIST_HEAD(&cb.links.old_list);
+	list_splice_init(&dev->links, &cb.links.old_list);
+	cb.links.list = &dev->links;
+
+	INIT_LIST_HEAD(&cb.req.old_list);
+	list_splice_init(&dev->global_attr, &cb.req.old_list);
+	cb.req.list = &dev->global_attr;
+
+	err = dev->ops->send_msg(dev, msg, save_all_handler, &cb);
+	if (err < 0)
+		cb.cb = NULL;
+
+	request_all_flush(&cb);
+	if (err < 0) {
+		/* keep the links that were not part of the partial dump */
+		list_splice(&cb.links.old_list, dev->links.prev);
+		return err;
+	}
+
+	list_for_each_entry_safe(l, tmp, &cb.links.old_list, list) {
+		list_del(&l->list);
+		free(l);
+	}
+
+	return 0;
+}
+
+struct wprobe_history_req {
+	struct wprobe_iface *dev;
+	struct list_head *list;
+	wprobe_history_cb cb;
+	void *arg;
+};
+
+static int
+save_history_handler(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct wprobe_history_req *req = arg;
+	struct wprobe_attribute *attr;
+	struct nlattr *nla;
+	uint64_t time = 0;
+	int id, rem;
+
+	nla_parse(tb, WPROBE_ATTR_LAST, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), attribute_policy);
+
+	if (!tb[WPROBE_ATTR_ID] || !tb[WPROBE_ATTR_HISTORY])
+		return -1;
+
+	id = nla_get_u32(tb[WPROBE_ATTR_ID]);
+	list_for_each_entry(attr, req->list, list) {
+		if (attr->id == id)
+			goto found;
+	}
+	/* not found */
+	return -1;
+
+found:
+	/* each value follows the timestamp of its sample */
+	nla_for_each_nested(nla, tb[WPROBE_ATTR_HISTORY], rem) {
+		switch(nla_type(nla)) {
+		case WPROBE_ATTR_TIMESTAMP:
+			time = nla_get_u64(nla);
+			break;
+		case WPROBE_VAL_S64:
+			req->cb(req->dev, attr, time, (int64_t) nla_get_u64(nla), req->arg);
+			break;
+		}
+	}
+	return 0;
+}
+
+int
+wprobe_request_history(struct wprobe_iface *dev, const unsigned char *addr,
+                       uint64_t since, wprobe_history_cb cb, void *arg)
+{
+	struct wprobe_history_req req;
+	struct nl_msg *msg;
+
+	msg = wprobe_new_msg(dev, WPROBE_CMD_GET_HISTORY, true);
+	if (!msg)
+		return -ENOMEM;
+
+	if (addr) {
+		req.list = &dev->link_attr;
+		NLA_PUT(msg, WPROBE_ATTR_MAC, 6, addr);
+	} else {
+		req.list = &dev->global_attr;
+	}
+
+	if (since)
+		NLA_PUT_U64(msg, WPROBE_ATTR_TIMESTAMP, since);
+
+	req.dev = dev;
+	req.cb = cb;
+	req.arg = arg;
+
+	return dev->ops->send_msg(dev, msg, save_history_handler, &req);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return -ENOMEM;
+}
+
 
@@ -15,7 +15,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,6 +30,7 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 
 #include <linux/wprobe.h>
 #include "wprobe.h"
@@ -75,52 +77,67 @@ wprobe_dump_value(struct wprobe_attribute *attr)
 
 
 static void
-wprobe_dump_data(struct wprobe_iface *dev)
+wprobe_show_data(struct wprobe_iface *dev, struct wprobe_link *link, void *arg)
 {
 	struct wprobe_attribute *attr;
-	struct wprobe_link *link;
 	bool first = true;
 
-	if (!simple_mode)
-		fprintf(stdout, "\n");
-	wprobe_request_data(dev, NULL);
-	list_for_each_entry(attr, &dev->global_attr, list) {
-		if (simple_mode) {
-			if (first)
-				fprintf(stdout, "[global]\n");
-			fprintf(stdout, "%s=%s\n", attr->name, wprobe_dump_value(attr));
+	if (!link) {
+		list_for_each_entry(attr, &dev->global_attr, list) {
+			if (simple_mode) {
+				if (first)
+					fprintf(stdout, "[global]\n");
+				fprintf(stdout, "%s=%s\n", attr->name, wprobe_dump_value(attr));
+			} else {
+				fprintf(stdout, (first ?
+					"Global:            %s=%s\n" :
+					"                   %s=%s\n"),
+					attr->name,
+					wprobe_dump_value(attr)
+				);
+			}
+			first = false;
+		}
+		return;
+	}
+
+	list_for_each_entry(attr, &dev->link_attr, list) {
+		if (first) {
+			fprintf(stdout,
+				(simple_mode ? 
+				 "[%02x:%02x:%02x:%02x:%02x:%02x]\n%s=%s\n" :
+				 "%02x:%02x:%02x:%02x:%02x:%02x: %s=%s\n"),
+				link->addr[0], link->addr[1], link->addr[2],
+				link->addr[3], link->addr[4], link->addr[5],
+				attr->name,
+				wprobe_dump_value(attr));
+			first = false;
 		} else {
-			fprintf(stdout, (first ?
-				"Global:            %s=%s\n" :
-				"                   %s=%s\n"),
+			fprintf(stdout,
+				(simple_mode ? "%s=%s\n" :
+				 "                   %s=%s\n"),
 				attr->name,
-				wprobe_dump_value(attr)
-			);
+				wprobe_dump_value(attr));
 		}
-		first = false;
 	}
+}
 
-	list_for_each_entry(link, &dev->links, list) {
-		first = true;
-		wprobe_request_data(dev, link->addr);
-		list_for_each_entry(attr, &dev->link_attr, list) {
-			if (first) {
-				fprintf(stdout,
-					(simple_mode ? 
-					 "[%02x:%02x:%02x:%02x:%02x:%02x]\n%s=%s\n" :
-					 "%02x:%02x:%02x:%02x:%02x:%02x: %s=%s\n"),
-					link->addr[0], link->addr[1], link->addr[2],
-					link->addr[3], link->addr[4], link->addr[5],
-					attr->name,
-					wprobe_dump_value(attr));
-				first = false;
-			} else {
-				fprintf(stdout,
-					(simple_mode ? "%s=%s\n" :
-					 "                   %s=%s\n"),
-					attr->name,
-					wprobe_dump_value(attr));
-			}
+static void
+wprobe_dump_data(struct wprobe_iface *dev)
+{
+	struct wprobe_link *link;
+
+	if (!simple_mode)
+		fprintf(stdout, "\n");
+
+	if (wprobe_request_all(dev, wprobe_show_data, NULL) < 0) {
+		/* kernel module without support for bulk requests */
+		wprobe_update_links(dev);
+		wprobe_request_data(dev, NULL);
+		wprobe_show_data(dev, NULL, NULL);
+		list_for_each_entry(link, &dev->links, list) {
+			wprobe_request_data(dev, link->addr);
+			wprobe_show_data(dev, link, NULL);
 		}
 	}
 	fflush(stdout);
@@ -154,11 +171,14 @@ static int usage(const char *prog)
 		"  -f:            Dump contents of layer 2 filter counters during measurement\n"
 		"  -F <file>:     Apply layer 2 filters from <file>\n"
 		"  -h:            This help text\n"
+		"  -H <samples>:  Keep the mean of the last <samples> measurement intervals per attribute (0 disables)\n"
 		"  -i <interval>: Set measurement interval\n"
 		"  -m:            Run measurement loop\n"
 		"  -p:            Set the TCP port for server/client (default: 17990)\n"
 #ifndef NO_LOCAL_ACCESS 
 		"  -P:            Run in proxy mode (listen on network)\n"
+		"  -t <msecs>:    Proxy mode: share measurement results between clients\n"
+		"                 for this long (default: 500, 0 disables)\n"
 #endif
 		"\n"
 		, prog);
@@ -207,7 +227,6 @@ static void loop_measurement(struct wprobe_iface *dev, bool print_filters, unsig
 {
 	while (1) {
 		usleep(delay * 1000);
-		wprobe_update_links(dev);
 		wprobe_dump_data(dev);
 		if (print_filters)
 			wprobe_dump_filters(dev, simple_mode ? show_filter_simple : show_filter, NULL);
@@ -258,17 +277,251 @@ static void set_filter(struct wprobe_iface *dev, const char *filename)
 
 #ifndef NO_LOCAL_ACCESS
 
-static void sigchld_handler(int s)
+#define PROXY_MAX_CLIENTS	32
+#define PROXY_MAX_REPLIES	8
+
+/*
+ * responses to read-only requests are kept for a short time and handed
+ * out to every client that sends the same request, so multiple collectors
+ * polling one device only cause one kernel query per interval
+ */
+struct proxy_reply {
+	struct list_head list;
+	unsigned long time;
+	int refcount;
+	void *req;
+	int req_len;
+	void *data;
+	int len;
+};
+
+struct proxy_client {
+	int fd;
+	unsigned char *buf;
+	int buf_len;
+	int buf_size;
+	struct proxy_reply *reply[PROXY_MAX_REPLIES];
+	int n_reply;
+	int reply_ofs;
+};
+
+static LIST_HEAD(proxy_cache);
+static unsigned long proxy_cache_time = 500;
+
+static unsigned long proxy_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void proxy_reply_put(struct proxy_reply *r)
+{
+	if (--r->refcount > 0)
+		return;
+
+	free(r->req);
+	free(r->data);
+	free(r);
+}
+
+static void proxy_cache_expire(bool all)
+{
+	struct proxy_reply *r, *tmp;
+	unsigned long now = proxy_time();
+
+	list_for_each_entry_safe(r, tmp, &proxy_cache, list) {
+		if (!all && now - r->time < proxy_cache_time)
+			continue;
+
+		list_del(&r->list);
+		proxy_reply_put(r);
+	}
+}
+
+static struct proxy_reply *proxy_cache_get(const void *req, int len)
 {
-	while (waitpid(-1, NULL, WNOHANG) > 0);
+	struct proxy_reply *r;
+
+	proxy_cache_expire(false);
+	list_for_each_entry(r, &proxy_cache, list) {
+		if (r->req_len != len || memcmp(r->req, req, len) != 0)
+			continue;
+
+		r->refcount++;
+		return r;
+	}
+
+	return NULL;
+}
+
+static bool proxy_cacheable(int cmd)
+{
+	switch(cmd) {
+	case WPROBE_CMD_GET_LIST:
+	case WPROBE_CMD_GET_INFO:
+	case WPROBE_CMD_GET_LINKS:
+	case WPROBE_CMD_GET_FILTER:
+	case WPROBE_CMD_GET_INFO_ALL:
+	case WPROBE_CMD_GET_HISTORY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct proxy_reply *proxy_request(const void *req, int len, int cmd)
+{
+	struct proxy_reply *r;
+	bool cache = proxy_cacheable(cmd);
+
+	if (cache && proxy_cache_time) {
+		r = proxy_cache_get(req, len);
+		if (r)
+			return r;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->refcount = 1;
+	r->len = wprobe_server_request(req, len, &r->data);
+	if (r->len < 0) {
+		free(r);
+		return NULL;
+	}
+
+	if (!cache) {
+		/* configuration changes invalidate everything */
+		proxy_cache_expire(true);
+		return r;
+	}
+
+	if (!proxy_cache_time)
+		return r;
+
+	r->req = malloc(len);
+	if (!r->req)
+		return r;
+
+	memcpy(r->req, req, len);
+	r->req_len = len;
+	r->time = proxy_time();
+	r->refcount++;
+	list_add(&r->list, &proxy_cache);
+
+	return r;
+}
+
+static int proxy_client_process(struct proxy_client *c)
+{
+	int len, cmd;
+	int ofs = 0;
+
+	while (c->n_reply < PROXY_MAX_REPLIES) {
+		len = wprobe_server_parse(c->buf + ofs, c->buf_len - ofs, &cmd);
+		if (len < 0)
+			return len;
+		if (!len)
+			break;
+
+		c->reply[c->n_reply] = proxy_request(c->buf + ofs, len, cmd);
+		if (!c->reply[c->n_reply])
+			return -1;
+
+		c->n_reply++;
+		ofs += len;
+	}
+
+	if (ofs) {
+		c->buf_len -= ofs;
+		memmove(c->buf, c->buf + ofs, c->buf_len);
+	}
+	return 0;
+}
+
+static int proxy_client_read(struct proxy_client *c)
+{
+	int ret;
+
+	if (c->buf_len == c->buf_size) {
+		void *buf;
+		int size = c->buf_size ? c->buf_size * 2 : 1024;
+
+		/* a request is at most 64k plus the header */
+		if (size > 2 * 65536)
+			return -1;
+
+		buf = realloc(c->buf, size);
+		if (!buf)
+			return -1;
+
+		c->buf = buf;
+		c->buf_size = size;
+	}
+
+	ret = read(c->fd, c->buf + c->buf_len, c->buf_size - c->buf_len);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (ret <= 0)
+		return -1;
+
+	c->buf_len += ret;
+	return proxy_client_process(c);
+}
+
+static int proxy_client_write(struct proxy_client *c)
+{
+	struct iovec iov[PROXY_MAX_REPLIES];
+	int i, ret;
+
+	for (i = 0; i < c->n_reply; i++) {
+		iov[i].iov_base = c->reply[i]->data;
+		iov[i].iov_len = c->reply[i]->len;
+	}
+	iov[0].iov_base = (char *) iov[0].iov_base + c->reply_ofs;
+	iov[0].iov_len -= c->reply_ofs;
+
+	ret = writev(c->fd, iov, c->n_reply);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (ret < 0)
+		return -1;
+
+	ret += c->reply_ofs;
+	for (i = 0; i < c->n_reply && ret >= c->reply[i]->len; i++) {
+		ret -= c->reply[i]->len;
+		proxy_reply_put(c->reply[i]);
+	}
+	c->n_reply -= i;
+	memmove(c->reply, c->reply + i, c->n_reply * sizeof(c->reply[0]));
+	c->reply_ofs = ret;
+
+	/* continue with requests that were held back by a full reply queue */
+	return proxy_client_process(c);
+}
+
+static void proxy_client_free(struct proxy_client *c)
+{
+	while (c->n_reply > 0)
+		proxy_reply_put(c->reply[--c->n_reply]);
+
+	wprobe_server_done();
+	close(c->fd);
+	free(c->buf);
+	free(c);
 }
 
 static int run_proxy(int port)
 {
+	struct proxy_client *clients[PROXY_MAX_CLIENTS];
+	struct pollfd fds[PROXY_MAX_CLIENTS + 1];
 	struct sockaddr_in sa;
-	struct sigaction sig;
+	int n_clients = 0;
 	int v = 1;
-	int s;
+	int i, s;
 
 	s = socket(AF_INET, SOCK_STREAM, 0);
 	if (s < 0) {
@@ -276,10 +529,7 @@ static int run_proxy(int port)
 		return 1;
 	}
 
-	sig.sa_handler = sigchld_handler;  // Signal Handler fuer Zombie Prozesse
-	sigemptyset(&sig.sa_mask);
-	sig.sa_flags = SA_RESTART;
-	sigaction(SIGCHLD, &sig, NULL);
+	signal(SIGPIPE, SIG_IGN);
 
 	memset(&sa, 0, sizeof(sa));
 	sa.sin_family = AF_INET;
@@ -296,33 +546,69 @@ static int run_proxy(int port)
 		return 1;
 	}
 	while(1) {
-		unsigned int addrlen = sizeof(struct sockaddr_in);
-		int ret, c;
+		fds[0].fd = s;
+		fds[0].events = (n_clients < PROXY_MAX_CLIENTS) ? POLLIN : 0;
+		for (i = 0; i < n_clients; i++) {
+			struct proxy_client *c = clients[i];
+
+			fds[i + 1].fd = c->fd;
+			fds[i + 1].events = 0;
+			if (c->n_reply < PROXY_MAX_REPLIES)
+				fds[i + 1].events |= POLLIN;
+			if (c->n_reply > 0)
+				fds[i + 1].events |= POLLOUT;
+		}
 
-		c = accept(s, (struct sockaddr *)&sa, &addrlen);
-		if (c < 0) {
+		if (poll(fds, n_clients + 1, -1) < 0) {
 			if (errno == EINTR)
 				continue;
 
-			perror("accept");
+			perror("poll");
 			return 1;
 		}
-		if (fork() == 0) {
-			/* close server socket, stdin, stdout, stderr */
-			close(s);
-			close(0);
-			close(1);
-			close(2);
-
-			wprobe_server_init(c);
-			do {
-				ret = wprobe_server_handle(c);
-			} while (ret >= 0);
-			wprobe_server_done();
-			close(c);
-			exit(0);
+
+		/* walk backwards, so that removing a client does not skip another one */
+		for (i = n_clients - 1; i >= 0; i--) {
+			struct proxy_client *c = clients[i];
+			short ev = fds[i + 1].revents;
+			int ret = 0;
+
+			if (ev & POLLOUT)
+				ret = proxy_client_write(c);
+			if (!ret && (ev & (POLLIN | POLLHUP | POLLERR)))
+				ret = proxy_client_read(c);
+			if (!ret)
+				continue;
+
+			proxy_client_free(c);
+			clients[i] = clients[--n_clients];
+		}
+
+		if (fds[0].revents & POLLIN) {
+			struct proxy_client *c;
+			unsigned int addrlen = sizeof(struct sockaddr_in);
+			int fd;
+
+			fd = accept(s, (struct sockaddr *)&sa, &addrlen);
+			if (fd < 0) {
+				if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+					continue;
+
+				perror("accept");
+				return 1;
+			}
+
+			c = calloc(1, sizeof(*c));
+			if (!c || wprobe_server_init(fd) != 0) {
+				free(c);
+				close(fd);
+				continue;
+			}
+
+			c->fd = fd;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			clients[n_clients++] = c;
 		}
-		close(c);
 	}
 
 	return 0;
@@ -345,6 +631,7 @@ int main(int argc, char **argv)
 	bool print_filters = false;
 	unsigned long delay = 1000;
 	int interval = -1;
+	int history = -1;
 	int ch;
 
 	if (argc < 2)
@@ -352,12 +639,15 @@ int main(int argc, char **argv)
 
 #ifndef NO_LOCAL_ACCESS 
 	if (!strcmp(argv[1], "-P")) {
-		while ((ch = getopt(argc - 1, argv + 1, "p:")) != -1) {
+		while ((ch = getopt(argc - 1, argv + 1, "p:t:")) != -1) {
 			switch(ch) {
 			case 'p':
 				/* set port */
 				wprobe_port = strtoul(optarg, NULL, 0);
 				break;
+			case 't':
+				proxy_cache_time = strtoul(optarg, NULL, 0);
+				break;
 			default:
 				return usage(prog);
 			}
@@ -373,7 +663,7 @@ int main(int argc, char **argv)
 	argv++;
 	argc--;
 
-	while ((ch = getopt(argc, argv, "cd:fF:hi:msp:")) != -1) {
+	while ((ch = getopt(argc, argv, "cd:fF:hH:i:msp:")) != -1) {
 		switch(ch) {
 		case 'c':
 			cmd = CMD_CONFIG;
@@ -387,6 +677,9 @@ int main(int argc, char **argv)
 		case 'i':
 			interval = strtoul(optarg, NULL, 10);
 			break;
+		case 'H':
+			history = strtoul(optarg, NULL, 10);
+			break;
 		case 'f':
 			print_filters = true;
 			break;
@@ -421,11 +714,13 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (filter || interval >= 0) {
+	if (filter || interval >= 0 || history >= 0) {
 		if (filter)
 			set_filter(dev, filter);
 		if (interval >= 0)
 			dev->interval = interval;
+		if (history >= 0)
+			dev->history = history;
 
 		wprobe_apply_config(dev);
 	}
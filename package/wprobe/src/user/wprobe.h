@@ -112,6 +112,7 @@ struct wprobe_iface {
 	int scale_max;
 	int scale_m;
 	int scale_d;
+	int history;
 
 	/* filter */
 	void *filter;
@@ -193,6 +194,40 @@ extern int wprobe_apply_config(struct wprobe_iface *dev);
  */
 extern int wprobe_request_data(struct wprobe_iface *dev, const unsigned char *addr);
 
+typedef void (*wprobe_data_cb)(struct wprobe_iface *dev, struct wprobe_link *link, void *arg);
+
+/**
+ * wprobe_request_all: request the global and all per-link values at once
+ * @dev: wprobe device structure
+ * @cb: (optional) callback, called once with link set to NULL when the
+ *      global attributes list is filled in, then once for every link
+ *      while the link attributes list holds the values of that link
+ * @arg: user argument for the callback
+ *
+ * the list of link partners is updated like with wprobe_update_links.
+ * all data is fetched with a single dump request, instead of one request
+ * for the links and one per link partner
+ */
+extern int wprobe_request_all(struct wprobe_iface *dev, wprobe_data_cb cb, void *arg);
+
+typedef void (*wprobe_history_cb)(struct wprobe_iface *dev, struct wprobe_attribute *attr, uint64_t time, int64_t value, void *arg);
+
+/**
+ * wprobe_request_history: fetch recent samples kept by the kernel
+ * @dev: wprobe device structure
+ * @addr: (optional) mac address of the link partner
+ * @since: only fetch samples newer than this (milliseconds since boot)
+ * @cb: callback, called for every sample, oldest first for each attribute
+ * @arg: user argument for the callback
+ *
+ * the kernel only keeps samples if dev->history was set to the number
+ * of samples per attribute with wprobe_apply_config. one sample, the
+ * mean of the values seen, is taken every measurement interval, so
+ * dev->interval has to be set as well. passing the time of the last
+ * sample as @since on the next call returns only new ones
+ */
+extern int wprobe_request_history(struct wprobe_iface *dev, const unsigned char *addr, uint64_t since, wprobe_history_cb cb, void *arg);
+
 /**
  * wprobe_server_init: send a wprobe server init message to a server's client socket
  * @socket: socket of the connection to the client
@@ -205,6 +240,27 @@ extern int wprobe_server_init(int socket);
  */
 extern int wprobe_server_handle(int socket);
 
+/**
+ * wprobe_server_parse: check for a complete client request in a receive buffer
+ * @data: data received from the client so far
+ * @len: number of bytes in @data
+ * @cmd: (optional) set to the wprobe command of a complete request
+ *
+ * returns the length of the request, 0 if more data is needed,
+ * or a negative error code if the request is invalid
+ */
+extern int wprobe_server_parse(const void *data, int len, int *cmd);
+
+/**
+ * wprobe_server_request: process a client request without doing any socket i/o
+ * @data: complete request, as checked with wprobe_server_parse
+ * @len: length of the request
+ * @reply: set to the response stream in network format, must be freed by the caller
+ *
+ * returns the length of the response or a negative error code
+ */
+extern int wprobe_server_request(const void *data, int len, void **reply);
+
 /**
  * wprobe_server_done: release memory allocated for the server connection
  */
@@ -247,16 +247,11 @@ swconfig_unlock(void)
 }
 
 static struct switch_dev *
-swconfig_get_dev(struct genl_info *info)
+swconfig_get_dev_id(int id)
 {
 	struct switch_dev *dev = NULL;
 	struct switch_dev *p;
-	int id;
-
-	if (!info->attrs[SWITCH_ATTR_ID])
-		goto done;
 
-	id = nla_get_u32(info->attrs[SWITCH_ATTR_ID]);
 	swconfig_lock();
 	list_for_each_entry(p, &swdevs, dev_list) {
 		if (id != p->id)
@@ -270,10 +265,18 @@ swconfig_get_dev(struct genl_info *info)
 	else
 		DPRINTF("device %d not found\n", id);
 	swconfig_unlock();
-done:
 	return dev;
 }
 
+static struct switch_dev *
+swconfig_get_dev(struct genl_info *info)
+{
+	if (!info->attrs[SWITCH_ATTR_ID])
+		return NULL;
+
+	return swconfig_get_dev_id(nla_get_u32(info->attrs[SWITCH_ATTR_ID]));
+}
+
 static inline void
 swconfig_put_dev(struct switch_dev *dev)
 {
@@ -741,6 +744,202 @@ error:
 	return err;
 }
 
+enum swconfig_dump_group {
+	DUMP_GLOBAL,
+	DUMP_PORT,
+	DUMP_VLAN,
+	__DUMP_MAX
+};
+
+/*
+ * Look up the idx-th attribute of a group, counting the driver attributes
+ * first and the defaults after them. Returns -1 past the last attribute,
+ * *attr is set to NULL for inactive defaults.
+ */
+static int
+swconfig_dump_lookup(struct switch_dev *dev, int group, int idx,
+		const struct switch_attr **attr, int *id)
+{
+	const struct switch_attrlist *alist;
+	struct switch_attr *def_list;
+	unsigned long *def_active;
+	int n_def;
+
+	switch(group) {
+	case DUMP_GLOBAL:
+		alist = &dev->attr_global;
+		def_list = default_global;
+		def_active = &dev->def_global;
+		n_def = ARRAY_SIZE(default_global);
+		break;
+	case DUMP_PORT:
+		alist = &dev->attr_port;
+		def_list = default_port;
+		def_active = &dev->def_port;
+		n_def = ARRAY_SIZE(default_port);
+		break;
+	case DUMP_VLAN:
+		alist = &dev->attr_vlan;
+		def_list = default_vlan;
+		def_active = &dev->def_vlan;
+		n_def = ARRAY_SIZE(default_vlan);
+		break;
+	default:
+		return -1;
+	}
+
+	if (idx < alist->n_attr) {
+		*attr = &alist->attr[idx];
+		*id = idx;
+		return 0;
+	}
+
+	idx -= alist->n_attr;
+	if (idx >= n_def)
+		return -1;
+
+	*attr = test_bit(idx, def_active) ? &def_list[idx] : NULL;
+	*id = SWITCH_ATTR_DEFAULTS_OFFSET + idx;
+	return 0;
+}
+
+static int
+swconfig_dump_value(struct sk_buff *skb, struct netlink_callback *cb,
+		struct switch_dev *dev, int group, int index,
+		const struct switch_attr *attr, int id)
+{
+	static const int cmds[] = {
+		[DUMP_GLOBAL] = SWITCH_CMD_GET_GLOBAL,
+		[DUMP_PORT] = SWITCH_CMD_GET_PORT,
+		[DUMP_VLAN] = SWITCH_CMD_GET_VLAN,
+	};
+	struct nlattr *n, *p;
+	struct switch_val val;
+	void *hdr;
+	int i;
+
+	memset(&val, 0, sizeof(val));
+	val.attr = attr;
+	val.port_vlan = index;
+	if (attr->type == SWITCH_TYPE_PORTS) {
+		val.value.ports = dev->portbuf;
+		memset(dev->portbuf, 0,
+			sizeof(struct switch_port) * dev->ports);
+	}
+
+	/* values that cannot be read are left out of the dump */
+	if (attr->get(dev, attr, &val))
+		return 0;
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).pid, cb->nlh->nlmsg_seq,
+			&switch_fam, NLM_F_MULTI, cmds[group]);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	NLA_PUT_U32(skb, SWITCH_ATTR_OP_ID, id);
+	if (group == DUMP_PORT)
+		NLA_PUT_U32(skb, SWITCH_ATTR_OP_PORT, index);
+	else if (group == DUMP_VLAN)
+		NLA_PUT_U32(skb, SWITCH_ATTR_OP_VLAN, index);
+
+	switch(attr->type) {
+	case SWITCH_TYPE_INT:
+		NLA_PUT_U32(skb, SWITCH_ATTR_OP_VALUE_INT, val.value.i);
+		break;
+	case SWITCH_TYPE_STRING:
+		NLA_PUT_STRING(skb, SWITCH_ATTR_OP_VALUE_STR, val.value.s);
+		break;
+	case SWITCH_TYPE_PORTS:
+		n = nla_nest_start(skb, SWITCH_ATTR_OP_VALUE_PORTS);
+		if (!n)
+			goto nla_put_failure;
+
+		for (i = 0; i < val.len; i++) {
+			p = nla_nest_start(skb, SWITCH_ATTR_PORT);
+			if (!p)
+				goto nla_put_failure;
+
+			NLA_PUT_U32(skb, SWITCH_PORT_ID, val.value.ports[i].id);
+			if (val.value.ports[i].flags & (1 << SWITCH_PORT_FLAG_TAGGED))
+				NLA_PUT_FLAG(skb, SWITCH_PORT_FLAG_TAGGED);
+			nla_nest_end(skb, p);
+		}
+		nla_nest_end(skb, n);
+		break;
+	default:
+		break;
+	}
+
+	return genlmsg_end(skb, hdr);
+
+nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+/*
+ * Dump the values of all readable global, port and vlan attributes of a
+ * switch, one message per value. cb->args holds the group, the port/vlan
+ * index and the attribute index to resume from.
+ */
+static int
+swconfig_dump_values(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlattr *tb[SWITCH_ATTR_MAX+1];
+	const struct switch_attr *attr;
+	struct switch_dev *dev;
+	int group = cb->args[0];
+	int index = cb->args[1];
+	int idx = cb->args[2];
+	int count, id;
+
+	if (nlmsg_parse(cb->nlh, GENL_HDRLEN + switch_fam.hdrsize, tb,
+			SWITCH_ATTR_MAX, switch_policy))
+		return -EINVAL;
+
+	if (!tb[SWITCH_ATTR_ID])
+		return -EINVAL;
+
+	dev = swconfig_get_dev_id(nla_get_u32(tb[SWITCH_ATTR_ID]));
+	if (!dev)
+		return -EINVAL;
+
+	for (; group < __DUMP_MAX; group++, index = 0) {
+		switch(group) {
+		case DUMP_PORT:
+			count = dev->ports;
+			break;
+		case DUMP_VLAN:
+			count = dev->vlans;
+			break;
+		default:
+			count = 1;
+			break;
+		}
+
+		for (; index < count; index++, idx = 0) {
+			for (; swconfig_dump_lookup(dev, group, idx, &attr, &id) == 0; idx++) {
+				if (!attr || attr->disabled || !attr->get ||
+				    (attr->type == SWITCH_TYPE_NOVAL))
+					continue;
+
+				/* a value that does not even fit into an empty buffer is skipped */
+				if ((swconfig_dump_value(skb, cb, dev, group, index, attr, id) < 0) &&
+				    skb->len)
+					goto out;
+			}
+		}
+	}
+
+out:
+	cb->args[0] = group;
+	cb->args[1] = index;
+	cb->args[2] = idx;
+	swconfig_put_dev(dev);
+
+	return skb->len;
+}
+
 static int
 swconfig_send_switch(struct sk_buff *msg, u32 pid, u32 seq, int flags,
 		const struct switch_dev *dev)
@@ -843,6 +1042,12 @@ static struct genl_ops swconfig_ops[] = {
 		.dumpit = swconfig_dump_switches,
 		.policy = switch_policy,
 		.done = swconfig_done,
+	},
+	{
+		.cmd = SWITCH_CMD_DUMP_VALUES,
+		.dumpit = swconfig_dump_values,
+		.policy = switch_policy,
+		.done = swconfig_done,
 	}
 };
 
@@ -0,0 +1,254 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  Table driven CRC-32, eight bytes at a time ("slicing-by-8").
+ *  On x86 hosts with the PCLMULQDQ instruction, large buffers are folded
+ *  128 bits at a time with carry-less multiplication instead, following
+ *  Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ *  Instruction". The instruction is detected at runtime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crc32.h"
+
+#define CRC32_POLY	0xedb88320
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define CRC32_PCLMUL
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/* smallest length worth setting up the folding for */
+#define PCLMUL_MIN_LEN	256
+
+static uint32_t crc32_table[8][256];
+/* x^(2^n) mod P, for advancing the register over runs of bytes */
+static uint32_t crc32_x2n_table[64];
+static int crc32_initialized;
+#ifdef CRC32_PCLMUL
+static int crc32_have_pclmul;
+#endif
+
+/* a * b mod P, both bit reflected (x^0 in the top bit) */
+static uint32_t gf2_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t prod = 0;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (a & 0x80000000)
+			prod ^= b;
+		a <<= 1;
+		b = (b & 1) ? (CRC32_POLY ^ (b >> 1)) : (b >> 1);
+	}
+
+	return prod;
+}
+
+static void crc32_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (CRC32_POLY ^ (crc >> 1)) : (crc >> 1);
+		crc32_table[0][i] = crc;
+	}
+
+	/* table n advances the crc of a byte by n more zero bytes */
+	for (i = 0; i < 256; i++) {
+		crc = crc32_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32_table[j][i] = crc;
+		}
+	}
+
+	/* x^1 */
+	crc32_x2n_table[0] = 1 << 30;
+	for (i = 1; i < 64; i++)
+		crc32_x2n_table[i] = gf2_multiply(crc32_x2n_table[i - 1],
+						  crc32_x2n_table[i - 1]);
+
+#ifdef CRC32_PCLMUL
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			crc32_have_pclmul = !!(ecx & bit_PCLMUL);
+		if (getenv("CRC32_NO_PCLMUL"))
+			crc32_have_pclmul = 0;
+	}
+#endif
+
+	crc32_initialized = 1;
+}
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t one, two;
+
+	while (len && ((uintptr_t) p & 3)) {
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		one = load32_le(p) ^ crc;
+		two = load32_le(p + 4);
+		crc = crc32_table[7][one & 0xff] ^
+		      crc32_table[6][(one >> 8) & 0xff] ^
+		      crc32_table[5][(one >> 16) & 0xff] ^
+		      crc32_table[4][one >> 24] ^
+		      crc32_table[3][two & 0xff] ^
+		      crc32_table[2][(two >> 8) & 0xff] ^
+		      crc32_table[1][(two >> 16) & 0xff] ^
+		      crc32_table[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef CRC32_PCLMUL
+/*
+ * len must be a multiple of 16 and at least 64.
+ * The constants are x^n mod P for the fold distances (bit reflected),
+ * see the paper mentioned above.
+ */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x0, x1, x2, x3, t0, t1, t2, t3;
+
+	x0 = _mm_loadu_si128((const __m128i *) p);
+	x1 = _mm_loadu_si128((const __m128i *) (p + 16));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 32));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 48));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	/* fold four blocks at a time */
+	while (len >= 64) {
+		t0 = _mm_clmulepi64_si128(x0, k1k2, 0x11);
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x0 = _mm_clmulepi64_si128(x0, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+			_mm_loadu_si128((const __m128i *) p));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+			_mm_loadu_si128((const __m128i *) (p + 16)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+			_mm_loadu_si128((const __m128i *) (p + 32)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+			_mm_loadu_si128((const __m128i *) (p + 48)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* fold the four blocks into one */
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x1);
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x2);
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x3);
+
+	/* and the rest, one block at a time */
+	while (len >= 16) {
+		t0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+		x0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+		x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+			_mm_loadu_si128((const __m128i *) p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits */
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x10);
+	x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), t0);
+
+	/* 64 -> 32 bits */
+	t0 = _mm_srli_si128(x0, 4);
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00);
+	x0 = _mm_xor_si128(x0, t0);
+
+	/* barrett reduction */
+	t0 = x0;
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x00);
+	x0 = _mm_xor_si128(x0, t0);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+#endif
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!crc32_initialized)
+		crc32_init();
+
+#ifdef CRC32_PCLMUL
+	if (crc32_have_pclmul && len >= PCLMUL_MIN_LEN) {
+		size_t n = len & ~(size_t) 15;
+
+		crc = crc32_pclmul(crc, p, n);
+		p += n;
+		len -= n;
+	}
+#endif
+
+	return crc32_slice8(crc, p, len);
+}
+
+uint32_t crc32_combine_raw(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	uint64_t bits = (uint64_t) len2 << 3;
+	int n;
+
+	if (!crc32_initialized)
+		crc32_init();
+
+	/* multiply crc1 by x^(8 * len2) */
+	for (n = 0; bits; n++, bits >>= 1)
+		if (bits & 1)
+			crc1 = gf2_multiply(crc32_x2n_table[n], crc1);
+
+	return crc1 ^ crc2;
+}
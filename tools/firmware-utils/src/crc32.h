@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 with the IEEE 802.3 polynomial (0xedb88320, reflected).
+ *
+ * crc32_update() works on the raw shift register: it neither inverts the
+ * initial value nor the result, so that all the variants used by the
+ * tools can be built on top of it:
+ *
+ *   zlib / ethernet:	~crc32_update(~crc, buf, len)
+ *   raw, seed ~0:	crc32_update(0xffffffff, buf, len)
+ *   raw, seed 0:	crc32_update(0, buf, len)
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Returns what crc1 becomes after feeding it another len2 bytes, where
+ * crc2 is the crc of those bytes computed with crc32_update(0, ...).
+ * This way the crc of a range can be put together from the crcs of its
+ * parts. With crc2 = 0 it skips over len2 zero bytes without touching
+ * them. The same works for zlib style crcs of both parts.
+ */
+uint32_t crc32_combine_raw(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#endif /* _CRC32_H */
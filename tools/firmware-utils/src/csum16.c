@@ -0,0 +1,241 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  The sum does not depend on the order in which the halfwords are added,
+ *  and a byte swapped sum is the sum of the byte swapped halfwords (see
+ *  RFC 1071). So the bulk of the data is added up as native 32-bit words
+ *  in 64-bit accumulators, where the carries pile up in the upper half,
+ *  and only the total is folded down to 16 bits and swapped if needed.
+ *  On x86 the adding is done with SSE2, or with AVX2 if the CPU has it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>	/* for __BYTE_ORDER */
+
+#include "csum16.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define CSUM16_SSE2
+#include <emmintrin.h>
+#if defined(__x86_64__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define CSUM16_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+/*
+ * Largest piece added up before folding, small enough that no lane can
+ * overflow: each one gets at most 2^28 words of 32 bits.
+ */
+#define CSUM16_CHUNK	(1UL << 30)
+
+/* smallest length worth switching to AVX2 for */
+#define AVX2_MIN_LEN	256
+
+#ifdef CSUM16_AVX2
+static int csum16_initialized;
+static int csum16_have_avx2;
+#endif
+
+static uint32_t csum16_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static uint64_t csum16_words(const uint8_t *p, size_t len)
+{
+	uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	uint32_t w[4];
+	uint16_t h;
+
+	while (len >= 16) {
+		memcpy(w, p, 16);
+		a0 += w[0];
+		a1 += w[1];
+		a2 += w[2];
+		a3 += w[3];
+		p += 16;
+		len -= 16;
+	}
+
+	while (len >= 4) {
+		memcpy(w, p, 4);
+		a0 += w[0];
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		a1 += h;
+	}
+
+	return a0 + a1 + a2 + a3;
+}
+
+#ifdef CSUM16_SSE2
+static uint64_t csum16_sse2(const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+	__m128i x, y;
+	uint64_t s[2];
+
+	while (len >= 32) {
+		x = _mm_loadu_si128((const __m128i *) p);
+		y = _mm_loadu_si128((const __m128i *) (p + 16));
+		a0 = _mm_add_epi64(a0, _mm_unpacklo_epi32(x, zero));
+		a1 = _mm_add_epi64(a1, _mm_unpackhi_epi32(x, zero));
+		a2 = _mm_add_epi64(a2, _mm_unpacklo_epi32(y, zero));
+		a3 = _mm_add_epi64(a3, _mm_unpackhi_epi32(y, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	a0 = _mm_add_epi64(_mm_add_epi64(a0, a1), _mm_add_epi64(a2, a3));
+	_mm_storeu_si128((__m128i *) s, a0);
+
+	return s[0] + s[1] + csum16_words(p, len);
+}
+#endif
+
+#ifdef CSUM16_AVX2
+__attribute__((target("avx2")))
+static uint64_t csum16_avx2(const uint8_t *p, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+	__m256i x, y;
+	uint64_t s[4];
+
+	while (len >= 64) {
+		x = _mm256_loadu_si256((const __m256i *) p);
+		y = _mm256_loadu_si256((const __m256i *) (p + 32));
+		a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(x, zero));
+		a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(x, zero));
+		a2 = _mm256_add_epi64(a2, _mm256_unpacklo_epi32(y, zero));
+		a3 = _mm256_add_epi64(a3, _mm256_unpackhi_epi32(y, zero));
+		p += 64;
+		len -= 64;
+	}
+
+	a0 = _mm256_add_epi64(_mm256_add_epi64(a0, a1),
+			      _mm256_add_epi64(a2, a3));
+	_mm256_storeu_si256((__m256i *) s, a0);
+
+	return s[0] + s[1] + s[2] + s[3] + csum16_words(p, len);
+}
+
+static void csum16_cpu_init(void)
+{
+	__builtin_cpu_init();
+	csum16_have_avx2 = __builtin_cpu_supports("avx2");
+	if (getenv("CSUM16_NO_AVX2"))
+		csum16_have_avx2 = 0;
+
+	csum16_initialized = 1;
+}
+#endif
+
+/* sum of an even number of bytes, 0 only if they are all zero */
+static uint32_t csum16_bulk(const uint8_t *p, size_t len)
+{
+	uint64_t sum;
+
+#ifdef CSUM16_AVX2
+	if (!csum16_initialized)
+		csum16_cpu_init();
+
+	if (csum16_have_avx2 && len >= AVX2_MIN_LEN)
+		sum = csum16_avx2(p, len);
+	else
+#endif
+#ifdef CSUM16_SSE2
+	sum = csum16_sse2(p, len);
+#else
+	sum = csum16_words(p, len);
+#endif
+
+	sum = csum16_fold(sum);
+#if (__BYTE_ORDER == __LITTLE_ENDIAN)
+	sum = ((sum & 0xff) << 8) | (sum >> 8);
+#endif
+
+	return sum;
+}
+
+/*
+ * Ones-complement addition, with the end around carry. Like adding the
+ * halfwords one by one, the result is never 0 unless both terms are.
+ */
+static inline uint32_t csum16_add(uint32_t sum, uint32_t val)
+{
+	sum += val;
+	if (sum > 0xffff)
+		sum -= 0xffff;
+
+	return sum;
+}
+
+void csum16_init(struct csum16_state *css)
+{
+	css->odd = 0;
+	css->sum = 0;
+	css->tmp = 0;
+}
+
+void csum16_update(struct csum16_state *css, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n;
+
+	if (len == 0)
+		return;
+
+	if (css->odd) {
+		css->sum = csum16_add(css->sum, (css->tmp << 8) + p[0]);
+		css->odd = 0;
+		len--;
+		p++;
+	}
+
+	while (len > 1) {
+		n = (len < CSUM16_CHUNK) ? len & ~(size_t) 1 : CSUM16_CHUNK;
+		css->sum = csum16_add(css->sum, csum16_bulk(p, n));
+		p += n;
+		len -= n;
+	}
+
+	if (len == 1) {
+		css->tmp = p[0];
+		css->odd = 1;
+	}
+}
+
+uint16_t csum16_get(struct csum16_state *css)
+{
+	uint8_t pad = 0;
+
+	csum16_update(css, &pad, 1);
+	return css->sum;
+}
+
+uint16_t csum16_buf(const void *buf, size_t len)
+{
+	struct csum16_state css;
+
+	csum16_init(&css);
+	csum16_update(&css, buf, len);
+	return csum16_get(&css);
+}
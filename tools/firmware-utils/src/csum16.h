@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#ifndef _CSUM16_H
+#define _CSUM16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 16-bit ones-complement sum of big-endian halfwords, the one used by the
+ * Internet protocols (RFC 1071) and by ZyNOS images, without the final
+ * inversion. The data may be fed in pieces of any length, an odd byte at
+ * the end of a piece is kept in the state until the next one. At the end
+ * a single zero byte is added if needed.
+ */
+struct csum16_state {
+	int		odd;	/* a byte is pending in tmp */
+	uint32_t	sum;	/* 0..0xffff */
+	uint32_t	tmp;
+};
+
+void csum16_init(struct csum16_state *css);
+void csum16_update(struct csum16_state *css, const void *buf, size_t len);
+uint16_t csum16_get(struct csum16_state *css);
+uint16_t csum16_buf(const void *buf, size_t len);
+
+#endif /* _CSUM16_H */
@@ -0,0 +1,323 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "fwlayout.h"
+
+#define FWL_BUF_LEN	(64 * 1024)
+
+#define ERR(img, fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			(img)->progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(img, fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt ", %s\n", \
+			(img)->progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+static uint8_t fwl_buf[FWL_BUF_LEN];
+
+struct fwl_region *
+fwl_find_region(struct fwl_image *img, const char *name)
+{
+	int i;
+
+	for (i = 0; i < img->num_regions; i++) {
+		if (img->regions[i].name &&
+		    strcmp(img->regions[i].name, name) == 0)
+			return &img->regions[i];
+	}
+
+	return NULL;
+}
+
+static int
+region_index(struct fwl_image *img, const char *name)
+{
+	struct fwl_region *r;
+
+	if (name == NULL)
+		return -1;
+
+	r = fwl_find_region(img, name);
+	if (r == NULL)
+		return -1;
+
+	return r - img->regions;
+}
+
+int
+fwl_layout(struct fwl_image *img)
+{
+	struct fwl_region *r;
+	struct fwl_sum *sum;
+	struct stat st;
+	uint32_t offset, pos;
+	int i;
+
+	img->fd = -1;
+
+	offset = 0;
+	for (i = 0; i < img->num_regions; i++) {
+		r = &img->regions[i];
+		r->offset = offset;
+		pos = img->base + offset;
+
+		switch (r->type) {
+		case FWL_DATA:
+		case FWL_FILL:
+			r->size = r->len;
+			break;
+		case FWL_FILE:
+			if (stat(r->file_name, &st)) {
+				ERRS(img, "stat failed on %s", r->file_name);
+				return -1;
+			}
+			r->size = st.st_size;
+			break;
+		case FWL_ALIGN:
+			r->size = (r->len) ? (r->len - pos % r->len) % r->len : 0;
+			break;
+		case FWL_PAD_TO:
+			r->size = (r->len > pos) ? r->len - pos : 0;
+			break;
+		default:
+			ERR(img, "invalid type of region %d", i);
+			return -1;
+		}
+
+		offset += r->size;
+	}
+	img->size = offset;
+
+	for (i = 0; i < img->num_sums; i++) {
+		sum = &img->sums[i];
+		sum->first_idx = region_index(img, sum->first);
+		sum->last_idx = region_index(img, sum->last);
+
+		if (sum->first_idx < 0 || sum->last_idx < sum->first_idx) {
+			ERR(img, "invalid range for sum %d", i);
+			return -1;
+		}
+
+		if (sum->ops->len > FWL_SUM_MAX) {
+			ERR(img, "sum %d is too long", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+write_data(struct fwl_image *img, int idx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	struct fwl_sum *sum;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < img->num_sums; i++) {
+		sum = &img->sums[i];
+		if (idx >= sum->first_idx && idx <= sum->last_idx)
+			sum->ops->update(sum->ctx, data, len);
+	}
+
+	while (len > 0) {
+		n = write(img->fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			ERRS(img, "unable to write output file");
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+write_padding(struct fwl_image *img, int idx, uint8_t padc, uint32_t len)
+{
+	uint32_t buflen = FWL_BUF_LEN;
+
+	if (len < buflen)
+		buflen = len;
+
+	memset(fwl_buf, padc, buflen);
+	while (len > 0) {
+		if (len < buflen)
+			buflen = len;
+
+		if (write_data(img, idx, fwl_buf, buflen))
+			return -1;
+
+		len -= buflen;
+	}
+
+	return 0;
+}
+
+static int
+write_file(struct fwl_image *img, int idx, struct fwl_region *r)
+{
+	uint32_t len = r->size;
+	ssize_t n;
+	int fd;
+	int res = -1;
+
+	fd = open(r->file_name, O_RDONLY);
+	if (fd < 0) {
+		ERRS(img, "could not open \"%s\" for reading", r->file_name);
+		return -1;
+	}
+
+	while (len > 0) {
+		n = read(fd, fwl_buf, (len < FWL_BUF_LEN) ? len : FWL_BUF_LEN);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			ERRS(img, "unable to read from file %s", r->file_name);
+			goto out;
+		}
+
+		if (n == 0) {
+			ERR(img, "file %s has been truncated", r->file_name);
+			goto out;
+		}
+
+		if (write_data(img, idx, fwl_buf, n))
+			goto out;
+
+		len -= n;
+	}
+
+	res = 0;
+
+out:
+	close(fd);
+	return res;
+}
+
+int
+fwl_write(struct fwl_image *img)
+{
+	struct fwl_region *r;
+	struct fwl_sum *sum;
+	int i, res;
+
+	img->fd = open(img->file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (img->fd < 0) {
+		ERRS(img, "could not open \"%s\" for writing", img->file_name);
+		return -1;
+	}
+
+	for (i = 0; i < img->num_sums; i++) {
+		sum = &img->sums[i];
+		sum->ctx = malloc(sum->ops->ctx_size);
+		if (sum->ctx == NULL) {
+			ERR(img, "not enough memory");
+			return -1;
+		}
+
+		sum->ops->init(sum->ctx);
+		if (sum->prefix_len)
+			sum->ops->update(sum->ctx, sum->prefix,
+					 sum->prefix_len);
+	}
+
+	res = 0;
+	for (i = 0; i < img->num_regions && res == 0; i++) {
+		r = &img->regions[i];
+
+		switch (r->type) {
+		case FWL_DATA:
+			res = write_data(img, i, r->data, r->size);
+			break;
+		case FWL_FILE:
+			res = write_file(img, i, r);
+			break;
+		default:
+			res = write_padding(img, i, r->padc, r->size);
+			break;
+		}
+	}
+
+	for (i = 0; i < img->num_sums; i++) {
+		sum = &img->sums[i];
+		sum->ops->final(sum->ctx, sum->result);
+		free(sum->ctx);
+		sum->ctx = NULL;
+
+		if (res == 0 && sum->field >= 0)
+			res = fwl_patch(img, sum->field, sum->result,
+					sum->ops->len);
+	}
+
+	return res;
+}
+
+int
+fwl_patch(struct fwl_image *img, uint32_t offset, const void *data,
+	  size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(img->fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			ERRS(img, "unable to write output file");
+			return -1;
+		}
+
+		p += n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int
+fwl_close(struct fwl_image *img, int failed)
+{
+	if (img->fd >= 0 && close(img->fd) != 0) {
+		ERRS(img, "unable to write output file");
+		failed = 1;
+	}
+	img->fd = -1;
+
+	if (failed) {
+		unlink(img->file_name);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (C) 2009 OpenWrt.org
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FWLAYOUT_H
+#define _FWLAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming firmware image writer.
+ *
+ * A tool describes its image as a list of regions, and the checksums or
+ * hashes of the image as sums over a span of named regions. The regions
+ * are written out in order, each input file is read only once, and the
+ * sums are computed from the data on its way to the output file. At the
+ * end the results are stored in the image with pwrite, so no buffer for
+ * the whole image is needed.
+ *
+ * Usage:
+ *	fwl_layout()	compute the offset and size of every region
+ *	fwl_write()	write the image and compute the sums
+ *	fwl_patch()	fix up header fields which depend on the sums
+ *	fwl_close()	close the image, remove it on failure
+ */
+
+#define FWL_DATA	0	/* 'len' bytes from 'data' */
+#define FWL_FILE	1	/* contents of the file 'file_name' */
+#define FWL_FILL	2	/* 'len' times 'padc' */
+#define FWL_ALIGN	3	/* 'padc' up to the next multiple of 'len' */
+#define FWL_PAD_TO	4	/* 'padc' up to offset 'len', if not there yet */
+
+#define FWL_SUM_MAX	64	/* max. length of a sum */
+
+struct fwl_region {
+	int		type;
+	char		*name;		/* name, used by sums and messages */
+	const void	*data;		/* FWL_DATA */
+	char		*file_name;	/* FWL_FILE */
+	uint32_t	len;
+	uint8_t		padc;
+
+	/* set up by fwl_layout() */
+	uint32_t	offset;		/* offset within the image */
+	uint32_t	size;
+};
+
+struct fwl_sum_ops {
+	size_t		ctx_size;	/* size of the private state */
+	size_t		len;		/* length of the result */
+	void		(*init)(void *ctx);
+	void		(*update)(void *ctx, const void *data, size_t len);
+	void		(*final)(void *ctx, void *result);
+};
+
+struct fwl_sum {
+	const struct fwl_sum_ops *ops;
+	char		*first;		/* first region covered */
+	char		*last;		/* last region covered */
+	const void	*prefix;	/* extra data summed in front */
+	size_t		prefix_len;
+	long		field;		/* offset of the result in the image,
+					   -1 if it is not stored by fwl_write */
+	uint8_t		result[FWL_SUM_MAX];
+
+	/* private */
+	void		*ctx;
+	int		first_idx;
+	int		last_idx;
+};
+
+struct fwl_image {
+	char		*progname;	/* for messages */
+	char		*file_name;	/* output file */
+	uint32_t	base;		/* offset of the image, alignments and
+					   FWL_PAD_TO are relative to this */
+	struct fwl_region *regions;
+	int		num_regions;
+	struct fwl_sum	*sums;
+	int		num_sums;
+
+	/* set up by fwl_layout() */
+	uint32_t	size;
+
+	/* private */
+	int		fd;
+};
+
+int fwl_layout(struct fwl_image *img);
+struct fwl_region *fwl_find_region(struct fwl_image *img, const char *name);
+int fwl_write(struct fwl_image *img);
+int fwl_patch(struct fwl_image *img, uint32_t offset, const void *data,
+	      size_t len);
+int fwl_close(struct fwl_image *img, int failed);
+
+#endif /* _FWLAYOUT_H */
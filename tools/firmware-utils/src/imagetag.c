@@ -14,9 +14,11 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 
 #include "bcm_tag.h"
+#include "crc32.h"
 
 #define IMAGETAG_MAGIC1			"Broadcom Corporatio"
 #define IMAGETAG_MAGIC2			"ver. 2.0"
@@ -45,70 +47,99 @@ struct kernelhdr {
 
 static struct tagiddesc_t tagidtab[NUM_TAGID] = TAGID_DEFINITIONS;
 
-static uint32_t crc32tab[256] = {
-	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-	0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-	0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-	0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-	0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-	0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-	0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-	0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-	0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-	0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-	0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-	0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-	0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-	0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-	0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-	0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-	0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-	0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-	0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-	0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-	0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+uint32_t crc32(uint32_t crc, uint8_t *data, size_t len)
+{
+	return crc32_update(crc, data, len);
+}
+
+/*
+ * The tags carry the crcs of several overlapping ranges of the image.
+ * Rather than reading the image back once per range, all of them are
+ * computed while the image is written: the data is cut at the range
+ * boundaries, the crc of each piece is computed once and then combined
+ * into every range that contains it.
+ */
+enum {
+	CRC_IMAGE,
+	CRC_KERNEL,
+	CRC_ROOTFS,
+	NUM_CRCS
 };
 
-uint32_t crc32(uint32_t crc, uint8_t *data, size_t len)
+struct crc_range {
+	size_t start;
+	size_t len;
+	uint32_t crc;
+};
+
+struct crc_stream {
+	struct crc_range range[NUM_CRCS];
+	size_t pos;
+};
+
+/* feed len bytes at the current position, data == NULL means zeros */
+void crc_stream_add(struct crc_stream *cs, const uint8_t *data, size_t len)
 {
-	while (len--)
-		crc = (crc >> 8) ^ crc32tab[(crc ^ *data++) & 0xFF];
+	struct crc_range *r;
+	size_t n, end;
+	uint32_t crc;
+	int i, used;
+
+	while (len > 0) {
+		n = len;
+		used = 0;
+		for (i = 0; i < NUM_CRCS; i++) {
+			r = &cs->range[i];
+			end = r->start + r->len;
+			if (r->start > cs->pos && r->start - cs->pos < n)
+				n = r->start - cs->pos;
+			if (end > cs->pos && end - cs->pos < n)
+				n = end - cs->pos;
+			if (r->start <= cs->pos && cs->pos < end)
+				used = 1;
+		}
+
+		if (used) {
+			crc = data ? crc32_update(0, data, n) : 0;
+			for (i = 0; i < NUM_CRCS; i++) {
+				r = &cs->range[i];
+				if (r->start <= cs->pos && cs->pos < r->start + r->len)
+					r->crc = crc32_combine_raw(r->crc, crc, n);
+			}
+		}
 
-	return crc;
+		if (data)
+			data += n;
+		cs->pos += n;
+		len -= n;
+	}
 }
 
-uint32_t compute_crc32(uint32_t crc, FILE *binfile, size_t compute_start, size_t compute_len)
+void write_data(FILE *binfile, struct crc_stream *cs, const void *data, size_t len)
 {
-	uint8_t readbuf[1024];
-	size_t read;
+	fwrite(data, sizeof(uint8_t), len, binfile);
+	crc_stream_add(cs, data, len);
+}
 
-	fseek(binfile, compute_start, SEEK_SET);
-	
-	/* read block of 1024 bytes */
-	while (binfile && !feof(binfile) && !ferror(binfile) && (compute_len >= sizeof(readbuf))) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), binfile);
-		crc = crc32(crc, readbuf, read);
-		compute_len = compute_len - read;
-	}
+/* Padding is not written out, it is left as a hole in the file */
+void write_padding(FILE *binfile, struct crc_stream *cs, size_t len)
+{
+	fseek(binfile, len, SEEK_CUR);
+	crc_stream_add(cs, NULL, len);
+}
 
-	/* Less than 1024 bytes remains, read compute_len bytes */
-	if (binfile && !feof(binfile) && !ferror(binfile) && (compute_len > 0)) {
-		read = fread(readbuf, sizeof(uint8_t), compute_len, binfile);
-		crc = crc32(crc, readbuf, read);
-	}
+uint8_t *map_file(FILE *fp, size_t len)
+{
+	void *data;
 
-	return crc;
+	if (!fp || !len)
+		return NULL;
+
+	data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	return data;
 }
 
 size_t getlen(FILE *fp)
@@ -135,12 +166,11 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin,
 	union bcm_tag tag;
 	struct kernelhdr khdr;
 	FILE *kernelfile = NULL, *rootfsfile = NULL, *binfile;
-	size_t kerneloff, kernellen, rootfsoff, rootfslen, read, imagelen, rootfsoffpadlen, kernelfslen;
-	uint8_t readbuf[1024];
-	uint32_t imagecrc = IMAGETAG_CRC_START;
-	uint32_t kernelcrc = IMAGETAG_CRC_START;
-	uint32_t rootfscrc = IMAGETAG_CRC_START;
-	uint32_t kernelfscrc = IMAGETAG_CRC_START;
+	size_t kerneloff, kernellen, rootfsoff, rootfslen, imagelen, rootfsoffpadlen, kernelfslen;
+	size_t kerneldatalen, rootfsdatalen;
+	uint8_t *kerneldata = NULL, *rootfsdata = NULL;
+	struct crc_stream cs;
+	uint32_t imagecrc, kernelcrc, rootfscrc, kernelfscrc;
 	const uint32_t deadcode = htonl(DEADCODE);
         union int2char intchar;
 
@@ -170,14 +200,14 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin,
 		return 1;
 	}
 
-	if (!bin || !(binfile = fopen(bin, "wb+"))) {
+	if (!bin || !(binfile = fopen(bin, "wb"))) {
 		fprintf(stderr, "Unable to open output file \"%s\"\n", bin);
 		return 1;
 	}
 
 	/* Build the kernel address and length (doesn't need to be aligned, read only) */
 	kerneloff = fwaddr + sizeof(tag);
-	kernellen = getlen(kernelfile);
+	kernellen = kerneldatalen = getlen(kernelfile);
 
 	/* Build the kernel header */
 	khdr.loadaddr	= htonl(loadaddr);
@@ -190,69 +220,85 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin,
 	/* Build the rootfs address and length (start and end do need to be aligned on flash erase block boundaries */
 	rootfsoff = kerneloff + kernellen;
 	rootfsoff = (rootfsoff % flash_bs) > 0 ? (((rootfsoff / flash_bs) + 1) * flash_bs) : rootfsoff;
-	rootfslen = getlen(rootfsfile);
+	rootfslen = rootfsdatalen = getlen(rootfsfile);
 	rootfslen = ( (rootfslen % flash_bs) > 0 ? (((rootfslen / flash_bs) + 1) * flash_bs) : rootfslen );
 	imagelen = rootfsoff + rootfslen - kerneloff + sizeof(deadcode);
 	rootfsoffpadlen = rootfsoff - (kerneloff + kernellen);
 
-	/* Seek to the start of the kernel */
-	fseek(binfile, kerneloff - fwaddr, SEEK_SET);
+	kerneldata = map_file(kernelfile, kerneldatalen);
+	if (kerneldatalen && !kerneldata) {
+		fprintf(stderr, "Unable to map kernel \"%s\"\n", kernel);
+		return 1;
+	}
 
-	/* Write the kernel header */
-	fwrite(&khdr, sizeof(khdr), 1, binfile);
+	rootfsdata = map_file(rootfsfile, rootfsdatalen);
+	if (rootfsdatalen && !rootfsdata) {
+		fprintf(stderr, "Unable to map rootfs \"%s\"\n", rootfs);
+		return 1;
+	}
 
-	/* Write the kernel */
-	while (kernelfile && !feof(kernelfile) && !ferror(kernelfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), kernelfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
+	/* Choose the ranges of the image whose CRC32 should be inserted in the
+	 * tag, all of them start with the kernel header
+	 */
+	memset(&cs, 0, sizeof(cs));
+	if (tagid && ((strncmp(tagid, "bccfe", TAGID_LEN) == 0) ||
+		      (strncmp(tagid, "bc300", TAGID_LEN) == 0))) {
+		/* The entire image (deadC0de included) */
+		cs.range[CRC_IMAGE].len = imagelen;
+	} else if (tagid && (strncmp(tagid, "ag306", TAGID_LEN) == 0)) {
+		/* The kernel and padding between kernel and rootfs */
+		cs.range[CRC_KERNEL].len = kernellen + rootfsoffpadlen;
+	} else if (tagid && (strncmp(tagid, "bc221", TAGID_LEN) == 0)) {
+		/* The entire image (deadC0de included), the kernel and rootfs
+		 * crc covers exactly the same range
+		 */
+		cs.range[CRC_IMAGE].len = imagelen;
+	} else if (tagid && (strncmp(tagid, "bc310", TAGID_LEN) == 0)) {
+		/* The entire image (deadC0de included) */
+		cs.range[CRC_IMAGE].len = imagelen;
+		/* The kernel and padding between kernel and rootfs */
+		cs.range[CRC_KERNEL].len = kernellen + rootfsoffpadlen;
+		/* The flashImageStart to rootLength.
+		 * The broadcom firmware assumes the rootfs starts the image,
+		 * therefore uses the rootfs start to determine where to flash
+		 * the image.  Since we have the kernel first we have to give
+		 * it the kernel address, but the crc uses the length
+		 * associated with this address, which is added to the kernel
+		 * length to determine the length of image to flash and thus
+		 * needs to be rootfs + deadcode
+		 */
+		cs.range[CRC_ROOTFS].len = rootfslen + sizeof(deadcode);
 	}
+	cs.range[CRC_IMAGE].crc = IMAGETAG_CRC_START;
+	cs.range[CRC_KERNEL].crc = IMAGETAG_CRC_START;
+	cs.range[CRC_ROOTFS].crc = IMAGETAG_CRC_START;
+
+	/* Seek to the start of the kernel */
+	fseek(binfile, kerneloff - fwaddr, SEEK_SET);
+
+	/* Write the kernel header and the kernel */
+	write_data(binfile, &cs, &khdr, sizeof(khdr));
+	write_data(binfile, &cs, kerneldata, kerneldatalen);
 
 	/* Write the RootFS */
-	fseek(binfile, rootfsoff - fwaddr, SEEK_SET);
-	while (rootfsfile && !feof(rootfsfile) && !ferror(rootfsfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), rootfsfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
-	}
+	write_padding(binfile, &cs, rootfsoffpadlen);
+	write_data(binfile, &cs, rootfsdata, rootfsdatalen);
 
 	/* Align image to specified erase block size and append deadc0de */
 	printf("Data alignment to %dk with 'deadc0de' appended\n", flash_bs/1024);
-	fseek(binfile, rootfsoff + rootfslen - fwaddr, SEEK_SET);
-	fwrite(&deadcode, sizeof(uint32_t), 1, binfile);
-	
-	/* Flush the binfile buffer so that when we read from file, it contains
-         * everything in the buffer
-	 */
-	fflush(binfile);
-
-	/* Choose and compute the CRC32 that should be inserted in the tag */
-        if ( tagid && ( (strncmp(tagid, "bccfe", TAGID_LEN) == 0)) || ( strncmp(tagid, "bc300", TAGID_LEN) == 0)) {
-		/* Compute the crc32 of the entire image (deadC0de included) */
-		imagecrc = compute_crc32(imagecrc, binfile, kerneloff - fwaddr, imagelen);
-	} else if ( tagid && (strncmp(tagid, "ag306", TAGID_LEN) == 0)) {
-	        /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-		kernelcrc = compute_crc32(kernelcrc, binfile, kerneloff - fwaddr, kernellen + rootfsoffpadlen);
-	} else if ( tagid && ( (strncmp(tagid, "bc221", TAGID_LEN) == 0))) {
-		/* Compute the crc32 of the entire image (deadC0de included) */
-		imagecrc = compute_crc32(imagecrc, binfile, kerneloff - fwaddr, imagelen);
-	        /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-		kernelfscrc = compute_crc32(kernelfscrc, binfile, kerneloff - fwaddr, kernellen + rootfsoffpadlen + rootfslen + sizeof(deadcode));
-	} else if ( tagid && (strncmp(tagid, "bc310", TAGID_LEN) == 0) ) {
-		/* Compute the crc32 of the entire image (deadC0de included) */
-		imagecrc = compute_crc32(imagecrc, binfile, kerneloff - fwaddr, imagelen);
-	        /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-		kernelcrc = compute_crc32(kernelcrc, binfile, kerneloff - fwaddr, kernellen + rootfsoffpadlen);
-		/* Compute the crc32 of the flashImageStart to rootLength. 
-                 * The broadcom firmware assumes the rootfs starts the image,
-                 * therefore uses the rootfs start to determine where to flash
-                 * the image.  Since we have the kernel first we have to give
-                 * it the kernel address, but the crc uses the length
-                 * associated with this address, which is added to the kernel
-                 * length to determine the length of image to flash and thus
-                 * needs to be rootfs + deadcode
-                 */
-		rootfscrc = compute_crc32(rootfscrc, binfile, kerneloff - fwaddr, rootfslen + sizeof(deadcode));
-        }
-	
+	write_padding(binfile, &cs, rootfslen - rootfsdatalen);
+	write_data(binfile, &cs, &deadcode, sizeof(deadcode));
+
+	imagecrc = cs.range[CRC_IMAGE].crc;
+	kernelcrc = cs.range[CRC_KERNEL].crc;
+	rootfscrc = cs.range[CRC_ROOTFS].crc;
+	kernelfscrc = imagecrc;
+
+	if (kerneldata)
+		munmap(kerneldata, kerneldatalen);
+	if (rootfsdata)
+		munmap(rootfsdata, rootfsdatalen);
+
 	/* Close the files */
 	fclose(kernelfile);
 	fclose(rootfsfile);
@@ -43,6 +43,7 @@
 #endif
 
 #include "myloader.h"
+#include "crc32.h"
 
 #define MAX_FW_BLOCKS  	32
 #define MAX_ARG_COUNT   32
@@ -251,55 +252,10 @@ usage(int status)
 	exit(status);
 }
 
-/*
- * Code to compute the CRC-32 table. Borrowed from
- * gzip-1.0.3/makecrc.c.
- */
-
-static uint32_t crc_32_tab[256];
-
-void
-init_crc_table(void)
-{
-	/* Not copyrighted 1990 Mark Adler	*/
-
-	uint32_t c;      /* crc shift register */
-	uint32_t e;      /* polynomial exclusive-or pattern */
-	int i;           /* counter for all possible eight bit values */
-	int k;           /* byte being shifted into crc apparatus */
-
-	/* terms of polynomial defining this crc (except x^32): */
-	static const int p[] = {0,1,2,4,5,7,8,10,11,12,16,22,23,26};
-
-	/* Make exclusive-or pattern from polynomial */
-	e = 0;
-	for (i = 0; i < sizeof(p)/sizeof(int); i++)
-		e |= 1L << (31 - p[i]);
-
-	crc_32_tab[0] = 0;
-
-	for (i = 1; i < 256; i++) {
-		c = 0;
-		for (k = i | 256; k != 1; k >>= 1) {
-			c = c & 1 ? (c >> 1) ^ e : c >> 1;
-			if (k & 1)
-				c ^= e;
-		}
-		crc_32_tab[i] = c;
-	}
-}
-
-
 void
 update_crc(uint8_t *p, uint32_t len, uint32_t *crc)
 {
-	uint32_t t;
-
-	t = *crc ^ 0xFFFFFFFFUL;
-	while (len--) {
-		t = crc_32_tab[(t ^ *p++) & 0xff] ^ (t >> 8);
-	}
-	*crc = t ^ 0xFFFFFFFFUL;
+	*crc = crc32_update(*crc ^ 0xFFFFFFFFUL, p, len) ^ 0xFFFFFFFFUL;
 }
 
 
@@ -1267,7 +1223,6 @@ main(int argc, char *argv[])
 	}
 
 	crc = 0;
-	init_crc_table();
 
 	if (write_out_header(outfile, &crc) != 0)
 		goto out_flush;
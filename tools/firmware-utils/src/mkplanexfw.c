@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>	/* for offsetof() */
 #include <string.h>
 #include <unistd.h>     /* for unlink() */
 #include <libgen.h>
@@ -19,6 +20,7 @@
 #include <sys/stat.h>
 
 #include "sha1.h"
+#include "fwlayout.h"
 
 #if (__BYTE_ORDER == __BIG_ENDIAN)
 #  define HOST_TO_BE32(x)	(x)
@@ -67,6 +69,29 @@ static struct board_info boards[] = {
 	}
 };
 
+static void sha1_init(void *ctx)
+{
+	sha1_starts(ctx);
+}
+
+static void sha1_add(void *ctx, const void *data, size_t len)
+{
+	sha1_update(ctx, (uchar *) data, len);
+}
+
+static void sha1_final(void *ctx, void *sha1sum)
+{
+	sha1_finish(ctx, sha1sum);
+}
+
+static const struct fwl_sum_ops sha1_ops = {
+	.ctx_size	= sizeof(sha1_context),
+	.len		= 20,
+	.init		= sha1_init,
+	.update		= sha1_add,
+	.final		= sha1_final,
+};
+
 /*
  * Message macros
  */
@@ -121,16 +146,15 @@ void usage(int status)
 int main(int argc, char *argv[])
 {
 	int res = EXIT_FAILURE;
-	int buflen;
+	int datalen;
 	int err;
 	struct stat st;
-	char *buf;
-	struct planex_hdr *hdr;
-	sha1_context ctx;
+	struct planex_hdr hdr;
+	struct fwl_region regions[3];
+	struct fwl_sum sha1sum;
+	struct fwl_image img;
 	uint32_t seed;
 
-	FILE *outfile, *infile;
-
 	progname = basename(argv[0]);
 
 	while ( 1 ) {
@@ -189,73 +213,57 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	buflen = (st.st_size + 3) & ~3;
-	buflen += sizeof(*hdr);
-
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto err;
-	}
+	datalen = (st.st_size + 3) & ~3;
 
-	memset(buf, 0xff, buflen);
-	hdr = (struct planex_hdr *)buf;
+	memset(&hdr, 0xff, sizeof(hdr));
+	hdr.datalen = HOST_TO_BE32(datalen);
+	hdr.unk1[0] = board->unk[0];
+	hdr.unk1[1] = board->unk[1];
 
-	hdr->datalen = HOST_TO_BE32(buflen - sizeof(*hdr));
-	hdr->unk1[0] = board->unk[0];
-	hdr->unk1[1] = board->unk[1];
+	snprintf(hdr.version, sizeof(hdr.version), "%s", version);
 
-	snprintf(hdr->version, sizeof(hdr->version), "%s", version);
+	memset(regions, 0, sizeof(regions));
+	regions[0].type = FWL_DATA;
+	regions[0].name = "header";
+	regions[0].data = &hdr;
+	regions[0].len = sizeof(hdr);
 
-	infile = fopen(ifname, "r");
-	if (infile == NULL) {
-		ERRS("could not open \"%s\" for reading", ifname);
-		goto err_free;
-	}
+	regions[1].type = FWL_FILE;
+	regions[1].name = "data";
+	regions[1].file_name = ifname;
 
-	errno = 0;
-	fread(buf +  sizeof(*hdr), st.st_size, 1, infile);
-	if (errno != 0) {
-		ERRS("unable to read from file %s", ifname);
-		goto err_close_in;
-	}
+	regions[2].type = FWL_FILL;
+	regions[2].name = "pad";
+	regions[2].len = datalen - st.st_size;
+	regions[2].padc = 0xff;
 
+	/* the sha1 sum covers the seed and the data */
 	seed = HOST_TO_BE32(board->seed);
-	sha1_starts(&ctx);
-	sha1_update(&ctx, (uchar *) &seed, sizeof(seed));
-	sha1_update(&ctx, buf + sizeof(*hdr), buflen - sizeof(*hdr));
-	sha1_finish(&ctx, hdr->sha1sum);
-
-	outfile = fopen(ofname, "w");
-	if (outfile == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto err_close_in;
-	}
+	memset(&sha1sum, 0, sizeof(sha1sum));
+	sha1sum.ops = &sha1_ops;
+	sha1sum.first = "data";
+	sha1sum.last = "pad";
+	sha1sum.prefix = &seed;
+	sha1sum.prefix_len = sizeof(seed);
+	sha1sum.field = offsetof(struct planex_hdr, sha1sum);
+
+	memset(&img, 0, sizeof(img));
+	img.progname = progname;
+	img.file_name = ofname;
+	img.regions = regions;
+	img.num_regions = 3;
+	img.sums = &sha1sum;
+	img.num_sums = 1;
+
+	if (fwl_layout(&img))
+		goto err;
 
-	errno = 0;
-	fwrite(buf, buflen, 1, outfile);
-	if (errno) {
-		ERRS("unable to write to file %s", ofname);
-		goto err_close_out;
-	}
+	err = fwl_write(&img);
+	if (fwl_close(&img, err))
+		goto err;
 
 	res = EXIT_SUCCESS;
 
- out_flush:
-	fflush(outfile);
-
- err_close_out:
-	fclose(outfile);
-	if (res != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
-
- err_close_in:
-	fclose(infile);
-
- err_free:
-	free(buf);
-
  err:
 	return res;
 }
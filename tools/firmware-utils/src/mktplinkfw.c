@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>	/* for offsetof() */
 #include <string.h>
 #include <unistd.h>     /* for unlink() */
 #include <libgen.h>
@@ -23,6 +24,7 @@
 #include <sys/stat.h>
 
 #include "md5.h"
+#include "fwlayout.h"
 
 #if (__BYTE_ORDER == __BIG_ENDIAN)
 #  define HOST_TO_BE32(x)	(x)
@@ -207,15 +209,29 @@ static void usage(int status)
 	exit(status);
 }
 
-static int get_md5(char *data, int size, char *md5)
+static void md5_init(void *ctx)
 {
-	MD5_CTX ctx;
+	MD5_Init(ctx);
+}
 
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, data, size);
-	MD5_Final(md5, &ctx);
+static void md5_update(void *ctx, const void *data, size_t len)
+{
+	MD5_Update(ctx, data, (unsigned int) len);
 }
 
+static void md5_final(void *ctx, void *md5)
+{
+	MD5_Final(md5, ctx);
+}
+
+static const struct fwl_sum_ops md5_ops = {
+	.ctx_size	= sizeof(MD5_CTX),
+	.len		= MD5SUM_LEN,
+	.init		= md5_init,
+	.update		= md5_update,
+	.final		= md5_final,
+};
+
 static int get_file_stat(struct file_info *fdata)
 {
 	struct stat st;
@@ -234,32 +250,6 @@ static int get_file_stat(struct file_info *fdata)
 	return 0;
 }
 
-static int read_to_buf(struct file_info *fdata, char *buf)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(fdata->file_name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", fdata->file_name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, fdata->file_size, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", fdata->file_name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
-
- out_close:
-	fclose(f);
- out:
-	return ret;
-}
-
 static int check_options(void)
 {
 	int ret;
@@ -320,10 +310,8 @@ static int check_options(void)
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static void fill_header(struct fw_header *hdr)
 {
-	struct fw_header *hdr = (struct fw_header *)buf;
-
 	memset(hdr, 0, sizeof(struct fw_header));
 
 	hdr->version = HOST_TO_BE32(HEADER_VERSION_V1);
@@ -332,6 +320,7 @@ static void fill_header(char *buf, int len)
 	hdr->hw_id = HOST_TO_BE32(board->hw_id);
 	hdr->hw_rev = HOST_TO_BE32(board->hw_rev);
 
+	/* the salt is replaced by the md5 sum of the image later */
 	if (boot_info.file_size == 0)
 		memcpy(hdr->md5sum1, md5salt_normal, sizeof(hdr->md5sum1));
 	else
@@ -346,82 +335,70 @@ static void fill_header(char *buf, int len)
 		hdr->rootfs_ofs = HOST_TO_BE32(board->rootfs_ofs);
 		hdr->rootfs_len = HOST_TO_BE32(rootfs_info.file_size);
 	}
-
-	get_md5(buf, len, hdr->md5sum1);
-}
-
-static int write_fw(char *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
 }
 
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
-	int ret = EXIT_FAILURE;
+	struct fw_header hdr;
+	struct fwl_region regions[5];
+	struct fwl_sum md5sum;
+	struct fwl_image img;
+	int n = 0;
+	int ret;
 
-	buflen = board->fw_max_len;
+	fill_header(&hdr);
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
-	}
+	memset(regions, 0, sizeof(regions));
+	regions[n].type = FWL_DATA;
+	regions[n].name = "header";
+	regions[n].data = &hdr;
+	regions[n++].len = sizeof(hdr);
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	regions[n].type = FWL_FILE;
+	regions[n].name = "kernel";
+	regions[n++].file_name = kernel_info.file_name;
 
 	if (!combined) {
-		p = buf + board->rootfs_ofs;
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
-	}
+		regions[n].type = FWL_PAD_TO;
+		regions[n].len = board->rootfs_ofs;
+		regions[n++].padc = 0xff;
 
-	fill_header(buf, buflen);
+		regions[n].type = FWL_FILE;
+		regions[n].name = "rootfs";
+		regions[n++].file_name = rootfs_info.file_name;
+	}
 
-	ret = write_fw(buf, buflen);
+	regions[n].type = FWL_PAD_TO;
+	regions[n].name = "end";
+	regions[n].len = board->fw_max_len;
+	regions[n++].padc = 0xff;
+
+	/* the md5 sum covers the whole image */
+	memset(&md5sum, 0, sizeof(md5sum));
+	md5sum.ops = &md5_ops;
+	md5sum.first = "header";
+	md5sum.last = "end";
+	md5sum.field = offsetof(struct fw_header, md5sum1);
+
+	memset(&img, 0, sizeof(img));
+	img.progname = progname;
+	img.file_name = ofname;
+	img.regions = regions;
+	img.num_regions = n;
+	img.sums = &md5sum;
+	img.num_sums = 1;
+
+	ret = fwl_layout(&img);
 	if (ret)
-		goto out_free_buf;
+		return EXIT_FAILURE;
 
-	ret = EXIT_SUCCESS;
+	ret = fwl_write(&img);
+	if (fwl_close(&img, ret))
+		return EXIT_FAILURE;
 
- out_free_buf:
-	free(buf);
- out:
-	return ret;
+	DBG("firmware file \"%s\" completed", ofname);
+
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
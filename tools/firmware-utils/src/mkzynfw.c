@@ -29,6 +29,8 @@
 #endif
 
 #include "zynos.h"
+#include "fwlayout.h"
+#include "csum16.h"
 
 #if (__BYTE_ORDER == __LITTLE_ENDIAN)
 #  define HOST_TO_LE16(x)	(x)
@@ -55,15 +57,8 @@
 #define MAX_NUM_BLOCKS	8
 #define MAX_ARG_COUNT	32
 #define MAX_ARG_LEN	1024
-#define FILE_BUF_LEN	(16*1024)
 
 
-struct csum_state{
-	int		odd;
-	uint32_t	sum;
-	uint32_t	tmp;
-};
-
 struct fw_block {
 	uint32_t	align;		/* alignment of this block */
 	char		*file_name;	/* name of the file */
@@ -417,151 +412,52 @@ is_empty_arg(char *arg)
 
 
 void
-csum_init(struct csum_state *css)
+zynos_csum_init(void *ctx)
 {
-	css->odd = 0;
-	css->sum = 0;
-	css->tmp = 0;
+	csum16_init(ctx);
 }
 
 
 void
-csum_update(uint8_t *p, uint32_t len, struct csum_state *css)
-{
-	if (len == 0)
-		return;
-
-	if (css->odd) {
-		css->sum += (css->tmp << 8) + p[0];
-		if (css->sum > 0xFFFF) {
-			css->sum += 1;
-			css->sum &= 0xFFFF;
-		}
-		css->odd = 0;
-		len--;
-		p++;
-	}
-
-	for ( ; len > 1; len -= 2, p +=2 ) {
-		css->sum  += (p[0] << 8) + p[1];
-		if (css->sum > 0xFFFF) {
-			css->sum += 1;
-			css->sum &= 0xFFFF;
-		}
-	}
-
-	if (len == 1){
-		css->tmp = p[0];
-		css->odd = 1;
-	}
-}
-
-
-uint16_t
-csum_get(struct csum_state *css)
-{
-	char pad = 0;
-
-	csum_update(&pad, 1, css);
-	return css->sum;
-}
-
-uint16_t
-csum_buf(uint8_t *p, uint32_t len)
-{
-	struct csum_state css;
-
-	csum_init(&css);
-	csum_update(p, len, &css);
-	return csum_get(&css);
-
-}
-
-/*
- * routines to write data to the output file
- */
-int
-write_out_data(FILE *outfile, uint8_t *data, size_t len,
-		struct csum_state *css)
+zynos_csum_update(void *ctx, const void *data, size_t len)
 {
-	errno = 0;
-
-	fwrite(data, len, 1, outfile);
-	if (errno) {
-		ERR("unable to write output file");
-		return -1;
-	}
-
-	if (css) {
-		csum_update(data, len, css);
-	}
-
-	return 0;
+	csum16_update(ctx, data, len);
 }
 
 
-int
-write_out_padding(FILE *outfile, size_t len, uint8_t padc,
-		 struct csum_state *css)
+void
+zynos_csum_final(void *ctx, void *result)
 {
-	uint8_t buf[512];
-	size_t buflen = sizeof(buf);
-
-	memset(buf, padc, buflen);
-	while (len > 0) {
-		if (len < buflen)
-			buflen = len;
-
-		if (write_out_data(outfile, buf, buflen, css))
-			return -1;
-
-		len -= buflen;
-	}
+	uint16_t csum;
 
-	return 0;
+	csum = csum16_get(ctx);
+	memcpy(result, &csum, sizeof(csum));
 }
 
 
-int
-write_out_data_align(FILE *outfile, uint8_t *data, size_t len, size_t align,
-		struct csum_state *css)
-{
-	size_t padlen;
-	int res;
-
-	res = write_out_data(outfile, data, len, css);
-	if (res)
-		return res;
-
-	padlen = ALIGN(len,align) - len;
-	res = write_out_padding(outfile, padlen, 0xFF, css);
-
-	return res;
-}
+struct fwl_sum_ops zynos_csum_ops = {
+	.ctx_size	= sizeof(struct csum16_state),
+	.len		= sizeof(uint16_t),
+	.init		= zynos_csum_init,
+	.update		= zynos_csum_update,
+	.final		= zynos_csum_final,
+};
 
 
-int
-write_out_header(FILE *outfile, struct zyn_rombin_hdr *hdr)
+void
+build_header(struct zyn_rombin_hdr *t, struct zyn_rombin_hdr *hdr)
 {
-	struct zyn_rombin_hdr t;
-
-	errno = 0;
-	if (fseek(outfile, 0, SEEK_SET) != 0) {
-		ERRS("fseek failed on output file");
-		return -1;
-	}
-
-	/* setup temporary header fields */
-	memset(&t, 0, sizeof(t));
-	t.addr = HOST_TO_BE32(hdr->addr);
-	memcpy(&t.sig, ROMBIN_SIGNATURE, ROMBIN_SIG_LEN);
-	t.type = hdr->type;
-	t.flags = hdr->flags;
-	t.osize = HOST_TO_BE32(hdr->osize);
-	t.csize = HOST_TO_BE32(hdr->csize);
-	t.ocsum = HOST_TO_BE16(hdr->ocsum);
-	t.ccsum = HOST_TO_BE16(hdr->ccsum);
-	t.mmap_addr = HOST_TO_BE32(hdr->mmap_addr);
+	/* setup header fields */
+	memset(t, 0, sizeof(*t));
+	t->addr = HOST_TO_BE32(hdr->addr);
+	memcpy(&t->sig, ROMBIN_SIGNATURE, ROMBIN_SIG_LEN);
+	t->type = hdr->type;
+	t->flags = hdr->flags;
+	t->osize = HOST_TO_BE32(hdr->osize);
+	t->csize = HOST_TO_BE32(hdr->csize);
+	t->ocsum = HOST_TO_BE16(hdr->ocsum);
+	t->ccsum = HOST_TO_BE16(hdr->ccsum);
+	t->mmap_addr = HOST_TO_BE32(hdr->mmap_addr);
 
 	DBG(2, "hdr.addr      = 0x%08x", hdr->addr);
 	DBG(2, "hdr.type      = 0x%02x", hdr->type);
@@ -571,21 +467,17 @@ write_out_header(FILE *outfile, struct zyn_rombin_hdr *hdr)
 	DBG(2, "hdr.ocsum     = 0x%04x", hdr->ocsum);
 	DBG(2, "hdr.ccsum     = 0x%04x", hdr->ccsum);
 	DBG(2, "hdr.mmap_addr = 0x%08x", hdr->mmap_addr);
-
-	return write_out_data(outfile, (uint8_t *)&t, sizeof(t), NULL);
 }
 
 
-int
-write_out_mmap(FILE *outfile, struct fw_mmap *mmap, struct csum_state *css)
+void
+build_mmap(uint8_t *buf, struct fw_mmap *mmap)
 {
 	struct zyn_mmt_hdr *mh;
-	uint8_t buf[MMAP_DATA_SIZE];
 	uint32_t user_size;
 	char *data;
-	int res;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, MMAP_DATA_SIZE);
 
 	mh = (struct zyn_mmt_hdr *)buf;
 
@@ -605,11 +497,7 @@ write_out_mmap(FILE *outfile, struct fw_mmap *mmap, struct csum_state *css)
 	user_size = (uint8_t *)data - buf;
 	mh->user_start= HOST_TO_BE32(mmap->addr+sizeof(*mh));
 	mh->user_end= HOST_TO_BE32(mmap->addr+user_size);
-	mh->csum = HOST_TO_BE16(csum_buf(buf+sizeof(*mh), user_size));
-
-	res = write_out_data(outfile, buf, sizeof(buf), css);
-
-	return res;
+	mh->csum = HOST_TO_BE16(csum16_buf(buf+sizeof(*mh), user_size));
 }
 
 
@@ -662,180 +550,162 @@ err:
 }
 
 
+/*
+ * The image is described as a list of regions, see fwlayout.h, the
+ * header and the checksum fixup are filled in after the data has been
+ * written and checksummed.
+ */
 int
-write_out_file(FILE *outfile, char *name, size_t len, struct csum_state *css)
-{
-	char buf[FILE_BUF_LEN];
-	size_t buflen = sizeof(buf);
-	FILE *f;
-	int res;
-
-	DBG(2, "writing out file, name=%s, len=%d",
-		name, len);
-
-	errno = 0;
-	f = fopen(name,"r");
-	if (errno) {
-		ERRS("unable to open file: %s", name);
-		return -1;
-	}
-
-	while (len > 0) {
-		if (len < buflen)
-			buflen = len;
-
-		/* read data from source file */
-		errno = 0;
-		fread(buf, buflen, 1, f);
-		if (errno != 0) {
-			ERRS("unable to read from file: %s",name);
-			res = -1;
-			break;
-		}
-
-		res = write_out_data(outfile, buf, buflen, css);
-		if (res)
-			break;
-
-		len -= buflen;
-	}
-
-	fclose(f);
-	return res;
-}
-
-
-int
-write_out_block(FILE *outfile, struct fw_block *block, struct csum_state *css)
-{
-	int res;
-
-	if (block == NULL)
-		return 0;
-
-	if (block->file_name == NULL)
-		return 0;
-
-	if (block->file_size == 0)
-		return 0;
-
-	res = write_out_file(outfile, block->file_name,
-			block->file_size, css);
-	return res;
-}
-
-
-int
-write_out_image(FILE *outfile)
+write_out_image(void)
 {
+	struct fwl_region regions[2 * MAX_NUM_BLOCKS + 6];
+	struct fwl_region *r;
+	struct fwl_sum css;
+	struct fwl_image img;
 	struct fw_block *block;
 	struct fw_mmap mmap;
 	struct zyn_rombin_hdr hdr;
-	struct csum_state css;
-	int i, res;
-	uint32_t offset;
-	uint32_t padlen;
+	struct zyn_rombin_hdr t;
+	uint8_t mmap_data[MMAP_DATA_SIZE];
+	int i, n, res;
 	uint16_t csum;
-	uint16_t t;
+	uint16_t fix;
 
-	/* setup header fields */
-	memset(&hdr, 0, sizeof(hdr));
-	hdr.addr = board->code_start;
-	hdr.type = OBJECT_TYPE_BOOTEXT;
-	hdr.flags = ROMBIN_FLAG_OCSUM;
-
-	offset = board->romio_offs;
+	memset(regions, 0, sizeof(regions));
+	memset(&t, 0, sizeof(t));
+	fix = 0;
+	n = 0;
+
+	r = &regions[n++];
+	r->type = FWL_DATA;
+	r->name = "header";
+	r->data = &t;
+	r->len = sizeof(t);
+
+	r = &regions[n++];
+	r->type = FWL_FILE;
+	r->name = "bootext";
+	r->file_name = bootext_block->file_name;
+
+	r = &regions[n++];
+	r->type = FWL_ALIGN;
+	r->len = MMAP_ALIGN;
+	r->padc = 0xFF;
+
+	r = &regions[n++];
+	r->type = FWL_DATA;
+	r->name = "mmap";
+	r->data = mmap_data;
+	r->len = MMAP_DATA_SIZE;
+
+	r = &regions[n++];
+	r->type = FWL_PAD_TO;
+	r->name = "bootext_end";
+	r->len = board->romio_offs + board->bootext_size;
+	r->padc = 0xFF;
 
-	res = write_out_header(outfile, &hdr);
-	if (res)
-		return res;
+	for (i = 0; i < num_blocks; i++) {
+		block = &blocks[i];
 
-	offset += sizeof(hdr);
+		if (block->type == BLOCK_TYPE_BOOTEXT)
+			continue;
 
-	csum_init(&css);
-	res = write_out_block(outfile, bootext_block, &css);
+		r = &regions[n++];
+		r->type = FWL_ALIGN;
+		r->len = block->align;
+		r->padc = block->padc;
+
+		r = &regions[n++];
+		r->type = FWL_FILE;
+		r->file_name = block->file_name;
+	}
+
+	r = &regions[n++];
+	r->type = FWL_ALIGN;
+	r->name = "end";
+	r->len = 4;
+	r->padc = 0xFF;
+
+	r = &regions[n++];
+	r->type = FWL_DATA;
+	r->name = "csum_fix";
+	r->data = &fix;
+	r->len = sizeof(fix);
+
+	/* everything but the header and the fixup is checksummed */
+	memset(&css, 0, sizeof(css));
+	css.ops = &zynos_csum_ops;
+	css.first = "bootext";
+	css.last = "end";
+	css.field = -1;
+
+	memset(&img, 0, sizeof(img));
+	img.progname = progname;
+	img.file_name = ofname;
+	img.base = board->romio_offs;
+	img.regions = regions;
+	img.num_regions = n;
+	img.sums = &css;
+	img.num_sums = 1;
+
+	res = fwl_layout(&img);
 	if (res)
 		return res;
 
-	offset += bootext_block->file_size;
-	if (offset > (board->romio_offs + board->bootext_size)) {
+	r = fwl_find_region(&img, "bootext");
+	if (r->offset + r->size > board->bootext_size) {
 		ERR("bootext file '%s' is too big", bootext_block->file_name);
 		return -1;
 	}
 
-	padlen = ALIGN(offset, MMAP_ALIGN) - offset;
-	res = write_out_padding(outfile, padlen, 0xFF, &css);
-	if (res)
-		return res;
+	r = fwl_find_region(&img, "bootext_end");
+	if (r->size)
+		DBG(2, "bootext end at %08x",
+			board->romio_offs + r->offset + r->size);
 
-	offset += padlen;
+	r = fwl_find_region(&img, "mmap");
+	mmap.addr = board->flash_base + board->romio_offs + r->offset;
+	build_mmap(mmap_data, &mmap);
 
-	mmap.addr = board->flash_base + offset;
-	res = write_out_mmap(outfile, &mmap, &css);
+	res = fwl_write(&img);
 	if (res)
-		return res;
-
-	offset += MMAP_DATA_SIZE;
-
-	if ((offset - board->romio_offs) < board->bootext_size) {
-		padlen = board->romio_offs + board->bootext_size - offset;
-		res = write_out_padding(outfile, padlen, 0xFF, &css);
-		if (res)
-			return res;
-		offset += padlen;
-
-		DBG(2, "bootext end at %08x", offset);
-	}
-
-	for (i = 0; i < num_blocks; i++) {
-		block = &blocks[i];
-
-		if (block->type == BLOCK_TYPE_BOOTEXT)
-			continue;
-
-		padlen = ALIGN(offset, block->align) - offset;
-		res = write_out_padding(outfile, padlen, 0xFF, &css);
-		if (res)
-			return res;
-		offset += padlen;
-
-		res = write_out_block(outfile, block, &css);
-		if (res)
-			return res;
-		offset += block->file_size;
-	}
-
-	padlen = ALIGN(offset, 4) - offset;
-	res = write_out_padding(outfile, padlen, 0xFF, &css);
-	if (res)
-		return res;
-	offset += padlen;
+		goto out;
 
-	csum = csum_get(&css);
+	/* setup header fields */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.addr = board->code_start;
+	hdr.type = OBJECT_TYPE_BOOTEXT;
+	hdr.flags = ROMBIN_FLAG_OCSUM;
 	hdr.mmap_addr = mmap.addr;
 	hdr.osize = 2;
 
 	res = read_magic(&hdr.ocsum);
 	if (res)
-		return res;
+		goto out;
 	hdr.ocsum = BE16_TO_HOST(hdr.ocsum);
 
+	memcpy(&csum, css.result, sizeof(csum));
 	if (csum <= hdr.ocsum)
-		t = hdr.ocsum - csum;
+		fix = hdr.ocsum - csum;
 	else
-		t = hdr.ocsum - csum - 1;
+		fix = hdr.ocsum - csum - 1;
 
-	DBG(2, "ocsum=%04x, csum=%04x, fix=%04x", hdr.ocsum, csum, t);
+	DBG(2, "ocsum=%04x, csum=%04x, fix=%04x", hdr.ocsum, csum, fix);
 
-	t = HOST_TO_BE16(t);
-	res = write_out_data(outfile, (uint8_t *)&t, 2, NULL);
+	fix = HOST_TO_BE16(fix);
+	r = fwl_find_region(&img, "csum_fix");
+	res = fwl_patch(&img, r->offset, &fix, sizeof(fix));
 	if (res)
-		return res;
+		goto out;
 
+	build_header(&t, &hdr);
+	res = fwl_patch(&img, 0, &t, sizeof(t));
 
-	res = write_out_header(outfile, &hdr);
+out:
+	if (fwl_close(&img, res))
+		return -1;
 
-	return res;
+	return 0;
 }
 
 
@@ -1030,8 +900,6 @@ main(int argc, char *argv[])
 	int c;
 	int res = EXIT_FAILURE;
 
-	FILE *outfile;
-
 	progname=basename(argv[0]);
 
 	opterr = 0;  /* could not print standard getopt error messages */
@@ -1088,25 +956,13 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
-	outfile = fopen(ofname, "w");
-	if (outfile == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
+	if (write_out_image() != 0)
 		goto out;
-	}
-
-	if (write_out_image(outfile) != 0)
-		goto out_flush;
 
 	DBG(1,"Image file %s completed.", ofname);
 
 	res = EXIT_SUCCESS;
 
-out_flush:
-	fflush(outfile);
-	fclose(outfile);
-	if (res != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
 out:
 	return res;
 }
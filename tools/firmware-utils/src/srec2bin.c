@@ -1,524 +1,540 @@
+/*
+ *  Converts a file of S3 S-records into the tagged binary format read by
+ *  the AR7 boot loader.
+ *
+ *  Usage: srec2bin <srec input file> <bin output file> [big endian]
+ *
+ *  If a third argument is present, the big endian tag is written.
+ *
+ *  File Structure
+ *
+ *  TAG    :   32 Bits	(0xDEADBE42 big endian, 0xFEEDFA42 little endian)
+ *  [DATA RECORDS]
+ *
+ *  Data Records Structure
+ *
+ *  LENGTH  :  32 Bits    <- Length of DATA, excludes ADDRESS and CHECKSUM
+ *  ADDRESS :  32 Bits
+ *  DATA    :  8 Bits * LENGTH
+ *  CHECKSUM:  32 Bits    <-  0 - (Sum of Length --> End of Data)
+ *
+ *  Note : If Length == 0, Address will be Program Start
+ *
+ *  All 32-bit fields are written little endian. Consecutive S3 records
+ *  are merged into one data record, a new one is started whenever the
+ *  address does not follow on from the last byte written.
+ *
+ *  The input is mapped into memory and decoded a line at a time, the
+ *  output is collected in a large buffer and written out in big chunks.
+ *  The length of a record is only known at its end, it is stored into
+ *  the buffer, or with pwrite if that part has been written out already.
+ */
+
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TAG_BIG		0xDEADBE42
+#define TAG_LITTLE	0xFEEDFA42
+
+#define OUT_BUF_LEN	(1024 * 1024)
+
+/* 'S', the type, the count and 255 bytes */
+#define MAX_LINE_LEN	(4 + 2 * 255)
+
+/* marks invalid characters in hex_table */
+#define HEX_INVALID	0x10
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt ", %s\n", \
+			progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+static char *progname;
+static char *ofname;
+static int line_num;
+
+static uint8_t hex_table[256];
+
+static int out_fd = -1;
+static uint8_t out_buf[OUT_BUF_LEN];
+static uint32_t out_len;	/* bytes in out_buf */
+static off_t out_pos;		/* file offset of out_buf */
+
+static int rec_started;
+static off_t rec_ofs;		/* offset of the length field */
+static uint32_t rec_len;
+static uint32_t rec_csum;
+static uint32_t cur_addr;	/* address of the last byte written */
+static uint32_t s3_total;
+
+static void hex_init(void)
+{
+	int i;
+
+	memset(hex_table, HEX_INVALID, sizeof(hex_table));
+	for (i = 0; i < 10; i++)
+		hex_table['0' + i] = i;
+	for (i = 0; i < 6; i++) {
+		hex_table['A' + i] = 10 + i;
+		hex_table['a' + i] = 10 + i;
+	}
+}
 
-//Rev 0.1 Original
-// 8 Jan 2001  MJH  Added code to write data to Binary file
-//                  note: outputfile is name.bin, where name is first part
-//                  of input file.  ie tmp.rec -> tmp.bin
-//
-//   srec2bin <input SREC file> <Output Binary File> <If Present, Big Endian>
-//
-//   TAG   
-//        bit32u TAG_BIG     = 0xDEADBE42;
-//        bit32u TAG_LITTLE  = 0xFEEDFA42;
-//
-//  File Structure
-//
-//  TAG    :   32 Bits
-//  [DATA RECORDS]
-//
-//  Data Records Structure
-//
-//  LENGTH  :  32 Bits    <- Length of DATA, excludes ADDRESS and CHECKSUM
-//  ADDRESS :  32 Bits
-//  DATA    :  8 Bits * LENGTH
-//  CHECKSUM:  32 Bits    <-  0 - (Sum of Length --> End of Data)
-//
-//  Note : If Length == 0, Address will be Program Start
-//
-//
-//  
-//
-//
-
-#define MajRevNum 0
-#define MinRevNum 2
-
-
-#define EndianSwitch(x) ((x >> 24) | (x << 24) | ((x << 8) & (0x00FF0000)) | ((x >> 8) & (0x0000FF00)) )
-
-typedef unsigned char bit8u;
-typedef unsigned int bit32u;
-typedef int bit32;
-
-#define FALSE 0
-#define TRUE (!FALSE)
-
-
-bit32u CheckSum;
-int RecStart;
-int debug;
-int verbose;
-
-FILE *OpenOutputFile( char *Name );
-FILE *fOut;
-bit32u RecLength=0;
-
-bit32u AddressCurrent;
+/* decodes len bytes from 2 * len hex digits */
+static int hex_decode(uint8_t *dst, const char *src, size_t len)
+{
+	unsigned int bad = 0;
+	unsigned int hi, lo;
+
+	while (len--) {
+		hi = hex_table[(uint8_t) src[0]];
+		lo = hex_table[(uint8_t) src[1]];
+		bad |= hi | lo;
+		*dst++ = (hi << 4) | lo;
+		src += 2;
+	}
+
+	return (bad & HEX_INVALID) ? -1 : 0;
+}
 
-bit32u gh(char *cp,int nibs);
+static int out_flush(void)
+{
+	uint8_t *p = out_buf;
+	ssize_t n;
 
-int BigEndian;
+	while (out_len > 0) {
+		n = write(out_fd, p, out_len);
+		if (n < 0 && errno == EINTR)
+			continue;
 
-int inputline;
+		if (n <= 0) {
+			ERRS("unable to write output file");
+			return -1;
+		}
 
-// char buf[16*1024];
+		p += n;
+		out_pos += n;
+		out_len -= n;
+	}
 
-char buffer[2048];
-char *cur_ptr;
-int cur_line=0;
-int cur_len=0;
+	return 0;
+}
 
-int s1s2s3_total=0;
+static int out_data(const uint8_t *data, uint32_t len)
+{
+	uint32_t n;
 
-bit32u PBVal;
-int    PBValid;
-bit32u PBAdr;
+	while (len > 0) {
+		if (out_len == OUT_BUF_LEN && out_flush())
+			return -1;
 
+		n = OUT_BUF_LEN - out_len;
+		if (n > len)
+			n = len;
 
-void dumpfTell(char *s, bit32u Value)
-{
-    int Length;
-    Length = (int) RecLength;
-    if (debug)
-          printf("[%s  ] ftell()[0x%08lX] Length[0x%4X] Length[%4d] Value[0x%08x]\n",
-                s, ftell(fOut), Length, Length, Value);
-}
+		memcpy(out_buf + out_len, data, n);
+		out_len += n;
+		data += n;
+		len -= n;
+	}
 
-void DispHex(bit32u Hex)
-{
-//    printf("%X", Hex);
+	return 0;
 }
 
-void WaitDisplay(void)
+static void put_le32(uint8_t *p, uint32_t val)
 {
-   static int Count=0;
-   static int Index=0;
-   char iline[]={"-\\|/"};
-
-   Count++;
-   if ((Count % 32)==0)
-   {
-     if (verbose)
-        printf("%c%c",iline[Index++],8);
-     Index &= 3;
-   }
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
 }
 
-
-void binOut32 ( bit32u Data )
+/* never split across a flush, so that out_patch32 finds it in one piece */
+static int out_le32(uint32_t val)
 {
-// On UNIX machine all 32bit writes need ENDIAN switched
-//    Data = EndianSwitch(Data);
-//    fwrite( &Data, sizeof(bit32u), 1, fOut);
+	if (out_len + 4 > OUT_BUF_LEN && out_flush())
+		return -1;
 
-   char sdat[4];
-   int i;
+	put_le32(out_buf + out_len, val);
+	out_len += 4;
 
-   for(i=0;i<4;i++)
-    sdat[i]=(char)(Data>>(i*8));
-   fwrite( sdat, 1, 4, fOut);
-   dumpfTell("Out32" , Data);
+	return 0;
 }
 
-// Only update RecLength on Byte Writes
-// All 32 bit writes will be for Length etc
-
-void binOut8 ( bit8u Data )
+static int out_patch32(off_t ofs, uint32_t val)
 {
-    int n;
-    dumpfTell("B4Data" , (bit32u) (Data & 0xFF) );
-    n = fwrite( &Data, sizeof(bit8u), 1, fOut);
-    if (n != 1)
-        printf("Error in writing %X for Address 0x%8X\n", Data, AddressCurrent);
-    RecLength += 1;
-}
-
-//  Currently ONLY used for outputting Program Start
+	uint8_t buf[4];
+	ssize_t n;
 
-void binRecStart(bit32u Address)
-{
-    RecLength      = 0;
-    CheckSum       = Address;
-    RecStart       = TRUE;
+	if (ofs >= out_pos) {
+		put_le32(out_buf + (ofs - out_pos), val);
+		return 0;
+	}
 
-    if (debug)
-          printf("[RecStart] CheckSum[0x%08X] Length[%4d] Address[0x%08X]\n",
-                CheckSum, RecLength, Address);
+	put_le32(buf, val);
+	do {
+		n = pwrite(out_fd, buf, sizeof(buf), ofs);
+	} while (n < 0 && errno == EINTR);
 
+	if (n != sizeof(buf)) {
+		ERRS("unable to write output file");
+		return -1;
+	}
 
-    dumpfTell("RecLength", RecLength);
-    binOut32( RecLength );
-    dumpfTell("Address", Address);
-    binOut32( Address );
+	return 0;
 }
 
-void binRecEnd(void)
+static int rec_start(uint32_t addr)
 {
-    long RecEnd;
+	rec_len = 0;
+	rec_csum = addr;
+	rec_started = 1;
 
-    if (!RecStart)   //  if no record started, do not end it
-    {
-        return;
-    }
+	if (out_le32(0))
+		return -1;
 
-    RecStart = FALSE;
+	rec_ofs = out_pos + out_len - 4;
 
+	return out_le32(addr);
+}
 
-    RecEnd = ftell(fOut);         // Save Current position
-
-    if (debug)
-          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X] RecEnd[0x%08lX]\n",
-                CheckSum, RecLength, RecLength, RecEnd);
+static int rec_end(void)
+{
+	if (!rec_started)
+		return 0;
 
-    fseek( fOut, -((long) RecLength), SEEK_CUR);  // move back Start Of Data
+	rec_started = 0;
 
-    dumpfTell("Data   ", -1);
+	if (out_patch32(rec_ofs, rec_len))
+		return -1;
 
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Address
+	rec_csum += rec_len;
 
-    dumpfTell("Address   ", -1);
+	return out_le32(~rec_csum + 1);
+}
 
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Length
+/* a new record is started unless addr follows on from the last byte */
+static int rec_addr(uint32_t addr)
+{
+	if (addr != cur_addr + 1) {
+		if (rec_end() || rec_start(addr))
+			return -1;
+	}
 
-    dumpfTell("Length   ", -1);
+	return 0;
+}
 
-    binOut32( RecLength );
+static int rec_data(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
 
-    fseek( fOut, RecEnd, SEEK_SET);  // move to end of Record
+	if (len == 0)
+		return 0;
 
-    CheckSum += RecLength;
+	if (rec_addr(addr))
+		return -1;
 
-    CheckSum =  ~CheckSum + 1;  // Two's complement
+	for (i = 0; i < len; i++)
+		rec_csum += data[i];
 
-    binOut32( CheckSum );
+	rec_len += len;
+	cur_addr = addr + len - 1;
 
-    if (verbose)
-        printf("[Created Record of %d Bytes with CheckSum [0x%8X]\n", RecLength, CheckSum);
+	return out_data(data, len);
 }
 
-void binRecOutProgramStart(bit32u Address)
+static int rec_program_start(uint32_t addr)
 {
-    if (Address != (AddressCurrent+1))
-    {
-        binRecEnd();
-        binRecStart(Address);
-    }
-    AddressCurrent = Address;
-}
-void binRecOutByte(bit32u Address, bit8u Data)
-{
-    //  If Address is one after Current Address, output Byte
-    //  If not, close out last record, update Length, write checksum
-    //  Then Start New Record, updating Current Address
-
-    if (Address != (AddressCurrent+1))
-    {
-        binRecEnd();
-        binRecStart(Address);
-    }
-    AddressCurrent = Address;
-    CheckSum += Data;
-    binOut8( Data );
-}
+	if (rec_addr(addr))
+		return -1;
 
-//=============================================================================
-//       SUPPORT FUNCTIONS
-//=============================================================================
-int readline(FILE *fil,char *buf,int len)
-{
-    int rlen;
-    
-    rlen=0;
-    if (len==0)  return(0);
-    while(1)
-    {
-      if (cur_len==0)
-      {
-        cur_len=fread(buffer, 1, sizeof(buffer), fil);
-        if (cur_len==0)
-        {
-          if (rlen)
-          {
-            *buf=0;
-            return(rlen);
-          }
-          return(-1);
-        }
-        cur_ptr=buffer;
-      }
-      if (cur_len)
-      {
-        if (*cur_ptr=='\n')
-        {
-          *buf=0;
-          cur_ptr++;
-          cur_len--;
-          return(rlen);
-        }
-         else
-         {
-           if ((len>1)&&(*cur_ptr!='\r'))
-           {
-             *buf++=*cur_ptr++;
-             len--;
-           }
-           else
-             cur_ptr++;
-
-           rlen++;
-           cur_len--;
-         }
-      }
-      else
-      {
-        *buf=0;
-        cur_ptr++;
-        cur_len--;
-        return(rlen);
-      }
-    }
-}
+	cur_addr = addr;
 
+	return 0;
+}
 
-int SRLerrorout(char *c1,char *c2)
+static uint32_t get_be16(const uint8_t *p)
 {
-  printf("\nERROR: %s - '%s'.",c1,c2);
-  return(FALSE);
+	return (p[0] << 8) | p[1];
 }
 
-
-int checksum(char *cp,int count)
+static uint32_t get_be32(const uint8_t *p)
 {
-  char *scp;
-  int cksum;
-  int dum;
-
-  scp=cp;
-  while(*scp)
-  {
-    if (!isxdigit(*scp++))
-      return(SRLerrorout("Invalid hex digits",cp));
-  }
-  scp=cp;
-
-  cksum=count;
-
-  while(count)
-  {
-    cksum += gh(scp,2);
-    if (count == 2)
-        dum = ~cksum;
-    scp += 2;
-    count--;
-  }
-  cksum&=0x0ff; 
-  //  printf("\nCk:%02x",cksum);
-  return(cksum==0x0ff);
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
-bit32u gh(char *cp,int nibs)
+static int srec_line(const char *line, size_t len)
 {
-  int i;
-  bit32u j;
-
-  j=0;
-
-  for(i=0;i<nibs;i++)
-  {
-    j<<=4;
-    if ((*cp>='a')&&(*cp<='z')) *cp &= 0x5f;
-    if ((*cp>='0')&&(*cp<='9')) 
-      j += (*cp-0x30);
-     else
-      if ((*cp>='A')&&(*cp<='F'))
-        j += (*cp-0x37);
-       else
-        SRLerrorout("Bad Hex char", cp);
-    cp++;
-  }
-  return(j);
+	uint8_t rec[256];
+	unsigned int count, sum, i;
+
+	if (line[0] != 'S') {
+		ERR("line %d: not an S-record", line_num);
+		return -1;
+	}
+
+	if (len < 5) {
+		ERR("line %d: S-record too short", line_num);
+		return -1;
+	}
+
+	if (hex_decode(rec, line + 2, 1)) {
+		ERR("line %d: invalid hex digits", line_num);
+		return -1;
+	}
+
+	count = rec[0];
+	if (len - 4 != 2 * count) {
+		ERR("line %d: count field does not match the length",
+		    line_num);
+		return -1;
+	}
+
+	if (hex_decode(rec, line + 4, count)) {
+		ERR("line %d: invalid hex digits", line_num);
+		return -1;
+	}
+
+	sum = count;
+	for (i = 0; i < count; i++)
+		sum += rec[i];
+
+	if ((sum & 0xff) != 0xff) {
+		ERR("line %d: bad checksum", line_num);
+		return -1;
+	}
+
+	switch (line[1]) {
+	case '0':
+		if (count < 3)
+			goto err_count;
+		if (get_be16(rec)) {
+			ERR("line %d: S0 record address is not zero",
+			    line_num);
+			return -1;
+		}
+		break;
+	case '3':
+		if (count < 5)
+			goto err_count;
+		if (rec_data(get_be32(rec), rec + 4, count - 5))
+			return -1;
+		s3_total++;
+		break;
+	case '5':
+		if (count < 3)
+			goto err_count;
+		if (get_be16(rec) != (s3_total & 0xffff)) {
+			ERR("line %d: incorrect number of S3 records processed",
+			    line_num);
+			return -1;
+		}
+		break;
+	case '7':
+		if (count != 5)
+			goto err_count;
+		if (rec_program_start(get_be32(rec)))
+			return -1;
+		break;
+	case '1':
+	case '2':
+	case '8':
+	case '9':
+		ERR("line %d: S%c records are not valid for MIPS",
+		    line_num, line[1]);
+		return -1;
+	case '4':
+	case '6':
+		ERR("line %d: invalid S-record type", line_num);
+		return -1;
+	default:
+		break;
+	}
+
+	return 0;
+
+err_count:
+	ERR("line %d: invalid count field", line_num);
+	return -1;
 }
 
-
-//=============================================================================
-//       PROCESS SREC LINE
-//=============================================================================
-
-int srecLine(char *pSrecLine)
+static int srec_convert(const char *data, size_t size)
 {
-    char *scp,ch;
-    int  itmp,count,dat;
-    bit32u adr;
-    static bit32u RecordCounter=0;
-
-    cur_line++;
-    scp=pSrecLine;
-  
-    if (*pSrecLine!='S')
-      return(SRLerrorout("Not an Srecord file",scp));
-    pSrecLine++;
-    if (strlen(pSrecLine)<4)
-      return(SRLerrorout("Srecord too short",scp));
-  
-    ch=*pSrecLine++;
-  
-    count=gh(pSrecLine,2);
-  
-    pSrecLine += 2;
-  
-  //  if(debug)
-  //        printf("count %d, strlen(pSrecLine) = %d, pSrecLine =[%s]\n", count, strlen(pSrecLine), pSrecLine);
-     RecordCounter++;
-     DispHex(RecordCounter);
-  
-    if ((count*2) != strlen(pSrecLine)) return(SRLerrorout("Count field larger than record",scp));
-  
-    if (!checksum(pSrecLine, count)) return(SRLerrorout("Bad Checksum",scp));
-  
-    switch(ch)
-    {
-        case '0': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp) return(SRLerrorout("Srecord 1 address not zero",scp));
-        break;
-        case '1': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '2': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '3': if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  count--;
-                  while(count)
-                  {
-                    dat=gh(pSrecLine,2); pSrecLine+=2; count--;
-                    binRecOutByte(adr, (char) (dat & 0xFF));
-                    adr++;
-                  }
-                  s1s2s3_total++;
-        break;
-        case '4': return(SRLerrorout("Invalid Srecord type",scp));
-        break;
-        case '5': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp|=s1s2s3_total) return(SRLerrorout("Incorrect number of S3 Record processed",scp));
-        break;
-        case '6': return(SRLerrorout("Invalid Srecord type",scp));
-        break;
-        case '7': // PROGRAM START
-                  if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  if (count!=1) return(SRLerrorout("Invalid Srecord count field",scp));
-                  binRecOutProgramStart(adr);
-        break;
-        case '8': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '9': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        default:
-        break;
-    }
-    return(TRUE);
+	char line[MAX_LINE_LEN];
+	const char *p = data;
+	const char *end = data + size;
+	const char *nl;
+	size_t len, n, i;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			nl = end;
+
+		len = nl - p;
+		line_num++;
+
+		/* carriage returns are dropped wherever they are */
+		if (len && memchr(p, '\r', len)) {
+			for (i = 0, n = 0; i < len; i++) {
+				if (p[i] == '\r')
+					continue;
+				if (n == sizeof(line)) {
+					ERR("line %d: S-record too long",
+					    line_num);
+					return -1;
+				}
+				line[n++] = p[i];
+			}
+
+			if (n && srec_line(line, n))
+				return -1;
+		} else if (len && srec_line(p, len)) {
+			return -1;
+		}
+
+		p = nl + 1;
+	}
+
+	return 0;
 }
- 
 
-//=============================================================================
-//       MAIN LOGIC, READS IN LINE AND OUTPUTS BINARY
-//=============================================================================
-
-int srec2bin(int argc,char *argv[],int verbose)
+/* pipes, fifos and the like can not be mapped, read them into memory */
+static char *read_input(int fd, size_t *size)
 {
-    int i,rlen,sts;
-    FILE *fp;
-    char ac;
-    char buff[256];
-    bit32u TAG_BIG     = 0xDEADBE42;
-    bit32u TAG_LITTLE  = 0xFEEDFA42;
-
-    bit32u Tag;
-
-  
-    if(argc < 3)
-    {
-      printf("\nError: <srec2bin <srec input file> <bin output file>\n\n");
-      return(0);
-    }
-  
-    if (argc > 3) BigEndian=TRUE; else BigEndian=FALSE;
-
-    if (BigEndian)
-        Tag = TAG_BIG;
-    else
-        Tag = TAG_LITTLE;
-
-    if (verbose)
-       printf("\nEndian: %s, Tag is 0x%8X\n",(BigEndian)?"BIG":"LITTLE", Tag);
-
-    fp = fopen(argv[1],"rt");
-
-    if (fp==NULL)
-    {
-      printf("\nError: Opening input file, %s.", argv[1]);
-      return(0);
-    }
-  
-    fOut = fopen( argv[2], "wb");
-    
-    if (fOut==NULL)
-    {
-      printf("\nError: Opening Output file, %s.", argv[2]);
-      if(fp) fclose(fp);
-      return(0);
-    }
- 
-    RecStart = FALSE;
-
-    AddressCurrent = 0xFFFFFFFFL;
-
-    // Setup Tag 
-  
-    dumpfTell("Tag", Tag);
-
-    binOut32(Tag);
-
-  
-    inputline=0;
-    sts=TRUE;
-
-    rlen = readline(fp,buff,sizeof buff);
-
-    while( (sts) && (rlen != -1))
-    {
-        if (strlen(buff))
-        {
-            sts &= srecLine(buff);
-            WaitDisplay();
-        }
-       rlen = readline(fp,buff,sizeof buff);
-    }
-
-  
-  //  printf("PC: 0x%08X, Length 0x%08X, Tag 0x%08X\n", ProgramStart, RecLength, TAG_LITTLE);
-  
-    binRecEnd();
-
-    if(fp) fclose(fp);
-    if(fOut) fclose(fOut);
-
-    return(1);
+	char *buf = NULL, *tmp;
+	size_t len = 0, alloc = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			tmp = realloc(buf, alloc);
+			if (tmp == NULL) {
+				ERR("out of memory");
+				goto err;
+			}
+			buf = tmp;
+		}
+
+		n = read(fd, buf + len, alloc - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERRS("unable to read input");
+			goto err;
+		}
+		if (n == 0)
+			break;
+
+		len += n;
+	}
+
+	*size = len;
+	return buf;
+
+err:
+	free(buf);
+	return NULL;
 }
 
-main(int argc, char *argv[])
+int main(int argc, char *argv[])
 {
-    debug = TRUE;
-    debug = FALSE;
-    verbose = FALSE;
-    srec2bin(argc,argv,verbose);
-    return 0;
+	struct stat st;
+	char *ifname;
+	void *map = NULL;
+	char *data = NULL;
+	size_t size = 0;
+	int ifd;
+	int res = EXIT_FAILURE;
+
+	progname = argv[0];
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <srec input file> <bin output file> "
+			"[big endian]\n", progname);
+		return EXIT_FAILURE;
+	}
+
+	ifname = argv[1];
+	ofname = argv[2];
+
+	ifd = open(ifname, O_RDONLY);
+	if (ifd < 0) {
+		ERRS("could not open \"%s\" for reading", ifname);
+		return EXIT_FAILURE;
+	}
+
+	if (fstat(ifd, &st)) {
+		ERRS("stat failed on %s", ifname);
+		goto out_close;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+		if (size > 0) {
+			map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, ifd, 0);
+			if (map == MAP_FAILED) {
+				map = NULL;
+				ERRS("unable to map %s", ifname);
+				goto out_close;
+			}
+			madvise(map, size, MADV_SEQUENTIAL);
+			data = map;
+		}
+	} else {
+		data = read_input(ifd, &size);
+		if (data == NULL)
+			goto out_close;
+	}
+
+	out_fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd < 0) {
+		ERRS("could not open \"%s\" for writing", ofname);
+		goto out_unmap;
+	}
+
+	hex_init();
+	cur_addr = 0xffffffff;
+
+	if (out_le32((argc > 3) ? TAG_BIG : TAG_LITTLE) ||
+	    srec_convert(data, size) ||
+	    rec_end() || out_flush())
+		goto out_unlink;
+
+	if (close(out_fd)) {
+		ERRS("unable to write output file");
+		goto out_unlink_closed;
+	}
+
+	res = EXIT_SUCCESS;
+	goto out_unmap;
+
+out_unlink:
+	close(out_fd);
+out_unlink_closed:
+	unlink(ofname);
+out_unmap:
+	if (map)
+		munmap(map, size);
+	else
+		free(data);
+out_close:
+	close(ifd);
+	return res;
 }
-
@@ -33,6 +33,7 @@
 #endif
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -146,6 +147,10 @@ table_entry_t comp_name[] = {
     {	-1,		"",		"",			},
 };
 
+static	int	parse_args (int, char **);
+static	void	make_image (void);
+static	int	run_manifest (void);
+static	void	write_data (int, const void *, int);
 static	void	copy_file (int, const char *, int);
 static	void	usage	(void);
 static	void	print_header (image_header_t *);
@@ -164,34 +169,55 @@ static	int	get_type(char *);
 
 char	*datafile;
 char	*imagefile;
+char	*manifest;
+char	*name = "";
 
 int dflag    = 0;
 int eflag    = 0;
 int lflag    = 0;
 int vflag    = 0;
 int xflag    = 0;
+int jobs     = 0;
 int opt_os   = IH_OS_LINUX;
 int opt_arch = IH_CPU_PPC;
 int opt_type = IH_TYPE_KERNEL;
 int opt_comp = IH_COMP_GZIP;
 
+uint32_t addr = 0;
+uint32_t ep = 0;
+
+/* crc and size of everything written behind the header so far */
+uint32_t data_crc = 0;
+uint32_t data_size = 0;
+
+/* amount of data to checksum right after writing it, while it is cached */
+#define COPY_CHUNK	(256 * 1024)
+
+/* limits for the lines of a manifest */
+#define MANIFEST_LINE	4096
+#define MANIFEST_ARGS	64
+
 image_header_t header;
 image_header_t *hdr = &header;
 
 int
 main (int argc, char **argv)
 {
-	int ifd;
-	uint32_t checksum;
-	uint32_t addr;
-	uint32_t ep;
-	struct stat sbuf;
-	unsigned char *ptr;
-	char *name = "";
-
 	cmdname = *argv;
 
-	addr = ep = 0;
+	parse_args (argc, argv);
+
+	if (manifest)
+		exit (run_manifest () ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	make_image ();
+	exit (EXIT_SUCCESS);
+}
+
+static int
+parse_args (int argc, char **argv)
+{
+	unsigned char *ptr;
 
 	while (--argc > 0 && **++argv == '-') {
 		while (*++*argv) {
@@ -237,6 +263,22 @@ main (int argc, char **argv)
 				datafile = *++argv;
 				dflag = 1;
 				goto NXTARG;
+			case 'j':
+				if (--argc <= 0)
+					usage ();
+				jobs = strtoul (*++argv, (char **)&ptr, 10);
+				if (*ptr || jobs <= 0) {
+					fprintf (stderr,
+						"%s: invalid number of jobs %s\n",
+						cmdname, *argv);
+					exit (EXIT_FAILURE);
+				}
+				goto NXTARG;
+			case 'M':
+				if (--argc <= 0)
+					usage ();
+				manifest = *++argv;
+				goto NXTARG;
 			case 'e':
 				if (--argc <= 0)
 					usage ();
@@ -267,6 +309,13 @@ main (int argc, char **argv)
 NXTARG:		;
 	}
 
+	/* the images are described in the manifest */
+	if (manifest) {
+		if (argc != 0)
+			usage ();
+		return 0;
+	}
+
 	if ((argc != 1) || ((lflag ^ dflag) == 0))
 		usage();
 
@@ -293,6 +342,19 @@ NXTARG:		;
 
 	imagefile = *argv;
 
+	return 0;
+}
+
+static void
+make_image (void)
+{
+	int ifd;
+	uint32_t checksum;
+	struct stat sbuf;
+	unsigned char *ptr;
+	uint32_t *sizes = NULL;
+	int n_sizes = 0;
+
 	if (lflag) {
 		ifd = open(imagefile, O_RDONLY|O_BINARY);
 	} else {
@@ -393,44 +455,45 @@ NXTARG:		;
 
 	if (opt_type == IH_TYPE_MULTI || opt_type == IH_TYPE_SCRIPT) {
 		char *file = datafile;
-		uint32_t size;
+		char *sep;
+		int i;
 
-		for (;;) {
-			char *sep = NULL;
+		for (sep = datafile, n_sizes = 1; (sep = strchr(sep, ':')) != NULL; sep++)
+			n_sizes++;
 
-			if (file) {
-				if ((sep = strchr(file, ':')) != NULL) {
-					*sep = '\0';
-				}
+		/*
+		 * keep the size table right behind the header, so that
+		 * print_header() finds it there
+		 */
+		hdr = calloc (1, sizeof(image_header_t) +
+				 (n_sizes + 1) * sizeof(uint32_t));
+		if (hdr == NULL) {
+			fprintf (stderr, "%s: Out of memory\n", cmdname);
+			exit (EXIT_FAILURE);
+		}
+		sizes = (uint32_t *)(hdr + 1);
 
-				if (stat (file, &sbuf) < 0) {
-					fprintf (stderr, "%s: Can't stat %s: %s\n",
-						cmdname, file, strerror(errno));
-					exit (EXIT_FAILURE);
-				}
-				size = htonl(sbuf.st_size);
-			} else {
-				size = 0;
+		for (i = 0; i < n_sizes; i++) {
+			if ((sep = strchr(file, ':')) != NULL) {
+				*sep = '\0';
 			}
 
-			if (write(ifd, (char *)&size, sizeof(size)) != sizeof(size)) {
-				fprintf (stderr, "%s: Write error on %s: %s\n",
-					cmdname, imagefile, strerror(errno));
+			if (stat (file, &sbuf) < 0) {
+				fprintf (stderr, "%s: Can't stat %s: %s\n",
+					cmdname, file, strerror(errno));
 				exit (EXIT_FAILURE);
 			}
-
-			if (!file) {
-				break;
-			}
+			sizes[i] = htonl(sbuf.st_size);
 
 			if (sep) {
 				*sep = ':';
 				file = sep + 1;
-			} else {
-				file = NULL;
 			}
 		}
 
+		/* the list is terminated by a zero size */
+		write_data (ifd, sizes, (n_sizes + 1) * sizeof(uint32_t));
+
 		file = datafile;
 
 		for (;;) {
@@ -462,28 +525,16 @@ NXTARG:		;
 		exit (EXIT_FAILURE);
 	}
 
-	ptr = (unsigned char *)mmap(0, sbuf.st_size,
-				    PROT_READ|PROT_WRITE, MAP_SHARED, ifd, 0);
-	if (ptr == (unsigned char *)MAP_FAILED) {
-		fprintf (stderr, "%s: Can't map %s: %s\n",
-			cmdname, imagefile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	hdr = (image_header_t *)ptr;
-
-	checksum = crc32 (0,
-			  (const char *)(ptr + sizeof(image_header_t)),
-			  sbuf.st_size - sizeof(image_header_t)
-			 );
-
-	/* Build new header */
+	/*
+	 * The data checksum has been computed while writing the data,
+	 * so only the header is left to be filled in
+	 */
 	hdr->ih_magic = htonl(IH_MAGIC);
 	hdr->ih_time  = htonl(sbuf.st_mtime);
-	hdr->ih_size  = htonl(sbuf.st_size - sizeof(image_header_t));
+	hdr->ih_size  = htonl(data_size);
 	hdr->ih_load  = htonl(addr);
 	hdr->ih_ep    = htonl(ep);
-	hdr->ih_dcrc  = htonl(checksum);
+	hdr->ih_dcrc  = htonl(data_crc);
 	hdr->ih_os    = opt_os;
 	hdr->ih_arch  = opt_arch;
 	hdr->ih_type  = opt_type;
@@ -495,9 +546,14 @@ NXTARG:		;
 
 	hdr->ih_hcrc = htonl(checksum);
 
-	print_header (hdr);
+	if (lseek(ifd, 0, SEEK_SET) != 0 ||
+	    write(ifd, hdr, sizeof(image_header_t)) != sizeof(image_header_t)) {
+		fprintf (stderr, "%s: Write error on %s: %s\n",
+			cmdname, imagefile, strerror(errno));
+		exit (EXIT_FAILURE);
+	}
 
-	(void) munmap((void *)ptr, sbuf.st_size);
+	print_header (hdr);
 
 	/* We're a bit of paranoid */
 #if defined(_POSIX_SYNCHRONIZED_IO) && !defined(__sun__) && !defined(__FreeBSD__)
@@ -511,8 +567,217 @@ NXTARG:		;
 			cmdname, imagefile, strerror(errno));
 		exit (EXIT_FAILURE);
 	}
+}
 
-	exit (EXIT_SUCCESS);
+/*
+ * Split a manifest line into words, double quotes group words
+ * containing blanks. Returns the number of words, or -1 on error.
+ */
+static int
+split_line (char *line, char **words, int max)
+{
+	char *p = line;
+	int n = 0;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+
+		if (!*p || *p == '#')
+			return n;
+
+		if (n == max)
+			return -1;
+
+		if (*p == '"') {
+			words[n++] = ++p;
+			if ((p = strchr(p, '"')) == NULL)
+				return -1;
+		} else {
+			words[n++] = p;
+			while (*p && *p != ' ' && *p != '\t' &&
+			       *p != '\n' && *p != '\r')
+				p++;
+			if (!*p)
+				return n;
+		}
+		*p++ = '\0';
+	}
+}
+
+static int
+wait_job (pid_t *pids, int *lines, int n)
+{
+	int status;
+	pid_t pid;
+	int i;
+
+	for (;;) {
+		pid = wait (&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (pids[i] == pid)
+				break;
+		}
+
+		/* keep waiting if it was not one of the jobs */
+		if (i < n)
+			break;
+	}
+
+	pids[i] = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf (stderr, "%s: %s:%d: failed to create the image\n",
+			cmdname, manifest, lines[i]);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create all images listed in the manifest, one image per line with
+ * the same arguments as on the command line. Options given on the
+ * command line in front of -M are the defaults for every image.
+ * Every image is created by a child process, up to 'jobs' at once.
+ * Returns the number of images that failed.
+ */
+static int
+run_manifest (void)
+{
+	char line[MANIFEST_LINE];
+	char *words[MANIFEST_ARGS + 2];
+	char **lines = NULL;
+	char *list;
+	pid_t *pids;
+	int *joblines;
+	int n_lines = 0, size = 0;
+	int running = 0, failed = 0;
+	int i, j, n, ret;
+	FILE *fp;
+	pid_t pid;
+
+	if (jobs <= 0) {
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+	}
+
+	if (strcmp(manifest, "-") == 0) {
+		fp = stdin;
+	} else if ((fp = fopen(manifest, "r")) == NULL) {
+		fprintf (stderr, "%s: Can't open %s: %s\n",
+			cmdname, manifest, strerror(errno));
+		return 1;
+	}
+
+	/*
+	 * read the whole manifest first, so that the children do not
+	 * share the stream with us
+	 */
+	while (fgets(line, sizeof(line), fp)) {
+		if (n_lines == size) {
+			size = size ? size * 2 : 64;
+			lines = realloc (lines, size * sizeof(char *));
+			if (lines == NULL) {
+				fprintf (stderr, "%s: Out of memory\n", cmdname);
+				return 1;
+			}
+		}
+		if ((lines[n_lines++] = strdup(line)) == NULL) {
+			fprintf (stderr, "%s: Out of memory\n", cmdname);
+			return 1;
+		}
+	}
+
+	if (fp != stdin)
+		fclose (fp);
+
+	pids = calloc (jobs, sizeof(pid_t));
+	joblines = calloc (jobs, sizeof(int));
+	if (pids == NULL || joblines == NULL) {
+		fprintf (stderr, "%s: Out of memory\n", cmdname);
+		return 1;
+	}
+
+	for (i = 0; i < n_lines; i++) {
+		n = split_line (lines[i], words + 1, MANIFEST_ARGS);
+		if (n < 0) {
+			fprintf (stderr, "%s: %s:%d: invalid line\n",
+				cmdname, manifest, i + 1);
+			failed++;
+			continue;
+		}
+		if (n == 0)
+			continue;
+
+		words[0] = cmdname;
+		words[n + 1] = NULL;
+
+		while (running == jobs) {
+			ret = wait_job (pids, joblines, jobs);
+			if (ret < 0)
+				break;
+			failed += ret;
+			running--;
+		}
+
+		if (running == jobs) {
+			fprintf (stderr, "%s: Can't wait for the jobs: %s\n",
+				cmdname, strerror(errno));
+			failed++;
+			break;
+		}
+
+		for (j = 0; pids[j]; j++)
+			;
+
+		fflush (stdout);
+		fflush (stderr);
+
+		pid = fork ();
+		if (pid < 0) {
+			fprintf (stderr, "%s: Can't fork: %s\n",
+				cmdname, strerror(errno));
+			failed++;
+			break;
+		}
+
+		if (pid == 0) {
+			/* keep the output of each image together */
+			setvbuf (stdout, NULL, _IOFBF, BUFSIZ);
+
+			list = manifest;
+			manifest = NULL;
+			parse_args (n + 1, words);
+			if (manifest) {
+				fprintf (stderr, "%s: %s:%d: -M can't be used in a manifest\n",
+					cmdname, list, i + 1);
+				exit (EXIT_FAILURE);
+			}
+			make_image ();
+			exit (EXIT_SUCCESS);
+		}
+
+		pids[j] = pid;
+		joblines[j] = i + 1;
+		running++;
+	}
+
+	while (running > 0) {
+		ret = wait_job (pids, joblines, jobs);
+		if (ret < 0)
+			break;
+		failed += ret;
+		running--;
+	}
+
+	return failed;
 }
 
 static void
@@ -578,23 +843,40 @@ copy_file (int ifd, const char *datafile, int pad)
 	}
 
 	size = sbuf.st_size - offset;
-	if (write(ifd, ptr + offset, size) != size) {
-		fprintf (stderr, "%s: Write error on %s: %s\n",
-			cmdname, imagefile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
+	write_data (ifd, ptr + offset, size);
 
 	if (pad && ((tail = size % 4) != 0)) {
+		write_data (ifd, (char *)&zero, 4-tail);
+	}
+
+	(void) munmap((void *)ptr, sbuf.st_size);
+	(void) close (dfd);
+}
+
+/*
+ * Write data behind the header, checksumming it in chunks right after
+ * they have been written, instead of reading the whole image back later
+ */
+static void
+write_data (int ifd, const void *buf, int len)
+{
+	const char *p = buf;
+	int n;
+
+	while (len > 0) {
+		n = (len < COPY_CHUNK) ? len : COPY_CHUNK;
 
-		if (write(ifd, (char *)&zero, 4-tail) != 4-tail) {
+		if (write(ifd, p, n) != n) {
 			fprintf (stderr, "%s: Write error on %s: %s\n",
 				cmdname, imagefile, strerror(errno));
 			exit (EXIT_FAILURE);
 		}
-	}
 
-	(void) munmap((void *)ptr, sbuf.st_size);
-	(void) close (dfd);
+		data_crc = crc32 (data_crc, p, n);
+		data_size += n;
+		p += n;
+		len -= n;
+	}
 }
 
 void
@@ -603,8 +885,9 @@ usage ()
 	fprintf (stderr, "Usage: %s -l image\n"
 			 "          -l ==> list image header information\n"
 			 "       %s [-x] -A arch -O os -T type -C comp "
-			 "-a addr -e ep -n name -d data_file[:data_file...] image\n",
-		cmdname, cmdname);
+			 "-a addr -e ep -n name -d data_file[:data_file...] image\n"
+			 "       %s [options] [-j jobs] -M manifest\n",
+		cmdname, cmdname, cmdname);
 	fprintf (stderr, "          -A ==> set architecture to 'arch'\n"
 			 "          -O ==> set operating system to 'os'\n"
 			 "          -T ==> set image type to 'type'\n"
@@ -614,6 +897,10 @@ usage ()
 			 "          -n ==> set image name to 'name'\n"
 			 "          -d ==> use image data from 'datafile'\n"
 			 "          -x ==> set XIP (execute in place)\n"
+			 "          -M ==> create the images listed in 'manifest', one\n"
+			 "                 per line with the arguments above, options\n"
+			 "                 given before -M apply to all of them\n"
+			 "          -j ==> create up to 'jobs' images at once\n"
 		);
 	exit (EXIT_FAILURE);
 }